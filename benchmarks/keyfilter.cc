@@ -0,0 +1,125 @@
+//
+// keyfilter.cc: key block filter throughput, per SIMD level
+//
+
+#include "carp/coding_float.h"
+#include "reader/query_utils.h"
+#include "reader/simd_filter.h"
+
+#include <pdlfs-common/env.h>
+#include <pdlfs-common/port.h>
+#include <stdio.h>
+#include <unistd.h>
+
+namespace pdlfs {
+namespace plfsio {
+class KeyFilterBenchmark {
+ public:
+  KeyFilterBenchmark(size_t num_keys, int rounds)
+      : env_(port::PosixGetDefaultEnv()),
+        num_keys_(num_keys),
+        rounds_(rounds),
+        keys_(num_keys),
+        idx_(num_keys) {}
+
+  /* keys uniform over [0, 100), so a query's width is its selectivity */
+  void Prepare() {
+    keyblk_.reserve(num_keys_ * sizeof(float));
+    for (size_t i = 0; i < num_keys_; i++) {
+      PutFloat32(&keyblk_, (rand() % 1000000) / 10000.0f);
+    }
+  }
+
+  void Run() {
+    const float sels[] = {0.1f, 1.0f, 10.0f, 50.0f, 100.0f};
+    const size_t nsels = sizeof(sels) / sizeof(sels[0]);
+
+    fprintf(stderr, "[KeyFilter] %zu keys, %d rounds, best level: %s\n",
+            num_keys_, rounds_, SimdFilter::LevelName(SimdFilter::Level()));
+
+    for (size_t s = 0; s < nsels; s++) {
+      float qmin = 50.0f - sels[s] / 2, qmax = 50.0f + sels[s] / 2;
+      size_t ref = SIZE_MAX;
+
+      for (int l = kSimdScalar; l <= SimdFilter::Level(); l++) {
+        size_t nmatch = 0;
+        uint64_t beg = env_->NowMicros();
+        for (int r = 0; r < rounds_; r++) {
+          nmatch = SimdFilter::FilterKeys(SimdLevel(l), keyblk_.data(),
+                                          num_keys_, qmin, qmax, &keys_[0],
+                                          &idx_[0]);
+        }
+        uint64_t us = env_->NowMicros() - beg;
+
+        fprintf(stderr, "[KeyFilter] sel %5.1f%%, %-6s: %6.2f GB/s\n",
+                sels[s], SimdFilter::LevelName(SimdLevel(l)), Gbps(us));
+
+        if (ref == SIZE_MAX) ref = nmatch;
+        if (nmatch != ref) {
+          fprintf(stderr, "[KeyFilter] !!! levels disagree !!!\n");
+        }
+      }
+
+      /* what SSTReadWorker sees: the kernel plus emitting key pairs */
+      std::vector< CompactKeyPair > out;
+      uint64_t beg = env_->NowMicros();
+      for (int r = 0; r < rounds_; r++) {
+        out.clear();
+        QueryUtils::FilterKeys(keyblk_.data(), num_keys_, sizeof(float), 0,
+                               qmin, qmax, out);
+      }
+      uint64_t us = env_->NowMicros() - beg;
+
+      fprintf(stderr, "[KeyFilter] sel %5.1f%%, pairs:  %6.2f GB/s\n",
+              sels[s], Gbps(us));
+    }
+  }
+
+ private:
+  /* key block bytes filtered per second, on the one core */
+  double Gbps(uint64_t us) const {
+    double bytes = 1.0 * num_keys_ * sizeof(float) * rounds_;
+    return us ? bytes / 1e3 / us : 0;
+  }
+
+  Env* const env_;
+  const size_t num_keys_;
+  const int rounds_;
+  std::string keyblk_;
+  std::vector< float > keys_;
+  std::vector< uint32_t > idx_;
+};
+}  // namespace plfsio
+}  // namespace pdlfs
+
+void PrintHelp() {
+  printf("./prog [-n num_keys (millions)] [-r rounds]\n");
+}
+
+int main(int argc, char* argv[]) {
+  size_t num_keys = 16;
+  int rounds = 10;
+  int c;
+
+  while ((c = getopt(argc, argv, "n:r:h")) != -1) {
+    switch (c) {
+      case 'n':
+        num_keys = std::stoul(optarg);
+        break;
+      case 'r':
+        rounds = std::stoi(optarg);
+        break;
+      case 'h':
+      default:
+        PrintHelp();
+        exit(0);
+        break;
+    }
+  }
+
+  pdlfs::plfsio::KeyFilterBenchmark bench(num_keys << 20, rounds);
+  bench.Prepare();
+  bench.Run();
+
+  return 0;
+}
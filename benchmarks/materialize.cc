@@ -0,0 +1,214 @@
+//
+// materialize.cc: late value materialization vs. reading whole SSTs
+//
+
+#include "common.h"
+
+#include <carp/coding_float.h>
+#include <carp/manifest.h>
+#include <reader/range_reader.h>
+#include <reader/reader_base.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace pdlfs {
+namespace plfsio {
+/* FullSSTReader: the baseline. Reads every SST overlapping the query
+ * whole, keys and values, and filters and sorts the records after. */
+class FullSSTReader : public ReaderBase {
+ public:
+  explicit FullSSTReader(const RdbOptions& options) : ReaderBase(options) {}
+
+  Status Prepare() { return ReadManifests(); }
+
+  Status Query(int epoch, float rbegin, float rend, std::string& records,
+               uint64_t& record_sz, uint64_t& bytes_read) {
+    PartitionManifestMatch match;
+    manifest_.GetOverlappingEntries(epoch, rbegin, rend, match);
+
+    /* fdcache_ reads files sequentially, so go in file order */
+    std::vector< const PartitionManifestItem* > items;
+    for (size_t i = 0; i < match.Size(); i++) items.push_back(&match[i]);
+    std::sort(items.begin(), items.end(), ItemLocationOrder());
+
+    record_sz = key_sz_ + val_sz_;
+    bytes_read = 0;
+
+    std::string unsorted;
+    std::vector< KeyPair > kps;
+    std::string scratch;
+
+    for (size_t i = 0; i < items.size(); i++) {
+      const PartitionManifestItem& item = *items[i];
+      const uint64_t cnt = item.part_item_count;
+      scratch.resize(cnt * record_sz);
+
+      Slice sst;
+      Status s = ReadSST(item, sst, &scratch[0]);
+      if (!s.ok()) return s;
+      if (sst.size() < cnt * record_sz) {
+        return Status::Corruption("Short SST read");
+      }
+      bytes_read += sst.size();
+
+      const char* keyblk = sst.data();
+      const char* valblk = sst.data() + cnt * key_sz_;
+
+      for (uint64_t j = 0; j < cnt; j++) {
+        float key = DecodeFloat32(keyblk + j * key_sz_);
+        if (key < rbegin or key > rend) continue;
+
+        KeyPair kp;
+        kp.key = key;
+        kp.rank = item.rank;
+        kp.offset = unsorted.size();
+        kps.push_back(kp);
+
+        char buf[sizeof(float)];
+        EncodeFloat32(buf, key);
+        unsorted.append(buf, sizeof(float));
+        unsorted.append(valblk + j * val_sz_, val_sz_);
+      }
+    }
+
+    std::sort(kps.begin(), kps.end(), KeyPairComparator());
+
+    records.resize(kps.size() * record_sz);
+    for (size_t i = 0; i < kps.size(); i++) {
+      memcpy(&records[i * record_sz], &unsorted[kps[i].offset], record_sz);
+    }
+
+    return Status::OK();
+  }
+
+ private:
+  struct ItemLocationOrder {
+    bool operator()(const PartitionManifestItem* a,
+                    const PartitionManifestItem* b) const {
+      if (a->rank != b->rank) return a->rank < b->rank;
+      return a->offset < b->offset;
+    }
+  };
+};
+
+/* order-independent, as the two sorts may break key ties differently */
+uint64_t RecordsChecksum(const std::string& records, uint64_t record_sz) {
+  uint64_t sum = 0;
+  for (size_t i = 0; record_sz > 0 and i < records.size(); i += record_sz) {
+    uint64_t h = 14695981039346656037ull;
+    for (uint64_t j = 0; j < record_sz; j++) {
+      h = (h ^ (unsigned char)records[i + j]) * 1099511628211ull;
+    }
+    sum += h;
+  }
+  return sum;
+}
+
+#define USTOMS(x) ((x) * 1e-3)
+#define MBPS(b, us) ((us) ? (b) / 1048576.0 / ((us) * 1e-6) : 0)
+
+void RunBenchmark(RdbOptions& options, int epoch, float rbegin, float rend,
+                  int rounds) {
+  /* the late path: keys only on query, values of matches after */
+  options.projection = kProjectKeys;
+
+  RangeReader< RandomAccessFile > late(options);
+  FullSSTReader full(options);
+
+  Status s = late.ReadManifest(options.data_path);
+  if (s.ok()) s = full.Prepare();
+  if (!s.ok()) {
+    printf("error: %s\n", s.ToString().c_str());
+    return;
+  }
+
+  for (int r = 0; r < rounds; r++) {
+    std::string late_recs, full_recs;
+    uint64_t late_rsz = 0, full_rsz = 0, full_bytes = 0;
+
+    uint64_t beg_us = options.env->NowMicros();
+    s = late.QueryParallel(-1, epoch, rbegin, rend);
+    uint64_t mid_us = options.env->NowMicros();
+    if (s.ok()) s = late.Materialize(late.Results(), late_recs, late_rsz);
+    uint64_t late_us = options.env->NowMicros();
+    if (s.ok()) s = full.Query(epoch, rbegin, rend, full_recs, full_rsz,
+                               full_bytes);
+    uint64_t full_us = options.env->NowMicros();
+
+    if (!s.ok()) {
+      printf("error: %s\n", s.ToString().c_str());
+      return;
+    }
+
+    bool same = late_recs.size() == full_recs.size() and
+                RecordsChecksum(late_recs, late_rsz) ==
+                    RecordsChecksum(full_recs, full_rsz);
+
+    printf("[Round %d] %zu records of %" PRIu64 " B (%s)\n", r,
+           full_rsz ? full_recs.size() / full_rsz : 0, full_rsz,
+           same ? "identical" : "MISMATCH");
+    printf("  late:     %8.2f ms (keys %.2f ms, values %.2f ms), %.1f MB/s\n",
+           USTOMS(late_us - beg_us), USTOMS(mid_us - beg_us),
+           USTOMS(late_us - mid_us),
+           MBPS(late_recs.size(), late_us - beg_us));
+    printf("  full SST: %8.2f ms (%" PRIu64 " MB read), %.1f MB/s\n",
+           USTOMS(full_us - late_us), full_bytes >> 20,
+           MBPS(full_recs.size(), full_us - late_us));
+  }
+}
+}  // namespace plfsio
+}  // namespace pdlfs
+
+void PrintHelp() {
+  printf(
+      "./prog [-p parallelism] [-n rounds] -i plfs_dir -e epoch -x begin "
+      "-y end\n");
+}
+
+int main(int argc, char* argv[]) {
+  pdlfs::plfsio::RdbOptions options;
+  int epoch = 0, rounds = 3;
+  float rbegin = 0, rend = 0;
+  int c;
+
+  while ((c = getopt(argc, argv, "i:p:e:x:y:n:h")) != -1) {
+    switch (c) {
+      case 'i':
+        options.data_path = optarg;
+        break;
+      case 'p':
+        options.parallelism = std::stoi(optarg);
+        break;
+      case 'e':
+        epoch = std::stoi(optarg);
+        break;
+      case 'x':
+        rbegin = std::stof(optarg);
+        break;
+      case 'y':
+        rend = std::stof(optarg);
+        break;
+      case 'n':
+        rounds = std::stoi(optarg);
+        break;
+      case 'h':
+      default:
+        PrintHelp();
+        exit(0);
+        break;
+    }
+  }
+
+  options.env = pdlfs::port::PosixGetDefaultEnv();
+
+  if (!options.env->FileExists(options.data_path.c_str())) {
+    printf("Input directory does not exist\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pdlfs::plfsio::RunBenchmark(options, epoch, rbegin, rend, rounds);
+
+  return 0;
+}
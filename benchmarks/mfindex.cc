@@ -0,0 +1,307 @@
+//
+// mfindex.cc: compare indexed manifest overlap lookups with a linear scan
+//
+
+#include "carp/coding_float.h"
+#include "carp/manifest.h"
+#include "reader/lazy_manifest.h"
+#include "reader/manifest_reader.h"
+#include "reader/simd_filter.h"
+
+#include <pdlfs-common/coding.h>
+#include <pdlfs-common/env.h>
+#include <pdlfs-common/port.h>
+#include <stdio.h>
+#include <unistd.h>
+
+namespace pdlfs {
+namespace plfsio {
+class ManifestIndexBenchmark {
+ public:
+  ManifestIndexBenchmark(int num_ranks, int num_epochs, int ssts_per_epoch)
+      : env_(port::PosixGetDefaultEnv()),
+        num_ranks_(num_ranks),
+        num_epochs_(num_epochs),
+        ssts_per_epoch_(ssts_per_epoch),
+        reader_(manifest_),
+        decode_us_(0) {}
+
+  /* encode a footer per rank, in the on-disk format, and load it through
+   * PartitionManifestReader so the manifest is built exactly as in a run */
+  void Prepare() {
+    footers_.resize(num_ranks_);
+
+    for (int rank = 0; rank < num_ranks_; rank++) {
+      std::string& footer = footers_[rank];
+      uint64_t offset = 0;
+
+      for (int epoch = 0; epoch < num_epochs_; epoch++) {
+        std::string items;
+        for (int i = 0; i < ssts_per_epoch_; i++) {
+          float rmin = (rand() % 100000) / 1000.0f;
+          float rmax = rmin + (rand() % 2000) / 1000.0f;
+          uint32_t count = 10000;
+
+          PutFixed64(&items, i);
+          PutFixed64(&items, offset);
+          PutFloat32(&items, rmin);
+          PutFloat32(&items, rmax);
+          PutFloat32(&items, rmin);
+          PutFloat32(&items, rmax);
+          PutFixed32(&items, 1);
+          PutFixed32(&items, count);
+          PutFixed32(&items, 0);
+
+          offset += count * 64;
+        }
+
+        PutFixed32(&footer, epoch);
+        PutFixed64(&footer, items.size());
+        footer += items;
+      }
+
+    }
+
+    uint64_t beg = env_->NowMicros();
+    reader_.UpdateKVSizes(sizeof(float), 60);
+    reader_.Reset(num_ranks_);
+    for (int rank = 0; rank < num_ranks_; rank++) {
+      Slice footer_sl(footers_[rank]);
+      reader_.ReadManifest(rank, footer_sl, footer_sl.size());
+    }
+    reader_.MergeManifests();
+    decode_us_ = env_->NowMicros() - beg;
+  }
+
+  /* time to first query of one epoch: decoding everything vs. indexing
+   * epoch frames and decoding only that epoch */
+  void RunLazy() {
+    uint64_t beg = env_->NowMicros();
+    LazyManifest lazy;
+    lazy.Reset(num_ranks_);
+    lazy.UpdateKVSizes(sizeof(float), 60);
+    for (int rank = 0; rank < num_ranks_; rank++) {
+      lazy.AddRank(rank, Slice(footers_[rank]), /* copy */ false);
+    }
+    uint64_t open_us = env_->NowMicros() - beg;
+
+    PartitionManifest* mf;
+    lazy.GetEpoch(num_epochs_ / 2, &mf);
+    uint64_t first_us = env_->NowMicros() - beg;
+
+    fprintf(stderr,
+            "[MFIndex] Eager decode: %.2f ms (+ index build)\n"
+            "[MFIndex] Lazy open: %.2f ms, first epoch ready: %.2f ms\n",
+            decode_us_ / 1e3, open_us / 1e3, first_us / 1e3);
+  }
+
+  void Run(int num_queries, float width, bool keep_cold) {
+    std::vector< Query > queries;
+    for (int i = 0; i < num_queries; i++) {
+      float qbeg = (rand() % 100000) / 1000.0f;
+      queries.push_back(Query(rand() % num_epochs_, qbeg, qbeg + width));
+    }
+
+    uint64_t scan_items = 0;
+    uint64_t scan_beg = env_->NowMicros();
+    for (size_t i = 0; i < queries.size(); i++) {
+      scan_items += ScanQuery(queries[i]);
+    }
+    uint64_t scan_us = env_->NowMicros() - scan_beg;
+
+    uint64_t build_beg = env_->NowMicros();
+    manifest_.BuildIndex();
+    uint64_t build_us = env_->NowMicros() - build_beg;
+
+    uint64_t index_items = 0;
+    uint64_t index_beg = env_->NowMicros();
+    for (size_t i = 0; i < queries.size(); i++) {
+      PartitionManifestMatch match;
+      manifest_.GetOverlappingEntries(queries[i], match);
+      index_items += match.Size();
+    }
+    uint64_t index_us = env_->NowMicros() - index_beg;
+
+    fprintf(stderr,
+            "[MFIndex] Ranks: %d, Epochs: %d, SSTs: %zu, Width: %.3f\n"
+            "[MFIndex] Scan:  %.2f us/query (%" PRIu64
+            " matches)\n"
+            "[MFIndex] Index: %.2f us/query (%" PRIu64
+            " matches), build: %.2f ms\n",
+            num_ranks_, num_epochs_, manifest_.Size(), width,
+            scan_us * 1.0 / num_queries, scan_items,
+            index_us * 1.0 / num_queries, index_items, build_us / 1e3);
+
+    if (scan_items != index_items) {
+      fprintf(stderr, "[MFIndex] !!! scan and index results differ !!!\n");
+    }
+
+    RunStats(queries);
+    RunLazy();
+    RunCompact(queries, keep_cold);
+  }
+
+  /* memory per item and lookup cost, expanded vs. compact manifest */
+  void RunCompact(const std::vector< Query >& queries, bool keep_cold) {
+    const size_t nitems = manifest_.Size();
+    const size_t ndecodes = queries.size() * 100;
+
+    size_t mem_expanded = manifest_.MemoryUsage();
+    uint64_t mass_expanded = 0, sum_expanded = 0;
+    uint64_t lookup_expanded = TimeLookups(queries, mass_expanded);
+    uint64_t decode_expanded = TimeDecodes(ndecodes, sum_expanded);
+
+    Status s = manifest_.Compact(keep_cold);
+    if (!s.ok()) {
+      fprintf(stderr, "[MFIndex] Compact failed: %s\n", s.ToString().c_str());
+      return;
+    }
+
+    size_t mem_compact = manifest_.MemoryUsage();
+    uint64_t mass_compact = 0, sum_compact = 0;
+    uint64_t lookup_compact = TimeLookups(queries, mass_compact);
+    uint64_t decode_compact = TimeDecodes(ndecodes, sum_compact);
+
+    fprintf(stderr,
+            "[MFIndex] Expanded: %.1f B/item, %.2f us/query, "
+            "%.1f ns/item access\n"
+            "[MFIndex] Compact:  %.1f B/item, %.2f us/query, "
+            "%.1f ns/item access\n",
+            mem_expanded * 1.0 / nitems, lookup_expanded * 1.0 / queries.size(),
+            decode_expanded * 1e3 / ndecodes, mem_compact * 1.0 / nitems,
+            lookup_compact * 1.0 / queries.size(),
+            decode_compact * 1e3 / ndecodes);
+
+    if (mass_expanded != mass_compact or sum_expanded != sum_compact) {
+      fprintf(stderr, "[MFIndex] !!! expanded and compact items differ !!!\n");
+    }
+  }
+
+  /* the analytics access pattern: mass/count per probe, via a match built
+   * from the index vs. via the SIMD filter over the columnar view */
+  void RunStats(const std::vector< Query >& queries) {
+    uint64_t match_mass = 0;
+    uint64_t match_beg = env_->NowMicros();
+    for (size_t i = 0; i < queries.size(); i++) {
+      const Range& r = queries[i].range;
+      PartitionManifestMatch match;
+      manifest_.GetOverlappingEntries(queries[i].epoch, r.range_min,
+                                      r.range_max, match);
+      match_mass += match.TotalMass();
+    }
+    uint64_t match_us = env_->NowMicros() - match_beg;
+
+    uint64_t cols_mass = 0;
+    uint64_t cols_beg = env_->NowMicros();
+    for (size_t i = 0; i < queries.size(); i++) {
+      const Range& r = queries[i].range;
+      uint64_t mass, count;
+      manifest_.GetOverlapStats(queries[i].epoch, r.range_min, r.range_max,
+                                mass, count);
+      cols_mass += mass;
+    }
+    uint64_t cols_us = env_->NowMicros() - cols_beg;
+
+    fprintf(stderr,
+            "[MFIndex] Stats via match:   %.2f us/query\n"
+            "[MFIndex] Stats via columns: %.2f us/query (simd: %s)\n",
+            match_us * 1.0 / queries.size(), cols_us * 1.0 / queries.size(),
+            SimdFilter::LevelName(SimdFilter::Level()));
+
+    if (match_mass != cols_mass) {
+      fprintf(stderr, "[MFIndex] !!! match and column stats differ !!!\n");
+    }
+  }
+
+ private:
+  uint64_t TimeLookups(const std::vector< Query >& queries, uint64_t& mass) {
+    uint64_t beg = env_->NowMicros();
+    for (size_t i = 0; i < queries.size(); i++) {
+      PartitionManifestMatch match;
+      manifest_.GetOverlappingEntries(queries[i], match);
+      mass += match.TotalMass();
+    }
+    return env_->NowMicros() - beg;
+  }
+
+  /* n random single-item accesses through GetItem, the same n each call */
+  uint64_t TimeDecodes(size_t n, uint64_t& sum) {
+    srand(n);
+    uint64_t beg = env_->NowMicros();
+    for (size_t i = 0; i < n; i++) {
+      sum += manifest_.GetItem(rand() % manifest_.Size()).offset;
+    }
+    return env_->NowMicros() - beg;
+  }
+
+  /* the pre-index lookup: every item of every epoch is examined */
+  uint64_t ScanQuery(const Query& q) {
+    PartitionManifestMatch match;
+    for (size_t i = 0; i < manifest_.Size(); i++) {
+      PartitionManifestItem& item = manifest_[i];
+      if (item.epoch == q.epoch && item.Overlaps(q.range)) {
+        match.AddItem(item);
+      }
+    }
+    return match.Size();
+  }
+
+  Env* const env_;
+  const int num_ranks_;
+  const int num_epochs_;
+  const int ssts_per_epoch_;
+  PartitionManifest manifest_;
+  PartitionManifestReader reader_;
+  std::vector< std::string > footers_;
+  uint64_t decode_us_;
+};
+}  // namespace plfsio
+}  // namespace pdlfs
+
+void PrintHelp() {
+  printf(
+      "./prog [-r ranks] [-e epochs] [-s ssts_per_epoch] [-n queries] "
+      "[-w query_width] [-d (drop debug fields when compacting)]\n");
+}
+
+int main(int argc, char* argv[]) {
+  int num_ranks = 4096, num_epochs = 12, ssts = 16, num_queries = 200;
+  float width = 0.01;
+  bool keep_cold = true;
+  int c;
+
+  while ((c = getopt(argc, argv, "r:e:s:n:w:dh")) != -1) {
+    switch (c) {
+      case 'r':
+        num_ranks = std::stoi(optarg);
+        break;
+      case 'e':
+        num_epochs = std::stoi(optarg);
+        break;
+      case 's':
+        ssts = std::stoi(optarg);
+        break;
+      case 'n':
+        num_queries = std::stoi(optarg);
+        break;
+      case 'w':
+        width = std::stof(optarg);
+        break;
+      case 'd':
+        keep_cold = false;
+        break;
+      case 'h':
+      default:
+        PrintHelp();
+        exit(0);
+        break;
+    }
+  }
+
+  srand(42);
+  pdlfs::plfsio::ManifestIndexBenchmark bench(num_ranks, num_epochs, ssts);
+  bench.Prepare();
+  bench.Run(num_queries, width, keep_cold);
+
+  return 0;
+}
@@ -95,6 +95,7 @@ class SimpleReader {
     uint64_t sst_cnt = sst_sz / (key_sz + val_sz);
 
     fdcache_.GetFileHandle(rank, &fh, &file_sz, false);
+    fdcache_.ReleaseFileHandle(rank);
 
     uint64_t num_ssts = file_sz / sst_sz;
     num_items = std::min(num_items, num_ssts);
@@ -152,7 +153,7 @@ class SimpleReader {
     match.GetKVSizes(key_sz, val_sz);
 
     for (uint32_t i = 0; i < match.Size(); i++) {
-      PartitionManifestItem& item = match[i];
+      const PartitionManifestItem& item = match[i];
       work_items[i].item = &item;
       work_items[i].key_sz = key_sz;
       work_items[i].val_sz = val_sz;
@@ -163,6 +164,7 @@ class SimpleReader {
 
       work_items[i].fdcache = &fdcache_;
       work_items[i].task_tracker = &task_tracker_;
+      work_items[i].manifest = NULL;
 
       thpool_->Schedule(QueryUtils::SSTReadWorker< T >, (void*)&work_items[i]);
     }
@@ -207,6 +209,7 @@ class SimpleReader {
 
       work_items[i].fdcache = &fdcache_;
       work_items[i].task_tracker = &task_tracker_;
+      work_items[i].manifest = NULL;
 
       thpool_->Schedule(QueryUtils::RankwiseSSTReadWorker< T >,
                         (void*)&work_items[i]);
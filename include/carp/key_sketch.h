@@ -0,0 +1,70 @@
+//
+// key_sketch.h: compact approximation of an epoch's key distribution
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace pdlfs {
+namespace plfsio {
+/* KeySketch: piecewise-linear approximation of the key CDF of an epoch,
+ * built from weighted key intervals. Each interval's mass is assumed to be
+ * spread uniformly over it; zero-width intervals are point masses. The
+ * manifest feeds it the observed range and item count of every SST, and
+ * replaces an SST's interval with finer ones once real key samples for it
+ * are known.
+ *
+ * Build() computes the exact CDF of the intervals and keeps a knot each
+ * time the CDF grows by another 1/max_knots of the total mass (plus the
+ * knot right before it), so Estimate() is off by at most 2 * total mass /
+ * max_knots relative to the uniform model, at O(log max_knots) per call.
+ *
+ * Not thread-safe while building; Estimate is safe to call concurrently.
+ */
+class KeySketch {
+ public:
+  static const size_t kDefaultKnots = 1024;
+
+  KeySketch() : mass_(0), step_(0) {}
+
+  void Add(float rmin, float rmax, double mass);
+
+  void Build(size_t max_knots = kDefaultKnots);
+
+  /* Estimated mass of keys in [rmin, rmax], or 0 if rmin > rmax */
+  double Estimate(float rmin, float rmax) const;
+
+  /* Max absolute error of Estimate w.r.t. the interval model */
+  double ErrorBound() const { return 2 * step_; }
+
+  double Mass() const { return mass_; }
+
+  size_t NumKnots() const { return knots_.size(); }
+
+  void Clear();
+
+ private:
+  struct Piece {
+    float rmin;
+    float rmax;
+    double mass;
+  };
+
+  struct Knot {
+    float key;
+    double cdf;
+  };
+
+  /* mass of keys < key (right = false) or <= key (right = true) */
+  double Cdf(float key, bool right) const;
+
+  std::vector< Piece > pieces_;
+  std::vector< Knot > knots_;
+  double mass_;
+  double step_;
+};
+}  // namespace plfsio
+}  // namespace pdlfs
@@ -4,10 +4,14 @@
 
 #pragma once
 
+#include "carp/key_sketch.h"
+
 #include "pdlfs-common/env.h"
+#include "pdlfs-common/port.h"
 #include "pdlfs-common/status.h"
 
 #include <algorithm>
+#include <deque>
 #include <float.h>
 #include <inttypes.h>
 #include <map>
@@ -65,6 +69,61 @@ struct Range {
   }
 };
 
+/* IntervalIndex: static index over a set of float intervals (the observed
+ * ranges of an epoch's SSTs). Intervals are sorted by range_min and laid out
+ * as an implicit binary tree, each node carrying the max range_max of its
+ * subtree. Overlap queries prune subtrees that end before the query begins
+ * and stop descending right once range_min exceeds the query end, so lookups
+ * cost O(log n + matches) instead of a full scan.
+ *
+ * Match semantics are identical to Range::Overlaps, including for inverted
+ * query ranges and for empty (range_min > range_max) intervals.
+ *
+ * Not thread-safe while building; Query is safe to call concurrently.
+ */
+class IntervalIndex {
+ public:
+  IntervalIndex() {}
+
+  void Add(const Range& r, uint32_t id);
+
+  void Build();
+
+  /* Appends ids of all intervals overlapping [rmin, rmax] to ids,
+   * in no particular order */
+  void Query(float rmin, float rmax, std::vector< uint32_t >& ids) const;
+
+  size_t Size() const { return ids_.size() + odd_.size(); }
+
+  /* heap bytes held by the built index */
+  size_t MemoryUsage() const;
+
+  void Clear();
+
+ private:
+  void QueryValid(float rmin, float rmax, std::vector< uint32_t >& ids) const;
+
+  float BuildSubtree(size_t lo, size_t hi);
+
+  struct Entry {
+    Range range;
+    uint32_t id;
+
+    bool operator<(const Entry& rhs) const {
+      return range.range_min < rhs.range.range_min;
+    }
+  };
+
+  std::vector< Entry > pending_;
+  /* valid intervals, sorted by range_min, and the subtree maxima */
+  std::vector< float > mins_;
+  std::vector< float > maxs_;
+  std::vector< float > subtree_max_;
+  std::vector< uint32_t > ids_;
+  /* empty/invalid intervals: checked linearly with Range::Overlaps */
+  std::vector< Entry > odd_;
+};
+
 struct Query {
  public:
   int epoch;
@@ -156,33 +215,46 @@ struct PMIOffsetComparator {
 #undef PROPLT
 #undef PROPEQ
 
+/* PartitionManifestMatch: the SSTs matching a query. Items found through a
+ * PartitionManifest are held by reference, so a match must not outlive the
+ * manifest it came from; items added with AddItem are copied and owned by
+ * the match. Per-rank lookups go through a flat rank-grouped index that is
+ * built with one sort on first use, and rebuilt if items are added after.
+ */
 class PartitionManifestMatch {
  public:
   PartitionManifestMatch()
-      : mass_data_(0), mass_total_(0), mass_oob_(0), key_sz_(0), val_sz_(0){};
+      : mass_data_(0),
+        mass_total_(0),
+        mass_oob_(0),
+        key_sz_(0),
+        val_sz_(0),
+        rank_index_valid_(false){};
 
-  void AddItem(PartitionManifestItem& item) {
-    items_.push_back(item);
-    ranks_[item.rank].push_back(items_.size() - 1);
-    mass_total_ += item.part_item_count;
-    mass_oob_ += item.part_item_oob;
+  void AddItem(const PartitionManifestItem& item) {
+    owned_.push_back(item);
+    AddItemRef(&owned_.back());
   }
 
   void GetUniqueRanks(std::vector< int >& ranks) {
-    std::map< int, std::vector< size_t > >::const_iterator it = ranks_.cbegin();
-    for (; it != ranks_.cend(); it++) {
-      ranks.push_back(it->first);
+    BuildRankIndex();
+    for (size_t i = 0; i < rank_index_.size(); i++) {
+      int rank = items_[rank_index_[i]]->rank;
+      if (i == 0 or rank != items_[rank_index_[i - 1]]->rank) {
+        ranks.push_back(rank);
+      }
     }
   }
 
+  /* Appends the items of rank, in match order, and returns their mass */
   uint64_t GetMatchesByRank(int rank,
                             std::vector< PartitionManifestItem >& rank_tables) {
-    std::vector< size_t >& rank_items = ranks_[rank];
-    uint64_t mass_rank = 0;
+    size_t beg, end;
+    GetRankBounds(rank, beg, end);
 
-    for (size_t i = 0; i < rank_items.size(); i++) {
-      size_t it_idx = rank_items[i];
-      PartitionManifestItem& item = items_[it_idx];
+    uint64_t mass_rank = 0;
+    for (size_t i = beg; i < end; i++) {
+      const PartitionManifestItem& item = *items_[rank_index_[i]];
       rank_tables.push_back(item);
       mass_rank += item.part_item_count;
     }
@@ -190,6 +262,22 @@ class PartitionManifestMatch {
     return mass_rank;
   }
 
+  /* As above, without copying the items */
+  uint64_t GetMatchesByRank(
+      int rank, std::vector< const PartitionManifestItem* >& rank_tables) {
+    size_t beg, end;
+    GetRankBounds(rank, beg, end);
+
+    uint64_t mass_rank = 0;
+    for (size_t i = beg; i < end; i++) {
+      const PartitionManifestItem* item = items_[rank_index_[i]];
+      rank_tables.push_back(item);
+      mass_rank += item->part_item_count;
+    }
+
+    return mass_rank;
+  }
+
   uint64_t TotalMass() const { return mass_total_; }
 
   float GetSelectivity() const {
@@ -205,7 +293,9 @@ class PartitionManifestMatch {
 
   uint64_t DataSize() const { return mass_data_; }
 
-  PartitionManifestItem& operator[](size_t i) { return this->items_[i]; }
+  const PartitionManifestItem& operator[](size_t i) const {
+    return *items_[i];
+  }
 
   std::string ToString() const {
     size_t buf_sz = 1024;
@@ -220,6 +310,60 @@ class PartitionManifestMatch {
   void Print();
 
  private:
+  /* orders positions in items_ by rank, keeping match order within a rank
+   */
+  struct RankComparator {
+    explicit RankComparator(
+        const std::vector< const PartitionManifestItem* >& items)
+        : items(items) {}
+
+    bool operator()(uint32_t a, uint32_t b) const {
+      return items[a]->rank < items[b]->rank;
+    }
+
+    bool operator()(uint32_t a, int rank) const {
+      return items[a]->rank < rank;
+    }
+
+    bool operator()(int rank, uint32_t b) const {
+      return rank < items[b]->rank;
+    }
+
+    const std::vector< const PartitionManifestItem* >& items;
+  };
+
+  void AddItemRef(const PartitionManifestItem* item) {
+    items_.push_back(item);
+    mass_total_ += item->part_item_count;
+    mass_oob_ += item->part_item_oob;
+    rank_index_valid_ = false;
+  }
+
+  void BuildRankIndex() {
+    if (rank_index_valid_) return;
+
+    rank_index_.resize(items_.size());
+    for (size_t i = 0; i < rank_index_.size(); i++) {
+      rank_index_[i] = i;
+    }
+
+    std::stable_sort(rank_index_.begin(), rank_index_.end(),
+                     RankComparator(items_));
+    rank_index_valid_ = true;
+  }
+
+  /* [beg, end) of rank in rank_index_ */
+  void GetRankBounds(int rank, size_t& beg, size_t& end) {
+    BuildRankIndex();
+
+    RankComparator cmp(items_);
+    beg = std::lower_bound(rank_index_.begin(), rank_index_.end(), rank, cmp) -
+          rank_index_.begin();
+    end = std::upper_bound(rank_index_.begin() + beg, rank_index_.end(), rank,
+                           cmp) -
+          rank_index_.begin();
+  }
+
   void SetDataSize(size_t data_sz) { mass_data_ = data_sz; }
 
   void SetKVSizes(uint64_t key_sz, uint64_t val_sz) {
@@ -227,13 +371,20 @@ class PartitionManifestMatch {
     val_sz_ = val_sz;
   }
 
-  std::vector< PartitionManifestItem > items_;
-  std::map< int, std::vector< size_t > > ranks_;
+  /* items_ may point into owned_, so no copies */
+  PartitionManifestMatch(const PartitionManifestMatch&);
+  void operator=(const PartitionManifestMatch&);
+
+  std::vector< const PartitionManifestItem* > items_;
+  /* items added through AddItem; a deque keeps references stable */
+  std::deque< PartitionManifestItem > owned_;
+  std::vector< uint32_t > rank_index_;
   uint64_t mass_data_;
   uint64_t mass_total_;
   uint64_t mass_oob_;
   uint64_t key_sz_;
   uint64_t val_sz_;
+  bool rank_index_valid_;
 
   friend class PartitionManifest;
   template < typename U >
@@ -241,6 +392,25 @@ class PartitionManifestMatch {
   friend class QueryMatchOptimizer;
 };
 
+/* ManifestColumns: columnar (SoA) copy of the hot fields of one epoch's
+ * items, in the same order as the epoch's segment. Sweeps over all SSTs of
+ * an epoch stream only the arrays they touch, and the observed bounds are
+ * laid out for the vectorized kernels in SimdFilter. A compact manifest
+ * decodes items from these as well. */
+struct ManifestColumns {
+  std::vector< float > obs_min;
+  std::vector< float > obs_max;
+  std::vector< uint32_t > count;
+
+  void Append(const PartitionManifestItem& item) {
+    obs_min.push_back(item.observed.range_min);
+    obs_max.push_back(item.observed.range_max);
+    count.push_back(item.part_item_count);
+  }
+
+  size_t Size() const { return obs_min.size(); }
+};
+
 // Public Query interface is thread-safe, write interface is not
 class PartitionManifest {
  public:
@@ -251,7 +421,32 @@ class PartitionManifest {
         key_sz_(0),
         val_sz_(0),
         zero_sst_cnt_(0),
-        ranks_(0) {}
+        ranks_(0),
+        indexed_(false),
+        compact_(false) {}
+
+  /* Lays items out in (epoch, rank, offset) order, so that each epoch, and
+   * each rank within an epoch, is one contiguous segment, and builds the
+   * per-epoch interval indexes used by GetOverlappingEntries.
+   * Call once after all items have been added, before issuing queries.
+   * Queries fall back to a linear scan if this hasn't been called. */
+  void BuildIndex();
+
+  /* Re-encodes the items of the manifest compactly (indexing it first if
+   * needed) and frees the expanded items. Queries are unchanged, except
+   * that matches hold decoded copies of items rather than references into
+   * the manifest, and operator[] gives way to GetItem. Returns NotSupported,
+   * leaving the manifest expanded, if an (epoch, rank) segment spans 4 GB
+   * or more of its rdb. Call once all items are added; this invalidates
+   * references into the manifest. Unless keep_cold is set, the debug-only
+   * fields are dropped: items then decode with expected == observed and
+   * zero updcnt/part_item_oob. */
+  Status Compact(bool keep_cold = true);
+
+  bool IsCompact() const { return compact_; }
+
+  /* Approximate heap bytes held for items, columns, and indexes */
+  size_t MemoryUsage() const;
 
   int GetAllEntries(int epoch, PartitionManifestMatch& match);
 
@@ -263,7 +458,34 @@ class PartitionManifest {
   int GetOverlappingEntries(int epoch, float range_begin, float range_end,
                             PartitionManifestMatch& match);
 
-  int GetOverlappingEntries(Query& q, PartitionManifestMatch& match);
+  int GetOverlappingEntries(const Query& q, PartitionManifestMatch& match);
+
+  /* Item count and total mass of the SSTs of epoch overlapping
+   * [rmin, rmax], without materializing a match. Meant for analytics that
+   * probe many points; uses the columnar view once indexed. */
+  void GetOverlapStats(int epoch, float rmin, float rmax, uint64_t& mass,
+                       uint64_t& count) const;
+
+  /* Estimated number of keys of epoch in [rmin, rmax], from the epoch's
+   * KeySketch, and the max error of that estimate w.r.t. the sketch's
+   * model. Needs BuildIndex. Never touches data. */
+  Status GetKeyMassEstimate(int epoch, float rmin, float rmax, double& mass,
+                            double& max_err);
+
+  /* Refines the key sketch of item's epoch with keys read from item. Only
+   * the first set of samples for an SST is kept. Thread-safe. */
+  void AddKeySamples(const PartitionManifestItem& item,
+                     std::vector< float >& keys);
+
+  /* false if item already has samples, or is not part of the manifest, so
+   * that readers can skip gathering them. Thread-safe. */
+  bool NeedsKeySamples(const PartitionManifestItem& item);
+
+  /* NULL if epoch is out of range or the manifest is not indexed */
+  const ManifestColumns* GetEpochColumns(int epoch) const {
+    if (!indexed_ or epoch < 0 or epoch >= num_epochs_) return NULL;
+    return &columns_[epoch];
+  }
 
   Status GenOverlapStats(const char* dir_path, Env* env);
 
@@ -309,17 +531,25 @@ class PartitionManifest {
     return s;
   }
 
-  void SortByKey() {
-    std::sort(items_.begin(), items_.end(), PMIRangeComparator());
-  }
+  /* SortByKey and SortByOffset only change the order operator[] walks
+   * the items in; the underlying segments are left intact */
+  void SortByKey();
 
   void SortByOffset() {
-    std::sort(items_.begin(), items_.end(), PMIOffsetComparator());
+    if (!indexed_) BuildIndex();
+    order_.clear();
   }
 
-  PartitionManifestItem& operator[](size_t i) { return this->items_[i]; }
+  /* Not available once compact */
+  PartitionManifestItem& operator[](size_t i) {
+    assert(!compact_);
+    return order_.empty() ? items_[i] : items_[order_[i]];
+  }
+
+  /* As operator[], by value; works for compact manifests too */
+  PartitionManifestItem GetItem(size_t i) const;
 
-  size_t Size() const { return items_.size(); }
+  size_t Size() const { return compact_ ? off_delta_.size() : items_.size(); }
 
   int NumRanks() const { return ranks_; }
 
@@ -328,6 +558,58 @@ class PartitionManifest {
 
   void GenEpochStatsCSV(const int epoch, WritableFile* fd);
 
+  /* Appends indexes into items_ of all items in epoch overlapping
+   * [rmin, rmax], in items_ order */
+  void GetOverlappingIndexes(int epoch, float rmin, float rmax,
+                             std::vector< uint32_t >& idxvec) const;
+
+  /* position of item in items_, or -1 if it's not part of the manifest */
+  int64_t FindItem(const PartitionManifestItem& item) const;
+
+  /* (re)builds the key sketch of epoch, using key samples where known */
+  void BuildSketch(int epoch);
+
+  /* [beg, end) of the segment of items_ holding epoch (all ranks if
+   * rank is -1). Only valid once indexed. */
+  void GetSegment(int epoch, int rank, size_t& beg, size_t& end) const {
+    beg = end = 0;
+    if (epoch < 0 or epoch >= num_epochs_) return;
+    if (rank >= ranks_) return;
+
+    if (rank < 0) {
+      beg = seg_begin_[epoch * ranks_];
+      end = seg_begin_[(epoch + 1) * ranks_];
+    } else {
+      beg = seg_begin_[epoch * ranks_ + rank];
+      end = seg_begin_[epoch * ranks_ + rank + 1];
+    }
+  }
+
+  /* item i, in items_ order, from the compact encoding. seg_hint is the
+   * (epoch, rank) segment of the last decoded item; it saves the segment
+   * lookup when items are decoded in order. */
+  void DecodeItem(size_t i, PartitionManifestItem& item,
+                  size_t& seg_hint) const;
+
+  void AddMatch(size_t i, PartitionManifestMatch& match, size_t& seg_hint) {
+    if (compact_) {
+      PartitionManifestItem item;
+      DecodeItem(i, item, seg_hint);
+      match.AddItem(item);
+    } else {
+      match.AddItemRef(&items_[i]);
+    }
+  }
+
+  void AddSegmentMatches(size_t beg, size_t end,
+                         PartitionManifestMatch& match) {
+    match.items_.reserve(match.items_.size() + end - beg);
+    size_t seg_hint = 0;
+    for (size_t i = beg; i < end; i++) {
+      AddMatch(i, match, seg_hint);
+    }
+  }
+
   void AddItem(PartitionManifestItem& item) {
     items_.push_back(item);
     mass_total_ += item.part_item_count;
@@ -371,6 +653,39 @@ class PartitionManifest {
   uint64_t val_sz_;
   int zero_sst_cnt_;
   int ranks_;
+  bool indexed_;
+  std::vector< IntervalIndex > index_epoch_;
+  std::vector< ManifestColumns > columns_;
+  /* sketches are rebuilt lazily once samples arrive; all sketch state is
+   * guarded by sketch_mutex_ */
+  std::vector< KeySketch > sketch_epoch_;
+  std::vector< bool > sketch_stale_;
+  std::map< uint32_t, std::vector< float > > key_samples_;
+  port::Mutex sketch_mutex_;
+  /* once indexed, items of (epoch, rank) are at
+   * [seg_begin_[epoch * ranks_ + rank], seg_begin_[epoch * ranks_ + rank + 1])
+   */
+  std::vector< uint32_t > seg_begin_;
+  /* iteration order for operator[], empty means items_ order */
+  std::vector< uint32_t > order_;
+
+  /* fields only needed to hand out whole items, and only kept if
+   * compacted with keep_cold */
+  struct ColdFields {
+    Range expected;
+    uint32_t updcnt;
+    uint32_t part_item_oob;
+  };
+
+  /* compact encoding (see Compact): items_ is empty, the hot fields stay
+   * in columns_, epoch and rank follow from seg_begin_, offsets are 32-bit
+   * deltas from the first offset of their segment (seg_base_), and the
+   * rest lives in a side table (cold_, possibly empty) that queries don't
+   * touch until they decode an item */
+  bool compact_;
+  std::vector< uint64_t > seg_base_;
+  std::vector< uint32_t > off_delta_;
+  std::vector< ColdFields > cold_;
 };
 }  // namespace plfsio
 }  // namespace pdlfs
@@ -62,6 +62,16 @@ namespace plfsio {
 #define KB(n) (1024 * (n))
 #define MB(n) (1024 * KB(n))
 
+/* what a query returns of each matching record */
+enum Projection {
+  /* keys only; no value bytes are read */
+  kProjectKeys,
+  /* keys, and bytes [value_off, value_off + value_len) of each value */
+  kProjectValueRange,
+  /* keys and whole values */
+  kProjectRecords
+};
+
 typedef struct RdbOptions {
   Env* env;
   std::string data_path;
@@ -81,6 +91,69 @@ typedef struct RdbOptions {
 
   bool full_scan;
 
+  /* SSTs are always read for keys only. Values, if projected, are read
+   * after the keys are filtered and sorted, for matching keys only. */
+  Projection projection;
+  uint32_t value_off;
+  uint32_t value_len;
+
+  /* answer the query with an aggregate instead of the matching keys */
+  bool aggregate_on;
+  bool aggregate_sum;
+  bool aggregate_approx;
+
+  /* reuse/maintain rdb.manifest.cache in the plfs dir (see ManifestCache) */
+  bool manifest_cache;
+
+  /* with manifest_cache, skip listing and stat'ing the rdb files if the
+   * plfs dir is unchanged since the cache was written. Rdb files rewritten
+   * in place are then not noticed (see ManifestCache::LoadListing). */
+  bool cached_listing;
+
+  /* keep the manifest compactly encoded in memory (see Compact) */
+  bool compact_manifest;
+
+  /* decode each epoch's manifest only once it is queried */
+  bool lazy_manifest;
+
+  /* if non-zero, read the SSTs of a query as one io_uring batch with up to
+   * this many reads in flight (see UringReader) */
+  uint32_t io_queue_depth;
+
+  /* mmap rdb files and decode SSTs in place (see MappedFile) */
+  bool mmap_reads;
+
+  /* rdb file handles kept open, least recently used ones are closed */
+  int max_open_files;
+
+  /* batched reads of a rank merge requests at most coalesce_gap bytes
+   * apart, reading at most coalesce_amplification times the bytes asked
+   * for. An amplification below 1 turns this off (see CoalesceOptions). */
+  uint64_t coalesce_gap;
+  double coalesce_amplification;
+
+  /* full scans (QueryNaive, compaction, fmtcheck) read with O_DIRECT, so
+   * that they don't evict the pages other queries rely on (see ReadMode) */
+  bool direct_scans;
+
+  /* in batch mode, read the SSTs of up to prefetch_depth queries ahead of
+   * the one being sorted, while their results take up at most
+   * prefetch_budget bytes. A depth of 0 runs queries one by one. With
+   * io_uring reads (io_queue_depth), queries always run one by one, as a
+   * batch is read in full before the next query is planned. */
+  uint32_t prefetch_depth;
+  uint64_t prefetch_budget;
+
+  /* sort query results with a parallel radix sort on the pool (see
+   * RadixSorter) rather than a comparison sort, which without TBB
+   * (CARP_PARALLEL_SORT) runs on a single thread */
+  bool radix_sort;
+  /* the matches of an SST that come out of it in key order make a sorted
+   * run: if most of a query's results are in sorted runs, and that is
+   * likely faster, merge them (see RunMerger) instead of sorting all
+   * results. Runs that overlap no other run are only copied. */
+  bool merge_runs;
+
   RdbOptions()
       : env(NULL),
         parallelism(1),
@@ -91,7 +164,27 @@ typedef struct RdbOptions {
         query_begin(0),
         query_end(0),
         query_batch(false),
-        full_scan(false) {}
+        full_scan(false),
+        projection(kProjectKeys),
+        value_off(0),
+        value_len(0),
+        aggregate_on(false),
+        aggregate_sum(false),
+        aggregate_approx(false),
+        manifest_cache(true),
+        cached_listing(false),
+        compact_manifest(false),
+        lazy_manifest(false),
+        io_queue_depth(0),
+        mmap_reads(false),
+        max_open_files(512),
+        coalesce_gap(MB(1)),
+        coalesce_amplification(2.0),
+        direct_scans(false),
+        prefetch_depth(1),
+        prefetch_budget(MB(256)),
+        radix_sort(true),
+        merge_runs(true) {}
 } RdbOptions;
 }  // namespace plfsio
 }  // namespace pdlfs
@@ -15,6 +15,7 @@ namespace plfsio {
 static const char* kPerfEventManifestRead = "manifest_read";
 static const char* kPerfEventSstRead = "sst_read";
 static const char* kPerfEventSstMergeSort = "sst_mergesort";
+static const char* kPerfEventValueRead = "value_read";
 
 class RangeReaderPerfLogger {
  public:
@@ -33,7 +33,8 @@ Status Compactor::MergeAll() {
   uint64_t key_sz, val_sz;
   manifest_.GetKVSizes(key_sz, val_sz);
   SlidingSorter::SetKVSizes(key_sz, val_sz);
-  SlidingSorter sorter(merge_dest, fdcache_);
+  SlidingSorter sorter(merge_dest, fdcache_,
+                       options_.direct_scans ? kReadDirect : kReadCached);
 
   EpochRunMap run_map;
   s = ComputeRuns(run_map);
@@ -81,7 +82,8 @@ Status Compactor::MergeEpoch(int epoch) {
   uint64_t key_sz, val_sz;
   manifest_.GetKVSizes(key_sz, val_sz);
   SlidingSorter::SetKVSizes(key_sz, val_sz);
-  SlidingSorter sorter(merge_dest, fdcache_);
+  SlidingSorter sorter(merge_dest, fdcache_,
+                       options_.direct_scans ? kReadDirect : kReadCached);
 
   EpochRunMap run_map;
   s = ComputeRuns(run_map);
@@ -0,0 +1,117 @@
+//
+// direct_io.cc: page-cache-bypassing reads of rdb files
+//
+
+#include "direct_io.h"
+
+#include "pdlfs-common/mutexlock.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace pdlfs {
+namespace plfsio {
+AlignedBufferPool::~AlignedBufferPool() {
+  for (size_t i = 0; i < free_.size(); i++) free(free_[i].data);
+}
+
+Status AlignedBufferPool::Get(size_t n, AlignedBuffer* buf) {
+  {
+    MutexLock ml(&mutex_);
+    /* the smallest free buffer that fits */
+    size_t best = free_.size();
+    for (size_t i = 0; i < free_.size(); i++) {
+      if (free_[i].size < n) continue;
+      if (best == free_.size() or free_[i].size < free_[best].size) best = i;
+    }
+
+    if (best < free_.size()) {
+      *buf = free_[best];
+      free_[best] = free_.back();
+      free_.pop_back();
+      return Status::OK();
+    }
+  }
+
+  size_t size = kDirectIoAlign;
+  while (size < n) size <<= 1;
+
+  void* data = NULL;
+  int r = posix_memalign(&data, kDirectIoAlign, size);
+  if (r != 0) return Status::IOError("posix_memalign", strerror(r));
+
+  buf->data = static_cast< char* >(data);
+  buf->size = size;
+  return Status::OK();
+}
+
+void AlignedBufferPool::Put(const AlignedBuffer& buf) {
+  MutexLock ml(&mutex_);
+  if (free_.size() < max_free_) {
+    free_.push_back(buf);
+    return;
+  }
+
+  /* full: keep the larger of buf and the smallest buffer kept */
+  size_t smallest = 0;
+  for (size_t i = 1; i < free_.size(); i++) {
+    if (free_[i].size < free_[smallest].size) smallest = i;
+  }
+
+  if (free_.empty() or free_[smallest].size >= buf.size) {
+    free(buf.data);
+  } else {
+    free(free_[smallest].data);
+    free_[smallest] = buf;
+  }
+}
+
+size_t AlignedBufferPool::NumFree() {
+  MutexLock ml(&mutex_);
+  return free_.size();
+}
+
+Status OpenDirect(const std::string& fname, int* fd, bool* buffered) {
+  *buffered = false;
+  *fd = open(fname.c_str(), O_RDONLY | O_DIRECT);
+  if (*fd >= 0) return Status::OK();
+
+  if (errno != EINVAL) return Status::IOError(fname, strerror(errno));
+
+  *buffered = true;
+  *fd = open(fname.c_str(), O_RDONLY);
+  if (*fd < 0) return Status::IOError(fname, strerror(errno));
+
+  return Status::OK();
+}
+
+Status PreadFully(int fd, const std::string& fname, uint64_t offset,
+                  uint64_t n, char* buf, uint64_t* got) {
+  *got = 0;
+  while (*got < n) {
+    ssize_t r = pread(fd, buf + *got, n - *got, offset + *got);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return Status::IOError(fname, strerror(errno));
+    }
+    if (r == 0) break;
+    *got += r;
+
+    /* only EOF ends a direct read off a block boundary, and a retry from
+     * there would be misaligned */
+    if (*got % kDirectIoAlign != 0) break;
+  }
+
+  return Status::OK();
+}
+
+void DropCachedPages(int fd, uint64_t offset, uint64_t n) {
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(fd, offset, n, POSIX_FADV_DONTNEED);
+#endif
+}
+}  // namespace plfsio
+}  // namespace pdlfs
@@ -0,0 +1,81 @@
+//
+// direct_io.h: page-cache-bypassing reads of rdb files
+//
+
+#pragma once
+
+#include "pdlfs-common/env.h"
+#include "pdlfs-common/port.h"
+
+#include <string>
+#include <vector>
+
+namespace pdlfs {
+namespace plfsio {
+/* O_DIRECT offsets, lengths and buffers are kept multiples of this, which
+ * covers the logical block size of any device we read from */
+static const uint64_t kDirectIoAlign = 4096;
+
+/* how an operation reads rdb files, see CachingDirReader::Read */
+enum ReadMode {
+  /* through env_ and the page cache */
+  kReadCached,
+  /* with O_DIRECT, for sweeps that would otherwise evict the page cache */
+  kReadDirect
+};
+
+/* [offset, offset + bytes) widened out to kDirectIoAlign boundaries */
+inline void AlignExtent(uint64_t offset, uint64_t bytes, uint64_t* aligned_off,
+                        uint64_t* aligned_len) {
+  uint64_t end = offset + bytes;
+  *aligned_off = offset / kDirectIoAlign * kDirectIoAlign;
+  end = (end + kDirectIoAlign - 1) / kDirectIoAlign * kDirectIoAlign;
+  *aligned_len = end - *aligned_off;
+}
+
+struct AlignedBuffer {
+  char* data;
+  size_t size;
+};
+
+/* AlignedBufferPool: kDirectIoAlign-aligned buffers, handed out and taken
+ * back so that a sweep does not allocate per read. Buffers are sized up to
+ * a power of two, so that reads of similar size share them, and at most
+ * max_free are kept between uses. Thread-safe. */
+class AlignedBufferPool {
+ public:
+  explicit AlignedBufferPool(size_t max_free = 16) : max_free_(max_free) {}
+
+  ~AlignedBufferPool();
+
+  /* a buffer of at least n bytes */
+  Status Get(size_t n, AlignedBuffer* buf);
+
+  void Put(const AlignedBuffer& buf);
+
+  size_t NumFree();
+
+ private:
+  /* No copying allowed */
+  AlignedBufferPool(const AlignedBufferPool&);
+  void operator=(const AlignedBufferPool&);
+
+  const size_t max_free_;
+  port::Mutex mutex_;
+  std::vector< AlignedBuffer > free_;
+};
+
+/* Opens fname for direct reads. If the file system refuses O_DIRECT (as
+ * tmpfs does), falls back to a plain descriptor and sets *buffered: the
+ * caller then drops the pages it read with DropCachedPages. */
+Status OpenDirect(const std::string& fname, int* fd, bool* buffered);
+
+/* preads [offset, offset + n) of fd into buf, retrying short reads. Comes
+ * back short (in *got) only at EOF. */
+Status PreadFully(int fd, const std::string& fname, uint64_t offset,
+                  uint64_t n, char* buf, uint64_t* got);
+
+/* evicts [offset, offset + n) of fd from the page cache */
+void DropCachedPages(int fd, uint64_t offset, uint64_t n);
+}  // namespace plfsio
+}  // namespace pdlfs
@@ -8,44 +8,263 @@
 #include "optimizer.h"
 #include "range_reader.h"
 #include "reader_base.h"
+#include "uring_reader.h"
 
+#include <fcntl.h>
+#include <inttypes.h>
 #include <pdlfs-common/mutexlock.h>
+#include <string.h>
 #include <string>
-
-#define MAP_HAS(m, k) (m.find(k) != m.end())
+#include <unistd.h>
 
 namespace pdlfs {
 namespace plfsio {
+namespace {
+struct StatWorkItem {
+  const std::string* dir;
+  std::vector<RdbFileInfo>* files;
+  int rank_beg;
+  int rank_end;
+
+  port::Mutex* mutex;
+  port::CondVar* cv;
+  int* tasks_pending;
+};
+
+void StatWorker(void* arg) {
+  StatWorkItem* wi = static_cast<StatWorkItem*>(arg);
+
+  for (int rank = wi->rank_beg; rank < wi->rank_end; rank++) {
+    RdbFileInfo& fi = (*wi->files)[rank];
+    if (!fi.exists) continue;
+
+    char tmp[20];
+    snprintf(tmp, sizeof(tmp), "RDB-%08x.tbl", rank);
+    std::string fname = *wi->dir + "/" + tmp;
+
+    /* a file removed since it was listed counts as missing */
+    Status s = GetFileInfo(fname, fi);
+    if (!s.ok()) {
+      logv(__LOG_ARGS__, LOG_WARN, "%s", s.ToString().c_str());
+    }
+  }
+
+  MutexLock ml(wi->mutex);
+  if (--*wi->tasks_pending == 0) wi->cv->SignalAll();
+}
+
+/* a run of requests served by a single read */
+struct ReadGroup {
+  uint64_t offset;
+  uint64_t bytes;
+  /* the group's requests are order[beg, end) */
+  size_t beg;
+  size_t end;
+};
+
+struct OffsetOrder {
+  explicit OffsetOrder(const std::vector<ReadRequest>& r) : requests(r) {}
+
+  bool operator()(size_t a, size_t b) const {
+    return requests[a].offset < requests[b].offset;
+  }
+
+  const std::vector<ReadRequest>& requests;
+};
+
+/* Orders requests by offset, and cuts them into groups that are each
+ * within opts of being read as one */
+void PlanReads(const std::vector<ReadRequest>& requests,
+               const CoalesceOptions& opts, std::vector<size_t>& order,
+               std::vector<ReadGroup>& groups) {
+  order.resize(requests.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), OffsetOrder(requests));
+
+  groups.clear();
+  const bool coalesce = opts.max_amplification >= 1;
+  /* bytes requested by the last group */
+  uint64_t useful = 0;
+
+  for (size_t i = 0; i < order.size(); i++) {
+    const ReadRequest& r = requests[order[i]];
+    uint64_t r_end = r.offset + r.bytes;
+
+    if (coalesce and !groups.empty()) {
+      ReadGroup& g = groups.back();
+      uint64_t g_end = g.offset + g.bytes;
+      uint64_t span = std::max(g_end, r_end) - g.offset;
+      bool near = r.offset <= g_end or r.offset - g_end <= opts.max_gap;
+
+      if (near and span <= opts.max_read and
+          span <= opts.max_amplification * (useful + r.bytes)) {
+        g.bytes = span;
+        g.end = i + 1;
+        useful += r.bytes;
+        continue;
+      }
+    }
+
+    ReadGroup g = {r.offset, r.bytes, i, i + 1};
+    groups.push_back(g);
+    useful = r.bytes;
+  }
+}
+
+/* Copies each request of g out of merged, the result of reading g. A read
+ * that came back short at EOF leaves the requests past it short too. */
+void ScatterReads(const Slice& merged, const ReadGroup& g,
+                  const std::vector<size_t>& order,
+                  std::vector<ReadRequest>& requests) {
+  for (size_t i = g.beg; i < g.end; i++) {
+    ReadRequest& r = requests[order[i]];
+    uint64_t off = r.offset - g.offset;
+
+    uint64_t n = 0;
+    if (off < merged.size()) n = std::min(r.bytes, merged.size() - off);
+    if (n > 0) memcpy(r.scratch, merged.data() + off, n);
+    r.slice = Slice(r.scratch, n);
+  }
+}
+}  // namespace
+
 template <typename T>
-Status CachingDirReader<T>::ReadDirectory(std::string dir, int& num_ranks) {
+CachingDirReader<T>::~CachingDirReader() {
+  delete uring_;
+
+  for (size_t i = 0; i < cache_.size(); i++) {
+    if (cache_[i].is_open) delete cache_[i].fh;
+    if (cache_[i].raw_fd >= 0) close(cache_[i].raw_fd);
+    if (cache_[i].direct_fd >= 0) close(cache_[i].direct_fd);
+  }
+}
+
+template <typename T>
+bool CachingDirReader<T>::ZeroCopyReads() {
+  return false;
+}
+
+template <>
+bool CachingDirReader<MappedFile>::ZeroCopyReads() {
+  return true;
+}
+
+template <typename T>
+Status CachingDirReader<T>::ReadDirectory(std::string dir, int& num_ranks,
+                                          ThreadPool* pool) {
   logv(__LOG_ARGS__, LOG_INFO, "Reading directory: %s\n", dir.c_str());
 
+  std::vector<std::string> names;
+  Status s = env_->GetChildren(dir.c_str(), &names);
+  if (!s.ok()) return s;
+
+  /* a single listing finds every rank, including any after a gap */
+  RdbFileInfo no_file = {false, 0, 0};
+  std::vector<RdbFileInfo> files;
+
+  for (size_t i = 0; i < names.size(); i++) {
+    int rank = ParseRdbName(names[i]);
+    if (rank < 0) continue;
+
+    if (rank >= kMaxRanks) {
+      logv(__LOG_ARGS__, LOG_WARN, "Ignoring %s, rank out of range",
+           names[i].c_str());
+      continue;
+    }
+
+    if (rank >= (int)files.size()) files.resize(rank + 1, no_file);
+    files[rank].exists = true;
+  }
+
+  /* one stat per file, spread over the pool */
+  const int kRanksPerTask = 64;
+  int num_tasks = (files.size() + kRanksPerTask - 1) / kRanksPerTask;
+
+  port::Mutex mutex;
+  port::CondVar cv(&mutex);
+  int tasks_pending = num_tasks;
+
+  std::vector<StatWorkItem> work_items(num_tasks);
+  for (int ti = 0; ti < num_tasks; ti++) {
+    StatWorkItem& wi = work_items[ti];
+    wi.dir = &dir;
+    wi.files = &files;
+    wi.rank_beg = ti * kRanksPerTask;
+    wi.rank_end = std::min((int)files.size(), wi.rank_beg + kRanksPerTask);
+    wi.mutex = &mutex;
+    wi.cv = &cv;
+    wi.tasks_pending = &tasks_pending;
+
+    if (pool) {
+      pool->Schedule(StatWorker, &wi);
+    } else {
+      StatWorker(&wi);
+    }
+  }
+
+  mutex.Lock();
+  while (tasks_pending > 0) cv.Wait();
+  mutex.Unlock();
+
+  return SetDirectory(dir, files, num_ranks);
+}
+
+template <typename T>
+Status CachingDirReader<T>::SetDirectory(std::string dir,
+                                         const std::vector<RdbFileInfo>& files,
+                                         int& num_ranks) {
+  /* handles of a previously read directory are dropped */
+  for (size_t i = 0; i < cache_.size(); i++) {
+    if (cache_[i].is_open) delete cache_[i].fh;
+    if (cache_[i].raw_fd >= 0) close(cache_[i].raw_fd);
+    if (cache_[i].direct_fd >= 0) close(cache_[i].direct_fd);
+  }
+  cache_.clear();
+  for (int i = 0; i < num_shards_; i++) shards_[i].lru.clear();
+
   dir_ = dir;
-  uint64_t fsz;
 
-  for (int rank = 0;; rank++) {
-    std::string fname = RdbName(dir_, rank);
-    bool file_exists = env_->FileExists(fname.c_str());
-    if (!file_exists) break;
+  FileCacheEntry<T> fe = FileCacheEntry<T>();
+  fe.rank = -1;
+  fe.raw_fd = -1;
+  fe.direct_fd = -1;
+  cache_.resize(files.size(), fe);
+  int num_found = 0;
 
-    Status s = env_->GetFileSize(fname.c_str(), &fsz);
-    if (!s.ok()) continue;
+  for (size_t rank = 0; rank < files.size(); rank++) {
+    if (!files[rank].exists) continue;
 
-    logv(__LOG_ARGS__, LOG_DBUG, "File: %s, size: %u\n", fname.c_str(), fsz);
+    cache_[rank].rank = rank;
+    cache_[rank].fsz = files[rank].fsz;
+    cache_[rank].mtime = files[rank].mtime;
+    num_found++;
 
-    if (!s.ok()) continue;
+    logv(__LOG_ARGS__, LOG_DBUG, "File: %s, size: %" PRIu64 "\n",
+         RdbName(dir_, rank).c_str(), files[rank].fsz);
+  }
 
-    FileCacheEntry<T> fe = {rank, false, nullptr, fsz};
-    cache_[rank] = fe;
+  logv(__LOG_ARGS__, LOG_INFO, "%d rdb files found.\n", num_found);
+  if (num_found < (int)files.size()) {
+    logv(__LOG_ARGS__, LOG_WARN, "%d of ranks 0-%d have no rdb file",
+         (int)files.size() - num_found, (int)files.size() - 1);
   }
 
-  logv(__LOG_ARGS__, LOG_INFO, "%u rdb files found.\n", cache_.size());
-  num_ranks = cache_.size();
+  num_ranks = files.size();
   num_ranks_ = num_ranks;
 
   return Status::OK();
 }
 
+template <typename T>
+void CachingDirReader<T>::GetListing(std::vector<RdbFileInfo>& files) const {
+  files.resize(cache_.size());
+  for (size_t rank = 0; rank < cache_.size(); rank++) {
+    files[rank].exists = cache_[rank].rank >= 0;
+    files[rank].fsz = cache_[rank].fsz;
+    files[rank].mtime = cache_[rank].mtime;
+  }
+}
+
 template <typename T>
 Status CachingDirReader<T>::ReadFooter(int rank, ParsedFooter& parsed_footer,
                                        uint64_t opt_rdsz) {
@@ -101,7 +320,7 @@ Status CachingDirReader<T>::ReadFooter(int rank, ParsedFooter& parsed_footer,
 
 template <typename T>
 Status CachingDirReader<T>::GetFileSize(int rank, uint64_t* fsz) {
-  if (!MAP_HAS(cache_, rank)) {
+  if (GetEntry(rank) == NULL) {
     return Status::InvalidArgument("rank not found");
   }
 
@@ -113,7 +332,7 @@ template <>
 Status CachingDirReader<RandomAccessFile>::OpenFileHandle(int rank,
                                                           RandomAccessFile** fh,
                                                           uint64_t* fsz) {
-  if (!MAP_HAS(cache_, rank)) return Status::NotFound("Key not found");
+  if (GetEntry(rank) == NULL) return Status::NotFound("Key not found");
   FileCacheEntry<RandomAccessFile>& e = cache_[rank];
 
   if (e.is_open) {
@@ -137,11 +356,35 @@ Status CachingDirReader<RandomAccessFile>::OpenFileHandle(int rank,
   return s;
 }
 
+template <>
+Status CachingDirReader<MappedFile>::OpenFileHandle(int rank, MappedFile** fh,
+                                                    uint64_t* fsz) {
+  if (GetEntry(rank) == NULL) return Status::NotFound("Key not found");
+  FileCacheEntry<MappedFile>& e = cache_[rank];
+
+  if (e.is_open) {
+    delete e.fh;
+    e.is_open = false;
+  }
+
+  std::string fname = RdbName(dir_, rank);
+
+  MappedFile* map_fh;
+  Status s = MappedFile::Open(fname, &map_fh);
+  if (!s.ok()) return s;
+
+  cache_[rank].is_open = true;
+  *fh = map_fh;
+  *fsz = cache_[rank].fsz;
+
+  return s;
+}
+
 template <>
 Status CachingDirReader<SequentialFile>::OpenFileHandle(int rank,
                                                         SequentialFile** fh,
                                                         uint64_t* fsz) {
-  if (!MAP_HAS(cache_, rank)) return Status::NotFound("Key not found");
+  if (GetEntry(rank) == NULL) return Status::NotFound("Key not found");
   FileCacheEntry<SequentialFile>& e = cache_[rank];
 
   if (e.is_open) {
@@ -170,21 +413,55 @@ Status CachingDirReader<RandomAccessFile>::GetFileHandle(int rank,
                                                          RandomAccessFile** fh,
                                                          uint64_t* fsz,
                                                          bool force_reopen) {
-  MutexLock ml(&mutex_);
+  if (GetEntry(rank) == NULL) return Status::InvalidArgument("Rank not found");
 
-  if (!MAP_HAS(cache_, rank)) return Status::InvalidArgument("Rank not found");
+  Shard& shard = ShardOf(rank);
+  MutexLock ml(&shard.mutex);
 
   Status s = Status::OK();
 
   bool is_open = cache_[rank].is_open;
 
-  if (force_reopen && first_warn_) {
-    logv(__LOG_ARGS__, LOG_DBUG, "RandomAccessFile: force-reopen set, ignoring!");
-    first_warn_ = false;
+  if (force_reopen) {
+    MutexLock wl(&mutex_);
+    if (first_warn_) {
+      logv(__LOG_ARGS__, LOG_DBUG,
+           "RandomAccessFile: force-reopen set, ignoring!");
+      first_warn_ = false;
+    }
   }
 
   if (!is_open) {
     s = OpenFileHandle(rank, fh, fsz);
+    if (!s.ok()) return s;
+    cache_[rank].fh = *fh;
+    cache_[rank].fsz = *fsz;
+  } else {
+    *fh = cache_[rank].fh;
+    *fsz = cache_[rank].fsz;
+  }
+
+  PinLocked(shard, cache_[rank], is_open);
+
+  return s;
+}
+
+/* never reopened, as that would unmap slices handed out earlier */
+template <>
+Status CachingDirReader<MappedFile>::GetFileHandle(int rank, MappedFile** fh,
+                                                   uint64_t* fsz, bool) {
+  if (GetEntry(rank) == NULL) return Status::InvalidArgument("Rank not found");
+
+  Shard& shard = ShardOf(rank);
+  MutexLock ml(&shard.mutex);
+
+  Status s = Status::OK();
+
+  bool is_open = cache_[rank].is_open;
+
+  if (!is_open) {
+    s = OpenFileHandle(rank, fh, fsz);
+    if (!s.ok()) return s;
     cache_[rank].fh = *fh;
     cache_[rank].fsz = *fsz;
   } else {
@@ -192,6 +469,8 @@ Status CachingDirReader<RandomAccessFile>::GetFileHandle(int rank,
     *fsz = cache_[rank].fsz;
   }
 
+  PinLocked(shard, cache_[rank], is_open);
+
   return s;
 }
 
@@ -200,9 +479,10 @@ Status CachingDirReader<SequentialFile>::GetFileHandle(int rank,
                                                        SequentialFile** fh,
                                                        uint64_t* fsz,
                                                        bool force_reopen) {
-  MutexLock ml(&mutex_);
+  if (GetEntry(rank) == NULL) return Status::InvalidArgument("Rank not found");
 
-  if (!MAP_HAS(cache_, rank)) return Status::InvalidArgument("Rank not found");
+  Shard& shard = ShardOf(rank);
+  MutexLock ml(&shard.mutex);
 
   Status s = Status::OK();
 
@@ -211,6 +491,7 @@ Status CachingDirReader<SequentialFile>::GetFileHandle(int rank,
 
   if (to_open) {
     s = OpenFileHandle(rank, fh, fsz);
+    if (!s.ok()) return s;
     cache_[rank].fh = *fh;
     cache_[rank].fsz = *fsz;
   } else {
@@ -218,14 +499,24 @@ Status CachingDirReader<SequentialFile>::GetFileHandle(int rank,
     *fsz = cache_[rank].fsz;
   }
 
+  PinLocked(shard, cache_[rank], !to_open);
+
   return s;
 }
 
 template <>
 Status CachingDirReader<RandomAccessFile>::Read(int rank, ReadRequest& request,
-                                                bool force_reopen) {
+                                                bool force_reopen,
+                                                ReadMode mode) {
   Status s = Status::OK();
 
+  if (mode == kReadDirect) {
+    std::vector<ReadRequest> requests(1, request);
+    s = ReadDirect(rank, requests);
+    request = requests[0];
+    return s;
+  }
+
   RandomAccessFile* fh;
   uint64_t fsz;
 
@@ -233,15 +524,41 @@ Status CachingDirReader<RandomAccessFile>::Read(int rank, ReadRequest& request,
   if (!s.ok()) return s;
 
   s = fh->Read(request.offset, request.bytes, &request.slice, request.scratch);
+  ReleaseFileHandle(rank);
+
+  return s;
+}
+
+template <>
+Status CachingDirReader<MappedFile>::Read(int rank, ReadRequest& request,
+                                          bool force_reopen, ReadMode) {
+  Status s = Status::OK();
+
+  MappedFile* fh;
+  uint64_t fsz;
+
+  s = GetFileHandle(rank, &fh, &fsz, force_reopen);
+  if (!s.ok()) return s;
+
+  s = fh->Read(request.offset, request.bytes, &request.slice, request.scratch);
+  ReleaseFileHandle(rank);
 
   return s;
 }
 
 template <>
 Status CachingDirReader<SequentialFile>::Read(int rank, ReadRequest& request,
-                                              bool force_reopen) {
+                                              bool force_reopen,
+                                              ReadMode mode) {
   Status s = Status::OK();
 
+  if (mode == kReadDirect) {
+    std::vector<ReadRequest> requests(1, request);
+    s = ReadDirect(rank, requests);
+    request = requests[0];
+    return s;
+  }
+
   SequentialFile* fh;
   uint64_t fsz;
 
@@ -250,56 +567,417 @@ Status CachingDirReader<SequentialFile>::Read(int rank, ReadRequest& request,
 
   if (request.offset) {
     s = fh->Skip(request.offset);
-    if (!s.ok()) return s;
   }
 
-  s = fh->Read(request.bytes, &request.slice, request.scratch);
+  if (s.ok()) {
+    s = fh->Read(request.bytes, &request.slice, request.scratch);
+  }
+
+  ReleaseFileHandle(rank);
 
   return s;
 }
 
 template <>
 Status CachingDirReader<RandomAccessFile>::ReadBatch(
-    int rank, std::vector<ReadRequest>& requests) {
-  Status s = Status::OK();
+    int rank, std::vector<ReadRequest>& requests, ReadMode mode) {
+  if (mode == kReadDirect) return ReadDirect(rank, requests);
+
+  std::vector<size_t> order;
+  std::vector<ReadGroup> groups;
+  PlanReads(requests, coalesce_, order, groups);
+
+  logv(__LOG_ARGS__, LOG_DBUG, "Rank %d: %zu requests in %zu reads", rank,
+       requests.size(), groups.size());
+
+  RandomAccessFile* fh;
+  uint64_t fsz;
+  Status s = GetFileHandle(rank, &fh, &fsz, false);
+  if (!s.ok()) return s;
+
+  std::string buf;
+  for (size_t gi = 0; gi < groups.size() and s.ok(); gi++) {
+    const ReadGroup& g = groups[gi];
+
+    /* a request on its own is read straight into its scratch */
+    if (g.end - g.beg == 1) {
+      ReadRequest& r = requests[order[g.beg]];
+      s = fh->Read(r.offset, r.bytes, &r.slice, r.scratch);
+      continue;
+    }
+
+    buf.resize(g.bytes);
+    Slice merged;
+    s = fh->Read(g.offset, g.bytes, &merged, &buf[0]);
+    if (s.ok()) ScatterReads(merged, g, order, requests);
+  }
+
+  ReleaseFileHandle(rank);
+
+  return s;
+}
+
+template <>
+Status CachingDirReader<MappedFile>::ReadBatch(
+    int rank, std::vector<ReadRequest>& requests, ReadMode) {
+  std::vector<size_t> order;
+  std::vector<ReadGroup> groups;
+  PlanReads(requests, coalesce_, order, groups);
+
+  MappedFile* fh;
+  uint64_t fsz;
+  Status s = GetFileHandle(rank, &fh, &fsz, false);
+  if (!s.ok()) return s;
+
+  /* nothing to copy, but each group is faulted in with a single hint,
+   * ahead of the first access */
+  for (size_t gi = 0; gi < groups.size(); gi++) {
+    fh->Advise(groups[gi].offset, groups[gi].bytes, kAdviseWillNeed);
+  }
 
   for (size_t i = 0; i < requests.size(); i++) {
-    s = Read(rank, requests[i], false);
-    if (!s.ok()) return s;
+    ReadRequest& r = requests[i];
+    s = fh->Read(r.offset, r.bytes, &r.slice, r.scratch);
+    if (!s.ok()) break;
   }
 
+  ReleaseFileHandle(rank);
+
   return s;
 }
 
 template <>
 Status CachingDirReader<SequentialFile>::ReadBatch(
-    int rank, std::vector<ReadRequest>& requests) {
-  Status s = Status::OK();
+    int rank, std::vector<ReadRequest>& requests, ReadMode mode) {
+  if (mode == kReadDirect) return ReadDirect(rank, requests);
+
+  std::vector<size_t> order;
+  std::vector<ReadGroup> groups;
+  PlanReads(requests, coalesce_, order, groups);
 
   SequentialFile* fh;
   uint64_t fsz;
-  s = GetFileHandle(rank, &fh, &fsz, true);
+  Status s = GetFileHandle(rank, &fh, &fsz, true);
   if (!s.ok()) return s;
 
-  std::sort(requests.begin(), requests.end());
-
+  std::string buf;
   uint64_t file_cursor = 0;
-  for (size_t i = 0; i < requests.size(); i++) {
-    ReadRequest r = requests[i];
-    uint64_t abs_offset = r.offset;
-    uint64_t rel_offset = abs_offset - file_cursor;
-    if (rel_offset < 0) {
+  for (size_t gi = 0; gi < groups.size(); gi++) {
+    const ReadGroup& g = groups[gi];
+    if (g.offset < file_cursor) {
       s = Status::InvalidArgument("Overlapping batch reads not supported");
       break;
     }
 
-    r.offset = rel_offset;
+    /* offsets are relative to the cursor */
+    ReadRequest r;
+    r.offset = g.offset - file_cursor;
+    r.bytes = g.bytes;
+
+    bool single = g.end - g.beg == 1;
+    if (single) {
+      r.scratch = requests[order[g.beg]].scratch;
+    } else {
+      buf.resize(g.bytes);
+      r.scratch = &buf[0];
+    }
 
     s = Read(rank, r, false);
     if (!s.ok()) break;
 
-    requests[i].slice = r.slice;
-    file_cursor += rel_offset + r.bytes;
+    if (single) {
+      requests[order[g.beg]].slice = r.slice;
+    } else {
+      ScatterReads(r.slice, g, order, requests);
+    }
+
+    file_cursor = g.offset + g.bytes;
+  }
+
+  ReleaseFileHandle(rank);
+
+  return s;
+}
+
+template <typename T>
+Status CachingDirReader<T>::GetRawFd(int rank, int* fd) {
+  if (GetEntry(rank) == NULL) return Status::InvalidArgument("Rank not found");
+
+  Shard& shard = ShardOf(rank);
+  MutexLock ml(&shard.mutex);
+
+  FileCacheEntry<T>& e = cache_[rank];
+  bool hit = e.raw_fd >= 0;
+  if (!hit) {
+    std::string fname = RdbName(dir_, rank);
+    e.raw_fd = open(fname.c_str(), O_RDONLY);
+    if (e.raw_fd < 0) return Status::IOError(fname, strerror(errno));
+  }
+
+  PinLocked(shard, e, hit);
+
+  *fd = e.raw_fd;
+  return Status::OK();
+}
+
+template <typename T>
+Status CachingDirReader<T>::GetDirectFd(int rank, int* fd, bool* buffered) {
+  if (GetEntry(rank) == NULL) return Status::InvalidArgument("Rank not found");
+
+  Shard& shard = ShardOf(rank);
+  MutexLock ml(&shard.mutex);
+
+  FileCacheEntry<T>& e = cache_[rank];
+  bool hit = e.direct_fd >= 0;
+  if (!hit) {
+    Status s = OpenDirect(RdbName(dir_, rank), &e.direct_fd,
+                          &e.direct_buffered);
+    if (!s.ok()) {
+      e.direct_fd = -1;
+      return s;
+    }
+  }
+
+  PinLocked(shard, e, hit);
+
+  *fd = e.direct_fd;
+  *buffered = e.direct_buffered;
+  return Status::OK();
+}
+
+template <typename T>
+Status CachingDirReader<T>::ReadDirect(int rank,
+                                       std::vector<ReadRequest>& requests) {
+  std::vector<size_t> order;
+  std::vector<ReadGroup> groups;
+  PlanReads(requests, coalesce_, order, groups);
+
+  int fd;
+  bool buffered;
+  Status s = GetDirectFd(rank, &fd, &buffered);
+  if (!s.ok()) return s;
+
+  for (size_t gi = 0; gi < groups.size() and s.ok(); gi++) {
+    const ReadGroup& g = groups[gi];
+
+    uint64_t aligned_off, aligned_len;
+    AlignExtent(g.offset, g.bytes, &aligned_off, &aligned_len);
+
+    AlignedBuffer buf;
+    s = direct_bufs_.Get(aligned_len, &buf);
+    if (!s.ok()) break;
+
+    uint64_t got;
+    s = PreadFully(fd, RdbName(dir_, rank), aligned_off, aligned_len,
+                   buf.data, &got);
+
+    if (s.ok()) {
+      /* trimmed back to the bytes the group asked for */
+      uint64_t lead = g.offset - aligned_off;
+      Slice merged;
+      if (got > lead) {
+        merged = Slice(buf.data + lead, std::min(g.bytes, got - lead));
+      }
+      ScatterReads(merged, g, order, requests);
+
+      if (buffered) DropCachedPages(fd, aligned_off, aligned_len);
+    }
+
+    direct_bufs_.Put(buf);
+  }
+
+  ReleaseFileHandle(rank);
+
+  return s;
+}
+
+template <typename T>
+void CachingDirReader<T>::ReleaseFileHandle(int rank) {
+  if (GetEntry(rank) == NULL) return;
+
+  Shard& shard = ShardOf(rank);
+  MutexLock ml(&shard.mutex);
+
+  FileCacheEntry<T>& e = cache_[rank];
+  assert(e.pins > 0);
+  e.pins--;
+
+  EvictLocked(shard);
+}
+
+template <typename T>
+void CachingDirReader<T>::PinLocked(Shard& shard, FileCacheEntry<T>& e,
+                                    bool hit) {
+  shard.mutex.AssertHeld();
+
+  if (hit) {
+    shard.hits++;
+  } else {
+    shard.misses++;
+  }
+
+  e.pins++;
+
+  if (e.in_lru) {
+    shard.lru.splice(shard.lru.begin(), shard.lru, e.lru_pos);
+  } else {
+    shard.lru.push_front(e.rank);
+    e.lru_pos = shard.lru.begin();
+    e.in_lru = true;
+  }
+
+  EvictLocked(shard);
+}
+
+template <typename T>
+bool CachingDirReader<T>::Evictable() {
+  return true;
+}
+
+template <>
+bool CachingDirReader<MappedFile>::Evictable() {
+  return false;
+}
+
+template <>
+bool CachingDirReader<SequentialFile>::Evictable() {
+  return false;
+}
+
+template <typename T>
+void CachingDirReader<T>::EvictLocked(Shard& shard) {
+  shard.mutex.AssertHeld();
+
+  if (!Evictable()) return;
+
+  std::list<int>& lru = shard.lru;
+  std::list<int>::iterator it = lru.end();
+  while (lru.size() > shard.capacity and it != lru.begin()) {
+    --it;
+    FileCacheEntry<T>& e = cache_[*it];
+    if (e.pins > 0) continue;
+
+    if (e.is_open) {
+      delete e.fh;
+      e.fh = nullptr;
+      e.is_open = false;
+    }
+
+    if (e.raw_fd >= 0) {
+      close(e.raw_fd);
+      e.raw_fd = -1;
+    }
+
+    if (e.direct_fd >= 0) {
+      close(e.direct_fd);
+      e.direct_fd = -1;
+    }
+
+    e.in_lru = false;
+    it = lru.erase(it);
+    shard.evictions++;
+  }
+}
+
+template <typename T>
+void CachingDirReader<T>::GetStats(FileCacheStats& stats) {
+  stats.hits = stats.misses = stats.evictions = 0;
+  stats.open = 0;
+
+  for (int i = 0; i < num_shards_; i++) {
+    MutexLock ml(&shards_[i].mutex);
+    stats.hits += shards_[i].hits;
+    stats.misses += shards_[i].misses;
+    stats.evictions += shards_[i].evictions;
+    stats.open += shards_[i].lru.size();
+  }
+}
+
+template <>
+Status CachingDirReader<RandomAccessFile>::EnableAsyncReads(
+    uint32_t queue_depth) {
+  if (uring_ != NULL) return Status::OK();
+
+  UringReader* uring = new UringReader();
+  Status s = uring->Open(queue_depth);
+  if (!s.ok()) {
+    delete uring;
+    return s;
+  }
+
+  logv(__LOG_ARGS__, LOG_INFO, "io_uring reads enabled, queue depth: %u\n",
+       uring->QueueDepth());
+  uring_ = uring;
+  return s;
+}
+
+template <>
+Status CachingDirReader<SequentialFile>::EnableAsyncReads(uint32_t) {
+  return Status::NotSupported("Async reads need random access files");
+}
+
+template <>
+Status CachingDirReader<MappedFile>::EnableAsyncReads(uint32_t) {
+  return Status::NotSupported("Reads are served from the mapping");
+}
+
+template <typename T>
+Status CachingDirReader<T>::Advise(int, uint64_t, uint64_t, ReadAdvice) {
+  return Status::OK();
+}
+
+template <>
+Status CachingDirReader<MappedFile>::Advise(int rank, uint64_t offset,
+                                            uint64_t bytes,
+                                            ReadAdvice advice) {
+  MappedFile* fh;
+  uint64_t fsz;
+  Status s = GetFileHandle(rank, &fh, &fsz, false);
+  if (!s.ok()) return s;
+
+  s = fh->Advise(offset, bytes, advice);
+  ReleaseFileHandle(rank);
+
+  return s;
+}
+
+template <typename T>
+Status CachingDirReader<T>::ReadBatchAsync(const std::vector<int>& ranks,
+                                           std::vector<ReadRequest>& requests,
+                                           ReadCallback cb, void* arg) {
+  Status s = Status::OK();
+
+  if (uring_ != NULL) {
+    /* every descriptor of the batch stays pinned until it completes */
+    std::vector<int> fds(ranks.size());
+    size_t pinned = 0;
+    for (; pinned < ranks.size() and s.ok(); pinned++) {
+      s = GetRawFd(ranks[pinned], &fds[pinned]);
+      if (!s.ok()) break;
+    }
+
+    if (s.ok()) {
+      s = uring_->ReadBatch(fds, requests, cb, arg);
+    } else {
+      for (size_t i = 0; i < requests.size(); i++) cb(arg, i, s);
+    }
+
+    for (size_t i = 0; i < pinned; i++) ReleaseFileHandle(ranks[i]);
+
+    /* a ring that failed is closed; later batches are read with pread */
+    if (!uring_->IsOpen()) {
+      logv(__LOG_ARGS__, LOG_WARN, "io_uring failed, reads are synchronous");
+      delete uring_;
+      uring_ = NULL;
+    }
+
+    return s;
+  }
+
+  for (size_t i = 0; i < requests.size(); i++) {
+    Status rs = Read(ranks[i], requests[i], false);
+    if (s.ok()) s = rs;
+    cb(arg, i, rs);
   }
 
   return s;
@@ -307,6 +985,7 @@ Status CachingDirReader<SequentialFile>::ReadBatch(
 
 template class CachingDirReader<RandomAccessFile>;
 template class CachingDirReader<SequentialFile>;
+template class CachingDirReader<MappedFile>;
 
 }  // namespace plfsio
 }  // namespace pdlfs
@@ -4,22 +4,51 @@
 
 #pragma once
 
+#include "direct_io.h"
+#include "manifest_cache.h"
+#include "mapped_file.h"
+
 #include "pdlfs-common/env.h"
 #include "pdlfs-common/mutexlock.h"
 
-#include <map>
+#include <algorithm>
+#include <list>
+#include <vector>
 
 namespace pdlfs {
 namespace plfsio {
 
 typedef struct ParsedFooter ParsedFooter;
 
+class UringReader;
+
 template <typename T>
 struct FileCacheEntry {
+  /* -1 for a rank without an rdb file */
   int rank;
   bool is_open;
   T* fh;
   uint64_t fsz;
+  uint64_t mtime;
+  /* plain descriptor for io_uring reads, opened on first use */
+  int raw_fd;
+  /* descriptor for direct reads, opened on first use. If buffered, the
+   * file system refused O_DIRECT (see OpenDirect). */
+  int direct_fd;
+  bool direct_buffered;
+  /* users of fh, raw_fd or direct_fd; a pinned entry is never evicted */
+  int pins;
+  /* set while any of them is open, with the entry's place in the LRU */
+  bool in_lru;
+  std::list<int>::iterator lru_pos;
+};
+
+struct FileCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  /* entries with an open handle */
+  size_t open;
 };
 
 struct ReadRequest {
@@ -33,6 +62,28 @@ struct ReadRequest {
   bool operator<(const ReadRequest& rhs) const { return offset < rhs.offset; }
 };
 
+/* how ReadBatch merges the requests of a rank into fewer, larger reads */
+struct CoalesceOptions {
+  /* requests at most this many bytes apart are read as one */
+  uint64_t max_gap;
+  /* as long as the merged read is at most this many times the bytes
+   * requested. Below 1, nothing is merged. */
+  double max_amplification;
+  /* and no larger than this */
+  uint64_t max_read;
+
+  CoalesceOptions()
+      : max_gap(MB(1)), max_amplification(2.0), max_read(MB(16)) {}
+
+  explicit CoalesceOptions(const RdbOptions& options)
+      : max_gap(options.coalesce_gap),
+        max_amplification(options.coalesce_amplification),
+        max_read(MB(16)) {}
+};
+
+/* invoked once per request of an async batch, as soon as it completes */
+typedef void (*ReadCallback)(void* arg, size_t idx, const Status& s);
+
 template <typename T>
 class CachingDirReader {
  public:
@@ -41,21 +92,95 @@ class CachingDirReader {
         dir_(""),
         num_ranks_(0),
         kMaxCacheSz(max_cache_size),
-        first_warn_(true) {}
+        first_warn_(true),
+        uring_(NULL) {
+    /* never more shards than handles, so that their shares add up to
+     * exactly kMaxCacheSz */
+    num_shards_ = std::max(1, std::min(kMaxCacheSz, kMaxShards));
+    for (int i = 0; i < num_shards_; i++) {
+      Shard& shard = shards_[i];
+      shard.capacity = std::max(kMaxCacheSz, 1) / num_shards_;
+      if (i < std::max(kMaxCacheSz, 1) % num_shards_) shard.capacity++;
+      shard.hits = shard.misses = shard.evictions = 0;
+    }
+  }
+
+  ~CachingDirReader();
 
+  /* the handle is pinned, and stays open, until ReleaseFileHandle */
   Status GetFileHandle(int rank, T** fh, uint64_t* fsz,
                        bool force_reopen = false);
 
-  Status ReadDirectory(std::string dir, int& num_ranks);
+  void ReleaseFileHandle(int rank);
+
+  void GetStats(FileCacheStats& stats);
+
+  /* Lists dir once and stats every rdb file in it, in parallel on pool
+   * if one is given. Ranks need not be contiguous: num_ranks is one past
+   * the highest rank found, and ranks without a file are skipped by
+   * HasRank. Drops the handles of any previously read dir. The dir is
+   * listed through env_, but the rdb files are stat'ed through the OS (see
+   * GetFileInfo), so env_ must see the same files as the default Env. */
+  Status ReadDirectory(std::string dir, int& num_ranks,
+                       ThreadPool* pool = NULL);
+
+  /* Same, but takes the listing from files rather than from dir, for a
+   * listing kept elsewhere (see ManifestCache::LoadListing) */
+  Status SetDirectory(std::string dir, const std::vector<RdbFileInfo>& files,
+                      int& num_ranks);
+
+  /* One entry per rank, as passed to or found by the last ReadDirectory */
+  void GetListing(std::vector<RdbFileInfo>& files) const;
+
+  bool HasRank(int rank) { return GetEntry(rank) != NULL; }
 
   int NumRanks() const { return num_ranks_; }
 
   Status ReadFooter(int rank, ParsedFooter& parsed_footer,
                     uint64_t opt_rdsz = 4096);
 
-  Status Read(int rank, ReadRequest& request, bool force_reopen = true);
+  /* With kReadDirect, the read bypasses env_ and the page cache: it is
+   * widened to kDirectIoAlign, read with O_DIRECT into a pooled aligned
+   * buffer, and copied out trimmed to request.scratch. Direct offsets are
+   * always absolute, also for a SequentialFile, whose cursor they leave
+   * alone. MappedFile reads always come from the mapping. */
+  Status Read(int rank, ReadRequest& request, bool force_reopen = true,
+              ReadMode mode = kReadCached);
+
+  /* Reads all requests of rank. Neighbouring requests are read together
+   * as set by SetCoalescing, and copied out into their own scratch (except
+   * for MappedFile, where they only share one madvise). requests keep
+   * their order. mode is as for Read. */
+  Status ReadBatch(int rank, std::vector<ReadRequest>& requests,
+                   ReadMode mode = kReadCached);
 
-  Status ReadBatch(int rank, std::vector<ReadRequest>& requests);
+  void SetCoalescing(const CoalesceOptions& options) { coalesce_ = options; }
+
+  /* true if Read returns slices into the file's mapping rather than into
+   * request.scratch, which then need not be allocated (see MappedFile) */
+  static bool ZeroCopyReads();
+
+  /* hints the access pattern of [offset, offset + bytes) of a rank's file,
+   * or of everything from offset if bytes is zero. A no-op except for
+   * MappedFile. */
+  Status Advise(int rank, uint64_t offset, uint64_t bytes, ReadAdvice advice);
+
+  /* Moves batched reads to an io_uring with up to queue_depth reads in
+   * flight. These bypass env_ and read the rdb files through the local
+   * file system. Returns NotSupported if io_uring can not be used, in which
+   * case ReadBatchAsync keeps reading synchronously. */
+  Status EnableAsyncReads(uint32_t queue_depth);
+
+  bool AsyncReadsEnabled() const { return uring_ != NULL; }
+
+  /* Reads requests[i] from ranks[i], calling cb as each one completes,
+   * failed or not: cb is called exactly once for every request. Without
+   * async reads, requests are read one after another and cb is called
+   * after each. If the io_uring fails, async reads are disabled for later
+   * batches. Not to be called concurrently. */
+  Status ReadBatchAsync(const std::vector<int>& ranks,
+                        std::vector<ReadRequest>& requests, ReadCallback cb,
+                        void* arg);
 
  private:
   // Works even if handle is not open, files are assumed to be static
@@ -63,6 +188,53 @@ class CachingDirReader {
 
   Status OpenFileHandle(int rank, T** fh, uint64_t* fsz);
 
+  /* pinned like GetFileHandle */
+  Status GetRawFd(int rank, int* fd);
+
+  /* pinned like GetFileHandle */
+  Status GetDirectFd(int rank, int* fd, bool* buffered);
+
+  /* ReadBatch with kReadDirect, for every T but MappedFile */
+  Status ReadDirect(int rank, std::vector<ReadRequest>& requests);
+
+  /* Handles are spread over shards by rank. Each shard has its own lock,
+   * LRU list and share of kMaxCacheSz, so threads reading different ranks
+   * rarely contend, and no lookup takes a global lock. */
+  struct Shard {
+    port::Mutex mutex;
+    /* ranks with open handles, most recently used first */
+    std::list<int> lru;
+    size_t capacity;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+  };
+
+  /* NULL if rank has no rdb file. cache_ is only resized by ReadDirectory,
+   * so this needs no lock. */
+  FileCacheEntry<T>* GetEntry(int rank) {
+    if (rank < 0 or rank >= (int)cache_.size()) return NULL;
+    return cache_[rank].rank < 0 ? NULL : &cache_[rank];
+  }
+
+  Shard& ShardOf(int rank) { return shards_[rank % num_shards_]; }
+
+  /* With shard.mutex held. Counts a hit or miss on e, pins it and makes it
+   * the most recently used entry of its shard. */
+  void PinLocked(Shard& shard, FileCacheEntry<T>& e, bool hit);
+
+  /* With shard.mutex held. Closes the least recently used unpinned
+   * entries until at most shard.capacity are open. If too many are
+   * pinned, the limit is exceeded until they are released. A no-op
+   * unless Evictable. */
+  void EvictLocked(Shard& shard);
+
+  /* false if closing a handle loses state its users rely on: slices
+   * returned from a mapping outlive the read, and a SequentialFile carries
+   * the cursor its users Skip relative to. Such handles stay open, and
+   * max_cache_size only sizes the shards. */
+  static bool Evictable();
+
   std::string RdbName(const std::string& parent, int rank) {
     char tmp[20];
     snprintf(tmp, sizeof(tmp), "RDB-%08x.tbl", rank);
@@ -71,11 +243,20 @@ class CachingDirReader {
 
   Env* const env_;
   std::string dir_;
-  std::map<int, FileCacheEntry<T> > cache_;
+  /* indexed by rank */
+  std::vector<FileCacheEntry<T> > cache_;
   int num_ranks_;
   const int kMaxCacheSz;
+  /* only guards first_warn_ */
   port::Mutex mutex_;
   bool first_warn_;
+  UringReader* uring_;
+  CoalesceOptions coalesce_;
+  AlignedBufferPool direct_bufs_;
+
+  static const int kMaxShards = 16;
+  Shard shards_[kMaxShards];
+  int num_shards_;
 };
 
 }  // namespace plfsio
@@ -0,0 +1,129 @@
+//
+// interval_index.cc: static interval index over manifest ranges
+//
+
+#include "carp/manifest.h"
+
+namespace pdlfs {
+namespace plfsio {
+void IntervalIndex::Add(const Range& r, uint32_t id) {
+  Entry e;
+  e.range = r;
+  e.id = id;
+  pending_.push_back(e);
+}
+
+void IntervalIndex::Build() {
+  /* the index is static: Build() after Clear() starts over */
+  std::vector< Entry > valid;
+  valid.reserve(pending_.size());
+
+  for (size_t i = 0; i < pending_.size(); i++) {
+    const Range& r = pending_[i].range;
+    if (r.range_min <= r.range_max) {
+      valid.push_back(pending_[i]);
+    } else {
+      odd_.push_back(pending_[i]);
+    }
+  }
+
+  std::vector< Entry >().swap(pending_);
+  std::sort(valid.begin(), valid.end());
+
+  size_t n = valid.size();
+  mins_.resize(n);
+  maxs_.resize(n);
+  ids_.resize(n);
+  subtree_max_.resize(n);
+
+  for (size_t i = 0; i < n; i++) {
+    mins_[i] = valid[i].range.range_min;
+    maxs_[i] = valid[i].range.range_max;
+    ids_[i] = valid[i].id;
+  }
+
+  if (n) BuildSubtree(0, n);
+}
+
+/* node for [lo, hi) lives at mid = (lo + hi) / 2 */
+float IntervalIndex::BuildSubtree(size_t lo, size_t hi) {
+  size_t mid = lo + (hi - lo) / 2;
+  float smax = maxs_[mid];
+
+  if (lo < mid) smax = std::max(smax, BuildSubtree(lo, mid));
+  if (mid + 1 < hi) smax = std::max(smax, BuildSubtree(mid + 1, hi));
+
+  subtree_max_[mid] = smax;
+  return smax;
+}
+
+void IntervalIndex::Query(float rmin, float rmax,
+                          std::vector< uint32_t >& ids) const {
+  if (rmin <= rmax) {
+    QueryValid(rmin, rmax, ids);
+  } else {
+    /* Range::Overlaps on an inverted query reduces to a match on either
+     * endpoint. Probe both and drop the duplicates. */
+    size_t beg = ids.size();
+    QueryValid(rmin, rmin, ids);
+    QueryValid(rmax, rmax, ids);
+    std::sort(ids.begin() + beg, ids.end());
+    ids.erase(std::unique(ids.begin() + beg, ids.end()), ids.end());
+  }
+
+  for (size_t i = 0; i < odd_.size(); i++) {
+    if (odd_[i].range.Overlaps(rmin, rmax)) ids.push_back(odd_[i].id);
+  }
+}
+
+void IntervalIndex::QueryValid(float rmin, float rmax,
+                               std::vector< uint32_t >& ids) const {
+  if (mins_.empty()) return;
+
+  /* explicit stack of [lo, hi) subtrees; depth is bounded by log2(n) */
+  size_t stack[128];
+  int top = 0;
+
+  stack[top++] = 0;
+  stack[top++] = mins_.size();
+
+  while (top > 0) {
+    size_t hi = stack[--top];
+    size_t lo = stack[--top];
+    if (lo >= hi) continue;
+
+    size_t mid = lo + (hi - lo) / 2;
+
+    /* nothing in this subtree reaches rmin */
+    if (subtree_max_[mid] < rmin) continue;
+
+    stack[top++] = lo;
+    stack[top++] = mid;
+
+    /* everything right of mid starts after rmax */
+    if (mins_[mid] > rmax) continue;
+
+    if (maxs_[mid] >= rmin) ids.push_back(ids_[mid]);
+
+    stack[top++] = mid + 1;
+    stack[top++] = hi;
+  }
+}
+
+size_t IntervalIndex::MemoryUsage() const {
+  return (mins_.capacity() + maxs_.capacity() + subtree_max_.capacity()) *
+             sizeof(float) +
+         ids_.capacity() * sizeof(uint32_t) +
+         (pending_.capacity() + odd_.capacity()) * sizeof(Entry);
+}
+
+void IntervalIndex::Clear() {
+  std::vector< Entry >().swap(pending_);
+  std::vector< float >().swap(mins_);
+  std::vector< float >().swap(maxs_);
+  std::vector< float >().swap(subtree_max_);
+  std::vector< uint32_t >().swap(ids_);
+  std::vector< Entry >().swap(odd_);
+}
+}  // namespace plfsio
+}  // namespace pdlfs
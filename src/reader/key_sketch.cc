@@ -0,0 +1,132 @@
+//
+// key_sketch.cc: compact approximation of an epoch's key distribution
+//
+
+#include "carp/key_sketch.h"
+
+#include <algorithm>
+
+namespace pdlfs {
+namespace plfsio {
+namespace {
+/* density change and point mass at a key, from one interval endpoint */
+struct Event {
+  float key;
+  double density;
+  double jump;
+
+  bool operator<(const Event& rhs) const { return key < rhs.key; }
+};
+}  // namespace
+
+void KeySketch::Add(float rmin, float rmax, double mass) {
+  /* empty and inverted ranges carry no usable position information */
+  if (mass <= 0 or !(rmin <= rmax)) return;
+
+  Piece p = {rmin, rmax, mass};
+  pieces_.push_back(p);
+}
+
+void KeySketch::Build(size_t max_knots) {
+  std::vector< Event > events;
+  events.reserve(pieces_.size() * 2);
+
+  for (size_t i = 0; i < pieces_.size(); i++) {
+    const Piece& p = pieces_[i];
+    if (p.rmin == p.rmax) {
+      Event e = {p.rmin, 0, p.mass};
+      events.push_back(e);
+    } else {
+      double density = p.mass / ((double)p.rmax - p.rmin);
+      Event beg = {p.rmin, density, 0};
+      Event end = {p.rmax, -density, 0};
+      events.push_back(beg);
+      events.push_back(end);
+    }
+  }
+
+  std::sort(events.begin(), events.end());
+
+  /* exact CDF: linear between endpoints, with a second knot at the same key
+   * wherever there's a point mass */
+  std::vector< Knot > exact;
+  double cdf = 0, density = 0;
+  size_t i = 0;
+
+  while (i < events.size()) {
+    float key = events[i].key;
+    if (!exact.empty()) cdf += density * ((double)key - exact.back().key);
+
+    Knot k = {key, cdf};
+    exact.push_back(k);
+
+    double jump = 0;
+    for (; i < events.size() and events[i].key == key; i++) {
+      jump += events[i].jump;
+      density += events[i].density;
+    }
+
+    if (jump > 0) {
+      cdf += jump;
+      Knot kj = {key, cdf};
+      exact.push_back(kj);
+    }
+  }
+
+  mass_ = cdf;
+  step_ = max_knots ? mass_ / max_knots : 0;
+  knots_.clear();
+
+  /* keep a knot each time the CDF has grown by step_ since the last kept
+   * one, along with its predecessor; segments between kept knots then either
+   * grow by less than step_ or are exact */
+  size_t last = 0;
+  for (size_t ki = 0; ki < exact.size(); ki++) {
+    bool keep = (ki == 0) or (ki + 1 == exact.size()) or
+                (exact[ki].cdf - exact[last].cdf >= step_);
+    if (!keep) continue;
+
+    if (ki > 0 and last != ki - 1) knots_.push_back(exact[ki - 1]);
+    knots_.push_back(exact[ki]);
+    last = ki;
+  }
+
+  std::vector< Piece >().swap(pieces_);
+}
+
+double KeySketch::Estimate(float rmin, float rmax) const {
+  if (rmin > rmax) return 0;
+  return std::max(0.0, Cdf(rmax, true) - Cdf(rmin, false));
+}
+
+double KeySketch::Cdf(float key, bool right) const {
+  size_t lo = 0, hi = knots_.size();
+
+  /* first knot with a key > key (right) or >= key (left) */
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    bool before = right ? (knots_[mid].key <= key) : (knots_[mid].key < key);
+    if (before) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (lo == 0) return 0;
+  if (lo == knots_.size()) return mass_;
+
+  const Knot& a = knots_[lo - 1];
+  const Knot& b = knots_[lo];
+  double t = ((double)key - a.key) / ((double)b.key - a.key);
+
+  return a.cdf + t * (b.cdf - a.cdf);
+}
+
+void KeySketch::Clear() {
+  pieces_.clear();
+  knots_.clear();
+  mass_ = step_ = 0;
+}
+}  // namespace plfsio
+}  // namespace pdlfs
@@ -0,0 +1,251 @@
+//
+// lazy_manifest.cc: per-epoch, on-demand decoding of rdb manifests
+//
+
+#include "lazy_manifest.h"
+
+#include "manifest_reader.h"
+
+#include "pdlfs-common/coding.h"
+#include "pdlfs-common/mutexlock.h"
+
+namespace pdlfs {
+namespace plfsio {
+struct LazyManifest::DecodeWorkItem {
+  const std::vector< RankFrames >* ranks;
+  int rank_beg;
+  int rank_end;
+  uint32_t epoch;
+  PartitionManifestReader* reader;
+
+  port::Mutex* mutex;
+  port::CondVar* cv;
+  int* tasks_pending;
+};
+
+LazyManifest::LazyManifest(ThreadPool* pool, bool compact)
+    : pool_(pool),
+      compact_(compact),
+      num_epochs_(0),
+      cv_(&mutex_),
+      sizes_set_(false),
+      key_sz_(0),
+      val_sz_(0) {}
+
+LazyManifest::~LazyManifest() { Clear(); }
+
+void LazyManifest::Reset(int num_ranks) {
+  Clear();
+  ranks_.resize(num_ranks);
+}
+
+void LazyManifest::Clear() {
+  MutexLock ml(&mutex_);
+  while (true) {
+    bool decoding = false;
+    for (size_t i = 0; i < epochs_.size(); i++) decoding |= epochs_[i].decoding;
+    if (!decoding) break;
+    cv_.Wait();
+  }
+
+  for (size_t i = 0; i < epochs_.size(); i++) {
+    delete epochs_[i].manifest;
+  }
+
+  epochs_.clear();
+  ranks_.clear();
+  num_epochs_ = 0;
+  sizes_set_ = false;
+  key_sz_ = val_sz_ = 0;
+}
+
+Status LazyManifest::AddRank(int rank, const Slice& manifest_data,
+                             bool copy) {
+  if (rank < 0 or rank >= (int)ranks_.size()) {
+    return Status::InvalidArgument("Rank out of range");
+  }
+
+  RankFrames& rf = ranks_[rank];
+  rf.frames.clear();
+  if (copy) {
+    rf.owned.assign(manifest_data.data(), manifest_data.size());
+    rf.data = Slice(rf.owned);
+  } else {
+    rf.owned.clear();
+    rf.data = manifest_data;
+  }
+
+  uint32_t max_epoch = 0;
+  uint64_t off = 0;
+
+  while (off < rf.data.size()) {
+    if (rf.data.size() - off < kFrameHeaderSz) {
+      return Status::Corruption("Manifest epoch frame truncated");
+    }
+
+    Frame f;
+    f.epoch = DecodeFixed32(rf.data.data() + off);
+    f.offset = off;
+    f.size = DecodeFixed64(rf.data.data() + off + sizeof(uint32_t));
+
+    if (f.size > rf.data.size() - off - kFrameHeaderSz) {
+      return Status::Corruption("Manifest epoch frame truncated");
+    }
+
+    rf.frames.push_back(f);
+    max_epoch = std::max(max_epoch, f.epoch);
+    off += kFrameHeaderSz + f.size;
+  }
+
+  if (!rf.frames.empty()) {
+    MutexLock ml(&mutex_);
+    num_epochs_ = std::max(num_epochs_, (int)max_epoch + 1);
+  }
+
+  return Status::OK();
+}
+
+Status LazyManifest::UpdateKVSizes(uint64_t key_sz, uint64_t val_sz) {
+  MutexLock ml(&mutex_);
+
+  if (!sizes_set_) {
+    key_sz_ = key_sz;
+    val_sz_ = val_sz;
+    sizes_set_ = true;
+  } else if (key_sz != key_sz_ or val_sz != val_sz_) {
+    return Status::InvalidArgument("Key/Value sizes different from expected.");
+  }
+
+  return Status::OK();
+}
+
+Status LazyManifest::GetKVSizes(uint64_t& key_sz, uint64_t& val_sz) const {
+  if (!sizes_set_) return Status::NotFound("Values not set");
+
+  key_sz = key_sz_;
+  val_sz = val_sz_;
+  return Status::OK();
+}
+
+bool LazyManifest::IsDecoded(int epoch) {
+  MutexLock ml(&mutex_);
+  return epoch >= 0 and epoch < (int)epochs_.size() and
+         epochs_[epoch].manifest != NULL and !epochs_[epoch].decoding;
+}
+
+Status LazyManifest::GetEpoch(int epoch, PartitionManifest** manifest) {
+  MutexLock ml(&mutex_);
+
+  if (epoch < 0 or epoch >= num_epochs_) {
+    return Status::InvalidArgument("Epoch not found");
+  }
+
+  if (epochs_.size() < (size_t)num_epochs_) {
+    EpochState empty = {NULL, false};
+    epochs_.resize(num_epochs_, empty);
+  }
+
+  EpochState& es = epochs_[epoch];
+  while (es.decoding) cv_.Wait();
+
+  if (es.manifest == NULL) {
+    es.manifest = new PartitionManifest();
+    es.decoding = true;
+
+    /* decode without the lock, so other epochs can be served meanwhile */
+    mutex_.Unlock();
+    Decode(epoch, es.manifest);
+    mutex_.Lock();
+
+    es.decoding = false;
+    cv_.SignalAll();
+  }
+
+  *manifest = es.manifest;
+  return Status::OK();
+}
+
+void LazyManifest::Decode(int epoch, PartitionManifest* manifest) {
+  uint64_t beg = Env::Default()->NowMicros();
+
+  PartitionManifestReader reader(*manifest);
+  if (sizes_set_) reader.UpdateKVSizes(key_sz_, val_sz_);
+  reader.Reset(ranks_.size());
+
+  const int kRanksPerTask = 64;
+  int num_tasks = (ranks_.size() + kRanksPerTask - 1) / kRanksPerTask;
+
+  port::Mutex mutex;
+  port::CondVar cv(&mutex);
+  int tasks_pending = num_tasks;
+
+  std::vector< DecodeWorkItem > work_items(num_tasks);
+  for (int ti = 0; ti < num_tasks; ti++) {
+    DecodeWorkItem& wi = work_items[ti];
+    wi.ranks = &ranks_;
+    wi.rank_beg = ti * kRanksPerTask;
+    wi.rank_end = std::min((int)ranks_.size(), wi.rank_beg + kRanksPerTask);
+    wi.epoch = epoch;
+    wi.reader = &reader;
+    wi.mutex = &mutex;
+    wi.cv = &cv;
+    wi.tasks_pending = &tasks_pending;
+
+    if (pool_) {
+      pool_->Schedule(DecodeWorker, &wi);
+    } else {
+      DecodeWorker(&wi);
+    }
+  }
+
+  mutex.Lock();
+  while (tasks_pending > 0) cv.Wait();
+  mutex.Unlock();
+
+  reader.MergeManifests(pool_);
+  manifest->BuildIndex();
+  if (compact_) manifest->Compact();
+
+  logv(__LOG_ARGS__, LOG_INFO, "Epoch %d decoded: %zu SSTs in %.2f ms", epoch,
+       manifest->Size(), (Env::Default()->NowMicros() - beg) / 1e3);
+}
+
+void LazyManifest::DecodeWorker(void* arg) {
+  DecodeWorkItem* wi = static_cast< DecodeWorkItem* >(arg);
+  const std::vector< RankFrames >& ranks = *wi->ranks;
+
+  std::string concat;
+
+  for (int rank = wi->rank_beg; rank < wi->rank_end; rank++) {
+    const RankFrames& rf = ranks[rank];
+
+    const Frame* first = NULL;
+    int nframes = 0;
+    for (size_t i = 0; i < rf.frames.size(); i++) {
+      if (rf.frames[i].epoch != wi->epoch) continue;
+      if (nframes++ == 0) first = &rf.frames[i];
+    }
+
+    if (nframes == 0) continue;
+
+    /* a frame is a valid manifest on its own; an epoch written in several
+     * frames is decoded from their concatenation */
+    Slice data(rf.data.data() + first->offset, kFrameHeaderSz + first->size);
+    if (nframes > 1) {
+      concat.clear();
+      for (size_t i = 0; i < rf.frames.size(); i++) {
+        const Frame& f = rf.frames[i];
+        if (f.epoch != wi->epoch) continue;
+        concat.append(rf.data.data() + f.offset, kFrameHeaderSz + f.size);
+      }
+      data = Slice(concat);
+    }
+
+    wi->reader->ReadManifest(rank, data, data.size());
+  }
+
+  MutexLock ml(wi->mutex);
+  if (--*wi->tasks_pending == 0) wi->cv->SignalAll();
+}
+}  // namespace plfsio
+}  // namespace pdlfs
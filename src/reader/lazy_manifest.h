@@ -0,0 +1,100 @@
+//
+// lazy_manifest.h: per-epoch, on-demand decoding of rdb manifests
+//
+
+#pragma once
+
+#include "carp/manifest.h"
+#include "common.h"
+
+#include "pdlfs-common/env.h"
+#include "pdlfs-common/port.h"
+
+#include <string>
+#include <vector>
+
+namespace pdlfs {
+namespace plfsio {
+/* LazyManifest: holds the raw manifest bytes of every rank, and at open
+ * time only indexes where each epoch frame ([EPOCH:4B | SIZE:8B | ITEMS])
+ * begins. The items of an epoch are decoded, merged and indexed into a
+ * PartitionManifest of their own the first time the epoch is asked for,
+ * with ranks decoded in parallel on the pool. Jobs touching a few epochs
+ * of a long run never pay for decoding the others.
+ *
+ * AddRank calls must all complete before the first GetEpoch. GetEpoch is
+ * thread-safe; concurrent callers for the same epoch wait for a single
+ * decode. GetEpoch schedules work on the pool and waits for it, so it must
+ * not be called from a task on that same pool.
+ */
+class LazyManifest {
+ public:
+  explicit LazyManifest(ThreadPool* pool = NULL, bool compact = false);
+
+  ~LazyManifest();
+
+  /* Drops all epochs and prepares for num_ranks manifests */
+  void Reset(int num_ranks);
+
+  /* Indexes the epoch frames of a rank's manifest. manifest_data is copied
+   * unless copy is false, in which case it must outlive this object (or the
+   * next Reset). Thread-safe as long as every caller passes a different
+   * rank. */
+  Status AddRank(int rank, const Slice& manifest_data, bool copy = true);
+
+  Status UpdateKVSizes(uint64_t key_sz, uint64_t val_sz);
+
+  Status GetKVSizes(uint64_t& key_sz, uint64_t& val_sz) const;
+
+  /* One more than the largest epoch with a frame in any rank */
+  int NumEpochs() const { return num_epochs_; }
+
+  /* The decoded manifest of epoch, decoding it first if needed. The
+   * manifest stays valid until the next Reset. */
+  Status GetEpoch(int epoch, PartitionManifest** manifest);
+
+  bool IsDecoded(int epoch);
+
+ private:
+  struct Frame {
+    uint32_t epoch;
+    /* start of the frame header in the rank's manifest bytes */
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  struct RankFrames {
+    std::string owned;
+    Slice data;
+    std::vector< Frame > frames;
+  };
+
+  struct EpochState {
+    PartitionManifest* manifest;
+    bool decoding;
+  };
+
+  struct DecodeWorkItem;
+
+  static void DecodeWorker(void* arg);
+
+  void Decode(int epoch, PartitionManifest* manifest);
+
+  void Clear();
+
+  ThreadPool* const pool_;
+  const bool compact_;
+  std::vector< RankFrames > ranks_;
+  int num_epochs_;
+
+  port::Mutex mutex_;
+  port::CondVar cv_;
+  bool sizes_set_;
+  uint64_t key_sz_;
+  uint64_t val_sz_;
+  std::vector< EpochState > epochs_;
+
+  static const size_t kFrameHeaderSz = 12;
+};
+}  // namespace plfsio
+}  // namespace pdlfs
@@ -5,15 +5,383 @@
 #include "carp/manifest.h"
 
 #include "common.h"
+#include "simd_filter.h"
+
+#include "pdlfs-common/mutexlock.h"
 
 #include <algorithm>
+#include <functional>
 
 namespace pdlfs {
 namespace plfsio {
-int PartitionManifest::GetAllEntries(int epoch, PartitionManifestMatch& match) {
+namespace {
+/* PMIRangeComparator, on indexes of one epoch's items, via its columns
+ * (base is the index of the epoch's first item) */
+struct ColumnRangeComparator {
+  ColumnRangeComparator(const ManifestColumns& cols, size_t base)
+      : cols(cols), base(base) {}
+
+  bool operator()(uint32_t a, uint32_t b) const {
+    float amin = cols.obs_min[a - base], bmin = cols.obs_min[b - base];
+    return amin < bmin or
+           (amin == bmin and cols.obs_max[a - base] < cols.obs_max[b - base]);
+  }
+
+  const ManifestColumns& cols;
+  const size_t base;
+};
+
+struct PMIOffsetLess {
+  bool operator()(const PartitionManifestItem& item, uint64_t offset) const {
+    return item.offset < offset;
+  }
+};
+}  // namespace
+
+void PartitionManifest::BuildIndex() {
+  /* a compact manifest is indexed, and its layout is fixed */
+  if (compact_) return;
+
+  /* items merged by PartitionManifestReader are already in this order */
+  if (!std::is_sorted(items_.begin(), items_.end(), PMIOffsetComparator())) {
+    std::sort(items_.begin(), items_.end(), PMIOffsetComparator());
+  }
+  order_.clear();
+
+  /* (epoch, rank) segments are laid out in the same order as the items,
+   * so one prefix sum over per-segment counts gives every boundary */
+  seg_begin_.assign((size_t)num_epochs_ * ranks_ + 1, 0);
+  for (size_t i = 0; i < items_.size(); i++) {
+    PartitionManifestItem& item = items_[i];
+    seg_begin_[(size_t)item.epoch * ranks_ + item.rank + 1]++;
+  }
+
+  for (size_t si = 1; si < seg_begin_.size(); si++) {
+    seg_begin_[si] += seg_begin_[si - 1];
+  }
+
+  index_epoch_.clear();
+  index_epoch_.resize(num_epochs_);
+
   for (size_t i = 0; i < items_.size(); i++) {
-    if (items_[i].epoch == epoch) {
-      match.AddItem(items_[i]);
+    PartitionManifestItem& item = items_[i];
+    index_epoch_[item.epoch].Add(item.observed, i);
+  }
+
+  for (int epoch = 0; epoch < num_epochs_; epoch++) {
+    index_epoch_[epoch].Build();
+  }
+
+  columns_.clear();
+  columns_.resize(num_epochs_);
+
+  for (size_t i = 0; i < items_.size(); i++) {
+    columns_[items_[i].epoch].Append(items_[i]);
+  }
+
+  indexed_ = true;
+
+  MutexLock ml(&sketch_mutex_);
+  key_samples_.clear();
+  sketch_epoch_.clear();
+  sketch_epoch_.resize(num_epochs_);
+  sketch_stale_.assign(num_epochs_, false);
+
+  for (int epoch = 0; epoch < num_epochs_; epoch++) {
+    BuildSketch(epoch);
+  }
+}
+
+void PartitionManifest::BuildSketch(int epoch) {
+  size_t beg, end;
+  GetSegment(epoch, -1, beg, end);
+
+  KeySketch& sketch = sketch_epoch_[epoch];
+  sketch.Clear();
+
+  const ManifestColumns& cols = columns_[epoch];
+
+  std::map< uint32_t, std::vector< float > >::const_iterator sit =
+      key_samples_.lower_bound(beg);
+
+  for (size_t i = beg; i < end; i++) {
+    float rmin = cols.obs_min[i - beg];
+    float rmax = cols.obs_max[i - beg];
+    uint32_t count = cols.count[i - beg];
+
+    if (sit == key_samples_.end() or sit->first != i) {
+      sketch.Add(rmin, rmax, count);
+      continue;
+    }
+
+    /* k sorted samples split the SST into k + 1 equal-mass pieces */
+    const std::vector< float >& keys = sit->second;
+    double piece_mass = count * 1.0 / (keys.size() + 1);
+    float prev = std::min(rmin, keys.front());
+    for (size_t ki = 0; ki < keys.size(); ki++) {
+      sketch.Add(prev, keys[ki], piece_mass);
+      prev = keys[ki];
+    }
+    sketch.Add(prev, std::max(rmax, prev), piece_mass);
+    sit++;
+  }
+
+  sketch.Build();
+  sketch_stale_[epoch] = false;
+}
+
+int64_t PartitionManifest::FindItem(const PartitionManifestItem& item) const {
+  if (!indexed_ or Size() == 0) return -1;
+
+  if (!compact_) {
+    std::less< const PartitionManifestItem* > lt;
+    const PartitionManifestItem* first = &items_[0];
+    const PartitionManifestItem* last = first + items_.size();
+    if (!lt(&item, first) and lt(&item, last)) return &item - first;
+  }
+
+  /* a copy of an item: look it up by its offset in its segment */
+  size_t beg, end;
+  GetSegment(item.epoch, item.rank, beg, end);
+  if (beg == end) return -1;
+
+  if (compact_) {
+    uint64_t base = seg_base_[(size_t)item.epoch * ranks_ + item.rank];
+    if (item.offset < base or item.offset - base > UINT32_MAX) return -1;
+
+    uint32_t delta = item.offset - base;
+    std::vector< uint32_t >::const_iterator it = std::lower_bound(
+        off_delta_.begin() + beg, off_delta_.begin() + end, delta);
+
+    size_t i = it - off_delta_.begin();
+    size_t epoch_beg = seg_begin_[(size_t)item.epoch * ranks_];
+    if (i == end or *it != delta or
+        columns_[item.epoch].count[i - epoch_beg] != item.part_item_count) {
+      return -1;
+    }
+
+    return i;
+  }
+
+  std::vector< PartitionManifestItem >::const_iterator it =
+      std::lower_bound(items_.begin() + beg, items_.begin() + end,
+                       item.offset, PMIOffsetLess());
+
+  if (it == items_.begin() + end or it->offset != item.offset or
+      it->part_item_count != item.part_item_count) {
+    return -1;
+  }
+
+  return it - items_.begin();
+}
+
+Status PartitionManifest::GetKeyMassEstimate(int epoch, float rmin,
+                                             float rmax, double& mass,
+                                             double& max_err) {
+  if (!indexed_) return Status::NotSupported("Manifest not indexed");
+  if (epoch < 0 or epoch >= num_epochs_) {
+    return Status::InvalidArgument("Epoch not found");
+  }
+
+  MutexLock ml(&sketch_mutex_);
+  if (sketch_stale_[epoch]) BuildSketch(epoch);
+
+  mass = sketch_epoch_[epoch].Estimate(rmin, rmax);
+  max_err = sketch_epoch_[epoch].ErrorBound();
+
+  return Status::OK();
+}
+
+void PartitionManifest::AddKeySamples(const PartitionManifestItem& item,
+                                      std::vector< float >& keys) {
+  if (keys.empty()) return;
+
+  int64_t id = FindItem(item);
+  if (id < 0) return;
+
+  std::sort(keys.begin(), keys.end());
+
+  MutexLock ml(&sketch_mutex_);
+  std::vector< float >& samples = key_samples_[id];
+  if (!samples.empty()) return;
+
+  samples.swap(keys);
+  sketch_stale_[item.epoch] = true;
+}
+
+bool PartitionManifest::NeedsKeySamples(const PartitionManifestItem& item) {
+  int64_t id = FindItem(item);
+  if (id < 0) return false;
+
+  MutexLock ml(&sketch_mutex_);
+  return key_samples_.find(id) == key_samples_.end();
+}
+
+void PartitionManifest::GetOverlappingIndexes(
+    int epoch, float rmin, float rmax, std::vector< uint32_t >& idxvec) const {
+  if (!indexed_) {
+    for (size_t i = 0; i < items_.size(); i++) {
+      if (items_[i].epoch == epoch && items_[i].Overlaps(rmin, rmax)) {
+        idxvec.push_back(i);
+      }
+    }
+    return;
+  }
+
+  if (epoch < 0 or epoch >= num_epochs_) return;
+
+  size_t beg = idxvec.size();
+  index_epoch_[epoch].Query(rmin, rmax, idxvec);
+  /* keep matches in manifest order, as the linear scan would */
+  std::sort(idxvec.begin() + beg, idxvec.end());
+}
+
+void PartitionManifest::SortByKey() {
+  if (!indexed_) BuildIndex();
+
+  order_.resize(Size());
+  for (size_t i = 0; i < order_.size(); i++) {
+    order_[i] = i;
+  }
+
+  /* epochs are already contiguous; sort each epoch's segment by key */
+  for (int epoch = 0; epoch < num_epochs_; epoch++) {
+    size_t beg, end;
+    GetSegment(epoch, -1, beg, end);
+
+    std::sort(order_.begin() + beg, order_.begin() + end,
+              ColumnRangeComparator(columns_[epoch], beg));
+  }
+}
+
+Status PartitionManifest::Compact(bool keep_cold) {
+  if (compact_) return Status::OK();
+  if (!indexed_) BuildIndex();
+
+  size_t num_segs = seg_begin_.size() - 1;
+  std::vector< uint64_t > seg_base(num_segs, 0);
+  std::vector< uint32_t > off_delta(items_.size());
+  std::vector< ColdFields > cold(keep_cold ? items_.size() : 0);
+
+  for (size_t seg = 0; seg < num_segs; seg++) {
+    size_t beg = seg_begin_[seg], end = seg_begin_[seg + 1];
+    if (beg == end) continue;
+
+    /* segments are sorted by offset, so deltas are never negative */
+    seg_base[seg] = items_[beg].offset;
+    for (size_t i = beg; i < end; i++) {
+      uint64_t delta = items_[i].offset - seg_base[seg];
+      if (delta > UINT32_MAX) {
+        return Status::NotSupported("Segment too large to compact");
+      }
+
+      off_delta[i] = delta;
+      if (!keep_cold) continue;
+
+      cold[i].expected = items_[i].expected;
+      cold[i].updcnt = items_[i].updcnt;
+      cold[i].part_item_oob = items_[i].part_item_oob;
+    }
+  }
+
+  seg_base_.swap(seg_base);
+  off_delta_.swap(off_delta);
+  cold_.swap(cold);
+  std::vector< PartitionManifestItem >().swap(items_);
+  compact_ = true;
+
+  return Status::OK();
+}
+
+void PartitionManifest::DecodeItem(size_t i, PartitionManifestItem& item,
+                                   size_t& seg_hint) const {
+  /* the segment holding i is the last one starting at or before it (empty
+   * segments share their begin with the next one). Matches are decoded in
+   * order, so search forward from a valid hint with a galloping search. */
+  size_t seg = seg_hint;
+  const size_t nsegs = seg_begin_.size() - 1;
+
+  if (seg >= nsegs or i < seg_begin_[seg]) {
+    seg = std::upper_bound(seg_begin_.begin(), seg_begin_.end(), i) -
+          seg_begin_.begin() - 1;
+  } else if (i >= seg_begin_[seg + 1]) {
+    size_t lo = seg + 1, step = 1;
+    while (lo + step < nsegs and seg_begin_[lo + step] <= i) {
+      lo += step;
+      step *= 2;
+    }
+
+    size_t hi = std::min(lo + step, nsegs);
+    seg = std::upper_bound(seg_begin_.begin() + lo, seg_begin_.begin() + hi,
+                           i) -
+          seg_begin_.begin() - 1;
+  }
+
+  seg_hint = seg;
+
+  item.epoch = seg / ranks_;
+  item.rank = seg % ranks_;
+  item.offset = seg_base_[seg] + off_delta_[i];
+
+  const ManifestColumns& cols = columns_[item.epoch];
+  size_t ci = i - seg_begin_[(size_t)item.epoch * ranks_];
+  item.observed = Range(cols.obs_min[ci], cols.obs_max[ci]);
+  item.part_item_count = cols.count[ci];
+
+  if (cold_.empty()) {
+    item.expected = item.observed;
+    item.updcnt = item.part_item_oob = 0;
+  } else {
+    const ColdFields& cold = cold_[i];
+    item.expected = cold.expected;
+    item.updcnt = cold.updcnt;
+    item.part_item_oob = cold.part_item_oob;
+  }
+}
+
+PartitionManifestItem PartitionManifest::GetItem(size_t i) const {
+  size_t idx = order_.empty() ? i : order_[i];
+  if (!compact_) return items_[idx];
+
+  PartitionManifestItem item;
+  size_t seg_hint = seg_begin_.size();  // no hint
+  DecodeItem(idx, item, seg_hint);
+  return item;
+}
+
+size_t PartitionManifest::MemoryUsage() const {
+  size_t bytes = items_.capacity() * sizeof(PartitionManifestItem);
+
+  for (size_t e = 0; e < columns_.size(); e++) {
+    const ManifestColumns& cols = columns_[e];
+    bytes += cols.obs_min.capacity() * sizeof(float);
+    bytes += cols.obs_max.capacity() * sizeof(float);
+    bytes += cols.count.capacity() * sizeof(uint32_t);
+  }
+
+  for (size_t e = 0; e < index_epoch_.size(); e++) {
+    bytes += index_epoch_[e].MemoryUsage();
+  }
+
+  bytes += seg_begin_.capacity() * sizeof(uint32_t);
+  bytes += order_.capacity() * sizeof(uint32_t);
+  bytes += seg_base_.capacity() * sizeof(uint64_t);
+  bytes += off_delta_.capacity() * sizeof(uint32_t);
+  bytes += cold_.capacity() * sizeof(ColdFields);
+
+  return bytes;
+}
+
+int PartitionManifest::GetAllEntries(int epoch, PartitionManifestMatch& match) {
+  if (indexed_) {
+    size_t beg, end;
+    GetSegment(epoch, -1, beg, end);
+    AddSegmentMatches(beg, end, match);
+  } else {
+    for (size_t i = 0; i < items_.size(); i++) {
+      if (items_[i].epoch == epoch) {
+        match.AddItemRef(&items_[i]);
+      }
     }
   }
 
@@ -28,9 +396,15 @@ int PartitionManifest::GetAllEntries(int epoch, PartitionManifestMatch& match) {
 
 int PartitionManifest::GetAllEntries(int epoch, int rank,
                                      PartitionManifestMatch& match) {
-  for (size_t i = 0; i < items_.size(); i++) {
-    if (items_[i].epoch == epoch and items_[i].rank == rank) {
-      match.AddItem(items_[i]);
+  if (indexed_) {
+    size_t beg = 0, end = 0;
+    if (rank >= 0) GetSegment(epoch, rank, beg, end);
+    AddSegmentMatches(beg, end, match);
+  } else {
+    for (size_t i = 0; i < items_.size(); i++) {
+      if (items_[i].epoch == epoch and items_[i].rank == rank) {
+        match.AddItemRef(&items_[i]);
+      }
     }
   }
 
@@ -45,10 +419,12 @@ int PartitionManifest::GetAllEntries(int epoch, int rank,
 
 int PartitionManifest::GetOverlappingEntries(int epoch, float point,
                                              PartitionManifestMatch& match) {
-  for (size_t i = 0; i < items_.size(); i++) {
-    if (items_[i].epoch == epoch && items_[i].Overlaps(point)) {
-      match.AddItem(items_[i]);
-    }
+  std::vector< uint32_t > idxvec;
+  GetOverlappingIndexes(epoch, point, point, idxvec);
+
+  size_t seg_hint = 0;
+  for (size_t i = 0; i < idxvec.size(); i++) {
+    AddMatch(idxvec[i], match, seg_hint);
   }
 
   uint64_t mass_epoch = mass_epoch_[epoch];
@@ -63,17 +439,18 @@ int PartitionManifest::GetOverlappingEntries(int epoch, float point,
 int PartitionManifest::GetOverlappingEntries(int epoch, float range_begin,
                                              float range_end,
                                              PartitionManifestMatch& match) {
-  for (size_t i = 0; i < items_.size(); i++) {
-    if (items_[i].epoch == epoch &&
-        items_[i].Overlaps(range_begin, range_end)) {
-      match.AddItem(items_[i]);
-    }
+  std::vector< uint32_t > idxvec;
+  GetOverlappingIndexes(epoch, range_begin, range_end, idxvec);
+
+  size_t seg_hint = 0;
+  for (size_t i = 0; i < idxvec.size(); i++) {
+    AddMatch(idxvec[i], match, seg_hint);
   }
 
   uint64_t mass_epoch = mass_epoch_[epoch];
   uint64_t mass_match = match.TotalMass();
 
-  logv(__LOG_ARGS__, LOG_INFO,
+  logv(__LOG_ARGS__, LOG_DBUG,
        "Query Selectivity: %.4f %% (%lu items, %lu total)\n",
        mass_match * 100.0 / mass_epoch, mass_match, mass_epoch);
 
@@ -84,19 +461,30 @@ int PartitionManifest::GetOverlappingEntries(int epoch, float range_begin,
   return 0;
 }
 
-int PartitionManifest::GetOverlappingEntries(Query& q,
+int PartitionManifest::GetOverlappingEntries(const Query& q,
                                              PartitionManifestMatch& match) {
-  for (size_t i = 0; i < items_.size(); i++) {
-    if (items_[i].epoch == q.epoch && items_[i].Overlaps(q.range)) {
-      if (q.rank != -1 and items_[i].rank != q.rank) continue;
-      match.AddItem(items_[i]);
+  std::vector< uint32_t > idxvec;
+  GetOverlappingIndexes(q.epoch, q.range.range_min, q.range.range_max, idxvec);
+
+  /* once indexed, a rank's items are the ones in its segment */
+  size_t seg_beg = 0, seg_end = 0;
+  if (q.rank != -1 and indexed_) GetSegment(q.epoch, q.rank, seg_beg, seg_end);
+
+  size_t seg_hint = 0;
+  for (size_t i = 0; i < idxvec.size(); i++) {
+    uint32_t idx = idxvec[i];
+    if (q.rank != -1) {
+      bool in_rank = indexed_ ? (idx >= seg_beg and idx < seg_end)
+                              : (items_[idx].rank == q.rank);
+      if (!in_rank) continue;
     }
+    AddMatch(idx, match, seg_hint);
   }
 
   uint64_t mass_epoch = mass_epoch_[q.epoch];
   uint64_t mass_match = match.TotalMass();
 
-  logv(__LOG_ARGS__, LOG_INFO,
+  logv(__LOG_ARGS__, LOG_DBUG,
        "Query Selectivity: %.4f %% (%lu items, %lu total)\n",
        mass_match * 100.0 / mass_epoch, mass_match, mass_epoch);
 
@@ -107,6 +495,41 @@ int PartitionManifest::GetOverlappingEntries(Query& q,
   return 0;
 }
 
+void PartitionManifest::GetOverlapStats(int epoch, float rmin, float rmax,
+                                        uint64_t& mass,
+                                        uint64_t& count) const {
+  mass = count = 0;
+
+  if (!indexed_) {
+    std::vector< uint32_t > idxvec;
+    GetOverlappingIndexes(epoch, rmin, rmax, idxvec);
+    for (size_t i = 0; i < idxvec.size(); i++) {
+      mass += items_[idxvec[i]].part_item_count;
+    }
+    count = idxvec.size();
+    return;
+  }
+
+  if (epoch < 0 or epoch >= num_epochs_) return;
+
+  const ManifestColumns& cols = columns_[epoch];
+  const size_t kBlockSz = 1024;
+  uint32_t idx[kBlockSz];
+
+  /* filter in blocks so the index list stays on the stack */
+  for (size_t beg = 0; beg < cols.Size(); beg += kBlockSz) {
+    size_t n = std::min(kBlockSz, cols.Size() - beg);
+    size_t nmatch = SimdFilter::FilterOverlapping(
+        &cols.obs_min[beg], &cols.obs_max[beg], n, rmin, rmax, idx);
+
+    const uint32_t* counts = &cols.count[beg];
+    for (size_t i = 0; i < nmatch; i++) {
+      mass += counts[idx[i]];
+    }
+    count += nmatch;
+  }
+}
+
 Status PartitionManifest::GenOverlapStats(const char* dir_path,
                                           Env* const env) {
   int num_epochs;
@@ -123,7 +546,7 @@ Status PartitionManifest::GenOverlapStats(const char* dir_path,
   }
 
   logv(__LOG_ARGS__, LOG_INFO, "[Analytics] Total SSTs: %zu, zero width: %d\n",
-       items_.size(), zero_sst_cnt_);
+       Size(), zero_sst_cnt_);
 
   return Status::OK();
 }
@@ -173,16 +596,16 @@ void PartitionManifest::GenEpochStatsCSV(const int epoch,
 
   for (size_t i = 0; i < probe_points.size(); i++) {
     float r = probe_points[i];
-    PartitionManifestMatch match;
-    GetOverlappingEntries(epoch, r, match);
+    uint64_t match_mass, match_count;
+    GetOverlapStats(epoch, r, r, match_mass, match_count);
     char buf[1024];
     int buf_len =
         snprintf(buf, 1024, "%d,%f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
-                 epoch, r, match.TotalMass(), epoch_mass, match.Size());
+                 epoch, r, match_mass, epoch_mass, match_count);
     assert(buf_len > 0 and buf_len < 1024);
     fd->Append(Slice(buf, buf_len));
 
-    max_match_mass = std::max(max_match_mass, match.TotalMass());
+    max_match_mass = std::max(max_match_mass, match_mass);
   }
 
   logv(__LOG_ARGS__, LOG_INFO, "[Analytics] [epoch %d] Max Overlap: %.2f%%\n",
@@ -193,7 +616,7 @@ void PartitionManifest::GenEpochStatsCSV(const int epoch,
 
 void PartitionManifestMatch::Print() {
   for (size_t i = 0; i < Size(); i++) {
-    logv(__LOG_ARGS__, LOG_DBUG, "%s\n", items_[i].ToString().c_str());
+    logv(__LOG_ARGS__, LOG_DBUG, "%s\n", items_[i]->ToString().c_str());
   }
 }
 }  // namespace plfsio
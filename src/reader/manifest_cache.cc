@@ -0,0 +1,446 @@
+//
+// manifest_cache.cc: consolidated, versioned cache of all rdb manifests
+//
+
+#include "manifest_cache.h"
+
+#include <carp/carp_config.h>
+
+#include "pdlfs-common/coding.h"
+#include "pdlfs-common/crc32c.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace pdlfs {
+namespace plfsio {
+namespace {
+std::string RdbName(const std::string& parent, int rank) {
+  char tmp[20];
+  snprintf(tmp, sizeof(tmp), "RDB-%08x.tbl", rank);
+  return parent + "/" + tmp;
+}
+}  // namespace
+
+int ParseRdbName(const std::string& name) {
+  if (name.size() != 16 or name.compare(0, 4, "RDB-") != 0 or
+      name.compare(12, 4, ".tbl") != 0) {
+    return -1;
+  }
+
+  int rank = 0;
+  for (size_t i = 4; i < 12; i++) {
+    char c = name[i];
+    if (c >= '0' and c <= '9') {
+      rank = (rank << 4) | (c - '0');
+    } else if (c >= 'a' and c <= 'f') {
+      rank = (rank << 4) | (c - 'a' + 10);
+    } else {
+      return -1;
+    }
+
+    /* stops before the shift overflows */
+    if (rank >= kMaxRanks) return kMaxRanks;
+  }
+
+  return rank;
+}
+
+Status GetFileInfo(const std::string& path, RdbFileInfo& info) {
+  info.exists = false;
+
+#ifdef CARP_HAVE_STATX
+  /* statx may be missing from the kernel, or the fs may not return both
+   * fields, in which case stat has the final word */
+  struct statx stx;
+  const unsigned int mask = STATX_SIZE | STATX_MTIME;
+  if (statx(AT_FDCWD, path.c_str(), 0, mask, &stx) == 0 and
+      (stx.stx_mask & mask) == mask) {
+    info.exists = true;
+    info.fsz = stx.stx_size;
+    info.mtime = stx.stx_mtime.tv_sec * 1000000000ull + stx.stx_mtime.tv_nsec;
+    return Status::OK();
+  }
+#endif
+
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return Status::IOError("stat failed", path);
+  }
+
+  info.exists = true;
+  info.fsz = st.st_size;
+  info.mtime = st.st_mtime * 1000000000ull;
+#if defined(__linux__)
+  info.mtime += st.st_mtim.tv_nsec;
+#endif
+
+  return Status::OK();
+}
+
+ManifestCache::ManifestCache(Env* env)
+    : env_(env), key_sz_(0), val_sz_(0), map_(NULL), map_sz_(0) {}
+
+Status ManifestCache::Map(const std::string& dir, const int num_ranks) {
+  Reset(dir, num_ranks);
+
+  std::string fname = CacheName(dir);
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) return Status::NotFound("No manifest cache", fname);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 or st.st_size < (off_t)kHeaderSz) {
+    close(fd);
+    return Status::Corruption("Manifest cache truncated", fname);
+  }
+
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return Status::IOError("mmap failed", fname);
+
+  map_ = static_cast< const char* >(map);
+  map_sz_ = st.st_size;
+  madvise(map, map_sz_, MADV_WILLNEED);
+
+  Status s = Status::OK();
+
+  if (DecodeFixed64(map_) != kMagic) {
+    s = Status::Corruption("Bad manifest cache magic", fname);
+  } else if (DecodeFixed32(map_ + 8) != kVersion) {
+    s = Status::InvalidArgument("Manifest cache version mismatch", fname);
+  } else if (DecodeFixed32(map_ + 12) != (uint32_t)num_ranks) {
+    s = Status::InvalidArgument("Manifest cache rank count mismatch", fname);
+  }
+
+  size_t table_sz = kHeaderSz + num_ranks * kRankEntrySz;
+  if (s.ok() and map_sz_ < table_sz + 12) {
+    s = Status::Corruption("Manifest cache truncated", fname);
+  }
+
+  if (s.ok()) {
+    uint32_t crc = crc32c::Unmask(DecodeFixed32(map_ + table_sz));
+    if (crc != crc32c::Value(map_, table_sz)) {
+      s = Status::Corruption("Manifest cache checksum mismatch", fname);
+    }
+  }
+
+  if (!s.ok()) {
+    Unmap();
+    return s;
+  }
+
+  key_sz_ = DecodeFixed64(map_ + 16);
+  val_sz_ = DecodeFixed64(map_ + 24);
+
+  for (int rank = 0; rank < num_ranks; rank++) {
+    const char* ent = map_ + kHeaderSz + rank * kRankEntrySz;
+    RankEntry& re = ranks_[rank];
+    re.fsz = DecodeFixed64(ent);
+    re.mtime = DecodeFixed64(ent + 8);
+    re.num_epochs = DecodeFixed32(ent + 16);
+    re.mfoff = DecodeFixed64(ent + 20);
+    re.mfsz = DecodeFixed64(ent + 28);
+    re.mfcrc = crc32c::Unmask(DecodeFixed32(ent + 36));
+
+    if (re.mfoff > map_sz_ or re.mfsz > map_sz_ - re.mfoff) {
+      s = Status::Corruption("Manifest cache truncated", fname);
+      break;
+    }
+  }
+
+  if (!s.ok()) Unmap();
+
+  return s;
+}
+
+Status ManifestCache::Load(const std::string& dir, const int num_ranks) {
+  Status s = Map(dir, num_ranks);
+
+  for (int rank = 0; s.ok() and rank < num_ranks; rank++) {
+    RdbFileInfo fi;
+    fi.exists = StatRdb(rank, fi.fsz, fi.mtime).ok();
+    if (!Matches(ranks_[rank], fi)) {
+      s = Status::InvalidArgument("Manifest cache is stale", CacheName(dir));
+    }
+  }
+
+  if (!s.ok()) Unmap();
+
+  return s;
+}
+
+Status ManifestCache::Load(const std::string& dir,
+                           const std::vector< RdbFileInfo >& files) {
+  Status s = Map(dir, files.size());
+
+  for (size_t rank = 0; s.ok() and rank < files.size(); rank++) {
+    if (!Matches(ranks_[rank], files[rank])) {
+      s = Status::InvalidArgument("Manifest cache is stale", CacheName(dir));
+    }
+  }
+
+  if (!s.ok()) Unmap();
+
+  return s;
+}
+
+Status ManifestCache::LoadListing(const std::string& dir,
+                                  std::vector< RdbFileInfo >& files) {
+  std::string fname = CacheName(dir);
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) return Status::NotFound("No manifest cache", fname);
+
+  /* only the header and the rank table are needed, not worth a mapping */
+  Status s = Status::OK();
+  std::string table(kHeaderSz, 0);
+  size_t table_sz = 0;
+
+  if (pread(fd, &table[0], kHeaderSz, 0) != (ssize_t)kHeaderSz) {
+    s = Status::Corruption("Manifest cache truncated", fname);
+  } else if (DecodeFixed64(&table[0]) != kMagic) {
+    s = Status::Corruption("Bad manifest cache magic", fname);
+  } else if (DecodeFixed32(&table[8]) != kVersion) {
+    s = Status::InvalidArgument("Manifest cache version mismatch", fname);
+  }
+
+  if (s.ok()) {
+    table_sz = kHeaderSz + DecodeFixed32(&table[12]) * kRankEntrySz;
+    table.resize(table_sz + 12);
+    ssize_t n = table.size() - kHeaderSz;
+    if (pread(fd, &table[kHeaderSz], n, kHeaderSz) != n) {
+      s = Status::Corruption("Manifest cache truncated", fname);
+    }
+  }
+
+  close(fd);
+
+  if (s.ok()) {
+    uint32_t crc = crc32c::Unmask(DecodeFixed32(&table[table_sz]));
+    if (crc != crc32c::Value(table.data(), table_sz)) {
+      s = Status::Corruption("Manifest cache checksum mismatch", fname);
+    }
+  }
+
+  RdbFileInfo di;
+  if (s.ok()) s = GetFileInfo(dir, di);
+
+  if (s.ok()) {
+    uint64_t dir_mtime = DecodeFixed64(&table[table_sz + 4]);
+    if (dir_mtime == 0 or dir_mtime != di.mtime) {
+      s = Status::NotFound("Dir changed since manifest cache was written");
+    }
+  }
+
+  if (!s.ok()) return s;
+
+  uint32_t num_ranks = DecodeFixed32(&table[12]);
+  files.resize(num_ranks);
+  for (uint32_t rank = 0; rank < num_ranks; rank++) {
+    const char* ent = &table[kHeaderSz + rank * kRankEntrySz];
+    RdbFileInfo& fi = files[rank];
+    fi.fsz = DecodeFixed64(ent);
+    fi.mtime = DecodeFixed64(ent + 8);
+    fi.exists = fi.fsz != kNoFile;
+  }
+
+  return s;
+}
+
+Status ManifestCache::GetManifest(int rank, Slice& manifest_data,
+                                  uint32_t& num_epochs) const {
+  if (map_ == NULL or rank < 0 or rank >= (int)ranks_.size()) {
+    return Status::InvalidArgument("Rank not in manifest cache");
+  }
+
+  const RankEntry& re = ranks_[rank];
+  if (crc32c::Value(map_ + re.mfoff, re.mfsz) != re.mfcrc) {
+    return Status::Corruption("Manifest cache checksum mismatch",
+                              CacheName(dir_));
+  }
+
+  manifest_data = Slice(map_ + re.mfoff, re.mfsz);
+  num_epochs = re.num_epochs;
+
+  return Status::OK();
+}
+
+void ManifestCache::Reset(const std::string& dir, const int num_ranks) {
+  Unmap();
+  dir_ = dir;
+  ranks_.clear();
+  ranks_.resize(num_ranks);
+  for (int rank = 0; rank < num_ranks; rank++) {
+    ranks_[rank].fsz = kNoFile;
+    ranks_[rank].mtime = 0;
+    ranks_[rank].num_epochs = 0;
+  }
+  key_sz_ = val_sz_ = 0;
+}
+
+void ManifestCache::Reset(const std::string& dir,
+                          const std::vector< RdbFileInfo >& files) {
+  Reset(dir, files.size());
+  for (size_t rank = 0; rank < files.size(); rank++) {
+    if (!files[rank].exists) continue;
+    ranks_[rank].fsz = files[rank].fsz;
+    ranks_[rank].mtime = files[rank].mtime;
+  }
+}
+
+Status ManifestCache::AddRank(int rank, const Slice& manifest_data,
+                              uint32_t num_epochs) {
+  if (rank < 0 or rank >= (int)ranks_.size()) {
+    return Status::InvalidArgument("Rank out of range");
+  }
+
+  RankEntry& re = ranks_[rank];
+  Status s = Status::OK();
+  if (re.fsz == kNoFile) s = StatRdb(rank, re.fsz, re.mtime);
+  if (!s.ok()) return s;
+
+  re.num_epochs = num_epochs;
+  re.data.assign(manifest_data.data(), manifest_data.size());
+
+  return s;
+}
+
+Status ManifestCache::Write(uint64_t key_sz, uint64_t val_sz) {
+  std::string table;
+  PutFixed64(&table, kMagic);
+  PutFixed32(&table, kVersion);
+  PutFixed32(&table, ranks_.size());
+  PutFixed64(&table, key_sz);
+  PutFixed64(&table, val_sz);
+
+  /* DATA starts after CRC and DIRMTIME */
+  const size_t dir_mtime_off = kHeaderSz + ranks_.size() * kRankEntrySz + 4;
+  uint64_t mfoff = dir_mtime_off + 8;
+  for (size_t rank = 0; rank < ranks_.size(); rank++) {
+    RankEntry& re = ranks_[rank];
+    re.mfoff = mfoff;
+    re.mfsz = re.data.size();
+    re.mfcrc = crc32c::Value(re.data.data(), re.data.size());
+
+    PutFixed64(&table, re.fsz);
+    PutFixed64(&table, re.mtime);
+    PutFixed32(&table, re.num_epochs);
+    PutFixed64(&table, re.mfoff);
+    PutFixed64(&table, re.mfsz);
+    PutFixed32(&table, crc32c::Mask(re.mfcrc));
+
+    mfoff += re.mfsz;
+  }
+
+  PutFixed32(&table, crc32c::Mask(crc32c::Value(table.data(), table.size())));
+  PutFixed64(&table, 0);
+
+  std::string fname = CacheName(dir_);
+  std::string tmp_fname = fname + ".tmp";
+
+  WritableFile* fd;
+  Status s = env_->NewWritableFile(tmp_fname.c_str(), &fd);
+  if (!s.ok()) return s;
+
+  s = fd->Append(table);
+  for (size_t rank = 0; s.ok() and rank < ranks_.size(); rank++) {
+    s = fd->Append(ranks_[rank].data);
+  }
+
+  if (s.ok()) s = fd->Sync();
+  if (s.ok()) s = fd->Close();
+  delete fd;
+
+  if (s.ok()) {
+    s = env_->RenameFile(tmp_fname.c_str(), fname.c_str());
+  } else {
+    env_->DeleteFile(tmp_fname.c_str());
+  }
+
+  if (s.ok()) {
+    logv(__LOG_ARGS__, LOG_INFO, "Manifest cache written: %s (%" PRIu64 " B)",
+         fname.c_str(), mfoff);
+
+    /* without it the cache still works, it just isn't used as a listing */
+    Status ds = WriteDirMtime(fname, dir_mtime_off);
+    if (!ds.ok()) {
+      logv(__LOG_ARGS__, LOG_WARN, "Dir listing not cached: %s",
+           ds.ToString().c_str());
+    }
+  }
+
+  return s;
+}
+
+Status ManifestCache::WriteDirMtime(const std::string& fname, size_t off) {
+  /* the rename has just changed the mtime of the dir, and so would any
+   * rdb file created or removed while the cache was built. The mtime is
+   * taken first and only recorded if a listing taken after it still
+   * matches the cache, so any later change shows up as a new mtime. */
+  RdbFileInfo di;
+  Status s = GetFileInfo(dir_, di);
+  if (!s.ok()) return s;
+
+  std::vector< std::string > names;
+  s = env_->GetChildren(dir_.c_str(), &names);
+  if (!s.ok()) return s;
+
+  size_t num_listed = 0;
+  for (size_t i = 0; i < names.size(); i++) {
+    int rank = ParseRdbName(names[i]);
+    if (rank < 0 or rank >= kMaxRanks) continue;
+
+    if (rank >= (int)ranks_.size() or ranks_[rank].fsz == kNoFile) {
+      return Status::NotFound("Rdb file added while building", names[i]);
+    }
+    num_listed++;
+  }
+
+  size_t num_cached = 0;
+  for (size_t rank = 0; rank < ranks_.size(); rank++) {
+    if (ranks_[rank].fsz != kNoFile) num_cached++;
+  }
+
+  if (num_listed != num_cached) {
+    return Status::NotFound("Rdb file removed while building", dir_);
+  }
+
+  char buf[8];
+  EncodeFixed64(buf, di.mtime);
+
+  /* writing to an existing file leaves the mtime of the dir alone */
+  int fd = open(fname.c_str(), O_WRONLY);
+  if (fd < 0) return Status::IOError(fname, strerror(errno));
+
+  if (pwrite(fd, buf, sizeof(buf), off) != (ssize_t)sizeof(buf)) {
+    s = Status::IOError(fname, strerror(errno));
+  }
+
+  close(fd);
+  return s;
+}
+
+Status ManifestCache::StatRdb(int rank, uint64_t& fsz, uint64_t& mtime) const {
+  RdbFileInfo fi;
+  Status s = GetFileInfo(RdbName(dir_, rank), fi);
+  if (!s.ok()) return s;
+
+  fsz = fi.fsz;
+  mtime = fi.mtime;
+
+  return Status::OK();
+}
+
+void ManifestCache::Unmap() {
+  if (map_ != NULL) {
+    munmap(const_cast< char* >(map_), map_sz_);
+    map_ = NULL;
+    map_sz_ = 0;
+  }
+}
+}  // namespace plfsio
+}  // namespace pdlfs
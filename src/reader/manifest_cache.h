@@ -0,0 +1,158 @@
+//
+// manifest_cache.h: consolidated, versioned cache of all rdb manifests
+//
+
+#pragma once
+
+#include "common.h"
+
+#include "pdlfs-common/env.h"
+
+#include <string>
+#include <vector>
+
+namespace pdlfs {
+namespace plfsio {
+/* what a listing of the plfs dir knows of one rank's rdb file */
+struct RdbFileInfo {
+  bool exists;
+  uint64_t fsz;
+  /* in nanoseconds */
+  uint64_t mtime;
+};
+
+/* far more than any run has, but keeps a stray file name from sizing the
+ * handle table absurdly */
+const int kMaxRanks = 1 << 24;
+
+/* rank of an RDB-%08x.tbl name, kMaxRanks if it is at least that, or -1
+ * for any other name */
+int ParseRdbName(const std::string& name);
+
+/* Stats path for its size and mtime only, with statx where available.
+ * This goes to the OS directly, not through an Env, so the listing and
+ * the manifest cache only support dirs that the default Env can see. */
+Status GetFileInfo(const std::string& path, RdbFileInfo& info);
+
+/* ManifestCache: keeps the manifest bytes of every RDB-*.tbl footer, the
+ * KV sizes, and the size/mtime of each rdb file in a single file in the
+ * plfs dir. Later runs mmap it instead of opening every rdb file and
+ * reading its footer. A cache is only used if every rdb file still has the
+ * size and mtime it was built from; otherwise it is rebuilt.
+ *
+ * The rank table doubles as a listing of the dir: ranks without an rdb
+ * file have an FSZ of kNoFile. DIRMTIME is the mtime of the dir taken
+ * after the cache was renamed into place, and only set if a listing taken
+ * after that still matched the rank table. If the dir still has it, no
+ * rdb file was added or removed since, and the listing can be used
+ * without listing or stat'ing anything (see LoadListing).
+ *
+ * HEADER = [MAGIC:8B | VERSION:4B | NRANKS:4B | KEYSZ:8B | VALSZ:8B]
+ * RANK   = [FSZ:8B | MTIME:8B | NEPOCHS:4B | MFOFF:8B | MFSZ:8B |
+ *           MFCRC:4B] x NRANKS
+ * CRC    = [masked crc32c of HEADER and all RANKs:4B]
+ * DIRMTIME = [written last, in place, not covered by CRC, 0 if unset:8B]
+ * DATA   = manifest bytes of each rank, exactly as found in its footer
+ *
+ * MFCRC is the masked crc32c of a rank's manifest bytes. It is checked as
+ * each rank's manifest is handed out, not at Load, so the ranks can be
+ * checked in parallel, and only those that are actually decoded.
+ */
+class ManifestCache {
+ public:
+  explicit ManifestCache(Env* env);
+
+  ~ManifestCache() { Unmap(); }
+
+  /* Maps the cache of dir and checks it against the rdb files in dir.
+   * Returns NotFound if there's no cache, Corruption if it is unreadable
+   * and InvalidArgument if it is stale. */
+  Status Load(const std::string& dir, int num_ranks);
+
+  /* Same, but checks the cache against files, as listed by the caller,
+   * instead of stat'ing every rdb file again */
+  Status Load(const std::string& dir, const std::vector< RdbFileInfo >& files);
+
+  /* Fills files with the listing kept in the cache of dir, if the dir has
+   * not changed since the cache was written. Returns NotFound otherwise.
+   * An rdb file rewritten in place goes unnoticed, as with the rest of
+   * the reader, which assumes rdb files are never modified. */
+  static Status LoadListing(const std::string& dir,
+                            std::vector< RdbFileInfo >& files);
+
+  /* Only valid after a successful Load */
+  void GetKVSizes(uint64_t& key_sz, uint64_t& val_sz) const {
+    key_sz = key_sz_;
+    val_sz = val_sz_;
+  }
+
+  /* Only valid after a successful Load. manifest_data points into the
+   * mapping, and stays valid until the next Load/Reset. Returns Corruption
+   * if the manifest bytes of rank do not match their checksum. */
+  Status GetManifest(int rank, Slice& manifest_data,
+                     uint32_t& num_epochs) const;
+
+  /* Drops any mapping, and prepares to collect num_ranks manifests */
+  void Reset(const std::string& dir, int num_ranks);
+
+  /* Same, but takes the size and mtime of each rdb file from files */
+  void Reset(const std::string& dir, const std::vector< RdbFileInfo >& files);
+
+  /* Copies the manifest of rank for a later Write, stat'ing the rdb file
+   * unless Reset was given a listing. Thread-safe as long as every caller
+   * passes a different rank. */
+  Status AddRank(int rank, const Slice& manifest_data, uint32_t num_epochs);
+
+  /* Writes everything added since Reset to the cache file of dir. The file
+   * is written under a temporary name and renamed, so readers never see a
+   * partially written cache. */
+  Status Write(uint64_t key_sz, uint64_t val_sz);
+
+  static std::string CacheName(const std::string& dir) {
+    return dir + "/rdb.manifest.cache";
+  }
+
+ private:
+  struct RankEntry {
+    uint64_t fsz;
+    uint64_t mtime;
+    uint32_t num_epochs;
+    uint64_t mfoff;
+    uint64_t mfsz;
+    uint32_t mfcrc;
+    std::string data;
+  };
+
+  static const uint64_t kMagic = 0x31636d7072616326ull;
+  static const uint32_t kVersion = 3;
+  static const uint64_t kNoFile = ~0ull;
+  static const size_t kHeaderSz = 32;
+  static const size_t kRankEntrySz = 40;
+
+  /* Maps the cache of dir and checks everything but the rdb files */
+  Status Map(const std::string& dir, int num_ranks);
+
+  static bool Matches(const RankEntry& re, const RdbFileInfo& fi) {
+    if (!fi.exists) return re.fsz == kNoFile;
+    return re.fsz == fi.fsz and re.mtime == fi.mtime;
+  }
+
+  Status StatRdb(int rank, uint64_t& fsz, uint64_t& mtime) const;
+
+  /* Records the mtime of the dir, now that the cache is in place, unless
+   * the dir no longer has the rdb files in the rank table */
+  Status WriteDirMtime(const std::string& fname, size_t off);
+
+  void Unmap();
+
+  Env* const env_;
+  std::string dir_;
+  std::vector< RankEntry > ranks_;
+  uint64_t key_sz_;
+  uint64_t val_sz_;
+
+  const char* map_;
+  size_t map_sz_;
+};
+}  // namespace plfsio
+}  // namespace pdlfs
@@ -7,8 +7,31 @@
 #include "common.h"
 #include "range_reader.h"
 
+#include <pdlfs-common/mutexlock.h>
+
 namespace pdlfs {
 namespace plfsio {
+struct PartitionManifestReader::MergeWorkItem {
+  const std::vector< RankItems* >* ranks;
+  int rank_beg;
+  int rank_end;
+  int num_epochs;
+  /* destination of the first item of (epoch, rank), at epoch * nranks + rank
+   */
+  const std::vector< size_t >* seg_start;
+  PartitionManifestItem* dest;
+
+  /* per-task stats, reduced by MergeManifests */
+  uint64_t mass_total;
+  int zero_sst_cnt;
+  std::vector< uint64_t > mass_epoch;
+  std::vector< Range > range_epoch;
+
+  port::Mutex* mutex;
+  port::CondVar* cv;
+  int* tasks_pending;
+};
+
 PartitionManifestReader::PartitionManifestReader(PartitionManifest& manifest)
     : manifest_(manifest) {
   size_t entry_init[] = {sizeof(uint64_t), sizeof(uint64_t), sizeof(float),
@@ -18,11 +41,27 @@ PartitionManifestReader::PartitionManifestReader(PartitionManifest& manifest)
   ComputeInternalOffsets(entry_sizes_, offsets_, num_entries_, item_sz_);
 }
 
+void PartitionManifestReader::Reset(int num_ranks) {
+  rank_items_.clear();
+  rank_items_.resize(num_ranks);
+  overflow_items_.clear();
+}
+
 Status PartitionManifestReader::ReadManifest(int rank, Slice& footer_data,
                                              const uint64_t footer_sz) {
   uint64_t epoch_offset = 0;
   Status s;
 
+  RankItems local;
+  RankItems* out = &local;
+  if (rank >= 0 and rank < (int)rank_items_.size()) {
+    out = &rank_items_[rank];
+  }
+
+  out->items.clear();
+  out->items.reserve(footer_sz / item_sz_);
+  out->epoch_counts.clear();
+
   FILE* file_out = NULL;
 
   if (!output_path_.empty()) {
@@ -39,7 +78,7 @@ Status PartitionManifestReader::ReadManifest(int rank, Slice& footer_data,
          off_prev);
 
     ReadFooterEpoch(num_ep_written, rank, footer_data, epoch_offset + 12,
-                    off_prev, file_out);
+                    off_prev, *out, file_out);
 
     epoch_offset += off_prev + 12;
   }
@@ -49,15 +88,161 @@ Status PartitionManifestReader::ReadManifest(int rank, Slice& footer_data,
     file_out = NULL;
   }
 
+  if (out == &local) {
+    MutexLock ml(&manifest_mutex_);
+    RankItems& dest = overflow_items_[rank];
+    dest.items.swap(local.items);
+    dest.epoch_counts.swap(local.epoch_counts);
+  }
+
   return s;
 }
 
+void PartitionManifestReader::MergeManifests(ThreadPool* pool) {
+  PartitionManifest& mf = manifest_;
+
+  std::vector< RankItems* > ranks(rank_items_.size(), NULL);
+  for (size_t rank = 0; rank < rank_items_.size(); rank++) {
+    ranks[rank] = &rank_items_[rank];
+  }
+
+  std::map< int, RankItems >::iterator it = overflow_items_.begin();
+  for (; it != overflow_items_.end(); it++) {
+    if (it->first >= (int)ranks.size()) ranks.resize(it->first + 1, NULL);
+    ranks[it->first] = &it->second;
+  }
+
+  /* epochs and ranks are only counted if they hold items, as in AddItem */
+  int num_epochs = mf.num_epochs_;
+  int num_ranks = mf.ranks_;
+  for (size_t rank = 0; rank < ranks.size(); rank++) {
+    if (ranks[rank] == NULL or ranks[rank]->items.empty()) continue;
+
+    const std::vector< uint32_t >& counts = ranks[rank]->epoch_counts;
+    for (int epoch = counts.size() - 1; epoch >= num_epochs; epoch--) {
+      if (counts[epoch]) {
+        num_epochs = epoch + 1;
+        break;
+      }
+    }
+
+    num_ranks = std::max(num_ranks, (int)rank + 1);
+  }
+
+  /* lay the new items out in (epoch, rank) order after the existing ones */
+  std::vector< size_t > seg_start((size_t)num_epochs * ranks.size());
+  size_t pos = mf.items_.size();
+  for (int epoch = 0; epoch < num_epochs; epoch++) {
+    for (size_t rank = 0; rank < ranks.size(); rank++) {
+      seg_start[epoch * ranks.size() + rank] = pos;
+      if (ranks[rank] == NULL) continue;
+
+      const std::vector< uint32_t >& counts = ranks[rank]->epoch_counts;
+      if (epoch < (int)counts.size()) pos += counts[epoch];
+    }
+  }
+
+  mf.items_.resize(pos);
+
+  const int kRanksPerTask = 64;
+  int num_tasks = (ranks.size() + kRanksPerTask - 1) / kRanksPerTask;
+
+  port::Mutex mutex;
+  port::CondVar cv(&mutex);
+  int tasks_pending = num_tasks;
+
+  std::vector< MergeWorkItem > work_items(num_tasks);
+  for (int ti = 0; ti < num_tasks; ti++) {
+    MergeWorkItem& wi = work_items[ti];
+    wi.ranks = &ranks;
+    wi.rank_beg = ti * kRanksPerTask;
+    wi.rank_end = std::min((int)ranks.size(), wi.rank_beg + kRanksPerTask);
+    wi.num_epochs = num_epochs;
+    wi.seg_start = &seg_start;
+    wi.dest = mf.items_.empty() ? NULL : &mf.items_[0];
+    wi.mutex = &mutex;
+    wi.cv = &cv;
+    wi.tasks_pending = &tasks_pending;
+
+    if (pool) {
+      pool->Schedule(MergeWorker, &wi);
+    } else {
+      MergeWorker(&wi);
+    }
+  }
+
+  mutex.Lock();
+  while (tasks_pending > 0) cv.Wait();
+  mutex.Unlock();
+
+  mf.num_epochs_ = num_epochs;
+  mf.ranks_ = num_ranks;
+  mf.mass_epoch_.resize(num_epochs, 0);
+  mf.range_epoch_.resize(num_epochs);
+  mf.indexed_ = false;
+
+  for (int ti = 0; ti < num_tasks; ti++) {
+    MergeWorkItem& wi = work_items[ti];
+    mf.mass_total_ += wi.mass_total;
+    mf.zero_sst_cnt_ += wi.zero_sst_cnt;
+
+    for (int epoch = 0; epoch < num_epochs; epoch++) {
+      mf.mass_epoch_[epoch] += wi.mass_epoch[epoch];
+      mf.range_epoch_[epoch].Extend(wi.range_epoch[epoch]);
+    }
+  }
+
+  std::vector< RankItems >().swap(rank_items_);
+  overflow_items_.clear();
+}
+
+void PartitionManifestReader::MergeWorker(void* arg) {
+  MergeWorkItem* wi = static_cast< MergeWorkItem* >(arg);
+  const std::vector< RankItems* >& ranks = *wi->ranks;
+  const size_t num_ranks = ranks.size();
+
+  wi->mass_total = 0;
+  wi->zero_sst_cnt = 0;
+  wi->mass_epoch.assign(wi->num_epochs, 0);
+  wi->range_epoch.assign(wi->num_epochs, Range());
+
+  std::vector< size_t > cursor(wi->num_epochs);
+
+  for (int rank = wi->rank_beg; rank < wi->rank_end; rank++) {
+    if (ranks[rank] == NULL) continue;
+
+    for (int epoch = 0; epoch < wi->num_epochs; epoch++) {
+      cursor[epoch] = (*wi->seg_start)[epoch * num_ranks + rank];
+    }
+
+    const std::vector< PartitionManifestItem >& items = ranks[rank]->items;
+    for (size_t i = 0; i < items.size(); i++) {
+      const PartitionManifestItem& item = items[i];
+      wi->dest[cursor[item.epoch]++] = item;
+
+      wi->mass_total += item.part_item_count;
+      wi->mass_epoch[item.epoch] += item.part_item_count;
+      wi->range_epoch[item.epoch].Extend(item.observed);
+      if (item.observed.ZeroWidth()) wi->zero_sst_cnt++;
+    }
+  }
+
+  MutexLock ml(wi->mutex);
+  if (--*wi->tasks_pending == 0) wi->cv->SignalAll();
+}
+
 void PartitionManifestReader::ReadFooterEpoch(int epoch, int rank, Slice& data,
                                               const uint64_t epoch_offset,
                                               const uint64_t epoch_sz,
+                                              RankItems& out,
                                               FILE* file_out) {
   int num_items = epoch_sz / item_sz_;
 
+  if (epoch >= (int)out.epoch_counts.size()) {
+    out.epoch_counts.resize(epoch + 1, 0);
+  }
+  out.epoch_counts[epoch] += num_items;
+
   uint64_t cur_offset = epoch_offset;
 
   for (int i = 0; i < num_items; i++) {
@@ -75,19 +260,17 @@ void PartitionManifestReader::ReadFooterEpoch(int epoch, int rank, Slice& data,
     item.part_item_count = DecodeFixed32(&data[cur_offset + offsets_[7]]);
     item.part_item_oob = DecodeFixed32(&data[cur_offset + offsets_[8]]);
 
+#if LOG_LVL >= LOG_DBG2
     std::string item_dbg = item.ToString();
     logv(__LOG_ARGS__, LOG_DBG2, "%s\n", item_dbg.c_str());
+#endif
 
     if (file_out) {
       std::string item_csv = item.ToCSVString();
       fprintf(file_out, "%s\n", item_csv.c_str());
     }
 
-    // Note to self: if this is a bottleneck,
-    // pre-allocate manifest and write to an index without locking
-    manifest_mutex_.Lock();
-    manifest_.AddItem(item);
-    manifest_mutex_.Unlock();
+    out.items.push_back(item);
 
     cur_offset += item_sz_;
   }
@@ -17,8 +17,19 @@ class PartitionManifestReader {
 
   void EnableManifestOutput(std::string out_path) { output_path_ = out_path; }
 
+  /* Pre-sizes the per-rank decode buffers. ReadManifest calls for ranks
+   * below num_ranks then run without any locking. */
+  void Reset(int num_ranks);
+
+  /* Decodes a rank's manifest into a rank-local buffer. Items only reach
+   * the manifest on MergeManifests. */
   Status ReadManifest(int rank, Slice& footer_data, uint64_t footer_sz);
 
+  /* Moves all decoded items into the manifest, laid out in (epoch, rank)
+   * order, and computes the per-epoch stats. Runs in parallel on pool if
+   * one is given. Call after all ReadManifest calls have completed. */
+  void MergeManifests(ThreadPool* pool = NULL);
+
   Status UpdateKVSizes(uint64_t key_sz, uint64_t val_sz) {
     manifest_mutex_.Lock();
     Status s = manifest_.UpdateKVSizes(key_sz, val_sz);
@@ -27,8 +38,19 @@ class PartitionManifestReader {
   }
 
  private:
+  /* items of one rank, in footer order, with a count per epoch */
+  struct RankItems {
+    std::vector< PartitionManifestItem > items;
+    std::vector< uint32_t > epoch_counts;
+  };
+
+  struct MergeWorkItem;
+
+  static void MergeWorker(void* arg);
+
   void ReadFooterEpoch(int epoch, int rank, Slice& data, uint64_t epoch_offset,
-                       uint64_t epoch_sz, FILE* file_out = NULL);
+                       uint64_t epoch_sz, RankItems& out,
+                       FILE* file_out = NULL);
 
   static void ComputeInternalOffsets(const size_t entry_sizes[],
                                      size_t offsets[], int num_entries,
@@ -43,6 +65,9 @@ class PartitionManifestReader {
  private:
   PartitionManifest& manifest_;
   port::Mutex manifest_mutex_;
+  std::vector< RankItems > rank_items_;
+  /* ranks read without a Reset covering them; guarded by manifest_mutex_ */
+  std::map< int, RankItems > overflow_items_;
 
   /* | ITEM | ITEM | ITEM | ...
    * ITEM = [IDX:8B | OFFSET:8B | RBEG:4B | REND:4B |
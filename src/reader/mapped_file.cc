@@ -0,0 +1,85 @@
+//
+// mapped_file.cc: read-only mmap of an rdb file
+//
+
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace pdlfs {
+namespace plfsio {
+Status MappedFile::Open(const std::string& fname, MappedFile** result) {
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) return Status::IOError(fname, strerror(errno));
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    Status s = Status::IOError(fname, strerror(errno));
+    close(fd);
+    return s;
+  }
+
+  uint64_t size = st.st_size;
+  char* base = NULL;
+
+  /* an empty file can not be mapped, and needs no mapping */
+  if (size > 0) {
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      Status s = Status::IOError(fname, strerror(errno));
+      close(fd);
+      return s;
+    }
+    base = static_cast< char* >(map);
+  }
+
+  /* the mapping keeps the file referenced */
+  close(fd);
+
+  *result = new MappedFile(fname, base, size);
+  return Status::OK();
+}
+
+MappedFile::~MappedFile() {
+  if (base_ != NULL) munmap(base_, size_);
+}
+
+Status MappedFile::Read(uint64_t offset, size_t n, Slice* result,
+                        char*) const {
+  if (offset > size_) {
+    *result = Slice();
+    return Status::IOError(fname_, "Read past EOF");
+  }
+
+  n = std::min< uint64_t >(n, size_ - offset);
+  *result = Slice(base_ + offset, n);
+  return Status::OK();
+}
+
+Status MappedFile::Advise(uint64_t offset, uint64_t n,
+                          ReadAdvice advice) const {
+  if (base_ == NULL or offset >= size_) return Status::OK();
+  if (n == 0 or n > size_ - offset) n = size_ - offset;
+
+  /* madvise wants a page-aligned start */
+  static const uint64_t page_sz = sysconf(_SC_PAGESIZE);
+  uint64_t beg = offset / page_sz * page_sz;
+
+  int flag = MADV_WILLNEED;
+  if (advice == kAdviseSequential) flag = MADV_SEQUENTIAL;
+  if (advice == kAdviseRandom) flag = MADV_RANDOM;
+
+  if (madvise(base_ + beg, offset + n - beg, flag) != 0) {
+    return Status::IOError(fname_, strerror(errno));
+  }
+
+  return Status::OK();
+}
+}  // namespace plfsio
+}  // namespace pdlfs
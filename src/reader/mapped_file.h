@@ -0,0 +1,45 @@
+//
+// mapped_file.h: read-only mmap of an rdb file
+//
+
+#pragma once
+
+#include "pdlfs-common/env.h"
+
+#include <string>
+
+namespace pdlfs {
+namespace plfsio {
+/* access pattern hints for a range of a file, see CachingDirReader::Advise
+ */
+enum ReadAdvice { kAdviseWillNeed, kAdviseSequential, kAdviseRandom };
+
+/* MappedFile: an rdb file mapped read-only in its entirety. Read has the
+ * signature of RandomAccessFile::Read, but never copies: the returned
+ * slice points into the mapping and scratch is ignored (it may be NULL).
+ * Slices stay valid for the lifetime of the MappedFile. Thread-safe, as
+ * the mapping is never modified. */
+class MappedFile {
+ public:
+  static Status Open(const std::string& fname, MappedFile** result);
+
+  ~MappedFile();
+
+  /* reads past the end of the file come back short, as with pread */
+  Status Read(uint64_t offset, size_t n, Slice* result, char* scratch) const;
+
+  /* madvise()s [offset, offset + n), or up to EOF if n is zero */
+  Status Advise(uint64_t offset, uint64_t n, ReadAdvice advice) const;
+
+  uint64_t Size() const { return size_; }
+
+ private:
+  MappedFile(const std::string& fname, char* base, uint64_t size)
+      : fname_(fname), base_(base), size_(size) {}
+
+  const std::string fname_;
+  char* const base_;
+  const uint64_t size_;
+};
+}  // namespace plfsio
+}  // namespace pdlfs
@@ -14,6 +14,11 @@ class PMISort {
                   const pdlfs::plfsio::PartitionManifestItem& b) const {
     return (a.epoch < b.epoch) || ((a.epoch == b.epoch && a.offset < b.offset));
   }
+
+  bool operator()(const pdlfs::plfsio::PartitionManifestItem* a,
+                  const pdlfs::plfsio::PartitionManifestItem* b) const {
+    return (*this)(*a, *b);
+  }
 };
 }  // namespace
 namespace pdlfs {
@@ -23,31 +28,31 @@ class QueryMatchOptimizer {
   static Status OptimizeSchedule(PartitionManifestMatch& match) {
     Status s = Status::OK();
 
-    std::map< int, std::vector< PartitionManifestItem > > item_map;
     std::vector< int > all_ranks;
     match.GetUniqueRanks(all_ranks);
 
     const size_t match_origcnt = match.items_.size();
 
+    /* only the references are reordered, items stay where they are */
+    std::vector< std::vector< const PartitionManifestItem* > > rank_vecs(
+        all_ranks.size());
+
     for (size_t ri = 0; ri < all_ranks.size(); ri++) {
-      int rank = all_ranks[ri];
-      std::vector< PartitionManifestItem >& vec = item_map[rank];
-      assert(vec.empty());
-      match.GetMatchesByRank(rank, vec);
+      std::vector< const PartitionManifestItem* >& vec = rank_vecs[ri];
+      match.GetMatchesByRank(all_ranks[ri], vec);
       std::sort(vec.begin(), vec.end(), PMISort());
     }
 
     match.items_.resize(0);
+    match.rank_index_valid_ = false;
 
     for (size_t ri = 0; ri < all_ranks.size(); ri++) {
-      int rank = all_ranks[ri];
-      std::vector< PartitionManifestItem >& vec = item_map[rank];
+      std::vector< const PartitionManifestItem* >& vec = rank_vecs[ri];
       if (!vec.empty()) match.items_.push_back(vec[0]);
     }
 
     for (size_t ri = 0; ri < all_ranks.size(); ri++) {
-      int rank = all_ranks[ri];
-      std::vector< PartitionManifestItem >& vec = item_map[rank];
+      std::vector< const PartitionManifestItem* >& vec = rank_vecs[ri];
       for (size_t vi = 1; vi < vec.size(); vi++) {
         match.items_.push_back(vec[vi]);
       }
@@ -4,6 +4,10 @@
 
 #include "query_utils.h"
 
+#include "simd_filter.h"
+
+#include <algorithm>
+#include <string.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 #define gettid() syscall(SYS_gettid)
@@ -38,11 +42,23 @@ Status QueryUtils::SummarizeManifest(PartitionManifest& manifest) {
 
     std::string print_buf_concat;
     for (float qpnt = 0.01; qpnt < 2; qpnt += 0.25) {
-      PartitionManifestMatch match;
-      manifest.GetOverlappingEntries(ep, qpnt, match);
+      uint64_t match_mass, match_count;
+      manifest.GetOverlapStats(ep, qpnt, qpnt, match_mass, match_count);
 
       logv(__LOG_ARGS__, LOG_INFO, "\t - Selectivity for key %.4f: %.3f%%", qpnt,
-           match.GetSelectivity() * 100);
+           match_mass * 100.0f / ep_itemcnt);
+    }
+
+    for (float qbeg = 0.01; qbeg < 2; qbeg += 0.25) {
+      double est_mass, max_err;
+      s = manifest.GetKeyMassEstimate(ep, qbeg, qbeg + 0.25f, est_mass,
+                                      max_err);
+      if (!s.ok()) return s;
+
+      logv(__LOG_ARGS__, LOG_INFO,
+           "\t - Est. key selectivity for [%.2f, %.2f]: %.3f%% (+/- %.3f%%)",
+           qbeg, qbeg + 0.25f, est_mass * 100 / ep_itemcnt,
+           max_err * 100 / ep_itemcnt);
     }
   }
 
@@ -83,6 +99,9 @@ void QueryUtils::ThreadSafetyWarning<SequentialFile>() {
 template <>
 void QueryUtils::ThreadSafetyWarning<RandomAccessFile>() {}
 
+template <>
+void QueryUtils::ThreadSafetyWarning<MappedFile>() {}
+
 template <typename T>
 void QueryUtils::SSTReadWorker(void* arg) {
   SSTReadWorkItem<T>* wi = static_cast<SSTReadWorkItem<T>*>(arg);
@@ -92,53 +111,167 @@ void QueryUtils::SSTReadWorker(void* arg) {
 
   int rank = wi->item->rank;
 
-  Slice slice;
-  const size_t key_sz = wi->key_sz;
-  const size_t val_sz = wi->val_sz;
-  const size_t kvp_sz = wi->key_sz + wi->val_sz;
-  const size_t sst_sz = kvp_sz * wi->item->part_item_count;
-  const size_t keyblk_sz = key_sz * wi->item->part_item_count;
-
-  std::string scratch;
-  scratch.resize(sst_sz);
-
-  std::vector<KeyPair>& qvec = *wi->query_results;
-  int qidx = wi->qrvec_offset;
-
+  /* only the key block is read, values of matching keys are read later
+   * if they are projected (see RangeReader::ReadValues) */
   ReadRequest req;
   req.offset = wi->item->offset;
-  req.bytes = sst_sz;
-  // XXX: tmp
-  req.bytes = sst_sz / kvp_sz * key_sz;
+  req.bytes = wi->key_sz * wi->item->part_item_count;
+
+  std::string scratch;
+  if (!CachingDirReader<T>::ZeroCopyReads()) scratch.resize(req.bytes);
   req.scratch = &scratch[0];
 
   int req_id = wi->task_tracker->MarkBegin(tid);
 
-  s = wi->fdcache->Read(rank, req, /* force-reopen */ false);
+  s = wi->fdcache->Read(rank, req, /* force-reopen */ false, wi->mode);
   if (!s.ok()) {
-    logv(__LOG_ARGS__, LOG_ERRO, "Read Failure");
+    logv(__LOG_ARGS__, LOG_ERRO, "Read Failure: %s", s.ToString().c_str());
+    wi->s = s;
+    wi->task_tracker->MarkCompleted(req_id);
     return;
   }
 
   wi->task_tracker->MarkIOCompleted(req_id);
 
-  slice = req.slice;
+  DecodeSST(wi, req.slice);
+
+  wi->task_tracker->MarkCompleted(req_id);
+}
+
+template <typename T>
+void QueryUtils::SSTDecodeWorker(void* arg) {
+  SSTReadWorkItem<T>* wi = static_cast<SSTReadWorkItem<T>*>(arg);
+
+  DecodeSST(wi, wi->req->slice);
+
+  wi->task_tracker->MarkCompleted(wi->req_id);
+}
+
+template <typename T>
+void QueryUtils::SSTReadCompleted(void* arg, size_t idx, const Status& s) {
+  SSTReadBatch<T>* batch = static_cast<SSTReadBatch<T>*>(arg);
+  SSTReadWorkItem<T>& wi = (*batch->work_items)[idx];
+
+  if (!s.ok()) {
+    logv(__LOG_ARGS__, LOG_ERRO, "Read Failure: %s", s.ToString().c_str());
+    wi.s = s;
+    wi.task_tracker->MarkCompleted(wi.req_id);
+    return;
+  }
+
+  wi.task_tracker->MarkIOCompleted(wi.req_id);
+  batch->pool->Schedule(SSTDecodeWorker<T>, &wi);
+}
+
+template <typename T>
+void QueryUtils::DecodeSST(SSTReadWorkItem<T>* wi, const Slice& keyblk) {
+  const size_t key_sz = wi->key_sz;
+  const size_t val_sz = wi->val_sz;
+  const size_t keyblk_sz = key_sz * wi->item->part_item_count;
+
+  if (keyblk.size() < keyblk_sz) {
+    logv(__LOG_ARGS__, LOG_ERRO, "Short SST read: %zu/%zu bytes",
+         keyblk.size(), keyblk_sz);
+    wi->s = Status::Corruption("Short SST read");
+    return;
+  }
+
+  SampleKeys(wi->manifest, *wi->item, keyblk.data(),
+             wi->item->part_item_count, key_sz);
+
+  if (wi->pushdown) {
+    FilterKeys(keyblk.data(), wi->item->part_item_count, key_sz,
+               wi->loc_base, wi->rbegin, wi->rend, wi->matches);
+    wi->sorted = std::is_sorted(wi->matches.begin(), wi->matches.end(),
+                                KeyPairComparator());
+    return;
+  }
+
+  std::vector<KeyPair>& qvec = *wi->query_results;
+  int qidx = wi->qrvec_offset;
 
   uint64_t keyblk_cur = 0;
-  uint64_t valblk_cur = req.offset + keyblk_sz;
+  uint64_t valblk_cur = wi->item->offset + keyblk_sz;
 
   while (keyblk_cur < keyblk_sz) {
-    qvec[qidx].key = DecodeFloat32(&slice[keyblk_cur]);
+    qvec[qidx].key = DecodeFloat32(&keyblk[keyblk_cur]);
+    qvec[qidx].rank = wi->item->rank;
     qvec[qidx].offset = valblk_cur;
 
     keyblk_cur += key_sz;
     valblk_cur += val_sz;
     qidx++;
   }
+}
+
+template <typename T>
+void QueryUtils::SSTAggregateWorker(void* arg) {
+  SSTAggregateWorkItem<T>* wi = static_cast<SSTAggregateWorkItem<T>*>(arg);
+
+  pid_t tid = gettid();
+
+  const PartitionManifestItem& item = *wi->item;
+  const size_t keyblk_sz = wi->key_sz * item.part_item_count;
+
+  std::string scratch;
+  if (!CachingDirReader<T>::ZeroCopyReads()) scratch.resize(keyblk_sz);
+
+  /* values are never needed, so only the key block is read */
+  ReadRequest req;
+  req.offset = item.offset;
+  req.bytes = keyblk_sz;
+  req.scratch = &scratch[0];
+
+  int req_id = wi->task_tracker->MarkBegin(tid);
+
+  wi->s = wi->fdcache->Read(item.rank, req, /* force-reopen */ false);
+  if (!wi->s.ok()) {
+    logv(__LOG_ARGS__, LOG_ERRO, "Read Failure");
+    wi->task_tracker->MarkCompleted(req_id);
+    return;
+  }
+
+  wi->task_tracker->MarkIOCompleted(req_id);
+
+  AggregateKeys(req.slice.data(), item.part_item_count, wi->key_sz,
+                wi->rbegin, wi->rend, wi->count, wi->sum);
 
   wi->task_tracker->MarkCompleted(req_id);
 }
 
+template <typename T>
+void QueryUtils::ValueReadWorker(void* arg) {
+  ValueReadWorkItem<T>* wi = static_cast<ValueReadWorkItem<T>*>(arg);
+
+  /* each value is read straight into its place in out */
+  std::vector<ReadRequest> reqs(wi->count);
+  for (size_t j = 0; j < wi->count; j++) {
+    size_t i = wi->idx[j];
+    reqs[j].offset = wi->locator->Locate(wi->kps[i]).offset + wi->off;
+    reqs[j].bytes = wi->width;
+    reqs[j].scratch = wi->out + i * wi->stride;
+  }
+
+  wi->s = wi->fdcache->ReadBatch(wi->rank, reqs);
+
+  for (size_t j = 0; wi->s.ok() and j < reqs.size(); j++) {
+    const ReadRequest& r = reqs[j];
+    if (r.slice.size() != wi->width) {
+      wi->s = Status::Corruption("Short value read");
+    } else if (r.slice.data() != r.scratch) {
+      memcpy(r.scratch, r.slice.data(), wi->width);
+    }
+  }
+
+  if (!wi->s.ok()) {
+    logv(__LOG_ARGS__, LOG_ERRO, "Rank %d: %s", wi->rank,
+         wi->s.ToString().c_str());
+  }
+
+  MutexLock ml(wi->mutex);
+  if (--*wi->tasks_pending == 0) wi->cv->SignalAll();
+}
+
 template <typename T>
 void QueryUtils::RankwiseSSTReadWorker(void* arg) {
   RankwiseSSTReadWorkItem<T>* wi =
@@ -151,7 +284,6 @@ void QueryUtils::RankwiseSSTReadWorker(void* arg) {
 
   const size_t key_sz = wi->key_sz;
   const size_t val_sz = wi->val_sz;
-  const size_t kvp_sz = wi->key_sz + wi->val_sz;
 
   std::vector<KeyPair>& qvec = *wi->query_results;
   uint64_t qidx = wi->qrvec_offset;
@@ -164,12 +296,14 @@ void QueryUtils::RankwiseSSTReadWorker(void* arg) {
 
   for (size_t i = 0; i < req_vec.size(); i++) {
     ReadRequest& req = req_vec[i];
-    PartitionManifestItem& item = wi->wi_vec[i];
+    const PartitionManifestItem& item = *wi->wi_vec[i];
+    /* key blocks only, as in SSTReadWorker */
     req.offset = item.offset;
-    req.bytes = kvp_sz * item.part_item_count;
-    scratch_vec[i].resize(req.bytes);
+    req.bytes = key_sz * item.part_item_count;
+    if (!CachingDirReader<T>::ZeroCopyReads()) {
+      scratch_vec[i].resize(req.bytes);
+    }
     req.scratch = &(scratch_vec[i][0]);
-    /* we copy this because req-vec gets reordered */
     req.item_count = item.part_item_count;
   }
 
@@ -191,20 +325,149 @@ void QueryUtils::RankwiseSSTReadWorker(void* arg) {
     /* valblk_off is absolute, keyblk_cur is relative */
     uint64_t keyblk_cur = 0;
     uint64_t valblk_cur = req_vec[i].offset + keyblk_sz;
+    uint64_t qidx_beg = qidx;
 
     while (keyblk_cur < keyblk_sz) {
       qvec[qidx].key = DecodeFloat32(&slice[keyblk_cur]);
+      qvec[qidx].rank = rank;
       qvec[qidx].offset = valblk_cur;
 
       keyblk_cur += key_sz;
       valblk_cur += val_sz;
       qidx++;
     }
+
+    /* ReadBatch keeps the order of req_vec, which is that of wi_vec */
+    SampleKeys(wi->manifest, *wi->wi_vec[i], qvec, qidx_beg, qidx);
   }
 
   wi->task_tracker->MarkCompleted(req_id);
 }
 
+void QueryUtils::SampleKeys(PartitionManifest* manifest,
+                            const PartitionManifestItem& item,
+                            const std::vector<KeyPair>& qvec, uint64_t beg,
+                            uint64_t end) {
+  if (manifest == NULL or end <= beg) return;
+  if (!manifest->NeedsKeySamples(item)) return;
+
+  std::vector<float> keys;
+  uint64_t n = end - beg;
+  size_t nsamples = std::min<uint64_t>(n, kKeySamplesPerSST);
+  for (size_t i = 0; i < nsamples; i++) {
+    keys.push_back(qvec[beg + (2 * i + 1) * n / (2 * nsamples)].key);
+  }
+
+  manifest->AddKeySamples(item, keys);
+}
+
+void QueryUtils::SampleKeys(PartitionManifest* manifest,
+                            const PartitionManifestItem& item,
+                            const char* keyblk, size_t n, size_t key_sz) {
+  if (manifest == NULL or n == 0) return;
+  if (!manifest->NeedsKeySamples(item)) return;
+
+  std::vector<float> keys;
+  size_t nsamples = std::min<uint64_t>(n, kKeySamplesPerSST);
+  for (size_t i = 0; i < nsamples; i++) {
+    size_t j = (2 * i + 1) * n / (2 * nsamples);
+    keys.push_back(DecodeFloat32(keyblk + j * key_sz));
+  }
+
+  manifest->AddKeySamples(item, keys);
+}
+
+void QueryUtils::EstimateAggregate(const PartitionManifestMatch& match,
+                                   float rbegin, float rend,
+                                   AggregateResult& res) {
+  double count_est = 0, count_lo = 0, count_hi = 0;
+  double sum_est = 0, sum_lo = 0, sum_hi = 0;
+
+  for (size_t i = 0; i < match.Size(); i++) {
+    const PartitionManifestItem& item = match[i];
+    const double cnt = item.part_item_count;
+    const double a = item.observed.range_min;
+    const double b = item.observed.range_max;
+
+    if (Contains(item, rbegin, rend)) {
+      count_est += cnt;
+      count_lo += cnt;
+      count_hi += cnt;
+      sum_est += cnt * (a + b) / 2;
+      sum_lo += cnt * a;
+      sum_hi += cnt * b;
+      continue;
+    }
+
+    /* a straddling SST: anywhere from none to all of its keys match, and
+     * the ones that do lie in the clipped range [ca, cb] */
+    double ca = std::max(a, (double)rbegin);
+    double cb = std::min(b, (double)rend);
+    if (ca > cb) continue;
+
+    double frac = (b > a) ? (cb - ca) / (b - a) : 1;
+    count_est += cnt * frac;
+    count_hi += cnt;
+    sum_est += cnt * frac * (ca + cb) / 2;
+    sum_lo += std::min(0.0, cnt * ca);
+    sum_hi += std::max(0.0, cnt * cb);
+  }
+
+  res.count = (uint64_t)(count_est + 0.5);
+  res.count_err = std::max(res.count - count_lo, count_hi - res.count);
+  res.sum = sum_est;
+  res.sum_err = std::max(sum_est - sum_lo, sum_hi - sum_est);
+  res.ssts_matched = match.Size();
+  res.ssts_read = 0;
+}
+
+void QueryUtils::AggregateKeys(const char* keyblk, size_t n, size_t key_sz,
+                               float rbegin, float rend, uint64_t& count,
+                               double& sum) {
+  for (size_t i = 0; i < n; i++) {
+    float key = DecodeFloat32(keyblk + i * key_sz);
+    if (key >= rbegin and key <= rend) {
+      count++;
+      sum += key;
+    }
+  }
+}
+
+void QueryUtils::FilterKeys(const char* keyblk, size_t n, size_t key_sz,
+                            uint32_t loc_base, float rbegin, float rend,
+                            std::vector<CompactKeyPair>& out) {
+  CompactKeyPair kp;
+
+  /* the SIMD kernel wants packed float keys */
+  if (key_sz != sizeof(float)) {
+    for (size_t i = 0; i < n; i++) {
+      kp.key = DecodeFloat32(keyblk + i * key_sz);
+      if (kp.key >= rbegin and kp.key <= rend) {
+        kp.loc = loc_base + i;
+        out.push_back(kp);
+      }
+    }
+    return;
+  }
+
+  /* in chunks, so that the kernel's output stays on the stack and in L1 */
+  static const size_t kChunk = 1024;
+  float keys[kChunk];
+  uint32_t idx[kChunk];
+
+  for (size_t beg = 0; beg < n; beg += kChunk) {
+    size_t cnt = std::min(kChunk, n - beg);
+    size_t nmatch = SimdFilter::FilterKeys(keyblk + beg * key_sz, cnt, rbegin,
+                                           rend, keys, idx);
+
+    for (size_t j = 0; j < nmatch; j++) {
+      kp.key = keys[j];
+      kp.loc = loc_base + beg + idx[j];
+      out.push_back(kp);
+    }
+  }
+}
+
 Status QueryUtils::GenQueries(PartitionManifest& manifest, int epoch,
                               std::vector<Query>& queries,
                               std::vector<float>& overlaps, float max_overlap,
@@ -214,16 +477,20 @@ Status QueryUtils::GenQueries(PartitionManifest& manifest, int epoch,
   s = manifest.GetEpochRange(epoch, r);
   if (!s.ok()) return s;
 
+  uint64_t epoch_mass = 0;
+  s = manifest.GetEpochMass(epoch, epoch_mass);
+  if (!s.ok()) return s;
+
   float rbeg = r.range_min;
   float rend = rbeg + 0.001f;
 
   while (rend < r.range_max) {
     Query q(epoch, rbeg, rend);
-    PartitionManifestMatch match;
+    uint64_t match_mass, match_count;
 
-    manifest.GetOverlappingEntries(q, match);
+    manifest.GetOverlapStats(epoch, rbeg, rend, match_mass, match_count);
 
-    float query_sel = match.GetSelectivity();
+    float query_sel = epoch_mass ? match_mass * 1.0f / epoch_mass : 0;
 
     int num_in_range = ItemsWithinRange(overlaps, query_sel, min_dist);
     bool query_useful = query_sel < max_overlap;
@@ -232,6 +499,15 @@ Status QueryUtils::GenQueries(PartitionManifest& manifest, int epoch,
     if (query_needed and query_useful) {
       queries.push_back(q);
       overlaps.push_back(query_sel);
+
+      double est_mass, max_err;
+      if (manifest.GetKeyMassEstimate(epoch, rbeg, rend, est_mass, max_err)
+              .ok()) {
+        logv(__LOG_ARGS__, LOG_INFO,
+             "Planned: %s, SST sel: %.3f%%, est. key sel: %.3f%%",
+             q.ToString().c_str(), query_sel * 100,
+             epoch_mass ? est_mass * 100 / epoch_mass : 0);
+      }
     }
 
     rend += 0.1;
@@ -249,8 +525,29 @@ Status QueryUtils::GenQueries(PartitionManifest& manifest, int epoch,
 
 template void QueryUtils::SSTReadWorker<RandomAccessFile>(void* arg);
 template void QueryUtils::SSTReadWorker<SequentialFile>(void* arg);
+template void QueryUtils::SSTReadWorker<MappedFile>(void* arg);
+
+template void QueryUtils::SSTDecodeWorker<RandomAccessFile>(void* arg);
+template void QueryUtils::SSTDecodeWorker<SequentialFile>(void* arg);
+template void QueryUtils::SSTDecodeWorker<MappedFile>(void* arg);
+
+template void QueryUtils::SSTReadCompleted<RandomAccessFile>(
+    void* arg, size_t idx, const Status& s);
+template void QueryUtils::SSTReadCompleted<SequentialFile>(
+    void* arg, size_t idx, const Status& s);
+template void QueryUtils::SSTReadCompleted<MappedFile>(
+    void* arg, size_t idx, const Status& s);
+
+template void QueryUtils::SSTAggregateWorker<RandomAccessFile>(void* arg);
+template void QueryUtils::SSTAggregateWorker<SequentialFile>(void* arg);
+template void QueryUtils::SSTAggregateWorker<MappedFile>(void* arg);
 
 template void QueryUtils::RankwiseSSTReadWorker<RandomAccessFile>(void* arg);
 template void QueryUtils::RankwiseSSTReadWorker<SequentialFile>(void* arg);
+template void QueryUtils::RankwiseSSTReadWorker<MappedFile>(void* arg);
+
+template void QueryUtils::ValueReadWorker<RandomAccessFile>(void* arg);
+template void QueryUtils::ValueReadWorker<SequentialFile>(void* arg);
+template void QueryUtils::ValueReadWorker<MappedFile>(void* arg);
 }  // namespace plfsio
 }  // namespace pdlfs
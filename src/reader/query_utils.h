@@ -20,16 +20,73 @@ class QueryUtils {
   static Status GenQueryPlan(PartitionManifest& manifest,
                              std::vector<Query>& queries);
 
+  /* true if every key of item is known to lie within [rbegin, rend] */
+  static bool Contains(const PartitionManifestItem& item, float rbegin,
+                       float rend) {
+    return item.observed.range_min >= rbegin and
+           item.observed.range_max <= rend;
+  }
+
+  /* Manifest-only COUNT/SUM over match, assuming the keys of every SST are
+   * uniformly spread over its observed range. The error bounds only assume
+   * that every key lies within its SST's observed range. */
+  static void EstimateAggregate(const PartitionManifestMatch& match,
+                                float rbegin, float rend,
+                                AggregateResult& res);
+
+  /* Adds the count/sum of the n keys in keyblk that are in [rbegin, rend] */
+  static void AggregateKeys(const char* keyblk, size_t n, size_t key_sz,
+                            float rbegin, float rend, uint64_t& count,
+                            double& sum);
+
+  /* Appends to out the n keys in keyblk that are in [rbegin, rend], the
+   * i-th key of keyblk being numbered loc_base + i (see ResultLocator) */
+  static void FilterKeys(const char* keyblk, size_t n, size_t key_sz,
+                         uint32_t loc_base, float rbegin, float rend,
+                         std::vector<CompactKeyPair>& out);
+
   template <typename T>
   static void SSTReadWorker(void* arg);
 
+  /* decode stage of an SST whose key block was read in a batch */
+  template <typename T>
+  static void SSTDecodeWorker(void* arg);
+
+  /* ReadCallback for a batch of SST reads, arg is an SSTReadBatch */
+  template <typename T>
+  static void SSTReadCompleted(void* arg, size_t idx, const Status& s);
+
+  template <typename T>
+  static void SSTAggregateWorker(void* arg);
+
   template <typename T>
   static void RankwiseSSTReadWorker(void* arg);
 
+  template <typename T>
+  static void ValueReadWorker(void* arg);
+
   template <typename T>
   static void ThreadSafetyWarning();
 
  private:
+  /* keys sampled per SST on first read, to refine the manifest's sketches */
+  static const size_t kKeySamplesPerSST = 32;
+
+  /* decodes the key block of wi->item into wi->query_results, or only
+   * its matching keys into wi->matches (see SSTReadWorkItem::pushdown) */
+  template <typename T>
+  static void DecodeSST(SSTReadWorkItem<T>* wi, const Slice& keyblk);
+
+  static void SampleKeys(PartitionManifest* manifest,
+                         const PartitionManifestItem& item,
+                         const std::vector<KeyPair>& qvec, uint64_t beg,
+                         uint64_t end);
+
+  /* same, from the n keys of item's key block */
+  static void SampleKeys(PartitionManifest* manifest,
+                         const PartitionManifestItem& item,
+                         const char* keyblk, size_t n, size_t key_sz);
+
   static Status GenQueries(PartitionManifest& manifest, int epoch,
                            std::vector<Query>& queries,
                            std::vector<float>& overlaps, float max_overlap,
@@ -0,0 +1,154 @@
+//
+// radix_sort.cc: parallel radix sort of query results by key
+//
+
+#include "radix_sort.h"
+
+#include "range_reader.h"
+
+#include "pdlfs-common/mutexlock.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace pdlfs {
+namespace plfsio {
+namespace {
+/* flips negative floats whole and positive ones' sign bit, so that the
+ * unsigned order of the result is the float order */
+inline uint32_t SortableBits(float key) {
+  uint32_t u;
+  memcpy(&u, &key, sizeof(u));
+  return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+inline uint32_t Digit(float key, int shift) {
+  return (SortableBits(key) >> shift) & 0xff;
+}
+}  // namespace
+
+/* a chunk [beg, end) of one pass. pos holds the chunk's digit counts after
+ * CountWorker, and is then turned into where each digit's entries of the
+ * chunk go in dst. */
+template <typename K>
+struct RadixSorter::Task {
+  const K* src;
+  K* dst;
+  size_t beg;
+  size_t end;
+  int shift;
+  size_t pos[256];
+
+  port::Mutex* mutex;
+  port::CondVar* cv;
+  int* tasks_pending;
+};
+
+template <typename K>
+void RadixSorter::CountWorker(void* arg) {
+  Task<K>* t = static_cast<Task<K>*>(arg);
+  memset(t->pos, 0, sizeof(t->pos));
+  for (size_t i = t->beg; i < t->end; i++) {
+    t->pos[Digit(t->src[i].key, t->shift)]++;
+  }
+
+  MutexLock ml(t->mutex);
+  if (--*t->tasks_pending == 0) t->cv->SignalAll();
+}
+
+template <typename K>
+void RadixSorter::ScatterWorker(void* arg) {
+  Task<K>* t = static_cast<Task<K>*>(arg);
+  for (size_t i = t->beg; i < t->end; i++) {
+    t->dst[t->pos[Digit(t->src[i].key, t->shift)]++] = t->src[i];
+  }
+
+  MutexLock ml(t->mutex);
+  if (--*t->tasks_pending == 0) t->cv->SignalAll();
+}
+
+template <typename K>
+void RadixSorter::RunTasks(std::vector<Task<K> >& tasks, void (*fn)(void*)) {
+  port::Mutex mutex;
+  port::CondVar cv(&mutex);
+  int tasks_pending = tasks.size();
+
+  for (size_t i = 0; i < tasks.size(); i++) {
+    tasks[i].mutex = &mutex;
+    tasks[i].cv = &cv;
+    tasks[i].tasks_pending = &tasks_pending;
+  }
+
+  if (tasks.size() == 1) {
+    fn(&tasks[0]);
+    return;
+  }
+
+  for (size_t i = 0; i < tasks.size(); i++) {
+    pool_->Schedule(fn, &tasks[i]);
+  }
+
+  mutex.Lock();
+  while (tasks_pending > 0) cv.Wait();
+  mutex.Unlock();
+}
+
+void RadixSorter::Sort(std::vector<KeyPair>& kps) { SortRuns(kps); }
+
+void RadixSorter::Sort(std::vector<CompactKeyPair>& kps) { SortRuns(kps); }
+
+template <typename K>
+void RadixSorter::SortRuns(std::vector<K>& kps) {
+  const size_t n = kps.size();
+  if (n < kMinRadixSort) {
+    std::sort(kps.begin(), kps.end(), KeyPairComparator());
+    return;
+  }
+
+  size_t ntasks = std::max(n / kMinChunk, (size_t)1);
+  ntasks = std::min(ntasks, (size_t)parallelism_);
+  if (pool_ == NULL) ntasks = 1;
+
+  std::vector<Task<K> > tasks(ntasks);
+  for (size_t t = 0; t < ntasks; t++) {
+    tasks[t].beg = n * t / ntasks;
+    tasks[t].end = n * (t + 1) / ntasks;
+  }
+
+  std::vector<K> scratch(n);
+  K* src = &kps[0];
+  K* dst = &scratch[0];
+
+  for (int shift = 0; shift < 32; shift += 8) {
+    for (size_t t = 0; t < ntasks; t++) {
+      tasks[t].src = src;
+      tasks[t].dst = dst;
+      tasks[t].shift = shift;
+    }
+
+    RunTasks(tasks, CountWorker<K>);
+
+    /* digit d of chunk t goes after all smaller digits, and after digit d
+     * of the chunks before t, which keeps the sort stable */
+    size_t next = 0;
+    bool all_same = false;
+    for (int d = 0; d < 256; d++) {
+      size_t begin = next;
+      for (size_t t = 0; t < ntasks; t++) {
+        size_t cnt = tasks[t].pos[d];
+        tasks[t].pos[d] = next;
+        next += cnt;
+      }
+      if (next - begin == n) all_same = true;
+    }
+
+    if (all_same) continue;
+
+    RunTasks(tasks, ScatterWorker<K>);
+    std::swap(src, dst);
+  }
+
+  if (src != &kps[0]) kps.swap(scratch);
+}
+}  // namespace plfsio
+}  // namespace pdlfs
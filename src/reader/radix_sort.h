@@ -0,0 +1,69 @@
+//
+// radix_sort.h: parallel radix sort of query results by key
+//
+
+#pragma once
+
+#include "pdlfs-common/env.h"
+#include "pdlfs-common/port.h"
+
+#include <vector>
+
+namespace pdlfs {
+namespace plfsio {
+struct KeyPair;
+struct CompactKeyPair;
+
+/* RadixSorter: sorts KeyPairs or CompactKeyPairs by key with an LSD radix
+ * sort, 8 bits a pass, on the key bits mapped to an unsigned int that
+ * orders as the float does. Passes over a digit all keys share are skipped,
+ * so keys of a narrow range typically take two or three passes, not four.
+ *
+ * Each pass splits the array into up to parallelism chunks: the chunks
+ * are histogrammed on the pool, the histograms prefix-summed into per-chunk
+ * output positions, and the chunks scattered on the pool. The sort is
+ * stable. It needs no TBB. The scratch array, as large as kps, is
+ * allocated per call and freed before Sort returns (with whichever buffer
+ * the sort did not end in), so an idle sorter holds no memory. Sort
+ * schedules work on the pool and waits for it, so it must not be called
+ * from a task on that same pool.
+ */
+class RadixSorter {
+ public:
+  RadixSorter(ThreadPool* pool, int parallelism)
+      : pool_(pool), parallelism_(parallelism > 0 ? parallelism : 1) {}
+
+  void Sort(std::vector<KeyPair>& kps);
+  void Sort(std::vector<CompactKeyPair>& kps);
+
+  /* arrays shorter than this go to std::sort */
+  static const size_t kMinRadixSort = 4096;
+  /* each chunk of a pass has at least this many entries */
+  static const size_t kMinChunk = 65536;
+
+ private:
+  template <typename K>
+  struct Task;
+
+  template <typename K>
+  void SortRuns(std::vector<K>& kps);
+
+  /* runs one phase of a pass over every task, on the pool if there is
+   * more than one */
+  template <typename K>
+  void RunTasks(std::vector<Task<K> >& tasks, void (*fn)(void*));
+
+  template <typename K>
+  static void CountWorker(void* arg);
+  template <typename K>
+  static void ScatterWorker(void* arg);
+
+  /* No copying allowed */
+  RadixSorter(const RadixSorter&);
+  void operator=(const RadixSorter&);
+
+  ThreadPool* const pool_;
+  const int parallelism_;
+};
+}  // namespace plfsio
+}  // namespace pdlfs
@@ -13,6 +13,11 @@
 #include <oneapi/tbb/parallel_sort.h>
 #endif
 
+#include <deque>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define gettid() syscall(SYS_gettid)
+
 namespace {
 template < typename RandomIt, typename Compare >
 void carp_sort(RandomIt first, RandomIt last, Compare comp) {
@@ -26,6 +31,100 @@ void carp_sort(RandomIt first, RandomIt last, Compare comp) {
 
 namespace pdlfs {
 namespace plfsio {
+namespace {
+/* orders positions in a match by where their SSTs are */
+struct MatchLocationOrder {
+  explicit MatchLocationOrder(const PartitionManifestMatch& m) : match(m) {}
+
+  bool operator()(uint32_t a, uint32_t b) const {
+    if (match[a].rank != match[b].rank) return match[a].rank < match[b].rank;
+    return match[a].offset < match[b].offset;
+  }
+
+  const PartitionManifestMatch& match;
+};
+}  // namespace
+
+Status ResultLocator::Reset(const PartitionManifestMatch& match) {
+  Clear();
+  sparse_ = match.TotalMass() > UINT32_MAX;
+
+  uint64_t key_sz;
+  match.GetKVSizes(key_sz, val_sz_);
+
+  std::vector< uint32_t > order(match.Size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::sort(order.begin(), order.end(), MatchLocationOrder(match));
+
+  ssts_.resize(match.Size());
+  item_base_.resize(match.Size());
+
+  /* all 0 if sparse, until Compact */
+  uint32_t base = 0;
+  for (size_t i = 0; i < order.size(); i++) {
+    const PartitionManifestItem& item = match[order[i]];
+    ssts_[i].base = base;
+    ssts_[i].rank = item.rank;
+    ssts_[i].valblk_off = item.offset + key_sz * item.part_item_count;
+    ssts_[i].item = order[i];
+    item_base_[order[i]] = base;
+    if (!sparse_) base += item.part_item_count;
+  }
+
+  return Status::OK();
+}
+
+Status ResultLocator::Compact(
+    const std::vector< std::vector< CompactKeyPair >* >& matches) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < matches.size(); i++) total += matches[i]->size();
+  if (total > UINT32_MAX) {
+    return Status::NotSupported("Too many results to locate in 32 bits");
+  }
+
+  sst_idx_.resize(total);
+
+  uint32_t base = 0;
+  for (size_t i = 0; i < ssts_.size(); i++) {
+    std::vector< CompactKeyPair >& kps = *matches[ssts_[i].item];
+    ssts_[i].base = base;
+    item_base_[ssts_[i].item] = base;
+    for (size_t j = 0; j < kps.size(); j++) {
+      sst_idx_[base + j] = kps[j].loc;
+      kps[j].loc = base + j;
+    }
+    base += kps.size();
+  }
+
+  return Status::OK();
+}
+
+void ResultLocator::Clear() {
+  ssts_.clear();
+  item_base_.clear();
+  val_sz_ = 0;
+  sparse_ = false;
+  sst_idx_.clear();
+}
+
+KeyPair ResultLocator::Locate(const CompactKeyPair& kp) const {
+  KeyPair res;
+  res.key = kp.key;
+  res.rank = -1;
+  res.offset = 0;
+  if (ssts_.empty()) return res;
+
+  /* the last SST starting at or before loc; empty SSTs share their base
+   * with the next, and are skipped over by upper_bound */
+  std::vector< SST >::const_iterator it =
+      std::upper_bound(ssts_.begin(), ssts_.end(), kp.loc, BaseOrder());
+  const SST& sst = *(it - 1);
+
+  uint64_t idx = sparse_ ? sst_idx_[kp.loc] : kp.loc - sst.base;
+  res.rank = sst.rank;
+  res.offset = sst.valblk_off + idx * val_sz_;
+  return res;
+}
 
 template < typename T >
 Status RangeReader< T >::ReadManifest(const std::string& dir_path) {
@@ -37,29 +136,121 @@ Status RangeReader< T >::ReadManifest(const std::string& dir_path) {
   Status s = Status::OK();
 
   dir_path_ = dir_path;
-  fdcache_.ReadDirectory(dir_path_, num_ranks_);
+
+  std::vector< RdbFileInfo > listing;
+  bool listed = false;
+  if (options_.manifest_cache and options_.cached_listing) {
+    Status ls = ManifestCache::LoadListing(dir_path_, listing);
+    if (ls.ok()) {
+      s = fdcache_.SetDirectory(dir_path_, listing, num_ranks_);
+      listed = s.ok();
+    } else {
+      logv(__LOG_ARGS__, LOG_INFO, "Cached dir listing not used: %s",
+           ls.ToString().c_str());
+    }
+  }
+
+  if (!listed) {
+    s = fdcache_.ReadDirectory(dir_path_, num_ranks_, thpool_);
+    if (!s.ok()) {
+      logv(__LOG_ARGS__, LOG_ERRO, "%s", s.ToString().c_str());
+      logger_.RegisterEnd(kPerfEventManifestRead);
+      return s;
+    }
+    fdcache_.GetListing(listing);
+  }
+
+  if (options_.io_queue_depth > 0) {
+    Status as = fdcache_.EnableAsyncReads(options_.io_queue_depth);
+    if (!as.ok()) {
+      logv(__LOG_ARGS__, LOG_WARN, "Falling back to synchronous reads: %s",
+           as.ToString().c_str());
+    } else if (options_.prefetch_depth > 0) {
+      logv(__LOG_ARGS__, LOG_WARN,
+           "Batch prefetching is off, io_uring reads do not overlap queries");
+    }
+  }
 
   manifest_reader_.EnableManifestOutput(dir_path);
 
+  /* analytics need every epoch, so they always decode everything. lazy_
+   * may point into the cache mapping, so it's reset before the cache. */
+  lazy_on_ = options_.lazy_manifest and !options_.analytics_on;
+  lazy_.Reset(num_ranks_);
+
+  bool from_cache = false;
+  if (options_.manifest_cache and num_ranks_ > 0) {
+    Status cs = mfcache_.Load(dir_path_, listing);
+    if (cs.ok()) {
+      uint64_t key_sz, val_sz;
+      mfcache_.GetKVSizes(key_sz, val_sz);
+      manifest_reader_.UpdateKVSizes(key_sz, val_sz);
+      lazy_.UpdateKVSizes(key_sz, val_sz);
+      from_cache = true;
+      logv(__LOG_ARGS__, LOG_INFO, "Reading manifests from cache.");
+    } else {
+      logv(__LOG_ARGS__, LOG_INFO, "Manifest cache not used: %s",
+           cs.ToString().c_str());
+      mfcache_.Reset(dir_path_, listing);
+    }
+  }
+
   RandomAccessFile* src;
   std::vector< ManifestReadWorkItem< T > > work_items;
   work_items.resize(num_ranks_);
 
   task_tracker_.Reset();
+  manifest_reader_.Reset(num_ranks_);
 
   for (int rank = 0; rank < num_ranks_; rank++) {
     work_items[rank].rank = rank;
     work_items[rank].fdcache = &fdcache_;
     work_items[rank].task_tracker = &task_tracker_;
     work_items[rank].manifest_reader = &manifest_reader_;
+    work_items[rank].mfcache = options_.manifest_cache ? &mfcache_ : NULL;
+    work_items[rank].from_cache = from_cache;
+    work_items[rank].lazy = lazy_on_ ? &lazy_ : NULL;
     thpool_->Schedule(ManifestReadWorker, (void*)(&work_items[rank]));
   }
 
   task_tracker_.WaitUntilCompleted(num_ranks_);
 
-  uint64_t key_sz, val_sz;
-  manifest_.GetKVSizes(key_sz, val_sz);
+  uint64_t key_sz = 0, val_sz = 0;
+
+  if (lazy_on_) {
+    lazy_.GetKVSizes(key_sz, val_sz);
+    logv(__LOG_ARGS__, LOG_INFO,
+         "Manifest indexed by epoch (%d epochs), decoding on demand.",
+         lazy_.NumEpochs());
+  } else {
+    manifest_reader_.MergeManifests(thpool_);
+    manifest_.BuildIndex();
+    manifest_.GetKVSizes(key_sz, val_sz);
+  }
+
+  if (options_.compact_manifest and !lazy_on_) {
+    size_t mem_before = manifest_.MemoryUsage();
+    Status cs = manifest_.Compact();
+    if (cs.ok()) {
+      logv(__LOG_ARGS__, LOG_INFO, "Manifest compacted: %zu -> %zu bytes",
+           mem_before, manifest_.MemoryUsage());
+    } else {
+      logv(__LOG_ARGS__, LOG_WARN, "Manifest not compacted: %s",
+           cs.ToString().c_str());
+    }
+  }
+
   logv(__LOG_ARGS__, LOG_INFO, "Key/Value Sizes: %lu/%lu\n", key_sz, val_sz);
+  key_sz_ = key_sz;
+  val_sz_ = val_sz;
+
+  if (options_.manifest_cache and num_ranks_ > 0 and !from_cache) {
+    Status cs = mfcache_.Write(key_sz, val_sz);
+    if (!cs.ok()) {
+      logv(__LOG_ARGS__, LOG_WARN, "Manifest cache not written: %s",
+           cs.ToString().c_str());
+    }
+  }
 
   logger_.RegisterEnd(kPerfEventManifestRead);
 
@@ -85,16 +276,27 @@ template < typename T >
 Status RangeReader< T >::QueryNaive(int epoch, float rbegin, float rend) {
   logger_.RegisterBegin(kPerfEventSstRead);
 
-  Status s = Status::OK();
   std::vector< KeyPair > matching_results;
 
-  for (int rank = 0; rank < manifest_.NumRanks(); rank++) {
+  PartitionManifest* mf;
+  Status s = GetManifest(epoch, mf);
+  if (!s.ok()) return s;
+
+  for (int rank = 0; rank < mf->NumRanks(); rank++) {
     logv(__LOG_ARGS__, LOG_INFO, "Reading Rank %d\n", rank);
     PartitionManifestMatch match_obj_in, match_obj;
-    manifest_.GetAllEntries(epoch, rank, match_obj);
+    mf->GetAllEntries(epoch, rank, match_obj);
+
+    /* a scan reads the rank front to back */
+    fdcache_.Advise(rank, 0, 0, kAdviseSequential);
 
     std::vector< KeyPair > query_results;
-    ReadSSTs(match_obj, query_results);
+    s = ReadSSTs(mf, match_obj, query_results,
+                 options_.direct_scans ? kReadDirect : kReadCached);
+    if (!s.ok()) {
+      logger_.RegisterEnd(kPerfEventSstRead);
+      return s;
+    }
     for (size_t qi = 0; qi < query_results.size(); qi++) {
       KeyPair& kp = query_results[qi];
       if (kp.key >= rbegin and kp.key < rend) {
@@ -106,8 +308,7 @@ Status RangeReader< T >::QueryNaive(int epoch, float rbegin, float rend) {
   logger_.RegisterEnd(kPerfEventSstRead);
 
   logger_.RegisterBegin(kPerfEventSstMergeSort);
-  carp_sort(matching_results.begin(), matching_results.end(),
-            KeyPairComparator());
+  SortResults(matching_results);
   logger_.RegisterEnd(kPerfEventSstMergeSort);
 
   logv(__LOG_ARGS__, LOG_INFO, "Query Results: %zu elements found\n",
@@ -134,35 +335,141 @@ Status RangeReader< T >::QueryNaive(int epoch, float rbegin, float rend) {
 template < typename T >
 Status RangeReader< T >::QueryParallel(int rank, int epoch, float rbegin,
                                        float rend) {
-  logv(__LOG_ARGS__, LOG_INFO, "---------");
-  logv(__LOG_ARGS__, LOG_INFO,
-       "Processing range query. Epoch: %d, (%.2f - %.2f)", epoch, rbegin, rend);
+  Query q(epoch, rbegin, rend);
+  if (rank >= 0) q.rank = rank;
 
-  logger_.RegisterBegin(kPerfEventSstRead);
+  PendingQuery< T > pq(q, options_.env);
+  Status s = PlanQuery(&pq);
+  if (s.ok()) s = StartQuery(&pq);
+  if (s.ok()) s = FinishQuery(&pq);
+
+  return s;
+}
+
+template < typename T >
+Status RangeReader< T >::QueryParallel(const std::vector< Query >& qvec,
+                                       QueryDoneCallback cb, void* arg) {
   Status s = Status::OK();
 
-  PartitionManifestMatch match_obj_in, match_obj;
+  /* an io_uring batch is read in full within StartQuery, so a query
+   * started early would only hold up the one before it */
+  uint32_t depth = options_.prefetch_depth;
+  if (fdcache_.AsyncReadsEnabled()) depth = 0;
+
+  /* started queries, oldest first, and the next one if it was planned but
+   * did not fit in the budget */
+  std::deque< PendingQuery< T >* > started;
+  PendingQuery< T >* planned = NULL;
+  uint64_t footprint = 0;
+  size_t next = 0;
+
+  while (s.ok()) {
+    /* the oldest query is started regardless of the budget */
+    while (started.size() <= depth) {
+      if (planned == NULL) {
+        if (next == qvec.size()) break;
+        planned = new PendingQuery< T >(qvec[next], options_.env);
+        planned->qidx = next++;
+        s = PlanQuery(planned);
+        if (!s.ok()) break;
+      }
 
-  Query q(epoch, rbegin, rend);
-  if (rank >= 0) q.rank = rank;
-  manifest_.GetOverlappingEntries(q, match_obj);
+      if (!started.empty() and
+          footprint + planned->footprint > options_.prefetch_budget) {
+        break;
+      }
+
+      footprint += planned->footprint;
+      started.push_back(planned);
+      planned = NULL;
+
+      s = StartQuery(started.back());
+      if (!s.ok()) break;
+    }
+
+    if (!s.ok() or started.empty()) break;
+
+    PendingQuery< T >* pq = started.front();
+    started.pop_front();
+
+    if (!started.empty()) {
+      logv(__LOG_ARGS__, LOG_INFO, "Prefetching %zu queries (%" PRIu64 " B)",
+           started.size(), footprint - pq->footprint);
+    }
+
+    s = FinishQuery(pq);
+    if (s.ok() and cb != NULL) cb(arg, pq->qidx);
+    footprint -= pq->footprint;
+    delete pq;
+  }
+
+  /* reads still in flight write into their queries */
+  for (size_t i = 0; i < started.size(); i++) {
+    started[i]->tracker.WaitUntilCompleted(started[i]->work_items.size());
+    delete started[i];
+  }
+  delete planned;
+
+  return s;
+}
+
+template < typename T >
+Status RangeReader< T >::PlanQuery(PendingQuery< T >* pq) {
+  const Query& q = pq->q;
+  float rbegin = q.range.range_min, rend = q.range.range_max;
+
+  logv(__LOG_ARGS__, LOG_INFO, "---------");
+  logv(__LOG_ARGS__, LOG_INFO,
+       "Processing range query. Epoch: %d, (%.2f - %.2f)", q.epoch, rbegin,
+       rend);
+
+  Status s = GetManifest(q.epoch, pq->mf);
+  if (!s.ok()) return s;
+
+  pq->mf->GetOverlappingEntries(q, pq->match);
 
   //  s = QueryMatchOptimizer::Optimize(match_obj_in, match_obj);
   // s = QueryMatchOptimizer::OptimizeSchedule(match_obj);
-  if (!s.ok()) return s;
 
   logv(__LOG_ARGS__, LOG_INFO, "Query Match: %llu SSTs found (%llu items)",
-       match_obj.Size(), match_obj.TotalMass());
+       pq->match.Size(), pq->match.TotalMass());
+
+  double est_err = 0;
+  pq->mf->GetKeyMassEstimate(q.epoch, rbegin, rend, pq->est_mass, est_err);
+
+  pq->match.Print();
 
-  match_obj.Print();
+  s = pq->locator.Reset(pq->match);
 
-  std::vector< KeyPair > query_results;
-  ReadSSTs(match_obj, query_results);
+  /* only matching keys are kept, so size by the estimate, erring high */
+  pq->footprint = (pq->est_mass + est_err) * sizeof(CompactKeyPair);
 
+  return s;
+}
+
+template < typename T >
+Status RangeReader< T >::StartQuery(PendingQuery< T >* pq) {
+  return StartReadSSTs(pq->mf, pq->match, NULL, pq->work_items, &pq->tracker,
+                       kReadCached, &pq->q.range, &pq->locator);
+}
+
+template < typename T >
+Status RangeReader< T >::FinishQuery(PendingQuery< T >* pq) {
+  const Query& q = pq->q;
+  float rbegin = q.range.range_min, rend = q.range.range_max;
+  PartitionManifestMatch& match_obj = pq->match;
+  std::vector< CompactKeyPair >& query_results = pq->results;
+
+  /* only the part of the reads not overlapped with earlier queries */
+  logger_.RegisterBegin(kPerfEventSstRead);
+  pq->tracker.WaitUntilCompleted(pq->work_items.size());
+  std::vector< KeyRun > runs;
+  Status s = GatherMatches(pq->work_items, pq->locator, query_results, runs);
   logger_.RegisterEnd(kPerfEventSstRead);
+  if (!s.ok()) return s;
 
   logger_.RegisterBegin(kPerfEventSstMergeSort);
-  carp_sort(query_results.begin(), query_results.end(), KeyPairComparator());
+  SortResults(query_results, runs);
   logger_.RegisterEnd(kPerfEventSstMergeSort);
 
   logv(__LOG_ARGS__, LOG_INFO, "Query Results: %zu elements found\n",
@@ -179,12 +486,26 @@ Status RangeReader< T >::QueryParallel(int rank, int epoch, float rbegin,
 
 #undef ITEM
 
-  uint64_t match_cnt = 0;
-  for (size_t qidx = 0; qidx < query_results.size(); qidx++) {
-    float k = query_results[qidx].key;
-    if (k >= rbegin and k <= rend) {
-      match_cnt++;
+  /* already filtered by the workers */
+  query_results_.swap(query_results);
+  locator_ = pq->locator;
+
+  uint64_t match_cnt = query_results_.size();
+
+  query_values_.clear();
+  if (options_.projection != kProjectKeys) {
+    logger_.RegisterBegin(kPerfEventValueRead);
+    uint64_t off, width;
+    s = ProjectedExtent(val_sz_, off, width);
+    if (s.ok()) {
+      query_values_.resize(match_cnt * width);
+      s = ReadValues(query_results_, off, width, &query_values_[0], width);
     }
+    logger_.RegisterEnd(kPerfEventValueRead);
+    if (!s.ok()) return s;
+
+    logv(__LOG_ARGS__, LOG_INFO, "Values read: %" PRIu64 " x %" PRIu64 " B",
+         match_cnt, width);
   }
 
   double qsel_key = match_cnt * 1.0 / match_obj.DataSize();
@@ -192,15 +513,269 @@ Status RangeReader< T >::QueryParallel(int rank, int epoch, float rbegin,
 
   logv(__LOG_ARGS__, LOG_INFO, "Total keys matched: %" PRIu64, match_cnt);
   logv(__LOG_ARGS__, LOG_INFO,
-       "Query key selectivity: %.2f%%, SST selectivity: %.2f%%",
-       qsel_key * 100, qsel_sst * 100);
+       "Query key selectivity: %.2f%% (est. %.2f%%), SST selectivity: %.2f%%",
+       qsel_key * 100, pq->est_mass * 100 / match_obj.DataSize(),
+       qsel_sst * 100);
+
+  FileCacheStats fcs;
+  fdcache_.GetStats(fcs);
+  logv(__LOG_ARGS__, LOG_INFO,
+       "File cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+       " evictions, %zu open",
+       fcs.hits, fcs.misses, fcs.evictions, fcs.open);
 
   logv(__LOG_ARGS__, LOG_INFO, "---------");
   logv(__LOG_ARGS__, LOG_INFO, "Query computed. Reporting performance stats.");
 
   logger_.PrintStats();
-  logger_.LogQuery(dir_path_.c_str(), epoch, rbegin, rend, qsel_sst, qsel_key);
-  task_tracker_.AnalyzeTimes();
+  logger_.LogQuery(dir_path_.c_str(), q.epoch, rbegin, rend, qsel_sst,
+                   qsel_key);
+  pq->tracker.AnalyzeTimes();
+
+  return s;
+}
+
+template < typename T >
+Status RangeReader< T >::ProjectedExtent(uint64_t val_sz, uint64_t& off,
+                                         uint64_t& width) {
+  off = width = 0;
+
+  if (options_.projection == kProjectRecords) {
+    width = val_sz;
+  } else if (options_.projection == kProjectValueRange) {
+    if (options_.value_off >= val_sz) {
+      return Status::InvalidArgument("Projected bytes past end of value");
+    }
+    off = options_.value_off;
+    width = val_sz - off;
+    if (options_.value_len > 0 and options_.value_len < width) {
+      width = options_.value_len;
+    }
+  }
+
+  return Status::OK();
+}
+
+template < typename T >
+void RangeReader< T >::SortResults(std::vector< KeyPair >& kps) {
+  if (options_.radix_sort) {
+    sorter_.Sort(kps);
+  } else {
+    carp_sort(kps.begin(), kps.end(), KeyPairComparator());
+  }
+}
+
+template < typename T >
+void RangeReader< T >::SortResults(std::vector< CompactKeyPair >& kps) {
+  if (options_.radix_sort) {
+    sorter_.Sort(kps);
+  } else {
+    carp_sort(kps.begin(), kps.end(), KeyPairComparator());
+  }
+}
+
+template < typename T >
+void RangeReader< T >::SortResults(std::vector< CompactKeyPair >& kps,
+                                   const std::vector< KeyRun >& runs) {
+  size_t sorted_mass = 0;
+  for (size_t i = 0; i < runs.size(); i++) {
+    if (runs[i].sorted) sorted_mass += runs[i].end - runs[i].beg;
+  }
+
+  /* runs that overlap no other are only copied, which beats the radix
+   * sort at any size. A heap merge costs O(log k) an entry, and beats it
+   * only on large results, which spill its scratch out of cache. */
+  bool merge = options_.merge_runs and runs.size() >= 2 and
+               2 * sorted_mass >= kps.size();
+  if (merge and options_.radix_sort and
+      kps.size() < RunMerger::kMinRadixMerge) {
+    merge = 2 * RunMerger::OverlapMass(kps, runs) <= kps.size();
+  }
+
+  if (merge) {
+    merger_.Merge(kps, runs);
+  } else {
+    SortResults(kps);
+  }
+}
+
+template < typename T >
+Status RangeReader< T >::ReadValues(
+    const std::vector< CompactKeyPair >& kps, uint64_t off, uint64_t width,
+    char* out, size_t stride) {
+  if (kps.empty() or width == 0) return Status::OK();
+
+  /* by loc, which is by rank, then offset, so that each task reads a run
+   * of neighbouring values that ReadBatch can coalesce */
+  std::vector< uint32_t > order(kps.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  carp_sort(order.begin(), order.end(), KeyPairLocationOrder(kps));
+
+  std::vector< ValueReadWorkItem< T > > work_items;
+  for (size_t beg = 0, end = 0; beg < order.size(); beg = end) {
+    int rank = locator_.Locate(kps[order[beg]]).rank;
+    if (rank < 0 or rank >= num_ranks_) {
+      return Status::Corruption("Key pair of unknown rank");
+    }
+    while (end < order.size() and end - beg < kValuesPerTask and
+           locator_.Locate(kps[order[end]]).rank == rank) {
+      end++;
+    }
+
+    ValueReadWorkItem< T > wi;
+    wi.rank = rank;
+    wi.kps = &kps[0];
+    wi.locator = &locator_;
+    wi.idx = &order[beg];
+    wi.count = end - beg;
+    wi.off = off;
+    wi.width = width;
+    wi.out = out;
+    wi.stride = stride;
+    wi.fdcache = &fdcache_;
+    work_items.push_back(wi);
+  }
+
+  port::Mutex mutex;
+  port::CondVar cv(&mutex);
+  int tasks_pending = work_items.size();
+
+  for (size_t i = 0; i < work_items.size(); i++) {
+    work_items[i].mutex = &mutex;
+    work_items[i].cv = &cv;
+    work_items[i].tasks_pending = &tasks_pending;
+    finish_pool_->Schedule(QueryUtils::ValueReadWorker< T >, &work_items[i]);
+  }
+
+  mutex.Lock();
+  while (tasks_pending > 0) cv.Wait();
+  mutex.Unlock();
+
+  for (size_t i = 0; i < work_items.size(); i++) {
+    if (!work_items[i].s.ok()) return work_items[i].s;
+  }
+
+  return Status::OK();
+}
+
+template < typename T >
+Status RangeReader< T >::Materialize(
+    const std::vector< CompactKeyPair >& kps, std::string& records,
+    uint64_t& record_sz) {
+  uint64_t off = 0, width = val_sz_;
+  Status s = Status::OK();
+  if (options_.projection != kProjectKeys) {
+    s = ProjectedExtent(val_sz_, off, width);
+    if (!s.ok()) return s;
+  }
+
+  record_sz = key_sz_ + width;
+  records.assign(kps.size() * record_sz, 0);
+  if (kps.empty()) return s;
+
+  for (size_t i = 0; i < kps.size(); i++) {
+    EncodeFloat32(&records[i * record_sz], kps[i].key);
+  }
+
+  return ReadValues(kps, off, width, &records[key_sz_], record_sz);
+}
+
+template < typename T >
+Status RangeReader< T >::QueryAggregate(const Query& q, bool with_sum,
+                                        bool approx, AggregateResult& res) {
+  logv(__LOG_ARGS__, LOG_INFO, "---------");
+  logv(__LOG_ARGS__, LOG_INFO,
+       "Processing %s %s query. Epoch: %d, (%.2f - %.2f)",
+       approx ? "approximate" : "exact", with_sum ? "SUM" : "COUNT", q.epoch,
+       q.range.range_min, q.range.range_max);
+
+  logger_.RegisterBegin(kPerfEventSstRead);
+
+  PartitionManifest* mf;
+  Status s = GetManifest(q.epoch, mf);
+  if (!s.ok()) return s;
+
+  const float rbegin = q.range.range_min;
+  const float rend = q.range.range_max;
+
+  PartitionManifestMatch match_obj;
+  mf->GetOverlappingEntries(q, match_obj);
+
+  res = AggregateResult();
+
+  if (approx) {
+    QueryUtils::EstimateAggregate(match_obj, rbegin, rend, res);
+  } else {
+    /* SUM needs every key; COUNT only the keys of straddling SSTs */
+    std::vector< const PartitionManifestItem* > to_read;
+    for (size_t i = 0; i < match_obj.Size(); i++) {
+      const PartitionManifestItem& item = match_obj[i];
+      if (!with_sum and QueryUtils::Contains(item, rbegin, rend)) {
+        res.count += item.part_item_count;
+      } else {
+        to_read.push_back(&item);
+      }
+    }
+
+    res.ssts_matched = match_obj.Size();
+    s = AggregateSSTs(mf, to_read, rbegin, rend, res);
+  }
+
+  logger_.RegisterEnd(kPerfEventSstRead);
+  if (!s.ok()) return s;
+
+  logv(__LOG_ARGS__, LOG_INFO,
+       "Aggregate Results: COUNT %" PRIu64 " (+/- %.0f), SST reads: %" PRIu64
+       "/%" PRIu64,
+       res.count, res.count_err, res.ssts_read, res.ssts_matched);
+  if (with_sum) {
+    logv(__LOG_ARGS__, LOG_INFO, "Aggregate Results: SUM %.6e (+/- %.3e)",
+         res.sum, res.sum_err);
+  }
+
+  logger_.PrintSingleStat(kPerfEventSstRead);
+
+  return s;
+}
+
+template < typename T >
+Status RangeReader< T >::AggregateSSTs(
+    PartitionManifest* mf, std::vector< const PartitionManifestItem* >& items,
+    float rbegin, float rend, AggregateResult& res) {
+  uint64_t key_sz = 0, val_sz = 0;
+  mf->GetKVSizes(key_sz, val_sz);
+
+  std::vector< SSTAggregateWorkItem< T > > work_items;
+  work_items.resize(items.size());
+  task_tracker_.Reset();
+
+  for (size_t i = 0; i < items.size(); i++) {
+    SSTAggregateWorkItem< T >& wi = work_items[i];
+    wi.item = items[i];
+    wi.key_sz = key_sz;
+    wi.rbegin = rbegin;
+    wi.rend = rend;
+    wi.count = 0;
+    wi.sum = 0;
+    wi.fdcache = &fdcache_;
+    wi.task_tracker = &task_tracker_;
+
+    fdcache_.Advise(items[i]->rank, items[i]->offset,
+                    key_sz * items[i]->part_item_count, kAdviseWillNeed);
+
+    thpool_->Schedule(QueryUtils::SSTAggregateWorker< T >, (void*)&wi);
+  }
+
+  task_tracker_.WaitUntilCompleted(work_items.size());
+
+  Status s = Status::OK();
+  for (size_t i = 0; i < work_items.size(); i++) {
+    if (s.ok()) s = work_items[i].s;
+    res.count += work_items[i].count;
+    res.sum += work_items[i].sum;
+  }
+
+  res.ssts_read = items.size();
 
   return s;
 }
@@ -209,15 +784,19 @@ template < typename T >
 Status RangeReader< T >::QuerySequential(int epoch, float rbegin, float rend) {
   logger_.RegisterBegin(kPerfEventSstRead);
 
+  PartitionManifest* mf;
+  Status s = GetManifest(epoch, mf);
+  if (!s.ok()) return s;
+
   PartitionManifestMatch match_obj;
-  manifest_.GetOverlappingEntries(epoch, rbegin, rend, match_obj);
+  mf->GetOverlappingEntries(epoch, rbegin, rend, match_obj);
   logv(__LOG_ARGS__, LOG_INFO, "Query Match: %llu SSTs found (%llu items)",
        match_obj.Size(), match_obj.TotalMass());
 
   Slice slice;
   std::string scratch;
   for (uint32_t i = 0; i < match_obj.Size(); i++) {
-    PartitionManifestItem& item = match_obj[i];
+    const PartitionManifestItem& item = match_obj[i];
     // logf(__LOG_ARGS__, LOG_DBUG, "Item Rank: %d, Offset: %llu\n", item.rank,
     // item.offset);
     ReadBlock(item.rank, item.offset, item.part_item_count * 60, slice,
@@ -227,15 +806,12 @@ Status RangeReader< T >::QuerySequential(int epoch, float rbegin, float rend) {
   logger_.RegisterEnd(kPerfEventSstRead);
 
   logger_.RegisterBegin(kPerfEventSstMergeSort);
-  carp_sort(query_results_.begin(), query_results_.end(), KeyPairComparator());
-#ifdef CARP_PARALLEL_SORT
-  oneapi::tbb::parallel_sort(query_results_.begin(), query_results_.end(),
-                             KeyPairComparator());
-#else
-  std::sort(query_results_.begin(), query_results_.end(), KeyPairComparator());
-#endif
+  SortResults(query_results_);
   logger_.RegisterEnd(kPerfEventSstMergeSort);
 
+  /* ReadBlock keeps no value locations */
+  locator_.Clear();
+
   logv(__LOG_ARGS__, LOG_INFO, "Query Results: %zu elements found\n",
        query_results_.size());
 
@@ -289,26 +865,109 @@ void RangeReader< T >::ManifestReadWorker(void* arg) {
 
   ParsedFooter pf;
 
+  /* ranks need not be contiguous */
+  if (!item->fdcache->HasRank(item->rank)) {
+    item->task_tracker->MarkCompleted(0);
+    return;
+  }
+
+  Status s = Status::OK();
+
+  if (item->from_cache) {
+    s = item->mfcache->GetManifest(item->rank, pf.manifest_data,
+                                   pf.num_epochs);
+    if (s.ok()) {
+      if (item->lazy) {
+        /* the cache mapping outlives lazy's use of it */
+        item->lazy->AddRank(item->rank, pf.manifest_data, /* copy */ false);
+      } else {
+        item->manifest_reader->ReadManifest(item->rank, pf.manifest_data,
+                                            pf.manifest_data.size());
+      }
+      item->task_tracker->MarkCompleted(0);
+      return;
+    }
+
+    /* the rdb file itself still has the manifest */
+    logv(__LOG_ARGS__, LOG_WARN, "Rank %d: %s, reading its footer",
+         item->rank, s.ToString().c_str());
+  }
+
   //  item->fdcache->GetFileHandle(item->rank, &src, &src_sz);
   //  RangeReader::ReadFooter(src, src_sz, pf);
-  item->fdcache->ReadFooter(item->rank, pf);
-  item->manifest_reader->UpdateKVSizes(pf.key_sz, pf.val_sz);
-  item->manifest_reader->ReadManifest(item->rank, pf.manifest_data,
-                                      pf.manifest_sz);
+  s = item->fdcache->ReadFooter(item->rank, pf);
+  if (!s.ok()) {
+    logv(__LOG_ARGS__, LOG_ERRO, "Rank %d: %s", item->rank,
+         s.ToString().c_str());
+    item->task_tracker->MarkCompleted(0);
+    return;
+  }
+
+  /* manifest_data may run past the manifest, into the footer suffix */
+  Slice manifest(pf.manifest_data.data(), pf.manifest_sz);
+
+  if (item->lazy) {
+    item->lazy->UpdateKVSizes(pf.key_sz, pf.val_sz);
+    item->lazy->AddRank(item->rank, manifest);
+  } else {
+    item->manifest_reader->UpdateKVSizes(pf.key_sz, pf.val_sz);
+    item->manifest_reader->ReadManifest(item->rank, pf.manifest_data,
+                                        pf.manifest_sz);
+  }
+
+  /* a cache that was loaded is not written again */
+  if (item->mfcache and !item->from_cache) {
+    item->mfcache->AddRank(item->rank, manifest, pf.num_epochs);
+  }
   item->task_tracker->MarkCompleted(0);
 }
 
 template < typename T >
-Status RangeReader< T >::ReadSSTs(PartitionManifestMatch& match,
-                                  std::vector< KeyPair >& query_results) {
-  Slice slice;
-  std::string scratch;
+Status RangeReader< T >::GetManifest(int epoch, PartitionManifest*& mf) {
+  if (!lazy_on_) {
+    mf = &manifest_;
+    return Status::OK();
+  }
 
+  Status s = lazy_.GetEpoch(epoch, &mf);
+  if (!s.ok()) {
+    logv(__LOG_ARGS__, LOG_ERRO, "Epoch %d: %s", epoch, s.ToString().c_str());
+  }
+
+  return s;
+}
+
+template < typename T >
+Status RangeReader< T >::ReadSSTs(PartitionManifest* mf,
+                                  PartitionManifestMatch& match,
+                                  std::vector< KeyPair >& query_results,
+                                  ReadMode mode) {
   std::vector< SSTReadWorkItem< T > > work_items;
-  work_items.resize(match.Size());
-  query_results.resize(match.TotalMass());
   task_tracker_.Reset();
 
+  Status s = StartReadSSTs(mf, match, &query_results, work_items,
+                           &task_tracker_, mode);
+
+  task_tracker_.WaitUntilCompleted(work_items.size());
+
+  for (size_t i = 0; s.ok() and i < work_items.size(); i++) {
+    s = work_items[i].s;
+  }
+
+  return s;
+}
+
+template < typename T >
+Status RangeReader< T >::StartReadSSTs(
+    PartitionManifest* mf, PartitionManifestMatch& match,
+    std::vector< KeyPair >* query_results,
+    std::vector< SSTReadWorkItem< T > >& work_items,
+    TaskCompletionTracker* tracker, ReadMode mode, const Range* pushdown,
+    const ResultLocator* locator) {
+  work_items.resize(match.Size());
+  /* with pushdown, regions are only allocated for the keys that match */
+  if (!pushdown) query_results->resize(match.TotalMass());
+
   uint64_t mass_sum = 0;
   uint64_t key_sz, val_sz;
   match.GetKVSizes(key_sz, val_sz);
@@ -321,32 +980,133 @@ Status RangeReader< T >::ReadSSTs(PartitionManifestMatch& match,
          ranks[0], ranks[ranks.size() - 1]);
   }
 
+  const bool batched = fdcache_.AsyncReadsEnabled() and mode == kReadCached;
+
   for (uint32_t i = 0; i < match.Size(); i++) {
-    PartitionManifestItem& item = match[i];
+    const PartitionManifestItem& item = match[i];
     work_items[i].item = &item;
     work_items[i].key_sz = key_sz;
     work_items[i].val_sz = val_sz;
 
-    work_items[i].query_results = &query_results;
+    work_items[i].query_results = query_results;
     work_items[i].qrvec_offset = mass_sum;
     mass_sum += item.part_item_count;
 
     work_items[i].fdcache = &fdcache_;
-    work_items[i].task_tracker = &task_tracker_;
+    work_items[i].task_tracker = tracker;
+    work_items[i].manifest = mf;
+    work_items[i].req = NULL;
+    work_items[i].mode = mode;
+    work_items[i].pushdown = pushdown != NULL;
+    work_items[i].sorted = false;
+    if (pushdown) {
+      work_items[i].rbegin = pushdown->range_min;
+      work_items[i].rend = pushdown->range_max;
+      work_items[i].loc_base = locator->Base(i);
+    }
 
-    thpool_->Schedule(QueryUtils::SSTReadWorker< T >, (void*)&work_items[i]);
+    /* start faulting in key blocks ahead of the workers (mmap only) */
+    fdcache_.Advise(item.rank, item.offset, key_sz * item.part_item_count,
+                    kAdviseWillNeed);
+
+    if (!batched) {
+      thpool_->Schedule(QueryUtils::SSTReadWorker< T >,
+                        (void*)&work_items[i]);
+    }
   }
 
   assert(mass_sum == match.TotalMass());
 
-  task_tracker_.WaitUntilCompleted(work_items.size());
+  Status s = Status::OK();
+  if (batched) {
+    s = BatchReadSSTs(work_items, tracker);
+  }
+
+  return s;
+}
+
+template < typename T >
+Status RangeReader< T >::GatherMatches(
+    std::vector< SSTReadWorkItem< T > >& work_items, ResultLocator& locator,
+    std::vector< CompactKeyPair >& query_results,
+    std::vector< KeyRun >& runs) {
+  size_t total = 0;
+  for (size_t i = 0; i < work_items.size(); i++) {
+    if (!work_items[i].s.ok()) return work_items[i].s;
+    total += work_items[i].matches.size();
+  }
+
+  if (locator.Sparse()) {
+    std::vector< std::vector< CompactKeyPair >* > matches(work_items.size());
+    for (size_t i = 0; i < work_items.size(); i++) {
+      matches[i] = &work_items[i].matches;
+    }
+    Status s = locator.Compact(matches);
+    if (!s.ok()) return s;
+  }
+
+  query_results.resize(total);
+
+  /* each item's region starts at the sum of the sizes before it */
+  size_t off = 0;
+  for (size_t i = 0; i < work_items.size(); i++) {
+    std::vector< CompactKeyPair >& matches = work_items[i].matches;
+    std::copy(matches.begin(), matches.end(), query_results.begin() + off);
+    if (!matches.empty()) {
+      KeyRun run;
+      run.beg = off;
+      run.end = off + matches.size();
+      run.sorted = work_items[i].sorted;
+      runs.push_back(run);
+    }
+    off += matches.size();
+    std::vector< CompactKeyPair >().swap(matches);
+  }
 
   return Status::OK();
 }
 
+template < typename T >
+Status RangeReader< T >::BatchReadSSTs(
+    std::vector< SSTReadWorkItem< T > >& work_items,
+    TaskCompletionTracker* tracker) {
+  const size_t n = work_items.size();
+  std::vector< int > ranks(n);
+  std::vector< ReadRequest > reqs(n);
+  std::vector< std::string > scratch(n);
+
+  pid_t tid = gettid();
+
+  /* only key blocks are read, as in SSTReadWorker */
+  for (size_t i = 0; i < n; i++) {
+    SSTReadWorkItem< T >& wi = work_items[i];
+    ranks[i] = wi.item->rank;
+    reqs[i].offset = wi.item->offset;
+    reqs[i].bytes = wi.key_sz * wi.item->part_item_count;
+    scratch[i].resize(reqs[i].bytes);
+    reqs[i].scratch = &scratch[i][0];
+
+    wi.req = &reqs[i];
+    wi.req_id = tracker->MarkBegin(tid);
+  }
+
+  SSTReadBatch< T > batch;
+  batch.work_items = &work_items;
+  batch.pool = thpool_;
+
+  Status s = fdcache_.ReadBatchAsync(ranks, reqs,
+                                     QueryUtils::SSTReadCompleted< T >, &batch);
+
+  /* decodes still reference reqs and scratch */
+  tracker->WaitUntilCompleted(n);
+
+  return s;
+}
+
 template < typename T >
 Status RangeReader< T >::RankwiseReadSSTs(
-    PartitionManifestMatch& match, std::vector< KeyPair >& query_results) {
+    PartitionManifest* mf, PartitionManifestMatch& match,
+    std::vector< KeyPair >& query_results) {
   Slice slice;
   std::string scratch;
 
@@ -378,6 +1138,7 @@ Status RangeReader< T >::RankwiseReadSSTs(
 
     work_items[i].fdcache = &fdcache_;
     work_items[i].task_tracker = &task_tracker_;
+    work_items[i].manifest = mf;
 
     thpool_->Schedule(QueryUtils::RankwiseSSTReadWorker< T >,
                       (void*)&work_items[i]);
@@ -414,8 +1175,9 @@ void RangeReader< T >::ReadBlock(int rank, uint64_t offset, uint64_t size,
 
   uint64_t block_offset = 0;
   while (block_offset < size) {
-    KeyPair kp;
+    CompactKeyPair kp;
     kp.key = DecodeFloat32(&slice[block_offset]);
+    kp.loc = 0;
     // XXX: val?
     query_results_.push_back(kp);
 
@@ -425,5 +1187,6 @@ void RangeReader< T >::ReadBlock(int rank, uint64_t offset, uint64_t size,
 
 template class RangeReader< SequentialFile >;
 template class RangeReader< RandomAccessFile >;
+template class RangeReader< MappedFile >;
 }  // namespace plfsio
 }  // namespace pdlfs
@@ -10,8 +10,12 @@
 #include "carp/manifest.h"
 #include "common.h"
 #include "file_cache.h"
+#include "lazy_manifest.h"
+#include "manifest_cache.h"
 #include "manifest_reader.h"
 #include "perf.h"
+#include "radix_sort.h"
+#include "run_merger.h"
 #include "task_completion_tracker.h"
 
 #include "pdlfs-common/env.h"
@@ -26,17 +30,86 @@ struct KeyPair {
   size_t offset;
 };
 
+/* CompactKeyPair: a query result in half the size of a KeyPair. Its value
+ * is located through loc, a number given to each key of the SSTs the query
+ * matched (see ResultLocator). */
+struct CompactKeyPair {
+  float key;
+  uint32_t loc;
+};
+
+/* ResultLocator: numbers the keys of the SSTs of a match, SST by SST in
+ * rank and offset order, so that loc order is also the order of the values
+ * on disk, and maps each loc back to the rank and offset of its value.
+ *
+ * If the SSTs have 2^32 keys or more, locs would not fit in 32 bits. Only
+ * the keys that match are numbered then: they are first numbered by their
+ * place in their SST (Base is 0), and renumbered by Compact once all
+ * matches are known, which keeps where each is in its SST aside. */
+class ResultLocator {
+ public:
+  ResultLocator() : val_sz_(0), sparse_(false) {}
+
+  Status Reset(const PartitionManifestMatch& match);
+
+  void Clear();
+
+  /* loc of the first key of match[i] */
+  uint32_t Base(size_t i) const { return item_base_[i]; }
+
+  /* set if locs are only given to matching keys, by Compact */
+  bool Sparse() const { return sparse_; }
+
+  /* Renumbers *matches[i], the matches of match[i] as numbered from 0 by
+   * their place in the SST, into locs of the same order. Fails if 2^32
+   * keys match or more. Only used if Sparse(). */
+  Status Compact(const std::vector<std::vector<CompactKeyPair>*>& matches);
+
+  KeyPair Locate(const CompactKeyPair& kp) const;
+
+ private:
+  struct SST {
+    uint32_t base;
+    int rank;
+    uint64_t valblk_off;
+    /* position in the match */
+    uint32_t item;
+  };
+
+  struct BaseOrder {
+    bool operator()(uint32_t loc, const SST& sst) const {
+      return loc < sst.base;
+    }
+  };
+
+  /* in loc order */
+  std::vector<SST> ssts_;
+  /* by position in the match */
+  std::vector<uint32_t> item_base_;
+  uint64_t val_sz_;
+  bool sparse_;
+  /* if sparse_, the place in its SST of the key of each loc */
+  std::vector<uint32_t> sst_idx_;
+};
+
 template <typename T>
 struct ManifestReadWorkItem {
   int rank;
   CachingDirReader<T>* fdcache;
   TaskCompletionTracker* task_tracker;
   PartitionManifestReader* manifest_reader;
+  /* read the manifest from mfcache if from_cache is set, otherwise read
+   * the footer and add it to mfcache (if not NULL) */
+  ManifestCache* mfcache;
+  bool from_cache;
+  /* if set, the manifest is only indexed by epoch here, and decoded on
+   * first use of an epoch (see LazyManifest) */
+  LazyManifest* lazy;
 };
 
 template <typename T>
 struct SSTReadWorkItem {
-  PartitionManifestItem* item;
+  const PartitionManifestItem* item;
   size_t key_sz;
   size_t val_sz;
 
@@ -45,11 +118,69 @@ struct SSTReadWorkItem {
 
   CachingDirReader<T>* fdcache;
   TaskCompletionTracker* task_tracker;
+  /* if set, receives key samples of the SSTs read (see AddKeySamples) */
+  PartitionManifest* manifest;
+
+  /* set if the key block was already read as part of a batch, in which
+   * case only SSTDecodeWorker is run for this item */
+  ReadRequest* req;
+  int req_id;
+
+  ReadMode mode;
+
+  /* out: set if the key block could not be read in full */
+  Status s;
+
+  /* if set, only the keys in [rbegin, rend] are decoded, into matches
+   * rather than into query_results (see RangeReader::GatherMatches), the
+   * first key of item being loc_base. sorted is set if matches are in key
+   * order. */
+  bool pushdown;
+  float rbegin;
+  float rend;
+  uint32_t loc_base;
+  std::vector<CompactKeyPair> matches;
+  bool sorted;
 };
 
+/* SSTReadBatch: passed to the completion callback of a batch of SST reads
+ * (see ReadBatchAsync), which hands each read SST to the pool for decoding
+ */
+template <typename T>
+struct SSTReadBatch {
+  std::vector<SSTReadWorkItem<T> >* work_items;
+  ThreadPool* pool;
+};
+
+/* PendingQuery: a query of a batch, planned, and with the key blocks of
+ * its SSTs being read on the pool ahead of its turn (see QueryParallel) */
+template <typename T>
+struct PendingQuery {
+  PendingQuery(const Query& query, Env* env)
+      : q(query), qidx(0), mf(NULL), est_mass(0), footprint(0), tracker(env) {}
+
+  Query q;
+  /* index of q in its batch */
+  size_t qidx;
+  PartitionManifest* mf;
+  PartitionManifestMatch match;
+  double est_mass;
+  /* bytes held from the start of its reads until it is finished */
+  uint64_t footprint;
+
+  std::vector<CompactKeyPair> results;
+  ResultLocator locator;
+  std::vector<SSTReadWorkItem<T> > work_items;
+  TaskCompletionTracker tracker;
+};
+
+/* called once for each query of a batch as it is finished, with its
+ * index in the batch (see RangeReader::QueryParallel) */
+typedef void (*QueryDoneCallback)(void* arg, size_t qidx);
+
 template <typename T>
 struct RankwiseSSTReadWorkItem {
-  std::vector<PartitionManifestItem> wi_vec;
+  std::vector<const PartitionManifestItem*> wi_vec;
   int rank;
   size_t key_sz;
   size_t val_sz;
@@ -57,28 +188,115 @@ struct RankwiseSSTReadWorkItem {
   std::vector<KeyPair>* query_results;
   uint64_t qrvec_offset;
 
+  CachingDirReader<T>* fdcache;
+  TaskCompletionTracker* task_tracker;
+  /* if set, receives key samples of the SSTs read (see AddKeySamples) */
+  PartitionManifest* manifest;
+};
+
+/* ValueReadWorkItem: a run of values of one rank, in offset order, read
+ * as one batch (see RangeReader::ReadValues) */
+template <typename T>
+struct ValueReadWorkItem {
+  int rank;
+  const CompactKeyPair* kps;
+  const ResultLocator* locator;
+  /* the values of kps[idx[0]] ... kps[idx[count - 1]] */
+  const uint32_t* idx;
+  size_t count;
+
+  /* bytes [off, off + width) of the value of kps[i] go to out + i * stride */
+  uint64_t off;
+  uint64_t width;
+  char* out;
+  size_t stride;
+
+  Status s;
+  CachingDirReader<T>* fdcache;
+
+  port::Mutex* mutex;
+  port::CondVar* cv;
+  int* tasks_pending;
+};
+
+/* AggregateResult: COUNT/SUM of the keys of a query range. Exact results
+ * have zero error; approximate ones are guaranteed to be within count_err
+ * and sum_err of the exact values. */
+struct AggregateResult {
+  uint64_t count;
+  double sum;
+  double count_err;
+  double sum_err;
+
+  uint64_t ssts_matched;
+  uint64_t ssts_read;
+
+  AggregateResult()
+      : count(0),
+        sum(0),
+        count_err(0),
+        sum_err(0),
+        ssts_matched(0),
+        ssts_read(0) {}
+};
+
+template <typename T>
+struct SSTAggregateWorkItem {
+  const PartitionManifestItem* item;
+  size_t key_sz;
+  float rbegin;
+  float rend;
+
+  /* out: aggregates of the keys of item in [rbegin, rend] */
+  uint64_t count;
+  double sum;
+  Status s;
+
   CachingDirReader<T>* fdcache;
   TaskCompletionTracker* task_tracker;
 };
 
+/* orders KeyPairs and CompactKeyPairs alike */
 struct KeyPairComparator {
-  inline bool operator()(const KeyPair& lhs, const KeyPair& rhs) const {
+  template <typename K>
+  inline bool operator()(const K& lhs, const K& rhs) const {
     return lhs.key < rhs.key;
   }
 };
 
+/* orders indexes into kps by where the values of the key pairs are */
+struct KeyPairLocationOrder {
+  explicit KeyPairLocationOrder(const std::vector<CompactKeyPair>& v)
+      : kps(v) {}
+
+  inline bool operator()(uint32_t a, uint32_t b) const {
+    return kps[a].loc < kps[b].loc;
+  }
+
+  const std::vector<CompactKeyPair>& kps;
+};
+
 template <typename T>
 class RangeReader {
  public:
   RangeReader(const RdbOptions& options)
       : options_(options),
         dir_path_(""),
-        fdcache_(options.env),
+        fdcache_(options.env, options.max_open_files),
         manifest_reader_(manifest_),
+        mfcache_(options.env),
         num_ranks_(0),
+        key_sz_(0),
+        val_sz_(0),
+        lazy_on_(false),
+        thpool_(ThreadPool::NewFixed(options.parallelism)),
+        finish_pool_(ThreadPool::NewFixed(options.parallelism)),
         task_tracker_(options.env),
-        logger_(options.env) {
-    thpool_ = ThreadPool::NewFixed(options.parallelism);
+        logger_(options.env),
+        lazy_(thpool_, options.compact_manifest),
+        sorter_(finish_pool_, options.parallelism),
+        merger_(finish_pool_, options.parallelism) {
+    fdcache_.SetCoalescing(CoalesceOptions(options));
   }
 
   ~RangeReader() {
@@ -86,20 +304,22 @@ class RangeReader {
       delete thpool_;
       thpool_ = nullptr;
     }
+    if (finish_pool_) {
+      delete finish_pool_;
+      finish_pool_ = nullptr;
+    }
   }
 
   Status ReadManifest(const std::string& dir_path);
 
-  Status QueryParallel(std::vector<Query> qvec) {
-    Status s = Status::OK();
-
-    for (size_t i = 0; i < qvec.size(); i++) {
-      s = QueryParallel(qvec[i]);
-      if (!s.ok()) break;
-    }
-
-    return s;
-  }
+  /* Runs the queries of qvec in order, pipelined: while a query is
+   * sorted and finished, the key blocks of up to options.prefetch_depth
+   * queries after it are already being read, as long as their results
+   * fit in options.prefetch_budget. Stops at the first failed query.
+   * If cb is set, it is called as each query is finished, while
+   * Results(), Locate() and Values() are those of that query. */
+  Status QueryParallel(const std::vector<Query>& qvec,
+                       QueryDoneCallback cb = NULL, void* arg = NULL);
 
   Status QueryParallel(Query q) {
     return QueryParallel(q.rank, q.epoch, q.range.range_min, q.range.range_max);
@@ -107,6 +327,38 @@ class RangeReader {
 
   Status QueryParallel(int rank, int epoch, float rbegin, float rend);
 
+  /* keys matched by the last QueryParallel, in key order */
+  const std::vector<CompactKeyPair>& Results() const {
+    return query_results_;
+  }
+
+  /* where the value of kp, one of Results(), is */
+  KeyPair Locate(const CompactKeyPair& kp) const {
+    return locator_.Locate(kp);
+  }
+
+  /* the projected part of the value of each of Results(), in the same
+   * order, all of the same width (see RdbOptions::projection). Empty if
+   * only keys are projected. */
+  const std::string& Values() const { return query_values_; }
+
+  /* Materializes the records of kps, any of Results() of the last query,
+   * in any order: records gets, for each of kps in turn, its key
+   * followed by the projected part of its value (whole values if only
+   * keys are projected), record_sz bytes in all. Values are read on the
+   * pool, in runs of neighbouring values of a rank that ReadBatch
+   * coalesces into large reads. */
+  Status Materialize(const std::vector<CompactKeyPair>& kps,
+                     std::string& records, uint64_t& record_sz);
+
+  /* Computes COUNT (and SUM, if with_sum) of the keys in [range_min,
+   * range_max] of q, without materializing or sorting them. COUNT reads only
+   * the key blocks of SSTs straddling the query bounds, and takes the rest
+   * from the manifest. If approx is set, nothing is read and the result is
+   * estimated from the manifest, with error bounds. */
+  Status QueryAggregate(const Query& q, bool with_sum, bool approx,
+                        AggregateResult& res);
+
   Status QuerySequential(int epoch, float rbegin, float rend);
 
   Status QueryNaive(int epoch, float rbegin, float rend);
@@ -116,29 +368,109 @@ class RangeReader {
  private:
   static void ManifestReadWorker(void* arg);
 
-  /* query_results: this vector is resized according to match.GetMass()
-   * and is also overwritten to, starting from zero */
-  Status ReadSSTs(PartitionManifestMatch& match,
-                  std::vector<KeyPair>& query_results);
+  /* looks up the SSTs of pq->q */
+  Status PlanQuery(PendingQuery<T>* pq);
+
+  /* starts reading the key blocks of a planned query */
+  Status StartQuery(PendingQuery<T>* pq);
 
-  Status RankwiseReadSSTs(PartitionManifestMatch& match,
+  /* waits for the reads of a started query, then sorts and filters its
+   * results into query_results_ and reads any projected values */
+  Status FinishQuery(PendingQuery<T>* pq);
+
+  /* the manifest to query epoch in: manifest_, or the lazily decoded
+   * manifest of epoch */
+  Status GetManifest(int epoch, PartitionManifest*& mf);
+
+  /* query_results: this vector is resized according to match.GetMass()
+   * and is also overwritten to, starting from zero. Direct reads are
+   * never batched on the io_uring. Returns the error of the first SST
+   * that could not be read. */
+  Status ReadSSTs(PartitionManifest* mf, PartitionManifestMatch& match,
+                  std::vector<KeyPair>& query_results,
+                  ReadMode mode = kReadCached);
+
+  /* ReadSSTs without the wait: work_items is set up to read match, and
+   * is scheduled on the pool, reporting to tracker. Returns once all of
+   * them are scheduled, or, if batched on the io_uring, completed. If
+   * pushdown is set, workers keep only the keys within it, numbered by
+   * locator, and query_results is not used. */
+  Status StartReadSSTs(PartitionManifest* mf, PartitionManifestMatch& match,
+                       std::vector<KeyPair>* query_results,
+                       std::vector<SSTReadWorkItem<T> >& work_items,
+                       TaskCompletionTracker* tracker, ReadMode mode,
+                       const Range* pushdown = NULL,
+                       const ResultLocator* locator = NULL);
+
+  /* With pushdown, the matches of each work item are gathered into
+   * query_results here, in SST order, each making one of runs, after
+   * locator numbers them if it is sparse. Returns the error of the first
+   * work item that failed, if any. */
+  static Status GatherMatches(std::vector<SSTReadWorkItem<T> >& work_items,
+                              ResultLocator& locator,
+                              std::vector<CompactKeyPair>& query_results,
+                              std::vector<KeyRun>& runs);
+
+  /* reads the key blocks of work_items as one batch, decoding each on the
+   * pool as soon as it has been read */
+  Status BatchReadSSTs(std::vector<SSTReadWorkItem<T> >& work_items,
+                       TaskCompletionTracker* tracker);
+
+  Status AggregateSSTs(PartitionManifest* mf,
+                       std::vector<const PartitionManifestItem*>& items,
+                       float rbegin, float rend, AggregateResult& res);
+
+  Status RankwiseReadSSTs(PartitionManifest* mf, PartitionManifestMatch& match,
                           std::vector<KeyPair>& query_results);
 
   void ReadBlock(int rank, uint64_t offset, uint64_t size, Slice& slice,
                  std::string& scratch, bool preview = true);
 
+  /* the part [off, off + width) of a val_sz-byte value that is projected */
+  Status ProjectedExtent(uint64_t val_sz, uint64_t& off, uint64_t& width);
+
+  /* Reads bytes [off, off + width) of the value of each kps[i] to
+   * out + i * stride, in parallel on finish_pool_. kps are of the last
+   * query, located by locator_. */
+  Status ReadValues(const std::vector<CompactKeyPair>& kps, uint64_t off,
+                    uint64_t width, char* out, size_t stride);
+
+  /* sorts kps by key, per options.radix_sort */
+  void SortResults(std::vector<KeyPair>& kps);
+  void SortResults(std::vector<CompactKeyPair>& kps);
+  /* the same, but merging runs instead if options.merge_runs is set and
+   * that is likely faster */
+  void SortResults(std::vector<CompactKeyPair>& kps,
+                   const std::vector<KeyRun>& runs);
+
+  /* values read by one ValueReadWorkItem, at most */
+  static const size_t kValuesPerTask = 16384;
+
   const RdbOptions& options_;
   std::string dir_path_;
   CachingDirReader<T> fdcache_;
   PartitionManifest manifest_;
   PartitionManifestReader manifest_reader_;
+  ManifestCache mfcache_;
   int num_ranks_;
-  std::vector<KeyPair> query_results_;
+  uint64_t key_sz_;
+  uint64_t val_sz_;
+  bool lazy_on_;
+  std::vector<CompactKeyPair> query_results_;
+  ResultLocator locator_;
+  std::string query_values_;
 
   ThreadPool* thpool_;
+  /* sorts, merges and value reads of the query being finished, which
+   * would otherwise queue behind the prefetched reads on thpool_ */
+  ThreadPool* finish_pool_;
   TaskCompletionTracker task_tracker_;
 
   RangeReaderPerfLogger logger_;
+  /* used instead of manifest_ if options.lazy_manifest is set */
+  LazyManifest lazy_;
+  RadixSorter sorter_;
+  RunMerger merger_;
 };
 }  // namespace plfsio
 }  // namespace pdlfs
@@ -3,7 +3,17 @@
 //
 
 #include "compactor.h"
+#include "direct_io.h"
+#include "lazy_manifest.h"
+#include "manifest_cache.h"
 #include "optimizer.h"
+#include "query_utils.h"
+#include "radix_sort.h"
+#include "run_merger.h"
+#include "simd_filter.h"
+#include "uring_reader.h"
+
+#include "carp/coding_float.h"
 
 #include "pdlfs-common/testharness.h"
 #include "pdlfs-common/testutil.h"
@@ -13,6 +23,187 @@ namespace plfsio {
 class ReaderTest {
  public:
   void Hello() { printf("hello world!\n"); }
+
+  /* encodes one epoch of a rank's footer, in the RDB manifest format */
+  static void EncodeEpoch(std::string& footer, int epoch, int num_items,
+                          uint64_t& offset) {
+    std::string items;
+    for (int i = 0; i < num_items; i++) {
+      float rmin = (rand() % 1000) / 100.0f;
+      float rmax = rmin + (rand() % 100) / 100.0f;
+      uint32_t count = 100 + rand() % 100;
+
+      PutFixed64(&items, i);
+      PutFixed64(&items, offset);
+      PutFloat32(&items, rmin);
+      PutFloat32(&items, rmax);
+      PutFloat32(&items, rmin);
+      PutFloat32(&items, rmax);
+      PutFixed32(&items, 1);
+      PutFixed32(&items, count);
+      PutFixed32(&items, 0);
+
+      offset += count * 64;
+    }
+
+    PutFixed32(&footer, epoch);
+    PutFixed64(&footer, items.size());
+    footer += items;
+  }
+
+  struct FileCacheReadArgs {
+    CachingDirReader< RandomAccessFile >* fdcache;
+    int num_ranks;
+    unsigned int seed;
+    int errors;
+    port::Mutex* mutex;
+    port::CondVar* cv;
+    int* pending;
+  };
+
+  /* reads random ranks through the cache, counting mismatches */
+  static void FileCacheReader(void* arg) {
+    FileCacheReadArgs* a = static_cast< FileCacheReadArgs* >(arg);
+    char scratch[16];
+
+    for (int i = 0; i < 2000; i++) {
+      int rank = rand_r(&a->seed) % a->num_ranks;
+      ReadRequest req;
+      req.offset = rand_r(&a->seed) % 48;
+      req.bytes = 16;
+      req.scratch = scratch;
+      Status s = a->fdcache->Read(rank, req, false);
+      if (!s.ok() or req.slice != Slice(std::string(16, 'a' + rank))) {
+        a->errors++;
+      }
+    }
+
+    MutexLock ml(a->mutex);
+    if (--*a->pending == 0) a->cv->SignalAll();
+  }
+
+  /* runs a ValueReadWorker for the values of kps[idx] of rank */
+  template < typename T >
+  static Status ReadValues(CachingDirReader< T >* fdcache, int rank,
+                           const std::vector< CompactKeyPair >& kps,
+                           const ResultLocator& locator,
+                           const std::vector< uint32_t >& idx, uint64_t off,
+                           uint64_t width, char* out, size_t stride) {
+    port::Mutex mutex;
+    port::CondVar cv(&mutex);
+    int pending = 1;
+
+    ValueReadWorkItem< T > wi;
+    wi.rank = rank;
+    wi.kps = &kps[0];
+    wi.locator = &locator;
+    wi.idx = &idx[0];
+    wi.count = idx.size();
+    wi.off = off;
+    wi.width = width;
+    wi.out = out;
+    wi.stride = stride;
+    wi.fdcache = fdcache;
+    wi.mutex = &mutex;
+    wi.cv = &cv;
+    wi.tasks_pending = &pending;
+
+    QueryUtils::ValueReadWorker< T >(&wi);
+    return wi.s;
+  }
+
+  /* Writes an rdb file of each of num_ranks ranks to dir, each holding
+   * ssts SSTs an epoch, and its footer. SSTs hold keys of overlapping
+   * ranges of [0, 10), unsorted, as CARP writes them, and the value of a
+   * key starts with the key. keys[epoch] gets every key of the epoch. */
+  static void WriteRdbDir(Env* env, const std::string& dir, int num_ranks,
+                          int num_epochs, int ssts, uint64_t val_sz,
+                          std::vector< std::vector< float > >& keys) {
+    env->CreateDir(dir.c_str());
+    std::vector< std::string > children;
+    env->GetChildren(dir.c_str(), &children);
+    for (size_t i = 0; i < children.size(); i++) {
+      env->DeleteFile((dir + "/" + children[i]).c_str());
+    }
+
+    keys.clear();
+    keys.resize(num_epochs);
+
+    for (int rank = 0; rank < num_ranks; rank++) {
+      std::string data, manifest;
+
+      for (int epoch = 0; epoch < num_epochs; epoch++) {
+        std::string items;
+        for (int i = 0; i < ssts; i++) {
+          float base = (rand() % 900) / 100.0f;
+          uint32_t count = 50 + rand() % 200;
+          std::string keyblk, valblk;
+          Range observed;
+
+          for (uint32_t k = 0; k < count; k++) {
+            float key = base + (rand() % 100) / 100.0f;
+            PutFloat32(&keyblk, key);
+            PutFloat32(&valblk, key);
+            valblk.append(val_sz - sizeof(float), 'a' + rank % 26);
+            observed.Extend(key);
+            keys[epoch].push_back(key);
+          }
+
+          PutFixed64(&items, i);
+          PutFixed64(&items, data.size());
+          PutFloat32(&items, observed.range_min);
+          PutFloat32(&items, observed.range_max);
+          PutFloat32(&items, observed.range_min);
+          PutFloat32(&items, observed.range_max);
+          PutFixed32(&items, 1);
+          PutFixed32(&items, count);
+          PutFixed32(&items, 0);
+
+          data += keyblk;
+          data += valblk;
+        }
+
+        PutFixed32(&manifest, epoch);
+        PutFixed64(&manifest, items.size());
+        manifest += items;
+      }
+
+      data += manifest;
+      PutFixed32(&data, num_epochs);
+      PutFixed64(&data, manifest.size());
+      PutFixed64(&data, sizeof(float));
+      PutFixed64(&data, val_sz);
+
+      char fname[64];
+      snprintf(fname, sizeof(fname), "/RDB-%08x.tbl", rank);
+      ASSERT_OK(WriteStringToFile(env, data, (dir + fname).c_str()));
+    }
+  }
+
+  /* ReadCallback: flags request idx as done if it succeeded */
+  static void MarkRead(void* arg, size_t idx, const Status& s) {
+    std::vector< int >* done = static_cast< std::vector< int >* >(arg);
+    (*done)[idx] += s.ok() ? 1 : 100;
+  }
+
+  /* what each query of a batch found */
+  struct BatchResults {
+    RangeReader< RandomAccessFile >* reader;
+    std::vector< std::vector< KeyPair > > results;
+    std::vector< std::string > values;
+  };
+
+  /* QueryDoneCallback: keeps the results of query qidx, as located */
+  static void CollectResults(void* arg, size_t qidx) {
+    BatchResults* br = static_cast< BatchResults* >(arg);
+    const std::vector< CompactKeyPair >& kps = br->reader->Results();
+    br->results.resize(std::max(br->results.size(), qidx + 1));
+    br->values.resize(br->results.size());
+    for (size_t i = 0; i < kps.size(); i++) {
+      br->results[qidx].push_back(br->reader->Locate(kps[i]));
+    }
+    br->values[qidx] = br->reader->Values();
+  }
 };
 
 TEST(ReaderTest, PlfsTest) {
@@ -74,6 +265,1673 @@ TEST(ReaderTest, OptimizeCheck) {
   ASSERT_EQ(match[3].rank, 0);
   ASSERT_EQ(match[4].rank, 0);
 }
+
+TEST(ReaderTest, MatchRankIndexCheck) {
+  PartitionManifestMatch match;
+  Range zero = {0, 0};
+  const int ranks[] = {3, 1, 3, 0, 1, 3};
+
+  for (int i = 0; i < 6; i++) {
+    uint32_t count = i + 1;
+    PartitionManifestItem item = {0, ranks[i], (uint64_t)i, zero, zero,
+                                  0, count,    0};
+    match.AddItem(item);
+  }
+
+  std::vector< int > unique_ranks;
+  match.GetUniqueRanks(unique_ranks);
+  ASSERT_EQ(unique_ranks.size(), 3);
+  ASSERT_EQ(unique_ranks[0], 0);
+  ASSERT_EQ(unique_ranks[1], 1);
+  ASSERT_EQ(unique_ranks[2], 3);
+
+  /* match order is kept within a rank */
+  std::vector< const PartitionManifestItem* > rank_items;
+  ASSERT_EQ(match.GetMatchesByRank(3, rank_items), 1 + 3 + 6);
+  ASSERT_EQ(rank_items.size(), 3);
+  ASSERT_EQ(rank_items[0]->offset, 0);
+  ASSERT_EQ(rank_items[1]->offset, 2);
+  ASSERT_EQ(rank_items[2]->offset, 5);
+
+  /* adding an item invalidates the rank index */
+  PartitionManifestItem item = {0, 2, 6, zero, zero, 0, 7, 0};
+  match.AddItem(item);
+
+  std::vector< PartitionManifestItem > rank_copies;
+  ASSERT_EQ(match.GetMatchesByRank(2, rank_copies), 7);
+  ASSERT_EQ(rank_copies.size(), 1);
+  ASSERT_EQ(match.GetMatchesByRank(4, rank_copies), 0);
+  ASSERT_EQ(match.TotalMass(), 28);
+}
+
+TEST(ReaderTest, IntervalIndexCheck) {
+  srand(301);
+
+  std::vector< Range > ranges;
+  IntervalIndex index;
+
+  for (uint32_t i = 0; i < 2000; i++) {
+    float rmin = (rand() % 10000) / 100.0f;
+    float rmax = rmin + (rand() % 300) / 100.0f;
+    if (i % 97 == 0) rmax = rmin;       // zero-width
+    if (i % 101 == 0) rmax = rmin - 1;  // inverted
+
+    Range r(rmin, rmax);
+    if (i % 103 == 0) r.Reset();  // empty
+    ranges.push_back(r);
+    index.Add(ranges.back(), i);
+  }
+
+  index.Build();
+  ASSERT_EQ(index.Size(), ranges.size());
+
+  for (int q = 0; q < 500; q++) {
+    float qmin = (rand() % 11000) / 100.0f - 5;
+    float qmax = qmin + (rand() % 500) / 100.0f;
+    if (q % 7 == 0) qmax = qmin;
+    if (q % 11 == 0) std::swap(qmin, qmax);
+
+    std::vector< uint32_t > expected, actual;
+    for (uint32_t i = 0; i < ranges.size(); i++) {
+      if (ranges[i].Overlaps(qmin, qmax)) expected.push_back(i);
+    }
+
+    index.Query(qmin, qmax, actual);
+    std::sort(actual.begin(), actual.end());
+    ASSERT_TRUE(actual == expected);
+  }
+}
+
+TEST(ReaderTest, ManifestSegmentCheck) {
+  srand(302);
+
+  const int num_ranks = 5, num_epochs = 4;
+  int expected[num_epochs][num_ranks];
+
+  PartitionManifest manifest;
+  PartitionManifestReader reader(manifest);
+  reader.UpdateKVSizes(sizeof(float), 60);
+
+  /* load ranks out of order, as parallel manifest reads would */
+  const int rank_order[num_ranks] = {3, 0, 4, 1, 2};
+  for (int ri = 0; ri < num_ranks; ri++) {
+    int rank = rank_order[ri];
+    std::string footer;
+    uint64_t offset = 0;
+
+    for (int epoch = 0; epoch < num_epochs; epoch++) {
+      /* rank 2 writes nothing in epoch 1 */
+      int num_items = (rank == 2 && epoch == 1) ? 0 : 1 + rand() % 7;
+      expected[epoch][rank] = num_items;
+      EncodeEpoch(footer, epoch, num_items, offset);
+    }
+
+    Slice footer_sl(footer);
+    ASSERT_TRUE(reader.ReadManifest(rank, footer_sl, footer.size()).ok());
+  }
+
+  reader.MergeManifests();
+  manifest.BuildIndex();
+
+  for (int epoch = 0; epoch < num_epochs; epoch++) {
+    int epoch_total = 0;
+
+    for (int rank = 0; rank < num_ranks; rank++) {
+      PartitionManifestMatch match;
+      manifest.GetAllEntries(epoch, rank, match);
+      ASSERT_EQ(match.Size(), expected[epoch][rank]);
+
+      for (size_t i = 0; i < match.Size(); i++) {
+        ASSERT_EQ(match[i].epoch, epoch);
+        ASSERT_EQ(match[i].rank, rank);
+        if (i) ASSERT_LT(match[i - 1].offset, match[i].offset);
+      }
+
+      epoch_total += expected[epoch][rank];
+    }
+
+    PartitionManifestMatch match;
+    manifest.GetAllEntries(epoch, match);
+    ASSERT_EQ(match.Size(), epoch_total);
+  }
+
+  manifest.SortByKey();
+  for (size_t i = 1; i < manifest.Size(); i++) {
+    ASSERT_FALSE(PMIRangeComparator()(manifest[i], manifest[i - 1]));
+  }
+
+  /* lookups are unaffected by the iteration order */
+  PartitionManifestMatch match;
+  manifest.GetAllEntries(2, 4, match);
+  ASSERT_EQ(match.Size(), expected[2][4]);
+
+  manifest.SortByOffset();
+  for (size_t i = 1; i < manifest.Size(); i++) {
+    ASSERT_TRUE(PMIOffsetComparator()(manifest[i - 1], manifest[i]));
+  }
+}
+
+TEST(ReaderTest, SimdFilterCheck) {
+  srand(303);
+
+  /* odd length, to exercise the scalar tail of every kernel */
+  const size_t n = 1003;
+  std::vector< float > mins(n), maxs(n);
+  std::vector< uint32_t > idx(n);
+
+  for (size_t i = 0; i < n; i++) {
+    Range r((rand() % 10000) / 100.0f, 0);
+    r.range_max = r.range_min + (rand() % 300) / 100.0f;
+    if (i % 97 == 0) r.range_max = r.range_min;
+    if (i % 101 == 0) r.range_max = r.range_min - 1;
+    if (i % 103 == 0) r.Reset();
+    mins[i] = r.range_min;
+    maxs[i] = r.range_max;
+  }
+
+  for (int q = 0; q < 200; q++) {
+    float qmin = (rand() % 11000) / 100.0f - 5;
+    float qmax = qmin + (rand() % 500) / 100.0f;
+    if (q % 7 == 0) qmax = qmin;
+    if (q % 11 == 0) std::swap(qmin, qmax);
+
+    std::vector< uint32_t > expected;
+    for (uint32_t i = 0; i < n; i++) {
+      if (Range(mins[i], maxs[i]).Overlaps(qmin, qmax)) expected.push_back(i);
+    }
+
+    for (int l = kSimdScalar; l <= SimdFilter::Level(); l++) {
+      size_t nmatch = SimdFilter::FilterOverlapping(
+          SimdLevel(l), &mins[0], &maxs[0], n, qmin, qmax, &idx[0]);
+      ASSERT_EQ(nmatch, expected.size());
+      ASSERT_TRUE(std::equal(expected.begin(), expected.end(), idx.begin()));
+    }
+  }
+}
+
+TEST(ReaderTest, SimdFilterKeysCheck) {
+  srand(304);
+
+  /* not a multiple of 16, as for SimdFilterCheck */
+  const size_t n = 2029;
+  std::string keyblk;
+  for (size_t i = 0; i < n; i++) {
+    float key = (rand() % 10000) / 100.0f;
+    if (i % 89 == 0) key = nanf("");
+    PutFloat32(&keyblk, key);
+  }
+
+  std::vector< float > keys(n);
+  std::vector< uint32_t > idx(n);
+
+  for (int q = 0; q < 100; q++) {
+    float qmin = (rand() % 11000) / 100.0f - 5;
+    float qmax = qmin + (rand() % 2000) / 100.0f;
+    if (q % 7 == 0) qmax = qmin;
+    if (q % 11 == 0) std::swap(qmin, qmax);
+
+    std::vector< uint32_t > expected;
+    for (uint32_t i = 0; i < n; i++) {
+      float key = DecodeFloat32(&keyblk[i * sizeof(float)]);
+      if (key >= qmin and key <= qmax) expected.push_back(i);
+    }
+
+    for (int l = kSimdScalar; l <= SimdFilter::Level(); l++) {
+      size_t nmatch = SimdFilter::FilterKeys(SimdLevel(l), keyblk.data(), n,
+                                             qmin, qmax, &keys[0], &idx[0]);
+      ASSERT_EQ(nmatch, expected.size());
+      for (size_t i = 0; i < nmatch; i++) {
+        ASSERT_EQ(idx[i], expected[i]);
+        ASSERT_EQ(keys[i], DecodeFloat32(&keyblk[idx[i] * sizeof(float)]));
+      }
+    }
+  }
+}
+
+TEST(ReaderTest, ManifestOverlapStatsCheck) {
+  srand(304);
+
+  PartitionManifest manifest;
+  PartitionManifestReader reader(manifest);
+  reader.UpdateKVSizes(sizeof(float), 60);
+  reader.Reset(16);
+
+  for (int rank = 0; rank < 16; rank++) {
+    std::string footer;
+    uint64_t offset = 0;
+    for (int epoch = 0; epoch < 3; epoch++) {
+      EncodeEpoch(footer, epoch, 1 + rand() % 40, offset);
+    }
+
+    Slice footer_sl(footer);
+    ASSERT_TRUE(reader.ReadManifest(rank, footer_sl, footer.size()).ok());
+  }
+
+  /* merge on a pool, as RangeReader does */
+  ThreadPool* pool = ThreadPool::NewFixed(4);
+  reader.MergeManifests(pool);
+  delete pool;
+
+  for (int epoch = 0; epoch < 3; epoch++) {
+    PartitionManifestMatch match;
+    manifest.GetAllEntries(epoch, match);
+
+    uint64_t epoch_mass;
+    ASSERT_OK(manifest.GetEpochMass(epoch, epoch_mass));
+    ASSERT_EQ(match.TotalMass(), epoch_mass);
+  }
+
+  manifest.BuildIndex();
+
+  for (int q = 0; q < 100; q++) {
+    int epoch = q % 3;
+    float qmin = (rand() % 1100) / 100.0f - 0.5f;
+    float qmax = qmin + (rand() % 100) / 100.0f;
+
+    PartitionManifestMatch match;
+    manifest.GetOverlappingEntries(epoch, qmin, qmax, match);
+
+    uint64_t mass, count;
+    manifest.GetOverlapStats(epoch, qmin, qmax, mass, count);
+    ASSERT_EQ(mass, match.TotalMass());
+    ASSERT_EQ(count, match.Size());
+  }
+}
+
+TEST(ReaderTest, ManifestCacheCheck) {
+  srand(305);
+
+  Env* env = Env::Default();
+  std::string dir = test::TmpDir() + "/carp-mfcache-test";
+  env->CreateDir(dir.c_str());
+  env->DeleteFile(ManifestCache::CacheName(dir).c_str());
+
+  const int num_ranks = 4;
+  std::vector< std::string > footers(num_ranks);
+
+  for (int rank = 0; rank < num_ranks; rank++) {
+    char fname[64];
+    snprintf(fname, sizeof(fname), "/RDB-%08x.tbl", rank);
+    ASSERT_OK(WriteStringToFile(env, std::string(100 + rank, 'x'),
+                                (dir + fname).c_str()));
+
+    uint64_t offset = 0;
+    for (int epoch = 0; epoch < 3; epoch++) {
+      EncodeEpoch(footers[rank], epoch, 1 + rand() % 10, offset);
+    }
+  }
+
+  ManifestCache cache(env);
+  ASSERT_TRUE(cache.Load(dir, num_ranks).IsNotFound());
+
+  cache.Reset(dir, num_ranks);
+  for (int rank = 0; rank < num_ranks; rank++) {
+    ASSERT_OK(cache.AddRank(rank, footers[rank], 3));
+  }
+  ASSERT_OK(cache.Write(sizeof(float), 60));
+
+  ManifestCache loaded(env);
+  ASSERT_OK(loaded.Load(dir, num_ranks));
+
+  uint64_t key_sz, val_sz;
+  loaded.GetKVSizes(key_sz, val_sz);
+  ASSERT_EQ(key_sz, sizeof(float));
+  ASSERT_EQ(val_sz, 60);
+
+  for (int rank = 0; rank < num_ranks; rank++) {
+    Slice manifest_data;
+    uint32_t num_epochs;
+    ASSERT_OK(loaded.GetManifest(rank, manifest_data, num_epochs));
+    ASSERT_EQ(num_epochs, 3);
+    ASSERT_TRUE(manifest_data == Slice(footers[rank]));
+  }
+
+  /* a damaged manifest is caught when handed out, and only for its rank */
+  std::string contents;
+  std::string cache_fname = ManifestCache::CacheName(dir);
+  ASSERT_OK(ReadFileToString(env, cache_fname.c_str(), &contents));
+  contents[contents.size() - 1] ^= 0x40;
+  ASSERT_OK(WriteStringToFile(env, contents, cache_fname.c_str()));
+
+  ASSERT_OK(loaded.Load(dir, num_ranks));
+  for (int rank = 0; rank < num_ranks; rank++) {
+    Slice manifest_data;
+    uint32_t num_epochs;
+    Status s = loaded.GetManifest(rank, manifest_data, num_epochs);
+    if (rank == num_ranks - 1) {
+      ASSERT_TRUE(s.IsCorruption());
+    } else {
+      ASSERT_OK(s);
+    }
+  }
+
+  /* a different rank count, or any rdb file changing, invalidates it */
+  ASSERT_FALSE(loaded.Load(dir, num_ranks - 1).ok());
+
+  char fname[64];
+  snprintf(fname, sizeof(fname), "/RDB-%08x.tbl", 2);
+  ASSERT_OK(WriteStringToFile(env, "changed", (dir + fname).c_str()));
+  ASSERT_TRUE(loaded.Load(dir, num_ranks).IsInvalidArgument());
+}
+
+TEST(ReaderTest, DirectoryListingCheck) {
+  Env* env = Env::Default();
+  std::string dir = test::TmpDir() + "/carp-listing-test";
+  env->CreateDir(dir.c_str());
+
+  std::vector< std::string > children;
+  env->GetChildren(dir.c_str(), &children);
+  for (size_t i = 0; i < children.size(); i++) {
+    env->DeleteFile((dir + "/" + children[i]).c_str());
+  }
+
+  /* sparse ranks, and names that only look like rdb files */
+  const int num_files = 4;
+  const int ranks[num_files] = {0, 1, 3, 130};
+  for (int i = 0; i < num_files; i++) {
+    char fname[64];
+    snprintf(fname, sizeof(fname), "/RDB-%08x.tbl", ranks[i]);
+    ASSERT_OK(WriteStringToFile(env, std::string(10 + i, 'x'),
+                                (dir + fname).c_str()));
+  }
+  ASSERT_OK(WriteStringToFile(env, "x", (dir + "/RDB-0000000g.tbl").c_str()));
+  ASSERT_OK(
+      WriteStringToFile(env, "x", (dir + "/RDB-00000002.tbl.tmp").c_str()));
+
+  ThreadPool* pool = ThreadPool::NewFixed(4);
+  CachingDirReader< RandomAccessFile > fdcache(env);
+  int num_ranks;
+  ASSERT_OK(fdcache.ReadDirectory(dir, num_ranks, pool));
+  ASSERT_EQ(num_ranks, 131);
+
+  std::vector< RdbFileInfo > listing;
+  fdcache.GetListing(listing);
+  ASSERT_EQ(listing.size(), 131);
+
+  int num_found = 0;
+  for (int rank = 0; rank < num_ranks; rank++) {
+    ASSERT_EQ(listing[rank].exists, fdcache.HasRank(rank));
+    if (listing[rank].exists) num_found++;
+  }
+  ASSERT_EQ(num_found, num_files);
+
+  for (int i = 0; i < num_files; i++) {
+    ASSERT_TRUE(listing[ranks[i]].exists);
+    ASSERT_EQ(listing[ranks[i]].fsz, 10 + i);
+  }
+
+  /* the manifest cache keeps the listing, for as long as the dir is
+   * unchanged */
+  ManifestCache cache(env);
+  cache.Reset(dir, listing);
+  for (int i = 0; i < num_files; i++) {
+    ASSERT_OK(cache.AddRank(ranks[i], Slice(), 0));
+  }
+  ASSERT_OK(cache.Write(sizeof(float), 60));
+  ASSERT_OK(cache.Load(dir, listing));
+
+  std::vector< RdbFileInfo > cached;
+  ASSERT_OK(ManifestCache::LoadListing(dir, cached));
+  ASSERT_EQ(cached.size(), listing.size());
+  for (size_t rank = 0; rank < cached.size(); rank++) {
+    ASSERT_EQ(cached[rank].exists, listing[rank].exists);
+    if (!cached[rank].exists) continue;
+    ASSERT_EQ(cached[rank].fsz, listing[rank].fsz);
+    ASSERT_EQ(cached[rank].mtime, listing[rank].mtime);
+  }
+
+  /* dir mtimes can be coarser than the time the writes take */
+  env->SleepForMicroseconds(50000);
+  ASSERT_OK(WriteStringToFile(env, "x", (dir + "/RDB-00000002.tbl").c_str()));
+  ASSERT_TRUE(ManifestCache::LoadListing(dir, cached).IsNotFound());
+
+  ASSERT_OK(fdcache.ReadDirectory(dir, num_ranks));
+  ASSERT_TRUE(fdcache.HasRank(2));
+  fdcache.GetListing(listing);
+  ASSERT_TRUE(cache.Load(dir, listing).IsInvalidArgument());
+
+  /* an rdb file created while the cache is built is not in its listing,
+   * so the listing must not be reused */
+  cache.Reset(dir, listing);
+  ASSERT_OK(WriteStringToFile(env, "x", (dir + "/RDB-00000005.tbl").c_str()));
+  ASSERT_OK(cache.Write(sizeof(float), 60));
+  ASSERT_TRUE(ManifestCache::LoadListing(dir, cached).IsNotFound());
+
+  delete pool;
+}
+
+TEST(ReaderTest, AsyncReadCheck) {
+  srand(311);
+
+  Env* env = Env::Default();
+  std::string dir = test::TmpDir() + "/carp-asyncread-test";
+  env->CreateDir(dir.c_str());
+
+  const int num_ranks = 3;
+  std::vector< std::string > contents(num_ranks);
+  for (int rank = 0; rank < num_ranks; rank++) {
+    for (int i = 0; i < 50000 + rank * 1000; i++) {
+      contents[rank].push_back('a' + rand() % 26);
+    }
+
+    char fname[64];
+    snprintf(fname, sizeof(fname), "/RDB-%08x.tbl", rank);
+    ASSERT_OK(WriteStringToFile(env, contents[rank], (dir + fname).c_str()));
+  }
+
+  /* once with io_uring (where the kernel has it), once with pread */
+  for (int async = 1; async >= 0; async--) {
+    CachingDirReader< RandomAccessFile > fdcache(env);
+    int num_ranks_found;
+    ASSERT_OK(fdcache.ReadDirectory(dir, num_ranks_found));
+    ASSERT_EQ(num_ranks_found, num_ranks);
+
+    if (async) {
+      Status s = fdcache.EnableAsyncReads(4);
+      if (!s.ok()) {
+        ASSERT_TRUE(s.IsNotSupported());
+        fprintf(stderr, "io_uring unavailable, skipped: %s\n",
+                s.ToString().c_str());
+        continue;
+      }
+      ASSERT_TRUE(fdcache.AsyncReadsEnabled());
+    }
+
+    const size_t num_reqs = 100;
+    std::vector< int > ranks(num_reqs);
+    std::vector< ReadRequest > reqs(num_reqs);
+    std::vector< std::string > scratch(num_reqs);
+
+    for (size_t i = 0; i < num_reqs; i++) {
+      ranks[i] = rand() % num_ranks;
+      reqs[i].offset = rand() % contents[ranks[i]].size();
+      reqs[i].bytes = 1 + rand() % 4096;
+      scratch[i].resize(reqs[i].bytes);
+      reqs[i].scratch = &scratch[i][0];
+    }
+
+    /* the last read runs past EOF, and comes back short */
+    reqs[num_reqs - 1].offset = contents[ranks[num_reqs - 1]].size() - 10;
+
+    std::vector< int > done(num_reqs, 0);
+    ASSERT_OK(fdcache.ReadBatchAsync(ranks, reqs, ReaderTest::MarkRead,
+                                     &done));
+
+    for (size_t i = 0; i < num_reqs; i++) {
+      ASSERT_EQ(done[i], 1);
+      const std::string& c = contents[ranks[i]];
+      uint64_t len = std::min(reqs[i].bytes, c.size() - reqs[i].offset);
+      ASSERT_EQ(reqs[i].slice.ToString(), c.substr(reqs[i].offset, len));
+    }
+  }
+
+  /* a batch that can not be read still reports every request, once */
+  UringReader closed;
+  std::vector< int > fds(10, -1);
+  std::vector< ReadRequest > reqs(fds.size());
+  std::vector< int > done(fds.size(), 0);
+  ASSERT_TRUE(closed.ReadBatch(fds, reqs, ReaderTest::MarkRead, &done)
+                  .IsNotSupported());
+  for (size_t i = 0; i < done.size(); i++) ASSERT_EQ(done[i], 100);
+}
+
+TEST(ReaderTest, CoalescedReadCheck) {
+  srand(317);
+
+  Env* env = Env::Default();
+  std::string dir = test::TmpDir() + "/carp-coalesce-test";
+  env->CreateDir(dir.c_str());
+
+  std::string contents;
+  for (int i = 0; i < 200000; i++) contents.push_back('a' + rand() % 26);
+  ASSERT_OK(WriteStringToFile(env, contents,
+                              (dir + "/RDB-00000000.tbl").c_str()));
+
+  /* small reads, some overlapping, one running past EOF */
+  std::vector< ReadRequest > reqs(64);
+  for (size_t i = 0; i < reqs.size(); i++) {
+    reqs[i].offset = rand() % contents.size();
+    reqs[i].bytes = 1 + rand() % 4096;
+  }
+  reqs[0].offset = contents.size() - 10;
+  reqs[0].bytes = 100;
+  reqs[1].offset = reqs[2].offset + 1;
+
+  /* default, adjacent only, and off */
+  CoalesceOptions opts[3];
+  opts[1].max_gap = 0;
+  opts[1].max_amplification = 1.0;
+  opts[2].max_amplification = 0;
+
+  std::vector< std::string > scratch(reqs.size());
+  for (int oi = 0; oi < 3; oi++) {
+    CachingDirReader< RandomAccessFile > fdcache(env);
+    int num_ranks;
+    ASSERT_OK(fdcache.ReadDirectory(dir, num_ranks));
+    fdcache.SetCoalescing(opts[oi]);
+
+    for (size_t i = 0; i < reqs.size(); i++) {
+      scratch[i].assign(reqs[i].bytes, 0);
+      reqs[i].scratch = &scratch[i][0];
+      reqs[i].slice = Slice();
+    }
+
+    ASSERT_OK(fdcache.ReadBatch(0, reqs));
+    for (size_t i = 0; i < reqs.size(); i++) {
+      const ReadRequest& r = reqs[i];
+      uint64_t len = std::min(r.bytes, contents.size() - r.offset);
+      ASSERT_EQ(r.slice.ToString(), contents.substr(r.offset, len));
+    }
+
+    CachingDirReader< MappedFile > mapped(env);
+    ASSERT_OK(mapped.ReadDirectory(dir, num_ranks));
+    mapped.SetCoalescing(opts[oi]);
+    ASSERT_OK(mapped.ReadBatch(0, reqs));
+    for (size_t i = 0; i < reqs.size(); i++) {
+      const ReadRequest& r = reqs[i];
+      uint64_t len = std::min(r.bytes, contents.size() - r.offset);
+      ASSERT_EQ(r.slice.ToString(), contents.substr(r.offset, len));
+    }
+  }
+
+  /* a sequential file takes disjoint requests, in any order */
+  std::vector< ReadRequest > seq_reqs(32);
+  for (size_t i = 0; i < seq_reqs.size(); i++) {
+    seq_reqs[i].offset = (seq_reqs.size() - i) * 5000 + rand() % 1000;
+    seq_reqs[i].bytes = 1 + rand() % 3000;
+    scratch[i].assign(seq_reqs[i].bytes, 0);
+    seq_reqs[i].scratch = &scratch[i][0];
+  }
+
+  CachingDirReader< SequentialFile > seq(env);
+  int num_ranks;
+  ASSERT_OK(seq.ReadDirectory(dir, num_ranks));
+  ASSERT_OK(seq.ReadBatch(0, seq_reqs));
+  for (size_t i = 0; i < seq_reqs.size(); i++) {
+    const ReadRequest& r = seq_reqs[i];
+    ASSERT_EQ(r.slice.ToString(), contents.substr(r.offset, r.bytes));
+  }
+}
+
+TEST(ReaderTest, ValueReadCheck) {
+  srand(318);
+
+  Env* env = Env::Default();
+  std::string dir = test::TmpDir() + "/carp-value-test";
+  env->CreateDir(dir.c_str());
+
+  const int num_ranks = 2;
+  std::string contents[num_ranks];
+  for (int rank = 0; rank < num_ranks; rank++) {
+    for (int i = 0; i < 100000; i++) {
+      contents[rank].push_back('a' + rand() % 26);
+    }
+    char fname[64];
+    snprintf(fname, sizeof(fname), "/RDB-%08x.tbl", rank);
+    ASSERT_OK(WriteStringToFile(env, contents[rank], (dir + fname).c_str()));
+  }
+
+  /* two SSTs of 1000 records a rank, the second rank's listed first */
+  const uint64_t key_sz = 4, val_sz = 32, count = 1000;
+  const uint64_t sst_sz = count * (key_sz + val_sz);
+  PartitionManifest manifest;
+  PartitionManifestReader reader(manifest);
+  reader.UpdateKVSizes(key_sz, val_sz);
+  for (int rank = num_ranks - 1; rank >= 0; rank--) {
+    std::string items, footer;
+    for (int sst = 0; sst < 2; sst++) {
+      PutFixed64(&items, sst);
+      PutFixed64(&items, sst * sst_sz);
+      for (int r = 0; r < 4; r++) PutFloat32(&items, r % 2);
+      PutFixed32(&items, 1);
+      PutFixed32(&items, count);
+      PutFixed32(&items, 0);
+    }
+    PutFixed32(&footer, 0);
+    PutFixed64(&footer, items.size());
+    footer += items;
+    Slice footer_sl(footer);
+    ASSERT_OK(reader.ReadManifest(rank, footer_sl, footer.size()));
+  }
+  reader.MergeManifests();
+  manifest.BuildIndex();
+
+  PartitionManifestMatch match;
+  manifest.GetOverlappingEntries(0, 0, 1, match);
+  ResultLocator locator;
+  ASSERT_OK(locator.Reset(match));
+
+  /* key pairs of both ranks, interleaved, some sharing a value. locs go
+   * SST by SST, by rank and then offset */
+  const uint64_t off = 8, width = 24, stride = 32;
+  std::vector< CompactKeyPair > kps(500);
+  std::vector< KeyPair > expected(kps.size());
+  for (size_t i = 0; i < kps.size(); i++) {
+    kps[i].key = i;
+    kps[i].loc = rand() % (num_ranks * 2 * count);
+    if (i == 1) kps[i].loc = kps[0].loc;
+
+    uint64_t sst = kps[i].loc / count;
+    expected[i].rank = sst / 2;
+    expected[i].offset =
+        (sst % 2) * sst_sz + count * key_sz + (kps[i].loc % count) * val_sz;
+
+    KeyPair kp = locator.Locate(kps[i]);
+    ASSERT_EQ(kp.rank, expected[i].rank);
+    ASSERT_EQ(kp.offset, expected[i].offset);
+  }
+
+  std::vector< uint32_t > idx[num_ranks];
+  for (size_t i = 0; i < kps.size(); i++) idx[expected[i].rank].push_back(i);
+
+  CachingDirReader< RandomAccessFile > fdcache(env);
+  CachingDirReader< MappedFile > mapped(env);
+  int n;
+  ASSERT_OK(fdcache.ReadDirectory(dir, n));
+  ASSERT_OK(mapped.ReadDirectory(dir, n));
+
+  for (int mode = 0; mode < 2; mode++) {
+    std::string out(kps.size() * stride, 0);
+    for (int rank = 0; rank < num_ranks; rank++) {
+      if (mode == 0) {
+        ASSERT_OK(ReadValues(&fdcache, rank, kps, locator, idx[rank], off,
+                             width, &out[0], stride));
+      } else {
+        ASSERT_OK(ReadValues(&mapped, rank, kps, locator, idx[rank], off,
+                             width, &out[0], stride));
+      }
+    }
+
+    for (size_t i = 0; i < kps.size(); i++) {
+      const std::string& c = contents[expected[i].rank];
+      ASSERT_EQ(out.substr(i * stride, width),
+                c.substr(expected[i].offset + off, width));
+      ASSERT_EQ(out.substr(i * stride + width, stride - width),
+                std::string(stride - width, 0));
+    }
+  }
+}
+
+TEST(ReaderTest, SparseLocatorCheck) {
+  srand(233);
+
+  /* more keys than locs can number, most of which do not match: two SSTs
+   * on rank 0 and one on rank 1 */
+  const uint64_t key_sz = 4, val_sz = 16, count = 3u << 30;
+  const uint64_t sst_sz = count * (key_sz + val_sz);
+  const int num_ssts[] = {2, 1};
+  PartitionManifest manifest;
+  PartitionManifestReader reader(manifest);
+  reader.UpdateKVSizes(key_sz, val_sz);
+  for (int rank = 1; rank >= 0; rank--) {
+    std::string items, footer;
+    for (int sst = 0; sst < num_ssts[rank]; sst++) {
+      PutFixed64(&items, sst);
+      PutFixed64(&items, sst * sst_sz);
+      for (int r = 0; r < 4; r++) PutFloat32(&items, r % 2);
+      PutFixed32(&items, 1);
+      PutFixed32(&items, count);
+      PutFixed32(&items, 0);
+    }
+    PutFixed32(&footer, 0);
+    PutFixed64(&footer, items.size());
+    footer += items;
+    Slice footer_sl(footer);
+    ASSERT_OK(reader.ReadManifest(rank, footer_sl, footer.size()));
+  }
+  reader.MergeManifests();
+  manifest.BuildIndex();
+
+  PartitionManifestMatch match;
+  manifest.GetOverlappingEntries(0, 0, 1, match);
+  ASSERT_EQ(match.Size(), 3);
+
+  ResultLocator locator;
+  ASSERT_OK(locator.Reset(match));
+  ASSERT_TRUE(locator.Sparse());
+
+  /* matches numbered by their place in the SST, as FilterKeys does */
+  std::vector< std::vector< CompactKeyPair > > matches(3);
+  std::vector< std::vector< uint32_t > > places(3);
+  std::vector< std::vector< CompactKeyPair >* > mptrs(3);
+  for (size_t i = 0; i < 3; i++) {
+    ASSERT_EQ(locator.Base(i), 0);
+    uint32_t idx = rand() % 1000;
+    for (size_t j = 0; j < 200 * (i + 1); j++) {
+      CompactKeyPair kp;
+      kp.key = j;
+      kp.loc = idx;
+      matches[i].push_back(kp);
+      places[i].push_back(idx);
+      idx += 1 + rand() % (count / 1000);
+    }
+    mptrs[i] = &matches[i];
+  }
+
+  ASSERT_OK(locator.Compact(mptrs));
+
+  /* locs now count matches only, by rank and then offset */
+  std::vector< size_t > order;
+  for (int rank = 0; rank < 2; rank++) {
+    for (int sst = 0; sst < num_ssts[rank]; sst++) {
+      for (size_t i = 0; i < 3; i++) {
+        if (match[i].rank == rank and match[i].offset == sst * sst_sz) {
+          order.push_back(i);
+        }
+      }
+    }
+  }
+  ASSERT_EQ(order.size(), 3);
+
+  uint32_t loc = 0;
+  for (size_t k = 0; k < order.size(); k++) {
+    size_t i = order[k];
+    ASSERT_EQ(locator.Base(i), loc);
+    for (size_t j = 0; j < matches[i].size(); j++) {
+      ASSERT_EQ(matches[i][j].loc, loc++);
+      KeyPair kp = locator.Locate(matches[i][j]);
+      uint64_t idx = places[i][j];
+      ASSERT_EQ(kp.rank, match[i].rank);
+      ASSERT_EQ(kp.offset, match[i].offset + count * key_sz + idx * val_sz);
+    }
+  }
+}
+
+TEST(ReaderTest, DirectReadCheck) {
+  srand(319);
+
+  uint64_t aligned_off, aligned_len;
+  AlignExtent(5000, 100, &aligned_off, &aligned_len);
+  ASSERT_EQ(aligned_off, 4096);
+  ASSERT_EQ(aligned_len, 4096);
+  AlignExtent(4096, 4097, &aligned_off, &aligned_len);
+  ASSERT_EQ(aligned_off, 4096);
+  ASSERT_EQ(aligned_len, 8192);
+
+  Env* env = Env::Default();
+  std::string dir = test::TmpDir() + "/carp-direct-test";
+  env->CreateDir(dir.c_str());
+
+  /* not a multiple of kDirectIoAlign, so the last block is short */
+  std::string contents;
+  for (int i = 0; i < 150001; i++) contents.push_back('a' + rand() % 26);
+  ASSERT_OK(WriteStringToFile(env, contents,
+                              (dir + "/RDB-00000000.tbl").c_str()));
+
+  std::vector< ReadRequest > reqs(48);
+  for (size_t i = 0; i < reqs.size(); i++) {
+    reqs[i].offset = rand() % contents.size();
+    reqs[i].bytes = 1 + rand() % 10000;
+  }
+  reqs[0].offset = contents.size() - 10;
+  reqs[0].bytes = 100;
+  reqs[1].offset = contents.size() + 10;
+
+  std::vector< std::string > scratch(reqs.size());
+  for (size_t i = 0; i < reqs.size(); i++) {
+    scratch[i].assign(reqs[i].bytes, 0);
+    reqs[i].scratch = &scratch[i][0];
+  }
+
+  CachingDirReader< RandomAccessFile > fdcache(env);
+  CachingDirReader< SequentialFile > seq(env);
+  int num_ranks;
+  ASSERT_OK(fdcache.ReadDirectory(dir, num_ranks));
+  ASSERT_OK(seq.ReadDirectory(dir, num_ranks));
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < reqs.size(); i++) reqs[i].slice = Slice();
+    if (pass == 0) {
+      ASSERT_OK(fdcache.ReadBatch(0, reqs, kReadDirect));
+    } else {
+      /* absolute offsets, in any order, for a sequential file too */
+      ASSERT_OK(seq.ReadBatch(0, reqs, kReadDirect));
+    }
+
+    for (size_t i = 0; i < reqs.size(); i++) {
+      const ReadRequest& r = reqs[i];
+      uint64_t len = 0;
+      if (r.offset < contents.size()) {
+        len = std::min(r.bytes, contents.size() - r.offset);
+      }
+      ASSERT_EQ(r.slice.ToString(),
+                contents.substr(std::min(r.offset, contents.size()), len));
+    }
+  }
+
+  ReadRequest req = reqs[2];
+  ASSERT_OK(seq.Read(0, req, false, kReadDirect));
+  ASSERT_EQ(req.slice.ToString(), contents.substr(req.offset, req.bytes));
+
+  /* buffers are reused, rather than allocated per read */
+  AlignedBufferPool pool(2);
+  AlignedBuffer a, b;
+  ASSERT_OK(pool.Get(5000, &a));
+  ASSERT_EQ((uintptr_t)a.data % kDirectIoAlign, 0);
+  ASSERT_GE(a.size, 5000);
+  pool.Put(a);
+  ASSERT_OK(pool.Get(100, &b));
+  ASSERT_EQ(b.data, a.data);
+  ASSERT_EQ(pool.NumFree(), 0);
+  pool.Put(b);
+  ASSERT_EQ(pool.NumFree(), 1);
+}
+
+TEST(ReaderTest, MappedReadCheck) {
+  srand(313);
+
+  Env* env = Env::Default();
+  std::string dir = test::TmpDir() + "/carp-mmapread-test";
+  env->CreateDir(dir.c_str());
+
+  /* rank 1 is empty, and can not be mapped */
+  std::vector< std::string > contents(2);
+  for (int i = 0; i < 20000; i++) contents[0].push_back('a' + rand() % 26);
+
+  for (int rank = 0; rank < 2; rank++) {
+    char fname[64];
+    snprintf(fname, sizeof(fname), "/RDB-%08x.tbl", rank);
+    ASSERT_OK(WriteStringToFile(env, contents[rank], (dir + fname).c_str()));
+  }
+
+  CachingDirReader< MappedFile > fdcache(env);
+  int num_ranks;
+  ASSERT_OK(fdcache.ReadDirectory(dir, num_ranks));
+  ASSERT_EQ(num_ranks, 2);
+  ASSERT_TRUE(CachingDirReader< MappedFile >::ZeroCopyReads());
+
+  std::vector< ReadRequest > reqs(50);
+  for (size_t i = 0; i < reqs.size(); i++) {
+    reqs[i].offset = rand() % contents[0].size();
+    reqs[i].bytes = 1 + rand() % 2048;
+    reqs[i].scratch = NULL;
+  }
+  reqs[0].offset = contents[0].size() - 5;
+  reqs[0].bytes = 100;
+
+  ASSERT_OK(fdcache.Advise(0, 0, 0, kAdviseWillNeed));
+  ASSERT_OK(fdcache.ReadBatch(0, reqs));
+
+  const char* base = reqs[1].slice.data() - reqs[1].offset;
+  for (size_t i = 0; i < reqs.size(); i++) {
+    const ReadRequest& r = reqs[i];
+    uint64_t len = std::min(r.bytes, contents[0].size() - r.offset);
+    ASSERT_EQ(r.slice.ToString(), contents[0].substr(r.offset, len));
+    /* every slice points into the one mapping */
+    ASSERT_TRUE(r.slice.data() == base + r.offset);
+  }
+
+  ReadRequest req;
+  req.offset = 0;
+  req.bytes = 10;
+  req.scratch = NULL;
+  ASSERT_OK(fdcache.Read(1, req, false));
+  ASSERT_EQ(req.slice.size(), 0);
+  ASSERT_OK(fdcache.Advise(1, 0, 0, kAdviseSequential));
+}
+
+TEST(ReaderTest, FileCacheLruCheck) {
+  Env* env = Env::Default();
+  std::string dir = test::TmpDir() + "/carp-fdcache-test";
+  env->CreateDir(dir.c_str());
+
+  const int num_ranks = 6;
+  for (int rank = 0; rank < num_ranks; rank++) {
+    char fname[64];
+    snprintf(fname, sizeof(fname), "/RDB-%08x.tbl", rank);
+    ASSERT_OK(WriteStringToFile(env, std::string(64, 'a' + rank),
+                                (dir + fname).c_str()));
+  }
+
+  CachingDirReader< RandomAccessFile > fdcache(env, 2);
+  int num_ranks_found;
+  ASSERT_OK(fdcache.ReadDirectory(dir, num_ranks_found));
+
+  /* rank 0 stays pinned while every other rank is read */
+  RandomAccessFile* pinned;
+  uint64_t fsz;
+  ASSERT_OK(fdcache.GetFileHandle(0, &pinned, &fsz));
+
+  char scratch[64];
+  for (int pass = 0; pass < 2; pass++) {
+    for (int rank = 1; rank < num_ranks; rank++) {
+      ReadRequest req;
+      req.offset = 0;
+      req.bytes = 8;
+      req.scratch = scratch;
+      ASSERT_OK(fdcache.Read(rank, req, false));
+      ASSERT_EQ(req.slice.ToString(), std::string(8, 'a' + rank));
+    }
+  }
+
+  FileCacheStats stats;
+  fdcache.GetStats(stats);
+  ASSERT_EQ(stats.hits, 0);
+  ASSERT_EQ(stats.misses, 11);
+  ASSERT_EQ(stats.evictions, 9);
+  ASSERT_EQ(stats.open, 2);
+
+  Slice slice;
+  ASSERT_OK(pinned->Read(0, 8, &slice, scratch));
+  ASSERT_EQ(slice.ToString(), std::string(8, 'a'));
+
+  /* the most recently used rank is still open */
+  ReadRequest req;
+  req.offset = 0;
+  req.bytes = 8;
+  req.scratch = scratch;
+  ASSERT_OK(fdcache.Read(num_ranks - 1, req, false));
+  fdcache.ReleaseFileHandle(0);
+
+  fdcache.GetStats(stats);
+  ASSERT_EQ(stats.hits, 1);
+  ASSERT_EQ(stats.open, 2);
+
+  /* sequential handles are never evicted: reading every rank 8 bytes at a
+   * time from its cursor must end exactly at EOF for all of them */
+  CachingDirReader< SequentialFile > seqcache(env, 2);
+  ASSERT_OK(seqcache.ReadDirectory(dir, num_ranks_found));
+  for (int pass = 0; pass <= 8; pass++) {
+    for (int rank = 0; rank < num_ranks; rank++) {
+      req.offset = 0;
+      req.bytes = 8;
+      req.scratch = scratch;
+      ASSERT_OK(seqcache.Read(rank, req, false));
+      if (pass < 8) {
+        ASSERT_EQ(req.slice.ToString(), std::string(8, 'a' + rank));
+      } else {
+        ASSERT_EQ(req.slice.size(), 0);
+      }
+    }
+  }
+
+  seqcache.GetStats(stats);
+  ASSERT_EQ(stats.evictions, 0);
+  ASSERT_EQ(stats.open, num_ranks);
+}
+
+TEST(ReaderTest, FileCacheConcurrentCheck) {
+  Env* env = Env::Default();
+  std::string dir = test::TmpDir() + "/carp-fdcache-mt-test";
+  env->CreateDir(dir.c_str());
+
+  const int num_ranks = 20;
+  for (int rank = 0; rank < num_ranks; rank++) {
+    char fname[64];
+    snprintf(fname, sizeof(fname), "/RDB-%08x.tbl", rank);
+    ASSERT_OK(WriteStringToFile(env, std::string(64, 'a' + rank),
+                                (dir + fname).c_str()));
+  }
+
+  /* fewer handles than ranks, so that shards keep evicting */
+  CachingDirReader< RandomAccessFile > fdcache(env, 8);
+  int num_ranks_found;
+  ASSERT_OK(fdcache.ReadDirectory(dir, num_ranks_found));
+
+  const int num_threads = 8;
+  ThreadPool* pool = ThreadPool::NewFixed(num_threads);
+  port::Mutex mutex;
+  port::CondVar cv(&mutex);
+  int pending = num_threads;
+
+  std::vector< ReaderTest::FileCacheReadArgs > args(num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    ReaderTest::FileCacheReadArgs a = {&fdcache, num_ranks, 17u + i, 0,
+                                       &mutex,   &cv,       &pending};
+    args[i] = a;
+    pool->Schedule(ReaderTest::FileCacheReader, &args[i]);
+  }
+
+  mutex.Lock();
+  while (pending > 0) cv.Wait();
+  mutex.Unlock();
+  delete pool;
+
+  for (int i = 0; i < num_threads; i++) ASSERT_EQ(args[i].errors, 0);
+
+  FileCacheStats stats;
+  fdcache.GetStats(stats);
+  ASSERT_EQ(stats.hits + stats.misses, num_threads * 2000);
+  ASSERT_TRUE(stats.evictions > 0);
+  ASSERT_TRUE(stats.open <= 8);
+}
+
+TEST(ReaderTest, KeySketchCheck) {
+  srand(306);
+
+  std::vector< Range > ranges;
+  std::vector< double > masses;
+  KeySketch sketch;
+
+  for (int i = 0; i < 3000; i++) {
+    float rmin = (rand() % 10000) / 100.0f;
+    float rmax = rmin + (rand() % 500) / 100.0f;
+    if (i % 13 == 0) rmax = rmin;
+
+    ranges.push_back(Range(rmin, rmax));
+    masses.push_back(1 + rand() % 1000);
+    sketch.Add(rmin, rmax, masses.back());
+  }
+
+  sketch.Build(256);
+  ASSERT_LE(sketch.NumKnots(), 2 * 256 + 2);
+
+  double total = 0;
+  for (size_t i = 0; i < masses.size(); i++) total += masses[i];
+  ASSERT_LT(fabs(sketch.Mass() - total), total * 1e-9);
+  ASSERT_LT(fabs(sketch.Estimate(-1, 200) - total), total * 1e-9);
+
+  for (int q = 0; q < 300; q++) {
+    float qmin = (rand() % 11000) / 100.0f - 5;
+    float qmax = qmin + (rand() % 1000) / 100.0f;
+
+    /* the model: uniform mass over each range, point mass if zero-width */
+    double expected = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+      const Range& r = ranges[i];
+      if (r.ZeroWidth()) {
+        if (r.Inside(qmin) or r.Inside(qmax) or
+            (qmin < r.range_min and qmax > r.range_max)) {
+          expected += masses[i];
+        }
+        continue;
+      }
+
+      double lo = std::max(r.range_min, qmin);
+      double hi = std::min(r.range_max, qmax);
+      if (hi > lo) {
+        expected += masses[i] * (hi - lo) / (r.range_max - r.range_min);
+      }
+    }
+
+    double actual = sketch.Estimate(qmin, qmax);
+    ASSERT_LE(fabs(actual - expected), sketch.ErrorBound() + total * 1e-6);
+  }
+}
+
+TEST(ReaderTest, KeySketchSamplesCheck) {
+  srand(307);
+
+  PartitionManifest manifest;
+  PartitionManifestReader reader(manifest);
+  reader.UpdateKVSizes(sizeof(float), 60);
+
+  std::string footer;
+  uint64_t offset = 0;
+  EncodeEpoch(footer, 0, 1, offset);
+
+  Slice footer_sl(footer);
+  ASSERT_OK(reader.ReadManifest(0, footer_sl, footer.size()));
+  reader.MergeManifests();
+
+  double mass, max_err;
+  ASSERT_FALSE(manifest.GetKeyMassEstimate(0, 0, 1, mass, max_err).ok());
+
+  manifest.BuildIndex();
+
+  const PartitionManifestItem& item = manifest[0];
+  const Range& r = item.observed;
+  float mid = (r.range_min + r.range_max) / 2;
+
+  /* the whole SST, with mass spread evenly over the observed range */
+  ASSERT_OK(manifest.GetKeyMassEstimate(0, r.range_min, r.range_max, mass,
+                                        max_err));
+  ASSERT_LT(fabs(mass - item.part_item_count), 1e-3);
+
+  /* samples showing all keys at the low end move the mass there */
+  std::vector< float > keys(8, r.range_min);
+  ASSERT_TRUE(manifest.NeedsKeySamples(item));
+  manifest.AddKeySamples(item, keys);
+  ASSERT_FALSE(manifest.NeedsKeySamples(item));
+
+  ASSERT_OK(manifest.GetKeyMassEstimate(0, mid, r.range_max, mass, max_err));
+  ASSERT_LE(mass, item.part_item_count / 9.0 + max_err + 1e-3);
+  ASSERT_OK(manifest.GetKeyMassEstimate(0, r.range_min, r.range_min, mass,
+                                        max_err));
+  ASSERT_GE(mass, item.part_item_count * 8 / 9.0 - max_err - 1e-3);
+}
+TEST(ReaderTest, ManifestCompactCheck) {
+  srand(309);
+
+  PartitionManifest manifest;
+  PartitionManifestReader reader(manifest);
+  reader.UpdateKVSizes(sizeof(float), 60);
+  reader.Reset(8);
+
+  /* rank 3 writes nothing, so some segments are empty */
+  for (int rank = 0; rank < 8; rank++) {
+    std::string footer;
+    uint64_t offset = rank * 1000;
+    for (int epoch = 0; epoch < 3; epoch++) {
+      EncodeEpoch(footer, epoch, rank == 3 ? 0 : 1 + rand() % 20, offset);
+    }
+
+    Slice footer_sl(footer);
+    ASSERT_OK(reader.ReadManifest(rank, footer_sl, footer.size()));
+  }
+
+  reader.MergeManifests();
+  manifest.BuildIndex();
+
+  std::vector< std::string > expanded;
+  for (size_t i = 0; i < manifest.Size(); i++) {
+    const PartitionManifestItem& item = manifest[i];
+    char buf[32];
+    snprintf(buf, sizeof(buf), ",%d", item.rank);
+    expanded.push_back(item.ToCSVString() + buf);
+  }
+
+  std::vector< Query > queries;
+  std::vector< uint64_t > match_mass;
+  for (int q = 0; q < 50; q++) {
+    float qmin = (rand() % 1100) / 100.0f - 0.5f;
+    Query query(q % 3, qmin, qmin + (rand() % 100) / 100.0f);
+    if (q % 5 == 0) query.rank = q % 8;
+
+    PartitionManifestMatch match;
+    manifest.GetOverlappingEntries(query, match);
+    queries.push_back(query);
+    match_mass.push_back(match.TotalMass());
+  }
+
+  size_t mem_expanded = manifest.MemoryUsage();
+  ASSERT_OK(manifest.Compact());
+  ASSERT_TRUE(manifest.IsCompact());
+  ASSERT_LT(manifest.MemoryUsage(), mem_expanded);
+  ASSERT_EQ(manifest.Size(), expanded.size());
+
+  for (size_t i = 0; i < manifest.Size(); i++) {
+    PartitionManifestItem item = manifest.GetItem(i);
+    char buf[32];
+    snprintf(buf, sizeof(buf), ",%d", item.rank);
+    ASSERT_EQ(item.ToCSVString() + buf, expanded[i]);
+  }
+
+  for (size_t q = 0; q < queries.size(); q++) {
+    PartitionManifestMatch match;
+    manifest.GetOverlappingEntries(queries[q], match);
+    ASSERT_EQ(match.TotalMass(), match_mass[q]);
+    for (size_t i = 0; i < match.Size(); i++) {
+      ASSERT_TRUE(match[i].Overlaps(queries[q].range));
+      if (queries[q].rank >= 0) ASSERT_EQ(match[i].rank, queries[q].rank);
+    }
+  }
+
+  /* key samples still find their SST through the compact encoding */
+  PartitionManifestItem item = manifest.GetItem(0);
+  double before, after, max_err;
+  const Range& r = item.observed;
+  ASSERT_OK(manifest.GetKeyMassEstimate(item.epoch, r.range_min, r.range_min,
+                                        before, max_err));
+  std::vector< float > keys(8, r.range_min);
+  manifest.AddKeySamples(item, keys);
+  ASSERT_OK(manifest.GetKeyMassEstimate(item.epoch, r.range_min, r.range_min,
+                                        after, max_err));
+  ASSERT_GT(after, before);
+}
+
+TEST(ReaderTest, LazyManifestCheck) {
+  srand(310);
+
+  const int num_ranks = 70;
+  std::vector< std::string > footers(num_ranks);
+  for (int rank = 0; rank < num_ranks; rank++) {
+    uint64_t offset = 0;
+    for (int epoch = 0; epoch < 3; epoch++) {
+      EncodeEpoch(footers[rank], epoch, rand() % 10, offset);
+    }
+    /* some ranks write a second frame for epoch 1 */
+    if (rank % 7 == 0) EncodeEpoch(footers[rank], 1, 1 + rand() % 5, offset);
+  }
+
+  PartitionManifest eager;
+  PartitionManifestReader reader(eager);
+  reader.UpdateKVSizes(sizeof(float), 60);
+  reader.Reset(num_ranks);
+
+  ThreadPool* pool = ThreadPool::NewFixed(4);
+  LazyManifest lazy(pool);
+  lazy.Reset(num_ranks);
+  ASSERT_OK(lazy.UpdateKVSizes(sizeof(float), 60));
+
+  for (int rank = 0; rank < num_ranks; rank++) {
+    Slice footer_sl(footers[rank]);
+    ASSERT_OK(reader.ReadManifest(rank, footer_sl, footer_sl.size()));
+    ASSERT_OK(lazy.AddRank(rank, footer_sl));
+  }
+
+  reader.MergeManifests();
+  eager.BuildIndex();
+
+  ASSERT_EQ(lazy.NumEpochs(), 3);
+  ASSERT_FALSE(lazy.IsDecoded(1));
+
+  PartitionManifest* mf;
+  ASSERT_FALSE(lazy.GetEpoch(3, &mf).ok());
+  ASSERT_OK(lazy.GetEpoch(1, &mf));
+  ASSERT_TRUE(lazy.IsDecoded(1));
+  ASSERT_FALSE(lazy.IsDecoded(0));
+
+  uint64_t eager_mass, lazy_mass;
+  ASSERT_OK(eager.GetEpochMass(1, eager_mass));
+  ASSERT_OK(mf->GetEpochMass(1, lazy_mass));
+  ASSERT_EQ(lazy_mass, eager_mass);
+
+  for (int q = 0; q < 50; q++) {
+    float qmin = (rand() % 1100) / 100.0f - 0.5f;
+    float qmax = qmin + (rand() % 100) / 100.0f;
+
+    PartitionManifestMatch eager_match, lazy_match;
+    eager.GetOverlappingEntries(1, qmin, qmax, eager_match);
+    mf->GetOverlappingEntries(1, qmin, qmax, lazy_match);
+    ASSERT_EQ(lazy_match.Size(), eager_match.Size());
+    for (size_t i = 0; i < lazy_match.Size(); i++) {
+      ASSERT_EQ(lazy_match[i].ToCSVString(), eager_match[i].ToCSVString());
+      ASSERT_EQ(lazy_match[i].rank, eager_match[i].rank);
+    }
+  }
+
+  lazy.Reset(0);
+  delete pool;
+
+  /* a truncated frame is caught at open time */
+  LazyManifest bad;
+  bad.Reset(1);
+  Slice truncated(footers[1].data(), footers[1].size() - 1);
+  ASSERT_FALSE(bad.AddRank(0, truncated).ok());
+}
+
+TEST(ReaderTest, AggregateCheck) {
+  srand(308);
+
+  const int num_ssts = 200;
+  const float qmin = 2.5f, qmax = 4.75f;
+
+  std::string items;
+  std::vector< std::string > keyblks(num_ssts);
+  uint64_t exact_count = 0, offset = 0;
+  double exact_sum = 0;
+
+  for (int i = 0; i < num_ssts; i++) {
+    float base = (rand() % 600) / 100.0f;
+    uint32_t count = 1 + rand() % 200;
+    Range observed;
+
+    for (uint32_t k = 0; k < count; k++) {
+      float key = base + (rand() % 100) / 100.0f;
+      PutFloat32(&keyblks[i], key);
+      observed.Extend(key);
+    }
+
+    uint64_t blk_count = 0;
+    double blk_sum = 0;
+    QueryUtils::AggregateKeys(keyblks[i].data(), count, sizeof(float), qmin,
+                              qmax, blk_count, blk_sum);
+    exact_count += blk_count;
+    exact_sum += blk_sum;
+
+    PutFixed64(&items, i);
+    PutFixed64(&items, offset);
+    PutFloat32(&items, observed.range_min);
+    PutFloat32(&items, observed.range_max);
+    PutFloat32(&items, observed.range_min);
+    PutFloat32(&items, observed.range_max);
+    PutFixed32(&items, 1);
+    PutFixed32(&items, count);
+    PutFixed32(&items, 0);
+
+    offset += count * sizeof(float);
+  }
+
+  uint64_t naive_count = 0;
+  for (int i = 0; i < num_ssts; i++) {
+    for (size_t k = 0; k < keyblks[i].size(); k += sizeof(float)) {
+      float key = DecodeFloat32(&keyblks[i][k]);
+      if (key >= qmin and key <= qmax) naive_count++;
+    }
+  }
+  ASSERT_EQ(exact_count, naive_count);
+
+  std::string footer;
+  PutFixed32(&footer, 0);
+  PutFixed64(&footer, items.size());
+  footer += items;
+
+  PartitionManifest manifest;
+  PartitionManifestReader reader(manifest);
+  reader.UpdateKVSizes(sizeof(float), 0);
+  Slice footer_sl(footer);
+  ASSERT_OK(reader.ReadManifest(0, footer_sl, footer.size()));
+  reader.MergeManifests();
+  manifest.BuildIndex();
+
+  PartitionManifestMatch match;
+  manifest.GetOverlappingEntries(0, qmin, qmax, match);
+
+  AggregateResult res;
+  QueryUtils::EstimateAggregate(match, qmin, qmax, res);
+  ASSERT_EQ(res.ssts_matched, match.Size());
+  ASSERT_LE(fabs((double)res.count - exact_count), res.count_err);
+  ASSERT_LE(fabs(res.sum - exact_sum), res.sum_err + 1e-6 * exact_sum);
+  ASSERT_LT(res.count_err, match.TotalMass());
+}
+
+TEST(ReaderTest, AggregateQueryCheck) {
+  srand(328);
+
+  Env* env = Env::Default();
+  std::string dir = test::TmpDir() + "/carp-aggregate-test";
+  std::vector< std::vector< float > > keys;
+  ReaderTest::WriteRdbDir(env, dir, 4, 2, 30, 16, keys);
+
+  RdbOptions options;
+  options.env = env;
+  options.parallelism = 4;
+  options.manifest_cache = false;
+  RangeReader< RandomAccessFile > reader(options);
+  ASSERT_OK(reader.ReadManifest(dir));
+
+  /* a narrow range, one fully containing most SSTs, and one covering all
+   * keys, with bounds on keys */
+  const float ranges[][2] = {{4.0f, 4.1f}, {0.5f, 9.5f}, {0.0f, 10.0f}};
+
+  for (int epoch = 0; epoch < 2; epoch++) {
+    for (size_t ri = 0; ri < 3; ri++) {
+      const float qmin = ranges[ri][0], qmax = ranges[ri][1];
+      uint64_t count = 0;
+      double sum = 0;
+      for (size_t i = 0; i < keys[epoch].size(); i++) {
+        float key = keys[epoch][i];
+        if (key < qmin or key > qmax) continue;
+        count++;
+        sum += key;
+      }
+
+      AggregateResult res;
+      ASSERT_OK(reader.QueryAggregate(Query(epoch, qmin, qmax), false, false,
+                                      res));
+      ASSERT_EQ(res.count, count);
+      ASSERT_EQ(res.count_err, 0);
+      /* SSTs inside the range are counted from the manifest alone */
+      if (ri > 0) ASSERT_LT(res.ssts_read, res.ssts_matched);
+
+      ASSERT_OK(reader.QueryAggregate(Query(epoch, qmin, qmax), true, false,
+                                      res));
+      ASSERT_EQ(res.count, count);
+      ASSERT_EQ(res.ssts_read, res.ssts_matched);
+      ASSERT_LE(fabs(res.sum - sum), 1e-9 * sum + 1e-3);
+    }
+  }
+}
+
+TEST(ReaderTest, PrefetchQueryCheck) {
+  srand(517);
+
+  Env* env = Env::Default();
+  std::string dir = test::TmpDir() + "/carp-prefetch-test";
+  std::vector< std::vector< float > > keys;
+  const uint64_t val_sz = 12;
+  ReaderTest::WriteRdbDir(env, dir, 4, 3, 30, val_sz, keys);
+
+  std::vector< Query > qvec;
+  for (int i = 0; i < 12; i++) {
+    float qmin = (rand() % 1000) / 100.0f;
+    float qmax = qmin + (rand() % 300) / 100.0f;
+    qvec.push_back(Query(i % 3, qmin, qmax));
+  }
+
+  /* queries one by one, then pipelined, with room for all prefetches and
+   * with room for none */
+  const uint32_t depths[] = {0, 2, 2};
+  const uint64_t budgets[] = {MB(256), MB(256), 1};
+  ReaderTest::BatchResults expected;
+
+  for (int ci = 0; ci < 3; ci++) {
+    RdbOptions options;
+    options.env = env;
+    options.parallelism = 4;
+    options.manifest_cache = false;
+    options.projection = kProjectRecords;
+    options.prefetch_depth = depths[ci];
+    options.prefetch_budget = budgets[ci];
+    RangeReader< RandomAccessFile > reader(options);
+    ASSERT_OK(reader.ReadManifest(dir));
+
+    ReaderTest::BatchResults br;
+    br.reader = &reader;
+    ASSERT_OK(reader.QueryParallel(qvec, ReaderTest::CollectResults, &br));
+    ASSERT_EQ(br.results.size(), qvec.size());
+
+    for (size_t qi = 0; qi < qvec.size(); qi++) {
+      const std::vector< KeyPair >& res = br.results[qi];
+      const Range& r = qvec[qi].range;
+      size_t count = 0;
+      const std::vector< float >& ekeys = keys[qvec[qi].epoch];
+      for (size_t i = 0; i < ekeys.size(); i++) {
+        if (ekeys[i] >= r.range_min and ekeys[i] <= r.range_max) count++;
+      }
+      ASSERT_EQ(res.size(), count);
+      ASSERT_EQ(br.values[qi].size(), count * val_sz);
+
+      for (size_t i = 0; i < res.size(); i++) {
+        if (i > 0) ASSERT_LE(res[i - 1].key, res[i].key);
+        /* each value starts with its key */
+        ASSERT_EQ(DecodeFloat32(&br.values[qi][i * val_sz]), res[i].key);
+      }
+
+      if (ci == 0) continue;
+      const std::vector< KeyPair >& eres = expected.results[qi];
+      for (size_t i = 0; i < res.size(); i++) {
+        ASSERT_EQ(res[i].key, eres[i].key);
+        ASSERT_EQ(res[i].rank, eres[i].rank);
+        ASSERT_EQ(res[i].offset, eres[i].offset);
+      }
+      ASSERT_EQ(br.values[qi], expected.values[qi]);
+    }
+
+    if (ci == 0) expected = br;
+  }
+}
+
+TEST(ReaderTest, SSTReadErrorCheck) {
+  srand(604);
+
+  Env* env = Env::Default();
+  std::string dir = test::TmpDir() + "/carp-readerror-test";
+  std::vector< std::vector< float > > keys;
+  ReaderTest::WriteRdbDir(env, dir, 2, 1, 20, 8, keys);
+
+  /* once with io_uring (where the kernel has it), once with pread */
+  for (int async = 1; async >= 0; async--) {
+    RdbOptions options;
+    options.env = env;
+    options.parallelism = 2;
+    options.manifest_cache = false;
+    options.io_queue_depth = async ? 8 : 0;
+    RangeReader< RandomAccessFile > reader(options);
+    ASSERT_OK(reader.ReadManifest(dir));
+    ASSERT_OK(reader.QueryParallel(-1, 0, 0.0f, 10.0f));
+
+    /* the SSTs of rank 1 are gone, its manifest is already read */
+    std::string fname = dir + "/RDB-00000001.tbl";
+    std::string data;
+    ASSERT_OK(ReadFileToString(env, fname.c_str(), &data));
+    ASSERT_OK(WriteStringToFile(env, Slice(data.data(), 16), fname.c_str()));
+
+    ASSERT_TRUE(!reader.QueryParallel(-1, 0, 0.0f, 10.0f).ok());
+    std::vector< Query > qvec(2, Query(0, 0.0f, 10.0f));
+    ASSERT_TRUE(!reader.QueryParallel(qvec).ok());
+    ASSERT_TRUE(!reader.QueryNaive(0, 0.0f, 10.0f).ok());
+
+    ASSERT_OK(WriteStringToFile(env, data, fname.c_str()));
+  }
+}
+
+TEST(ReaderTest, FilterKeysCheck) {
+  srand(412);
+
+  const size_t n = 5000;
+  const uint32_t loc_base = 12288;
+  const float qmin = 1.25f, qmax = 2.5f;
+
+  std::string keyblk;
+  for (size_t i = 0; i < n; i++) {
+    /* hundredths, so that the bounds themselves occur */
+    PutFloat32(&keyblk, (rand() % 400) / 100.0f);
+  }
+
+  std::vector< CompactKeyPair > out;
+  QueryUtils::FilterKeys(keyblk.data(), n, sizeof(float), loc_base, qmin,
+                         qmax, out);
+
+  size_t oidx = 0;
+  for (size_t i = 0; i < n; i++) {
+    float key = DecodeFloat32(&keyblk[i * sizeof(float)]);
+    if (key < qmin or key > qmax) continue;
+    ASSERT_LT(oidx, out.size());
+    ASSERT_EQ(out[oidx].key, key);
+    ASSERT_EQ(out[oidx].loc, loc_base + i);
+    oidx++;
+  }
+  ASSERT_EQ(oidx, out.size());
+}
+
+TEST(ReaderTest, RadixSortCheck) {
+  srand(415);
+
+  ThreadPool* pool = ThreadPool::NewFixed(4);
+  RadixSorter par_sorter(pool, 4);
+  RadixSorter seq_sorter(NULL, 1);
+
+  /* below the cutoff, one chunk, and several chunks a pass */
+  const size_t sizes[] = {100, 10000, 300000};
+  /* many ties, negative keys, and keys agreeing in their high bits */
+  const float spans[] = {10.0f, 2000.0f, 0.01f};
+
+  for (size_t si = 0; si < 3; si++) {
+    for (size_t pi = 0; pi < 3; pi++) {
+      std::vector< KeyPair > kps(sizes[si]);
+      for (size_t i = 0; i < kps.size(); i++) {
+        kps[i].key = (rand() % 1000) * spans[pi] / 1000 - spans[pi] / 2;
+        if (i % 1009 == 0) kps[i].key = (i % 2) ? -0.0f : 0.0f;
+        kps[i].rank = rand() % 16;
+        kps[i].offset = i;
+      }
+
+      std::vector< KeyPair > expected = kps;
+      std::stable_sort(expected.begin(), expected.end(), KeyPairComparator());
+
+      std::vector< KeyPair > seq = kps;
+      seq_sorter.Sort(seq);
+      par_sorter.Sort(kps);
+
+      for (size_t i = 0; i < kps.size(); i++) {
+        ASSERT_EQ(kps[i].key, expected[i].key);
+        ASSERT_EQ(seq[i].key, expected[i].key);
+        ASSERT_EQ(seq[i].rank, kps[i].rank);
+        ASSERT_EQ(seq[i].offset, kps[i].offset);
+        if (sizes[si] < RadixSorter::kMinRadixSort) continue;
+        /* radix sorts are stable; ties between 0 and -0 aside */
+        if (kps[i].key == 0) continue;
+        ASSERT_EQ(kps[i].offset, expected[i].offset);
+      }
+    }
+  }
+
+  delete pool;
+}
+
+TEST(ReaderTest, RunMergeCheck) {
+  srand(425);
+
+  ThreadPool* pool = ThreadPool::NewFixed(4);
+  RunMerger par_merger(pool, 4);
+  RunMerger seq_merger(NULL, 1);
+
+  /* one run, a few, and many, some empty, so that a task may end in the
+   * middle of a run of ties, of 0 and -0 among others. Runs either all
+   * overlap, or each has a band of keys of its own, in run order or not,
+   * or shares it with one other run. */
+  const size_t nruns[] = {1, 3, 40};
+  const size_t n = 300000;
+  enum { kOverlapping, kDisjoint, kDisjointInOrder, kPairs };
+
+  for (size_t ri = 0; ri < 3; ri++) {
+    for (int ci = 0; ci < 2 * (kPairs + 1); ci++) {
+      const int layout = ci / 2, mixed = ci % 2;
+      std::vector< CompactKeyPair > kps(n);
+      std::vector< KeyRun > runs;
+      std::vector< size_t > bands(nruns[ri]);
+      for (size_t r = 0; r < nruns[ri]; r++) {
+        KeyRun run;
+        run.beg = n * r / nruns[ri];
+        run.end = run.beg;
+        run.sorted = true;
+        if (r % 7 == 5) runs.push_back(run);
+        run.end = n * (r + 1) / nruns[ri];
+        run.sorted = !mixed or r % 2 == 0;
+        runs.push_back(run);
+
+        bands[r] = r;
+      }
+      if (layout != kDisjointInOrder) {
+        std::random_shuffle(bands.begin(), bands.end());
+      }
+
+      for (size_t r = 0; r < nruns[ri]; r++) {
+        const size_t beg = n * r / nruns[ri], end = n * (r + 1) / nruns[ri];
+        for (size_t i = beg; i < end; i++) {
+          float key = (rand() % 1000) / 10.0f - 50.0f;
+          if (layout == kOverlapping) {
+            if (i % 1009 == 0) key = (i % 2) ? -0.0f : 0.0f;
+          } else {
+            size_t band = layout == kPairs ? bands[r] / 2 : bands[r];
+            key = band * 100.0f + (rand() % 1000) / 10.0f;
+          }
+          kps[i].key = key;
+          kps[i].loc = i;
+        }
+      }
+      for (size_t r = 0; r < runs.size(); r++) {
+        if (!runs[r].sorted) continue;
+        std::stable_sort(kps.begin() + runs[r].beg, kps.begin() + runs[r].end,
+                         KeyPairComparator());
+      }
+
+      size_t overlap = RunMerger::OverlapMass(kps, runs);
+      if (layout == kOverlapping and nruns[ri] > 1) ASSERT_EQ(overlap, n);
+      if (layout == kDisjoint or layout == kDisjointInOrder) {
+        ASSERT_EQ(overlap, 0);
+      }
+
+      std::vector< CompactKeyPair > expected = kps;
+      std::stable_sort(expected.begin(), expected.end(), KeyPairComparator());
+
+      std::vector< CompactKeyPair > seq = kps;
+      seq_merger.Merge(seq, runs);
+      par_merger.Merge(kps, runs);
+
+      for (size_t i = 0; i < n; i++) {
+        ASSERT_EQ(kps[i].key, expected[i].key);
+        ASSERT_EQ(seq[i].key, expected[i].key);
+        ASSERT_EQ(seq[i].loc, kps[i].loc);
+        /* ties go by run order, as the stable sort has them, unless
+         * sorting an unsorted run reordered them; 0 and -0 aside */
+        if (mixed or kps[i].key == 0) continue;
+        ASSERT_EQ(kps[i].loc, expected[i].loc);
+      }
+
+      /* each entry exactly once */
+      std::vector< bool > seen(n, false);
+      for (size_t i = 0; i < n; i++) {
+        ASSERT_TRUE(!seen[kps[i].loc]);
+        seen[kps[i].loc] = true;
+      }
+    }
+  }
+
+  delete pool;
+}
 }  // namespace plfsio
 }  // namespace pdlfs
 
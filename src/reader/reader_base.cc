@@ -12,15 +12,57 @@ Status ReaderBase::ReadManifests() {
   s = fdcache_.ReadDirectory(options_.data_path, num_ranks_);
   if (!s.ok()) return s;
 
+  std::vector< RdbFileInfo > listing;
+  fdcache_.GetListing(listing);
+
   rank_cursors_.resize(fdcache_.NumRanks(), 0);
+  manifest_reader_.Reset(num_ranks_);
+
+  bool from_cache = false;
+  if (options_.manifest_cache and num_ranks_ > 0) {
+    Status cs = mfcache_.Load(options_.data_path, listing);
+    if (cs.ok()) {
+      mfcache_.GetKVSizes(key_sz_, val_sz_);
+      s = manifest_reader_.UpdateKVSizes(key_sz_, val_sz_);
+      if (!s.ok()) return s;
+      from_cache = true;
+    } else {
+      logv(__LOG_ARGS__, LOG_INFO, "Manifest cache not used: %s",
+           cs.ToString().c_str());
+      mfcache_.Reset(options_.data_path, listing);
+    }
+  }
 
   for (int rank = 0; rank < num_ranks_; rank++) {
+    if (!fdcache_.HasRank(rank)) continue;
+
     ParsedFooter pf;
-    s = fdcache_.ReadFooter(rank, pf);
-    if (!s.ok()) return s;
 
-    s = manifest_reader_.UpdateKVSizes(pf.key_sz, pf.val_sz);
-    if (!s.ok()) return s;
+    if (from_cache) {
+      s = mfcache_.GetManifest(rank, pf.manifest_data, pf.num_epochs);
+      if (s.ok()) {
+        pf.manifest_sz = pf.manifest_data.size();
+      } else {
+        /* the rdb file itself still has the manifest */
+        logv(__LOG_ARGS__, LOG_WARN, "Rank %d: %s, reading its footer", rank,
+             s.ToString().c_str());
+        s = fdcache_.ReadFooter(rank, pf);
+        if (!s.ok()) return s;
+      }
+    } else {
+      s = fdcache_.ReadFooter(rank, pf);
+      if (!s.ok()) return s;
+
+      s = manifest_reader_.UpdateKVSizes(pf.key_sz, pf.val_sz);
+      if (!s.ok()) return s;
+
+      if (options_.manifest_cache) {
+        /* manifest_data may run past the manifest, into the footer suffix */
+        Slice manifest(pf.manifest_data.data(), pf.manifest_sz);
+        s = mfcache_.AddRank(rank, manifest, pf.num_epochs);
+        if (!s.ok()) return s;
+      }
+    }
 
     s = manifest_reader_.ReadManifest(rank, pf.manifest_data, pf.manifest_sz);
     if (!s.ok()) return s;
@@ -29,7 +71,18 @@ Status ReaderBase::ReadManifests() {
          pf.manifest_sz, pf.num_epochs);
   }
 
+  manifest_reader_.MergeManifests();
+  manifest_.BuildIndex();
   s = manifest_.GetKVSizes(key_sz_, val_sz_);
+  if (!s.ok()) return s;
+
+  if (options_.manifest_cache and num_ranks_ > 0 and !from_cache) {
+    Status cs = mfcache_.Write(key_sz_, val_sz_);
+    if (!cs.ok()) {
+      logv(__LOG_ARGS__, LOG_WARN, "Manifest cache not written: %s",
+           cs.ToString().c_str());
+    }
+  }
 
   return s;
 }
@@ -45,6 +98,14 @@ Status ReaderBase::ReadSST(const PartitionManifestItem& item, Slice& sst,
 
   req.scratch = scratch;
 
+  /* direct reads take absolute offsets, and leave the cursor alone */
+  if (options_.direct_scans) {
+    req.offset = item.offset;
+    s = fdcache_.Read(item.rank, req, false, kReadDirect);
+    if (s.ok()) sst = req.slice;
+    return s;
+  }
+
   bool reopen = false;
   size_t& cursor = rank_cursors_[item.rank];
 
@@ -65,7 +126,7 @@ Status ReaderBase::ReadSST(const PartitionManifestItem& item, Slice& sst,
   if (!s.ok()) return s;
 
   sst = req.slice;
-  cursor += req.bytes;
+  cursor = item.offset + req.bytes;
 
   return s;
 }
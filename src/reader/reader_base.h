@@ -6,6 +6,7 @@
 
 #include "common.h"
 #include "file_cache.h"
+#include "manifest_cache.h"
 #include "manifest_reader.h"
 
 #include <carp/manifest.h>
@@ -28,10 +29,13 @@ class ReaderBase {
   ReaderBase(const RdbOptions options)
       : options_(options),
         num_ranks_(0),
-        fdcache_(options.env),
+        fdcache_(options.env, options.max_open_files),
         manifest_reader_(manifest_),
+        mfcache_(options.env),
         key_sz_(0),
-        val_sz_(0) {}
+        val_sz_(0) {
+    fdcache_.SetCoalescing(CoalesceOptions(options));
+  }
 
  protected:
   Status ReadManifests();
@@ -46,6 +50,7 @@ class ReaderBase {
   CachingDirReader<SequentialFile> fdcache_;
   PartitionManifest manifest_;
   PartitionManifestReader manifest_reader_;
+  ManifestCache mfcache_;
 
   std::vector<size_t> rank_cursors_;
   uint64_t key_sz_;
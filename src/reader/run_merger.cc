@@ -0,0 +1,373 @@
+//
+// run_merger.cc: parallel multiway merge of sorted runs of query results
+//
+
+#include "run_merger.h"
+
+#include "range_reader.h"
+
+#include "pdlfs-common/mutexlock.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace pdlfs {
+namespace plfsio {
+namespace {
+/* the order-preserving bits of a float, as in radix_sort.cc, and back */
+inline uint32_t SortableBits(float key) {
+  uint32_t u;
+  memcpy(&u, &key, sizeof(u));
+  return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+inline float FromSortableBits(uint32_t u) {
+  u = (u & 0x80000000u) ? (u & 0x7fffffffu) : ~u;
+  float key;
+  memcpy(&key, &u, sizeof(key));
+  return key;
+}
+
+struct KeyLess {
+  bool operator()(const CompactKeyPair& kp, float key) const {
+    return kp.key < key;
+  }
+
+  bool operator()(float key, const CompactKeyPair& kp) const {
+    return key < kp.key;
+  }
+};
+
+/* the head of a run in the merge heap */
+struct HeapEntry {
+  float key;
+  uint32_t run;
+};
+
+/* std::*_heap keep the greatest on top, so this puts the smallest key
+ * there, and of equal keys the earliest run */
+struct HeapOrder {
+  bool operator()(const HeapEntry& a, const HeapEntry& b) const {
+    if (a.key != b.key) return a.key > b.key;
+    return a.run > b.run;
+  }
+};
+
+/* the keys a run spans */
+struct RunSpan {
+  float lo;
+  float hi;
+  size_t run;
+};
+
+struct SpanOrder {
+  bool operator()(const RunSpan& a, const RunSpan& b) const {
+    if (a.lo != b.lo) return a.lo < b.lo;
+    if (a.hi != b.hi) return a.hi < b.hi;
+    return a.run < b.run;
+  }
+};
+}  // namespace
+
+struct RunMerger::SortTask {
+  CompactKeyPair* beg;
+  CompactKeyPair* end;
+
+  port::Mutex* mutex;
+  port::CondVar* cv;
+  int* tasks_pending;
+};
+
+/* [cut_beg[i], cut_end[i]) of every run i of a group, merged into
+ * dst + out_beg, or copied if only one of them is not empty */
+struct RunMerger::Piece {
+  size_t out_beg;
+  std::vector<size_t> cut_beg;
+  std::vector<size_t> cut_end;
+};
+
+/* the pieces [beg, end), which are next to each other in dst */
+struct RunMerger::MergeTask {
+  const CompactKeyPair* src;
+  CompactKeyPair* dst;
+  Piece* beg;
+  Piece* end;
+
+  port::Mutex* mutex;
+  port::CondVar* cv;
+  int* tasks_pending;
+};
+
+void RunMerger::SortWorker(void* arg) {
+  SortTask* t = static_cast<SortTask*>(arg);
+  std::sort(t->beg, t->end, KeyPairComparator());
+
+  MutexLock ml(t->mutex);
+  if (--*t->tasks_pending == 0) t->cv->SignalAll();
+}
+
+void RunMerger::MergeWorker(void* arg) {
+  MergeTask* t = static_cast<MergeTask*>(arg);
+
+  std::vector<HeapEntry> heap;
+  for (Piece* p = t->beg; p != t->end; p++) {
+    std::vector<size_t>& cur = p->cut_beg;
+    const std::vector<size_t>& end = p->cut_end;
+
+    heap.clear();
+    for (size_t i = 0; i < cur.size(); i++) {
+      if (cur[i] == end[i]) continue;
+      HeapEntry e;
+      e.key = t->src[cur[i]].key;
+      e.run = i;
+      heap.push_back(e);
+    }
+
+    CompactKeyPair* out = t->dst + p->out_beg;
+    if (heap.size() == 1) {
+      size_t i = heap[0].run;
+      std::copy(t->src + cur[i], t->src + end[i], out);
+      continue;
+    }
+
+    std::make_heap(heap.begin(), heap.end(), HeapOrder());
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), HeapOrder());
+      HeapEntry& e = heap.back();
+      *out++ = t->src[cur[e.run]++];
+
+      if (cur[e.run] == end[e.run]) {
+        heap.pop_back();
+      } else {
+        e.key = t->src[cur[e.run]].key;
+        std::push_heap(heap.begin(), heap.end(), HeapOrder());
+      }
+    }
+  }
+
+  MutexLock ml(t->mutex);
+  if (--*t->tasks_pending == 0) t->cv->SignalAll();
+}
+
+template <typename Task>
+void RunMerger::RunTasks(std::vector<Task>& tasks, void (*fn)(void*)) {
+  port::Mutex mutex;
+  port::CondVar cv(&mutex);
+  int tasks_pending = tasks.size();
+
+  for (size_t i = 0; i < tasks.size(); i++) {
+    tasks[i].mutex = &mutex;
+    tasks[i].cv = &cv;
+    tasks[i].tasks_pending = &tasks_pending;
+  }
+
+  if (pool_ == NULL or tasks.size() == 1) {
+    for (size_t i = 0; i < tasks.size(); i++) fn(&tasks[i]);
+    return;
+  }
+
+  for (size_t i = 0; i < tasks.size(); i++) {
+    pool_->Schedule(fn, &tasks[i]);
+  }
+
+  mutex.Lock();
+  while (tasks_pending > 0) cv.Wait();
+  mutex.Unlock();
+}
+
+void RunMerger::FindCuts(const CompactKeyPair* kps,
+                         const std::vector<KeyRun>& runs, size_t r,
+                         std::vector<size_t>& cuts) {
+  /* the key space the runs span. Results are range-filtered, so hold no
+   * NaNs, and every value in between is a number. */
+  uint32_t lo = UINT32_MAX, hi = 0;
+  for (size_t i = 0; i < runs.size(); i++) {
+    if (runs[i].beg == runs[i].end) continue;
+    lo = std::min(lo, SortableBits(kps[runs[i].beg].key));
+    hi = std::max(hi, SortableBits(kps[runs[i].end - 1].key));
+  }
+
+  /* the smallest key with at least r entries at or below it */
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    float key = FromSortableBits(mid);
+    size_t cnt = 0;
+    for (size_t i = 0; i < runs.size(); i++) {
+      cnt += std::upper_bound(kps + runs[i].beg, kps + runs[i].end, key,
+                              KeyLess()) -
+             (kps + runs[i].beg);
+    }
+    if (cnt >= r) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  /* everything below that key, and then as many entries equal to it as
+   * still needed, from the earliest runs first */
+  const float key = FromSortableBits(lo);
+  size_t below = 0;
+  cuts.resize(runs.size());
+  for (size_t i = 0; i < runs.size(); i++) {
+    cuts[i] = std::lower_bound(kps + runs[i].beg, kps + runs[i].end, key,
+                               KeyLess()) -
+              kps;
+    below += cuts[i] - runs[i].beg;
+  }
+
+  size_t need = r - below;
+  for (size_t i = 0; i < runs.size() and need > 0; i++) {
+    size_t eq = std::upper_bound(kps + cuts[i], kps + runs[i].end, key,
+                                 KeyLess()) -
+                (kps + cuts[i]);
+    size_t take = std::min(eq, need);
+    cuts[i] += take;
+    need -= take;
+  }
+}
+
+void RunMerger::GroupRuns(const CompactKeyPair* kps,
+                          const std::vector<KeyRun>& runs,
+                          std::vector<std::vector<size_t> >& groups) {
+  std::vector<RunSpan> spans;
+  for (size_t i = 0; i < runs.size(); i++) {
+    const CompactKeyPair* beg = kps + runs[i].beg;
+    const CompactKeyPair* end = kps + runs[i].end;
+    if (beg == end) continue;
+
+    RunSpan span;
+    span.run = i;
+    if (runs[i].sorted) {
+      span.lo = beg->key;
+      span.hi = (end - 1)->key;
+    } else {
+      span.lo = std::min_element(beg, end, KeyPairComparator())->key;
+      span.hi = std::max_element(beg, end, KeyPairComparator())->key;
+    }
+    spans.push_back(span);
+  }
+
+  std::sort(spans.begin(), spans.end(), SpanOrder());
+
+  /* a run starting past every key of the group so far starts a new one.
+   * Runs that only touch it join it, so that ties still go by run order. */
+  groups.clear();
+  float hi = 0;
+  for (size_t i = 0; i < spans.size(); i++) {
+    if (groups.empty() or spans[i].lo > hi) {
+      groups.push_back(std::vector<size_t>());
+      hi = spans[i].hi;
+    }
+    groups.back().push_back(spans[i].run);
+    hi = std::max(hi, spans[i].hi);
+  }
+
+  for (size_t g = 0; g < groups.size(); g++) {
+    std::sort(groups[g].begin(), groups[g].end());
+  }
+}
+
+size_t RunMerger::OverlapMass(const std::vector<CompactKeyPair>& kps,
+                              const std::vector<KeyRun>& runs) {
+  if (kps.empty()) return 0;
+
+  std::vector<std::vector<size_t> > groups;
+  GroupRuns(&kps[0], runs, groups);
+
+  size_t mass = 0;
+  for (size_t g = 0; g < groups.size(); g++) {
+    if (groups[g].size() < 2) continue;
+    for (size_t i = 0; i < groups[g].size(); i++) {
+      const KeyRun& run = runs[groups[g][i]];
+      mass += run.end - run.beg;
+    }
+  }
+
+  return mass;
+}
+
+void RunMerger::Merge(std::vector<CompactKeyPair>& kps,
+                      const std::vector<KeyRun>& runs) {
+  const size_t n = kps.size();
+
+  std::vector<SortTask> sort_tasks;
+  for (size_t i = 0; i < runs.size(); i++) {
+    if (runs[i].sorted or runs[i].end - runs[i].beg < 2) continue;
+    SortTask t;
+    t.beg = &kps[0] + runs[i].beg;
+    t.end = &kps[0] + runs[i].end;
+    sort_tasks.push_back(t);
+  }
+
+  if (!sort_tasks.empty()) RunTasks(sort_tasks, SortWorker);
+  if (runs.size() < 2 or n == 0) return;
+
+  std::vector<std::vector<size_t> > groups;
+  GroupRuns(&kps[0], runs, groups);
+
+  /* runs that are already in key order, and overlap no other run */
+  bool in_order = true;
+  for (size_t g = 0; in_order and g < groups.size(); g++) {
+    in_order = groups[g].size() == 1 and
+               (g == 0 or groups[g][0] > groups[g - 1][0]);
+  }
+  if (in_order) return;
+
+  /* each group is cut into pieces of about n / parallelism_ entries */
+  const size_t target = std::max(kMinChunk, n / parallelism_);
+
+  std::vector<Piece> pieces;
+  size_t out = 0;
+  for (size_t g = 0; g < groups.size(); g++) {
+    std::vector<KeyRun> gruns;
+    size_t m = 0;
+    for (size_t i = 0; i < groups[g].size(); i++) {
+      gruns.push_back(runs[groups[g][i]]);
+      m += gruns.back().end - gruns.back().beg;
+    }
+
+    size_t npieces = std::max(m / target, (size_t)1);
+    std::vector<std::vector<size_t> > cuts(npieces + 1);
+    for (size_t i = 0; i < gruns.size(); i++) {
+      cuts[0].push_back(gruns[i].beg);
+      cuts[npieces].push_back(gruns[i].end);
+    }
+    for (size_t t = 1; t < npieces; t++) {
+      FindCuts(&kps[0], gruns, m * t / npieces, cuts[t]);
+    }
+
+    for (size_t t = 0; t < npieces; t++) {
+      pieces.push_back(Piece());
+      pieces.back().out_beg = out + m * t / npieces;
+      pieces.back().cut_beg.swap(cuts[t]);
+      pieces.back().cut_end = cuts[t + 1];
+    }
+    out += m;
+  }
+
+  /* consecutive pieces, until they hold target entries or more */
+  std::vector<MergeTask> tasks;
+  for (size_t beg = 0, end = 0; beg < pieces.size(); beg = end) {
+    end = beg + 1;
+    while (end < pieces.size() and
+           pieces[end].out_beg - pieces[beg].out_beg < target) {
+      end++;
+    }
+
+    MergeTask t;
+    t.src = &kps[0];
+    t.beg = &pieces[beg];
+    t.end = &pieces[0] + end;
+    tasks.push_back(t);
+  }
+
+  std::vector<CompactKeyPair> scratch(n);
+  for (size_t t = 0; t < tasks.size(); t++) tasks[t].dst = &scratch[0];
+
+  RunTasks(tasks, MergeWorker);
+
+  kps.swap(scratch);
+}
+}  // namespace plfsio
+}  // namespace pdlfs
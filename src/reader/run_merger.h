@@ -0,0 +1,94 @@
+//
+// run_merger.h: parallel multiway merge of sorted runs of query results
+//
+
+#pragma once
+
+#include "pdlfs-common/env.h"
+#include "pdlfs-common/port.h"
+
+#include <vector>
+
+namespace pdlfs {
+namespace plfsio {
+struct CompactKeyPair;
+
+/* KeyRun: [beg, end) of a result vector, holding the matches of one SST,
+ * and whether they came out of the SST already in key order */
+struct KeyRun {
+  size_t beg;
+  size_t end;
+  bool sorted;
+};
+
+/* RunMerger: puts a result vector made of runs in key order by sorting
+ * the runs that are not sorted, each on its own, and merging them.
+ *
+ * Runs are ordered by their first and last keys, and split into groups
+ * whose key ranges do not overlap. A group of one run is copied to its
+ * place in the output, in O(n). Only groups of overlapping runs are
+ * merged, with a heap, in O(n log k) for k runs of the group. The runs
+ * of a compacted dir, each holding its own part of the key space, are
+ * thus only copied, however many there are.
+ *
+ * The work is split among up to parallelism tasks by output position:
+ * the cut of each run of a group at a task boundary is found by a binary
+ * search over the key space (merge path partitioning), and each task then
+ * copies or merges its parts of the groups independently. Ties are broken
+ * by run order. Like RadixSorter, it allocates its scratch array per
+ * call and frees kps' old buffer before returning, and must not be called
+ * from a task on its pool.
+ */
+class RunMerger {
+ public:
+  RunMerger(ThreadPool* pool, int parallelism)
+      : pool_(pool), parallelism_(parallelism > 0 ? parallelism : 1) {}
+
+  /* runs must cover kps, in order */
+  void Merge(std::vector<CompactKeyPair>& kps,
+             const std::vector<KeyRun>& runs);
+
+  /* entries of kps in runs that overlap another run, which Merge would
+   * merge rather than copy. Scans the runs that are not sorted for their
+   * first and last keys. */
+  static size_t OverlapMass(const std::vector<CompactKeyPair>& kps,
+                            const std::vector<KeyRun>& runs);
+
+  /* each merge task writes at least this many entries */
+  static const size_t kMinChunk = 65536;
+  /* below this many entries, RadixSorter is faster than merging, unless
+   * most entries are only copied */
+  static const size_t kMinRadixMerge = 4 << 20;
+
+ private:
+  struct SortTask;
+  struct Piece;
+  struct MergeTask;
+
+  template <typename Task>
+  void RunTasks(std::vector<Task>& tasks, void (*fn)(void*));
+
+  static void SortWorker(void* arg);
+  static void MergeWorker(void* arg);
+
+  /* Splits the non-empty runs into groups that overlap no other group,
+   * in key order. Each group lists its runs by index, in run order. */
+  static void GroupRuns(const CompactKeyPair* kps,
+                        const std::vector<KeyRun>& runs,
+                        std::vector<std::vector<size_t> >& groups);
+
+  /* sets cuts[i] to where in runs[i] the first r entries of the merge
+   * end */
+  static void FindCuts(const CompactKeyPair* kps,
+                       const std::vector<KeyRun>& runs, size_t r,
+                       std::vector<size_t>& cuts);
+
+  /* No copying allowed */
+  RunMerger(const RunMerger&);
+  void operator=(const RunMerger&);
+
+  ThreadPool* const pool_;
+  const int parallelism_;
+};
+}  // namespace plfsio
+}  // namespace pdlfs
@@ -0,0 +1,301 @@
+//
+// simd_filter.cc: vectorized filter kernels with runtime ISA dispatch
+//
+
+#include "simd_filter.h"
+
+#include "carp/coding_float.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CARP_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace pdlfs {
+namespace plfsio {
+namespace {
+SimdLevel DetectLevel() {
+  SimdLevel level = kSimdScalar;
+
+#ifdef CARP_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) level = kSimdSSE;
+  if (__builtin_cpu_supports("avx2")) level = kSimdAVX2;
+  if (__builtin_cpu_supports("avx512f")) level = kSimdAVX512;
+#endif
+
+  const char* cap = getenv("CARP_SIMD");
+  if (cap != NULL) {
+    SimdLevel cap_level = level;
+    if (strcmp(cap, "scalar") == 0) cap_level = kSimdScalar;
+    if (strcmp(cap, "sse") == 0) cap_level = kSimdSSE;
+    if (strcmp(cap, "avx2") == 0) cap_level = kSimdAVX2;
+    if (strcmp(cap, "avx512") == 0) cap_level = kSimdAVX512;
+    if (cap_level < level) level = cap_level;
+  }
+
+  return level;
+}
+
+/* Range::Overlaps, spelled out on raw bounds */
+inline bool Overlaps(float rmin, float rmax, float qmin, float qmax) {
+  return (qmin >= rmin and qmin <= rmax) or (qmax >= rmin and qmax <= rmax) or
+         (qmin < rmin and qmax > rmax);
+}
+
+size_t FilterOverlappingScalar(const float* mins, const float* maxs,
+                               size_t beg, size_t n, float qmin, float qmax,
+                               uint32_t* idx) {
+  size_t nout = 0;
+  for (size_t i = beg; i < n; i++) {
+    /* branch-free append: always write, advance only on a match */
+    idx[nout] = i;
+    nout += Overlaps(mins[i], maxs[i], qmin, qmax);
+  }
+  return nout;
+}
+
+size_t FilterKeysScalar(const char* keyblk, size_t beg, size_t n, float qmin,
+                        float qmax, float* keys, uint32_t* idx) {
+  size_t nout = 0;
+  for (size_t i = beg; i < n; i++) {
+    float key = DecodeFloat32(keyblk + i * sizeof(float));
+    keys[nout] = key;
+    idx[nout] = i;
+    nout += (key >= qmin) & (key <= qmax);
+  }
+  return nout;
+}
+
+#ifdef CARP_SIMD_X86
+inline size_t AppendMask(unsigned mask, size_t base, uint32_t* idx) {
+  size_t nout = 0;
+  while (mask) {
+    idx[nout++] = base + __builtin_ctz(mask);
+    mask &= mask - 1;
+  }
+  return nout;
+}
+
+__attribute__((target("sse2"))) size_t FilterOverlappingSSE(
+    const float* mins, const float* maxs, size_t n, float qmin, float qmax,
+    uint32_t* idx) {
+  const __m128 vqmin = _mm_set1_ps(qmin);
+  const __m128 vqmax = _mm_set1_ps(qmax);
+
+  size_t i = 0, nout = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 lo = _mm_loadu_ps(mins + i);
+    __m128 hi = _mm_loadu_ps(maxs + i);
+
+    __m128 qmin_in =
+        _mm_and_ps(_mm_cmpge_ps(vqmin, lo), _mm_cmple_ps(vqmin, hi));
+    __m128 qmax_in =
+        _mm_and_ps(_mm_cmpge_ps(vqmax, lo), _mm_cmple_ps(vqmax, hi));
+    __m128 covers =
+        _mm_and_ps(_mm_cmplt_ps(vqmin, lo), _mm_cmpgt_ps(vqmax, hi));
+
+    __m128 match = _mm_or_ps(_mm_or_ps(qmin_in, qmax_in), covers);
+    nout += AppendMask(_mm_movemask_ps(match), i, idx + nout);
+  }
+
+  return nout +
+         FilterOverlappingScalar(mins, maxs, i, n, qmin, qmax, idx + nout);
+}
+
+__attribute__((target("avx2"))) size_t FilterOverlappingAVX2(
+    const float* mins, const float* maxs, size_t n, float qmin, float qmax,
+    uint32_t* idx) {
+  const __m256 vqmin = _mm256_set1_ps(qmin);
+  const __m256 vqmax = _mm256_set1_ps(qmax);
+
+  size_t i = 0, nout = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 lo = _mm256_loadu_ps(mins + i);
+    __m256 hi = _mm256_loadu_ps(maxs + i);
+
+    __m256 qmin_in = _mm256_and_ps(_mm256_cmp_ps(vqmin, lo, _CMP_GE_OQ),
+                                   _mm256_cmp_ps(vqmin, hi, _CMP_LE_OQ));
+    __m256 qmax_in = _mm256_and_ps(_mm256_cmp_ps(vqmax, lo, _CMP_GE_OQ),
+                                   _mm256_cmp_ps(vqmax, hi, _CMP_LE_OQ));
+    __m256 covers = _mm256_and_ps(_mm256_cmp_ps(vqmin, lo, _CMP_LT_OQ),
+                                  _mm256_cmp_ps(vqmax, hi, _CMP_GT_OQ));
+
+    __m256 match = _mm256_or_ps(_mm256_or_ps(qmin_in, qmax_in), covers);
+    nout += AppendMask(_mm256_movemask_ps(match), i, idx + nout);
+  }
+
+  return nout +
+         FilterOverlappingScalar(mins, maxs, i, n, qmin, qmax, idx + nout);
+}
+
+/* x86 is little-endian, so the SIMD kernels load key blocks as is */
+__attribute__((target("sse2"))) size_t FilterKeysSSE(const char* keyblk,
+                                                     size_t n, float qmin,
+                                                     float qmax, float* keys,
+                                                     uint32_t* idx) {
+  const float* kf = reinterpret_cast< const float* >(keyblk);
+  const __m128 vqmin = _mm_set1_ps(qmin);
+  const __m128 vqmax = _mm_set1_ps(qmax);
+
+  size_t i = 0, nout = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 k = _mm_loadu_ps(kf + i);
+    __m128 match = _mm_and_ps(_mm_cmpge_ps(k, vqmin), _mm_cmple_ps(k, vqmax));
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, k);
+    unsigned mask = _mm_movemask_ps(match);
+    while (mask) {
+      unsigned j = __builtin_ctz(mask);
+      keys[nout] = lanes[j];
+      idx[nout++] = i + j;
+      mask &= mask - 1;
+    }
+  }
+
+  return nout + FilterKeysScalar(keyblk, i, n, qmin, qmax, keys + nout,
+                                 idx + nout);
+}
+
+/* AVX2 has no compress-store: a permutation moving the lanes set in a mask
+ * to the front stands in for it, one per 8-bit mask */
+struct CompressTable {
+  CompressTable() {
+    for (unsigned mask = 0; mask < 256; mask++) {
+      unsigned j = 0;
+      for (unsigned lane = 0; lane < 8; lane++) {
+        if (mask & (1u << lane)) perm[mask][j++] = lane;
+      }
+      while (j < 8) perm[mask][j++] = 0;
+    }
+  }
+
+  uint32_t perm[256][8];
+};
+
+const CompressTable& GetCompressTable() {
+  static const CompressTable table;
+  return table;
+}
+
+__attribute__((target("avx2"))) size_t FilterKeysAVX2(const char* keyblk,
+                                                      size_t n, float qmin,
+                                                      float qmax, float* keys,
+                                                      uint32_t* idx) {
+  const CompressTable& table = GetCompressTable();
+  const float* kf = reinterpret_cast< const float* >(keyblk);
+  const __m256 vqmin = _mm256_set1_ps(qmin);
+  const __m256 vqmax = _mm256_set1_ps(qmax);
+  const __m256i step = _mm256_set1_epi32(8);
+  __m256i vidx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+  /* every store is a full 8 lanes, but starts at nout <= i, so stays in
+   * the first n entries of keys and idx */
+  size_t i = 0, nout = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 k = _mm256_loadu_ps(kf + i);
+    __m256 match = _mm256_and_ps(_mm256_cmp_ps(k, vqmin, _CMP_GE_OQ),
+                                 _mm256_cmp_ps(k, vqmax, _CMP_LE_OQ));
+    unsigned mask = _mm256_movemask_ps(match);
+
+    __m256i perm = _mm256_loadu_si256(
+        reinterpret_cast< const __m256i* >(table.perm[mask]));
+    _mm256_storeu_ps(keys + nout, _mm256_permutevar8x32_ps(k, perm));
+    _mm256_storeu_si256(reinterpret_cast< __m256i* >(idx + nout),
+                        _mm256_permutevar8x32_epi32(vidx, perm));
+
+    nout += __builtin_popcount(mask);
+    vidx = _mm256_add_epi32(vidx, step);
+  }
+
+  return nout + FilterKeysScalar(keyblk, i, n, qmin, qmax, keys + nout,
+                                 idx + nout);
+}
+
+__attribute__((target("avx512f"))) size_t FilterKeysAVX512(
+    const char* keyblk, size_t n, float qmin, float qmax, float* keys,
+    uint32_t* idx) {
+  const float* kf = reinterpret_cast< const float* >(keyblk);
+  const __m512 vqmin = _mm512_set1_ps(qmin);
+  const __m512 vqmax = _mm512_set1_ps(qmax);
+  const __m512i step = _mm512_set1_epi32(16);
+  __m512i vidx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+                                   13, 14, 15);
+
+  size_t i = 0, nout = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 k = _mm512_loadu_ps(kf + i);
+    __mmask16 mask = _mm512_cmp_ps_mask(k, vqmin, _CMP_GE_OQ);
+    mask = _mm512_mask_cmp_ps_mask(mask, k, vqmax, _CMP_LE_OQ);
+
+    _mm512_mask_compressstoreu_ps(keys + nout, mask, k);
+    _mm512_mask_compressstoreu_epi32(idx + nout, mask, vidx);
+
+    nout += __builtin_popcount(mask);
+    vidx = _mm512_add_epi32(vidx, step);
+  }
+
+  return nout + FilterKeysScalar(keyblk, i, n, qmin, qmax, keys + nout,
+                                 idx + nout);
+}
+#endif
+}  // namespace
+
+SimdLevel SimdFilter::Level() {
+  static const SimdLevel level = DetectLevel();
+  return level;
+}
+
+const char* SimdFilter::LevelName(SimdLevel level) {
+  switch (level) {
+    case kSimdSSE:
+      return "sse";
+    case kSimdAVX2:
+      return "avx2";
+    case kSimdAVX512:
+      return "avx512";
+    case kSimdScalar:
+    default:
+      return "scalar";
+  }
+}
+
+size_t SimdFilter::FilterOverlapping(SimdLevel level, const float* mins,
+                                     const float* maxs, size_t n, float qmin,
+                                     float qmax, uint32_t* idx) {
+  /* never dispatch beyond what the CPU supports */
+  level = std::min(level, Level());
+
+#ifdef CARP_SIMD_X86
+  if (level >= kSimdAVX2) {
+    return FilterOverlappingAVX2(mins, maxs, n, qmin, qmax, idx);
+  } else if (level >= kSimdSSE) {
+    return FilterOverlappingSSE(mins, maxs, n, qmin, qmax, idx);
+  }
+#endif
+  return FilterOverlappingScalar(mins, maxs, 0, n, qmin, qmax, idx);
+}
+
+size_t SimdFilter::FilterKeys(SimdLevel level, const char* keyblk, size_t n,
+                              float qmin, float qmax, float* keys,
+                              uint32_t* idx) {
+  level = std::min(level, Level());
+
+#ifdef CARP_SIMD_X86
+  if (level >= kSimdAVX512) {
+    return FilterKeysAVX512(keyblk, n, qmin, qmax, keys, idx);
+  } else if (level >= kSimdAVX2) {
+    return FilterKeysAVX2(keyblk, n, qmin, qmax, keys, idx);
+  } else if (level >= kSimdSSE) {
+    return FilterKeysSSE(keyblk, n, qmin, qmax, keys, idx);
+  }
+#endif
+  return FilterKeysScalar(keyblk, 0, n, qmin, qmax, keys, idx);
+}
+}  // namespace plfsio
+}  // namespace pdlfs
@@ -0,0 +1,56 @@
+//
+// simd_filter.h: vectorized filter kernels with runtime ISA dispatch
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace pdlfs {
+namespace plfsio {
+enum SimdLevel {
+  kSimdScalar = 0,
+  kSimdSSE = 1,
+  kSimdAVX2 = 2,
+  kSimdAVX512 = 3,
+};
+
+class SimdFilter {
+ public:
+  /* Best level supported by both the build and the running CPU. Can be
+   * capped with the CARP_SIMD env var (scalar/sse/avx2/avx512), which is mostly
+   * useful for benchmarking the kernels against each other. */
+  static SimdLevel Level();
+
+  static const char* LevelName(SimdLevel level);
+
+  /* Writes to idx the positions i in [0, n) for which the interval
+   * [mins[i], maxs[i]] overlaps [qmin, qmax], with the exact semantics
+   * of Range::Overlaps. Returns the number of positions written; idx
+   * must have room for n entries. */
+  static size_t FilterOverlapping(const float* mins, const float* maxs,
+                                  size_t n, float qmin, float qmax,
+                                  uint32_t* idx) {
+    return FilterOverlapping(Level(), mins, maxs, n, qmin, qmax, idx);
+  }
+
+  static size_t FilterOverlapping(SimdLevel level, const float* mins,
+                                  const float* maxs, size_t n, float qmin,
+                                  float qmax, uint32_t* idx);
+
+  /* Writes to keys and idx the keys of keyblk, n packed little-endian
+   * float32s, that are in [qmin, qmax], and their positions, in key block
+   * order. Returns the number written; keys and idx must have room for n
+   * entries. */
+  static size_t FilterKeys(const char* keyblk, size_t n, float qmin,
+                           float qmax, float* keys, uint32_t* idx) {
+    return FilterKeys(Level(), keyblk, n, qmin, qmax, keys, idx);
+  }
+
+  static size_t FilterKeys(SimdLevel level, const char* keyblk, size_t n,
+                           float qmin, float qmax, float* keys,
+                           uint32_t* idx);
+};
+}  // namespace plfsio
+}  // namespace pdlfs
@@ -28,26 +28,35 @@ Status SlidingSorter::AddManifestItem(const PartitionManifestItem& item) {
   char *buf = new char[req.bytes];
   req.scratch = &buf[0];
 
-  bool reopen = false;
-  size_t& cursor = rank_cursors_[item.rank];
-
-  /* reopen every file on first read, just to be safe
-   * we assume fdcache doesn't serve any other reader
-   * as sliding_sorter is reading
-   */
-  if (cursor == 0) reopen = true;
-
-  if (item.offset < cursor) {
-    reopen = true;  // random read in seq file; move cursor to offset 0
-    cursor = 0;
-  }
+  if (mode_ == kReadDirect) {
+    /* absolute offset, the cursor is left alone */
+    req.offset = item.offset;
+    s = fdcache_.Read(item.rank, req, false, kReadDirect);
+  } else {
+    bool reopen = false;
+    size_t& cursor = rank_cursors_[item.rank];
+
+    /* reopen every file on first read, just to be safe
+     * we assume fdcache doesn't serve any other reader
+     * as sliding_sorter is reading
+     */
+    if (cursor == 0) reopen = true;
 
-  // relative offset
-  req.offset = item.offset - cursor;
-  s = fdcache_.Read(item.rank, req, reopen);
-  if (!s.ok()) return s;
+    if (item.offset < cursor) {
+      reopen = true;  // random read in seq file; move cursor to offset 0
+      cursor = 0;
+    }
 
-  cursor += req.offset + req.bytes;
+    // relative offset
+    req.offset = item.offset - cursor;
+    s = fdcache_.Read(item.rank, req, reopen);
+    if (s.ok()) cursor += req.offset + req.bytes;
+  }
+
+  if (!s.ok()) {
+    delete[] buf;
+    return s;
+  }
 
   AddSST(req.slice, item_sz, item.part_item_count);
   delete[] buf;
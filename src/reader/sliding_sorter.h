@@ -16,8 +16,13 @@ namespace plfsio {
 class SlidingSorter {
  public:
   explicit SlidingSorter(std::string dir_out,
-                         CachingDirReader< SequentialFile >& fdcache)
-      : num_ranks_(0), last_cutoff_(0), dir_out_(dir_out), fdcache_(fdcache) {}
+                         CachingDirReader< SequentialFile >& fdcache,
+                         ReadMode mode = kReadCached)
+      : num_ranks_(0),
+        last_cutoff_(0),
+        dir_out_(dir_out),
+        fdcache_(fdcache),
+        mode_(mode) {}
 
   Status AddManifestItem(const PartitionManifestItem& item);
 
@@ -137,6 +142,7 @@ class SlidingSorter {
   std::string dir_out_;
 
   CachingDirReader< SequentialFile >& fdcache_;
+  const ReadMode mode_;
   std::vector< size_t > rank_cursors_;
   std::priority_queue< KVItem, std::vector< KVItem >, std::greater< KVItem > >
       merge_pool_;
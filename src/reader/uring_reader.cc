@@ -0,0 +1,344 @@
+//
+// uring_reader.cc: batched positional reads over io_uring
+//
+
+#include "uring_reader.h"
+
+#include <carp/carp_config.h>
+
+#include "common.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+
+#ifdef CARP_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace pdlfs {
+namespace plfsio {
+namespace {
+/* reports every request not finished yet as failed with s */
+void FailAll(const std::vector<bool>& finished, ReadCallback cb, void* arg,
+             const Status& s) {
+  for (size_t i = 0; i < finished.size(); i++) {
+    if (!finished[i]) cb(arg, i, s);
+  }
+}
+}  // namespace
+
+#ifdef CARP_IO_URING
+namespace {
+/* true if the kernel behind ring_fd supports IORING_OP_READ */
+bool ProbeRead(int ring_fd) {
+  const unsigned num_ops = IORING_OP_READ + 1;
+  std::vector<char> buf(sizeof(struct io_uring_probe) +
+                        num_ops * sizeof(struct io_uring_probe_op));
+  struct io_uring_probe* probe = (struct io_uring_probe*)&buf[0];
+  int rv = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+                   probe, num_ops);
+  if (rv < 0 or probe->last_op < IORING_OP_READ) return false;
+  return probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED;
+}
+}  // namespace
+
+struct UringReader::Ring {
+  void* sq_map;
+  size_t sq_map_sz;
+  void* cq_map;
+  size_t cq_map_sz;
+  struct io_uring_sqe* sqes;
+  size_t sqes_sz;
+
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+};
+
+UringReader::UringReader() : ring_fd_(-1), queue_depth_(0), ring_(NULL) {}
+
+UringReader::~UringReader() { Close(); }
+
+void UringReader::Close() {
+  if (ring_ != NULL) {
+    munmap(ring_->sqes, ring_->sqes_sz);
+    if (ring_->cq_map != ring_->sq_map) {
+      munmap(ring_->cq_map, ring_->cq_map_sz);
+    }
+    munmap(ring_->sq_map, ring_->sq_map_sz);
+    delete ring_;
+    ring_ = NULL;
+  }
+
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+    ring_fd_ = -1;
+  }
+}
+
+Status UringReader::Open(uint32_t queue_depth) {
+  Close();
+  if (queue_depth == 0) return Status::InvalidArgument("Zero queue depth");
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  int fd = syscall(__NR_io_uring_setup, queue_depth, &p);
+  if (fd < 0) {
+    return Status::NotSupported("io_uring_setup", strerror(errno));
+  }
+
+  ring_fd_ = fd;
+  /* rings exist since linux 5.1 but IORING_OP_READ only since 5.6, which
+   * also added the probe: if either is missing, callers use pread */
+  if (!ProbeRead(fd)) {
+    Close();
+    return Status::NotSupported("io_uring", "IORING_OP_READ not supported");
+  }
+
+  ring_ = new Ring();
+  Ring& r = *ring_;
+
+  r.sq_map_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r.cq_map_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  /* with IORING_FEAT_SINGLE_MMAP both rings share one mapping */
+  bool single_map = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_map) {
+    r.sq_map_sz = r.cq_map_sz = std::max(r.sq_map_sz, r.cq_map_sz);
+  }
+
+  r.sq_map = mmap(NULL, r.sq_map_sz, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  r.cq_map = MAP_FAILED;
+  r.sqes = (struct io_uring_sqe*)MAP_FAILED;
+
+  if (r.sq_map != MAP_FAILED) {
+    r.cq_map = single_map
+                   ? r.sq_map
+                   : mmap(NULL, r.cq_map_sz, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  }
+
+  if (r.cq_map != MAP_FAILED) {
+    r.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r.sqes = (struct io_uring_sqe*)mmap(NULL, r.sqes_sz, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, fd,
+                                        IORING_OFF_SQES);
+  }
+
+  if (r.sqes == MAP_FAILED) {
+    Status s = Status::IOError("io_uring mmap", strerror(errno));
+    if (r.cq_map != MAP_FAILED and r.cq_map != r.sq_map) {
+      munmap(r.cq_map, r.cq_map_sz);
+    }
+    if (r.sq_map != MAP_FAILED) munmap(r.sq_map, r.sq_map_sz);
+    delete ring_;
+    ring_ = NULL;
+    Close();
+    return s;
+  }
+
+  char* sq = (char*)r.sq_map;
+  r.sq_head = (unsigned*)(sq + p.sq_off.head);
+  r.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  r.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  r.sq_array = (unsigned*)(sq + p.sq_off.array);
+
+  char* cq = (char*)r.cq_map;
+  r.cq_head = (unsigned*)(cq + p.cq_off.head);
+  r.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  r.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  r.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  /* the kernel may round the depth up; never keep more in flight than
+   * there are SQ entries */
+  queue_depth_ = std::min(queue_depth, p.sq_entries);
+
+  return Status::OK();
+}
+
+void UringReader::PrepRead(int fd, const ReadRequest& req, uint64_t done,
+                           size_t idx) {
+  Ring& r = *ring_;
+  unsigned tail = *r.sq_tail;
+  unsigned slot = tail & *r.sq_mask;
+
+  struct io_uring_sqe* sqe = &r.sqes[slot];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->off = req.offset + done;
+  sqe->addr = (uint64_t)(uintptr_t)(req.scratch + done);
+  sqe->len = req.bytes - done;
+  sqe->user_data = idx;
+
+  r.sq_array[slot] = slot;
+  /* publish the entry before the tail that makes it visible */
+  __atomic_store_n(r.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+Status UringReader::Enter(uint32_t& to_submit, uint32_t min_complete) {
+  while (true) {
+    int rv = syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+    if (rv >= 0) {
+      to_submit -= rv;
+      return Status::OK();
+    }
+
+    if (errno != EINTR and errno != EAGAIN and errno != EBUSY) {
+      return Status::IOError("io_uring_enter", strerror(errno));
+    }
+  }
+}
+
+uint32_t UringReader::Drain(uint32_t inflight) {
+  Ring& r = *ring_;
+
+  /* without SQPOLL, the kernel only takes entries off the SQ ring in
+   * io_uring_enter, so those it has not taken yet can be taken back */
+  unsigned sq_head = __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE);
+  unsigned sq_tail = *r.sq_tail;
+  inflight -= sq_tail - sq_head;
+  __atomic_store_n(r.sq_tail, sq_head, __ATOMIC_RELEASE);
+
+  /* the kernel posts completions to the CQ ring whether or not the ring
+   * is entered, as long as this thread returns from syscalls now and then
+   * to run the task work that posts some of them */
+  uint32_t reaped = 0;
+  while (reaped < inflight) {
+    unsigned head = *r.cq_head;
+    unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+    reaped += tail - head;
+    __atomic_store_n(r.cq_head, tail, __ATOMIC_RELEASE);
+    if (reaped < inflight) usleep(1000);
+  }
+
+  return reaped;
+}
+
+Status UringReader::ReadBatch(const std::vector<int>& fds,
+                              std::vector<ReadRequest>& requests,
+                              ReadCallback cb, void* arg) {
+  const size_t n = requests.size();
+  std::vector<bool> finished(n, false);
+
+  if (!IsOpen()) {
+    Status s = Status::NotSupported("io_uring not open");
+    FailAll(finished, cb, arg, s);
+    return s;
+  }
+
+  Ring& r = *ring_;
+
+  /* bytes read so far, and requests with a short read to resubmit */
+  std::vector<uint64_t> done(n, 0);
+  std::vector<size_t> retry;
+
+  Status s = Status::OK();
+  size_t next = 0, completed = 0;
+  uint32_t inflight = 0, to_submit = 0;
+
+  while (completed < n) {
+    while (inflight < queue_depth_ and (!retry.empty() or next < n)) {
+      size_t idx;
+      if (!retry.empty()) {
+        idx = retry.back();
+        retry.pop_back();
+      } else {
+        idx = next++;
+      }
+
+      PrepRead(fds[idx], requests[idx], done[idx], idx);
+      inflight++;
+      to_submit++;
+    }
+
+    Status es = Enter(to_submit, 1);
+    if (!es.ok()) {
+      /* the ring is unusable. Reads in flight still write into their
+       * scratch, which the caller frees once this returns, so they are
+       * waited for before whatever has not completed is failed. */
+      logv(__LOG_ARGS__, LOG_ERRO, "%s", es.ToString().c_str());
+      Drain(inflight);
+      Close();
+      FailAll(finished, cb, arg, es);
+      return es;
+    }
+
+    unsigned head = *r.cq_head;
+    unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+      const struct io_uring_cqe& cqe = r.cqes[head & *r.cq_mask];
+      size_t idx = cqe.user_data;
+      ReadRequest& req = requests[idx];
+      inflight--;
+
+      if (cqe.res < 0) {
+        Status rs = Status::IOError("io_uring read", strerror(-cqe.res));
+        if (s.ok()) s = rs;
+        finished[idx] = true;
+        completed++;
+        cb(arg, idx, rs);
+        continue;
+      }
+
+      done[idx] += cqe.res;
+      if (cqe.res > 0 and done[idx] < req.bytes) {
+        retry.push_back(idx);
+        continue;
+      }
+
+      req.slice = Slice(req.scratch, done[idx]);
+      finished[idx] = true;
+      completed++;
+      cb(arg, idx, Status::OK());
+    }
+
+    __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  return s;
+}
+#else
+struct UringReader::Ring {};
+
+UringReader::UringReader() : ring_fd_(-1), queue_depth_(0), ring_(NULL) {}
+
+UringReader::~UringReader() {}
+
+void UringReader::Close() {}
+
+Status UringReader::Open(uint32_t) {
+  return Status::NotSupported("Built without io_uring support");
+}
+
+void UringReader::PrepRead(int, const ReadRequest&, uint64_t, size_t) {}
+
+Status UringReader::Enter(uint32_t&, uint32_t) {
+  return Status::NotSupported("Built without io_uring support");
+}
+
+uint32_t UringReader::Drain(uint32_t) { return 0; }
+
+Status UringReader::ReadBatch(const std::vector<int>&,
+                              std::vector<ReadRequest>& requests,
+                              ReadCallback cb, void* arg) {
+  Status s = Status::NotSupported("Built without io_uring support");
+  FailAll(std::vector<bool>(requests.size(), false), cb, arg, s);
+  return s;
+}
+#endif
+}  // namespace plfsio
+}  // namespace pdlfs
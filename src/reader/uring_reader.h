@@ -0,0 +1,71 @@
+//
+// uring_reader.h: batched positional reads over io_uring
+//
+
+#pragma once
+
+#include "file_cache.h"
+
+#include "pdlfs-common/env.h"
+
+#include <vector>
+
+namespace pdlfs {
+namespace plfsio {
+/* UringReader: submits a batch of preads to an io_uring, keeping up to
+ * queue_depth of them in flight, and reports each one to a callback as
+ * soon as it completes (in completion order, not request order). Short
+ * reads are resubmitted for the remainder; a read that hits EOF completes
+ * with a short slice, as pread would.
+ *
+ * The raw io_uring syscalls are used, so liburing is not required. Open
+ * returns NotSupported if the build or the kernel lacks io_uring or its
+ * IORING_OP_READ (linux < 5.6), and the caller is expected to fall back to
+ * synchronous reads. One batch may be in progress at a time.
+ *
+ * If io_uring_enter fails for good, ReadBatch waits for the reads already
+ * in flight, closes the ring and fails the rest of the batch. Later
+ * batches fail with NotSupported until the ring is opened again.
+ */
+class UringReader {
+ public:
+  UringReader();
+
+  ~UringReader();
+
+  Status Open(uint32_t queue_depth);
+
+  bool IsOpen() const { return ring_fd_ >= 0; }
+
+  uint32_t QueueDepth() const { return queue_depth_; }
+
+  /* Reads requests[i] from fds[i] into its scratch, invoking cb on the
+   * calling thread as each read completes. Returns once every request has
+   * been reported, with the first error seen, if any, and once no read is
+   * in flight. */
+  Status ReadBatch(const std::vector<int>& fds,
+                   std::vector<ReadRequest>& requests, ReadCallback cb,
+                   void* arg);
+
+ private:
+  struct Ring;
+
+  /* queues a read of requests[idx] past the done[idx] bytes already read */
+  void PrepRead(int fd, const ReadRequest& req, uint64_t done, size_t idx);
+
+  /* submits queued reads, and waits for at least min_complete */
+  Status Enter(uint32_t& to_submit, uint32_t min_complete);
+
+  /* takes back the queued reads the kernel has not taken yet, and waits
+   * for the rest of the inflight reads, discarding their completions.
+   * Returns the number of completions reaped. */
+  uint32_t Drain(uint32_t inflight);
+
+  void Close();
+
+  int ring_fd_;
+  uint32_t queue_depth_;
+  Ring* ring_;
+};
+}  // namespace plfsio
+}  // namespace pdlfs
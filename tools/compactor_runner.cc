@@ -12,14 +12,15 @@
 typedef pdlfs::plfsio::RdbOptions RdbOptions;
 
 void PrintHelp(const char* prog) {
-  printf("Usage: %s -i <plfs_dir> [-o <out_dir>]", prog);
+  printf("Usage: %s -i <plfs_dir> [-o <out_dir>] [-D (bypass page cache)]",
+         prog);
 }
 
 void ParseOptions(int argc, char* argv[], RdbOptions& options) {
   extern char* optarg;
   extern int optind;
   int c;
-  while ((c = getopt(argc, argv, "i:e:o:")) != -1) {
+  while ((c = getopt(argc, argv, "i:e:o:D")) != -1) {
     switch (c) {
       case 'i':
         options.data_path = optarg;
@@ -30,6 +31,9 @@ void ParseOptions(int argc, char* argv[], RdbOptions& options) {
       case 'o':
         options.output_path = optarg;
         break;
+      case 'D':
+        options.direct_scans = true;
+        break;
       default:
         PrintHelp(argv[0]);
         exit(0);
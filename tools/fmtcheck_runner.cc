@@ -9,17 +9,22 @@
 
 typedef pdlfs::plfsio::RdbOptions RdbOptions;
 
-void PrintHelp(const char* prog) { printf("Usage: %s -i <plfs_dir>", prog); }
+void PrintHelp(const char* prog) {
+  printf("Usage: %s -i <plfs_dir> [-D (bypass page cache)]", prog);
+}
 
 void ParseOptions(int argc, char* argv[], RdbOptions& options) {
   extern char* optarg;
   extern int optind;
   int c;
-  while ((c = getopt(argc, argv, "i:")) != -1) {
+  while ((c = getopt(argc, argv, "i:D")) != -1) {
     switch (c) {
       case 'i':
         options.data_path = optarg;
         break;
+      case 'D':
+        options.direct_scans = true;
+        break;
       default:
         PrintHelp(argv[0]);
         exit(0);
@@ -15,6 +15,8 @@
 
 #include <carp/carp_config.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <string.h>
 #include <sys/stat.h>
 
 #if __cplusplus >= 201103
@@ -74,7 +76,17 @@ void ReadCSV(Env* env, const char* csv_path, std::vector< Query >& qvec) {
 void PrintHelp() {
   logv(__LOG_ARGS__, LOG_INFO, 
       "./prog [-p parallelism] [-a analytics] [-q query -s query_start -e "
-      "query_end -r rank] [-b batch_query_path ]\n");
+      "query_end -r rank] [-b batch_query_path ] [-c (no manifest cache)] "
+      "[-g count|sum|approx-count|approx-sum (aggregate query)] "
+      "[-m (compact in-memory manifest)] [-l (lazy per-epoch manifest)] "
+      "[-u io_uring_queue_depth] [-z (zero-copy mmap reads)] "
+      "[-f max_open_files] [-d (reuse the dir listing in the manifest cache)]"
+      " [-k coalesce_gap_bytes] [-o coalesce_amplification (<1: off)]"
+      " [-v keys|all|value_off:value_len (projected value bytes)]"
+      " [-D (full scans bypass the page cache)]"
+      " [-w batch_prefetch_depth (0: off, always off with -u)]"
+      " [-S (comparison sort of results instead of radix sort)]"
+      " [-M (sort results instead of merging sorted runs)]\n");
 }
 
 void ParseOptionsLong(int argc, char* argv[],
@@ -99,7 +111,8 @@ void ParseOptions(int argc, char* argv[], pdlfs::plfsio::RdbOptions& options) {
   extern int optind;
   int c;
 
-  while ((c = getopt(argc, argv, "i:p:aqr:b:e:x:y:sh")) != -1) {
+  const char* optstring = "i:p:aqr:b:e:x:y:scdhg:mlu:zf:k:o:v:Dw:SM";
+  while ((c = getopt(argc, argv, optstring)) != -1) {
     switch (c) {
       case 'i':
         options.data_path = optarg;
@@ -132,6 +145,70 @@ void ParseOptions(int argc, char* argv[], pdlfs::plfsio::RdbOptions& options) {
       case 's':
         options.full_scan = true;
         break;
+      case 'c':
+        options.manifest_cache = false;
+        break;
+      case 'd':
+        options.cached_listing = true;
+        break;
+      case 'g':
+        options.aggregate_on = true;
+        if (strcmp(optarg, "count") == 0 or strcmp(optarg, "sum") == 0 or
+            strcmp(optarg, "approx-count") == 0 or
+            strcmp(optarg, "approx-sum") == 0) {
+          options.aggregate_approx = strncmp(optarg, "approx-", 7) == 0;
+          options.aggregate_sum = strstr(optarg, "sum") != NULL;
+        } else {
+          PrintHelp();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'm':
+        options.compact_manifest = true;
+        break;
+      case 'l':
+        options.lazy_manifest = true;
+        break;
+      case 'u':
+        options.io_queue_depth = std::stoi(optarg);
+        break;
+      case 'z':
+        options.mmap_reads = true;
+        break;
+      case 'f':
+        options.max_open_files = std::stoi(optarg);
+        break;
+      case 'k':
+        options.coalesce_gap = std::stoull(optarg);
+        break;
+      case 'o':
+        options.coalesce_amplification = std::stod(optarg);
+        break;
+      case 'v':
+        if (strcmp(optarg, "keys") == 0) {
+          options.projection = pdlfs::plfsio::kProjectKeys;
+        } else if (strcmp(optarg, "all") == 0) {
+          options.projection = pdlfs::plfsio::kProjectRecords;
+        } else if (sscanf(optarg, "%u:%u", &options.value_off,
+                          &options.value_len) == 2) {
+          options.projection = pdlfs::plfsio::kProjectValueRange;
+        } else {
+          PrintHelp();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'D':
+        options.direct_scans = true;
+        break;
+      case 'w':
+        options.prefetch_depth = std::stoi(optarg);
+        break;
+      case 'S':
+        options.radix_sort = false;
+        break;
+      case 'M':
+        options.merge_runs = false;
+        break;
       case 'h':
         PrintHelp();
         exit(0);
@@ -143,6 +220,31 @@ void ParseOptions(int argc, char* argv[], pdlfs::plfsio::RdbOptions& options) {
 
   logv(__LOG_ARGS__, LOG_INFO, "[Threads] %d\n", options.parallelism);
   logv(__LOG_ARGS__, LOG_INFO, "[Analytics] %s\n", BOOLS(options.analytics_on));
+  logv(__LOG_ARGS__, LOG_INFO, "[Manifest Cache] %s\n",
+       BOOLS(options.manifest_cache));
+  logv(__LOG_ARGS__, LOG_INFO, "[Cached Dir Listing] %s\n",
+       BOOLS(options.cached_listing));
+  logv(__LOG_ARGS__, LOG_INFO, "[Compact Manifest] %s\n",
+       BOOLS(options.compact_manifest));
+  logv(__LOG_ARGS__, LOG_INFO, "[Lazy Manifest] %s\n",
+       BOOLS(options.lazy_manifest));
+  logv(__LOG_ARGS__, LOG_INFO, "[IO Queue Depth] %u%s\n",
+       options.io_queue_depth, options.io_queue_depth ? "" : " (pread)");
+  logv(__LOG_ARGS__, LOG_INFO, "[Mmap Reads] %s\n", BOOLS(options.mmap_reads));
+  logv(__LOG_ARGS__, LOG_INFO, "[Max Open Files] %d\n",
+       options.max_open_files);
+  logv(__LOG_ARGS__, LOG_INFO, "[Read Coalescing] gap %" PRIu64 " B, %.2fx\n",
+       options.coalesce_gap, options.coalesce_amplification);
+  logv(__LOG_ARGS__, LOG_INFO, "[Direct Scans] %s\n",
+       BOOLS(options.direct_scans));
+  if (options.projection == pdlfs::plfsio::kProjectValueRange) {
+    logv(__LOG_ARGS__, LOG_INFO, "[Projection] keys, value bytes %u-%u\n",
+         options.value_off, options.value_off + options.value_len);
+  } else {
+    logv(__LOG_ARGS__, LOG_INFO, "[Projection] %s\n",
+         options.projection == pdlfs::plfsio::kProjectRecords ? "records"
+                                                               : "keys");
+  }
 
   std::string full_scan = "";
   if (options.full_scan) {
@@ -152,35 +254,35 @@ void ParseOptions(int argc, char* argv[], pdlfs::plfsio::RdbOptions& options) {
   if (options.query_on) {
     logv(__LOG_ARGS__, LOG_INFO, "[Query] Mode: Single%s\n", full_scan.c_str());
     logv(__LOG_ARGS__, LOG_INFO, "[Query] %.3f to %.3f\n", options.query_begin, options.query_end);
+    if (options.aggregate_on) {
+      logv(__LOG_ARGS__, LOG_INFO, "[Query] Aggregate: %s%s\n",
+           options.aggregate_approx ? "approx. " : "",
+           options.aggregate_sum ? "SUM" : "COUNT");
+    }
   } else if (options.query_batch) {
     logv(__LOG_ARGS__, LOG_INFO, "[Query] Mode: Batch%s\n", full_scan.c_str());
     logv(__LOG_ARGS__, LOG_INFO, "[Query] Batchfile: %s\n", options.query_batch_in.c_str());
+    logv(__LOG_ARGS__, LOG_INFO,
+         "[Query] Prefetch: %u queries, %" PRIu64 " MB\n",
+         options.prefetch_depth, options.prefetch_budget >> 20);
   } else {
     logv(__LOG_ARGS__, LOG_INFO, "[Query] Mode: Off\n");
   }
 }
 
-int main(int argc, char* argv[]) {
-  pdlfs::plfsio::feature_prompt();
-  pdlfs::plfsio::RdbOptions options;
-  ParseOptions(argc, argv, options);
-
-  if (options.query_on && !options.analytics_on && options.query_epoch < 0) {
-    logv(__LOG_ARGS__, LOG_INFO, "[ERROR] Epoch < 0\n");
-    exit(EXIT_FAILURE);
-  }
-
-  options.env = pdlfs::port::PosixGetDefaultEnv();
-
-  if (!options.env->FileExists(options.data_path.c_str())) {
-    logv(__LOG_ARGS__, LOG_INFO, "Input directory does not exist\n");
-    exit(EXIT_FAILURE);
-  }
-
-  pdlfs::plfsio::RangeReader< pdlfs::RandomAccessFile > reader(options);
+template < typename T >
+void RunReader(const pdlfs::plfsio::RdbOptions& options) {
+  pdlfs::plfsio::RangeReader< T > reader(options);
   if (options.query_on and !options.analytics_on) {
     reader.ReadManifest(options.data_path);
-    if (options.full_scan) {
+    if (options.aggregate_on) {
+      pdlfs::plfsio::Query q(options.query_epoch, options.query_begin,
+                             options.query_end);
+      q.rank = options.query_rank;
+      pdlfs::plfsio::AggregateResult res;
+      reader.QueryAggregate(q, options.aggregate_sum, options.aggregate_approx,
+                            res);
+    } else if (options.full_scan) {
       reader.QueryNaive(options.query_epoch, options.query_begin,
                         options.query_end);
     } else {
@@ -200,6 +302,30 @@ int main(int argc, char* argv[]) {
   } else if (options.analytics_on) {
     reader.AnalyzeManifest(options.data_path, options.query_on);
   }
+}
+
+int main(int argc, char* argv[]) {
+  pdlfs::plfsio::feature_prompt();
+  pdlfs::plfsio::RdbOptions options;
+  ParseOptions(argc, argv, options);
+
+  if (options.query_on && !options.analytics_on && options.query_epoch < 0) {
+    logv(__LOG_ARGS__, LOG_INFO, "[ERROR] Epoch < 0\n");
+    exit(EXIT_FAILURE);
+  }
+
+  options.env = pdlfs::port::PosixGetDefaultEnv();
+
+  if (!options.env->FileExists(options.data_path.c_str())) {
+    logv(__LOG_ARGS__, LOG_INFO, "Input directory does not exist\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (options.mmap_reads) {
+    RunReader< pdlfs::plfsio::MappedFile >(options);
+  } else {
+    RunReader< pdlfs::RandomAccessFile >(options);
+  }
 
   return 0;
 }